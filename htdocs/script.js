@@ -9,6 +9,10 @@
  */
 
 var pl = [], fb_dir = [], mb = [];
+var pl_pages_requested = [], pl_version = 0;
+var pl_changes = [], pl_changes_dropped = 0; // Recent playlist changes: {version, position}
+var PL_CHANGES_MAX = 32;
+var PL_PAGE_SIZE = 100;
 var dir;
 var selected_tab = 'pl';
 
@@ -106,8 +110,14 @@ function Connection()
 						t = document.getElementById("playlisttable");
 						rows = jmsg['length'];
 						pl_set_number_of_items(rows);
+						if (jmsg['version'] !== undefined) {
+							pl_version = jmsg['version'];
+							pl_changes.push({version: pl_version, position: jmsg['changed_at_position']});
+							if (pl_changes.length > PL_CHANGES_MAX) pl_changes_dropped = pl_changes.shift().version;
+						}
 						for (var i = jmsg['changed_at_position']; i < rows; i++)
 							pl[i] = undefined;
+						pl_pages_requested.length = Math.floor(jmsg['changed_at_position'] / PL_PAGE_SIZE);
 						document.getElementById('tpl').innerHTML = 'Playlist ('+rows+')';
 						toggle_state = false;
 						current_length = t.rows.length;
@@ -122,11 +132,30 @@ function Connection()
 						if (jmsg['position']-plt.first_visible_line >= 0)
 							plt.set_row_data(jmsg['position']-plt.first_visible_line);
 						break;
+					case 'playlist_range':
+						var items = jmsg['items'];
+						// Entries of an outdated reply are still valid up to the first change since
+						var valid_below = pl_valid_below(jmsg['version']);
+						if (valid_below <= jmsg['offset']) {
+							// Request the page again (if the change has not done that already)
+							pl_pages_requested[Math.floor(jmsg['offset'] / PL_PAGE_SIZE)] = false;
+							handle_playlist_scroll();
+							break;
+						}
+						for (var i = jmsg['offset']; i < jmsg['next'] && i < pl.length && i < valid_below; i++) {
+							pl[i] = items[i];
+							if (i-plt.first_visible_line >= 0 && i-plt.first_visible_line <= plt.visible_line_count)
+								plt.set_row_data(i-plt.first_visible_line);
+						}
+						break;
 					case 'playback_time':
 						min = parseInt((jmsg['time'] / 1000) / 60);
 						sec = parseInt((jmsg['time'] / 1000) - min * 60);
 						write_to_time_display(min + ':' + (sec < 10 ? '0' : '') + sec);
 						break;
+					case 'audio_buffer_info':
+						write_to_screen('Audio buffer underrun (' + jmsg['underruns'] + ' so far), buffer: ' + jmsg['buffer_time_ms'] + ' ms');
+						break;
 					case 'dir_read':
 						if (jmsg['res'] == 'ok') {
 							cur_dir = jmsg['path'];
@@ -622,6 +651,31 @@ function pl_need_data(row)
 	return pl[row] === undefined;
 }
 
+/*
+ * Returns the position from which on playlist data of the given version is
+ * outdated, i.e. the lowest position of the changes announced since.
+ */
+function pl_valid_below(version)
+{
+	var res = Infinity, i;
+	if (version >= pl_version) return res;
+	if (pl_changes_dropped > version) return 0; // Some of the changes are no longer known
+	for (i = 0; i < pl_changes.length; i++)
+		if (pl_changes[i].version > version && pl_changes[i].position < res)
+			res = pl_changes[i].position;
+	return res;
+}
+
+/* Requests the page of playlist entries containing 'item', unless already requested */
+function pl_get_data(item)
+{
+	var page = Math.floor((item-1) / PL_PAGE_SIZE);
+	if (!pl_pages_requested[page]) {
+		pl_pages_requested[page] = true;
+		con.do_send('{"cmd":"playlist_get_range","offset":'+(page*PL_PAGE_SIZE)+',"count":'+PL_PAGE_SIZE+'}');
+	}
+}
+
 function fb_item_row_construct(item, col)
 {
 	var res;
@@ -745,10 +799,7 @@ function init()
 
 	plt = new GmuList();
 	plt.init('pl', 'playlisttable', 'plscrollbar', 'plscrolldummy',
-	         function(item)
-	         {
-				 con.do_send('{"cmd":"playlist_get_item","item":'+(item-1)+'}');
-	         },
+	         pl_get_data,
 	         pl_item_row_construct,
 	         pl_need_data
 	);
@@ -781,10 +832,7 @@ function init()
 	con.start("ws://" + document.location.host + "/gmu");
 	window.onresize = function(event) {
 		plt.init('pl', 'playlisttable', 'plscrollbar', 'plscrolldummy',
-			 function(item)
-			 {
-				con.do_send('{"cmd":"playlist_get_item","item":'+(item-1)+'}');
-			 },
+			 pl_get_data,
 			 pl_item_row_construct,
 			 pl_need_data
 		);
@@ -14,6 +14,8 @@
  * for details.
  */
 #include <math.h>
+#include <time.h>
+#include <stdint.h>
 #include "SDL.h"
 #include "ringbuffer.h"
 #include "audio.h"
@@ -23,13 +25,21 @@
 #include "gmuerror.h"
 #include "core.h"
 #include FILE_HW_H
-#define RINGBUFFER_SIZE 131072
+/* Smallest buffer size; Has to hold two decoder chunks */
+#define AUDIO_BUFFER_SIZE_MIN (2 * AUDIO_BUFFER_RESERVE_MAX)
+/* The buffer grows by 50 % after this many underruns within AUDIO_UNDERRUN_WINDOW seconds */
+#define AUDIO_UNDERRUN_GROW_COUNT 3
+#define AUDIO_UNDERRUN_WINDOW     30
+/* A grown buffer shrinks by a third after this many seconds without underruns */
+#define AUDIO_SHRINK_DELAY        300
+
+/* Full memory barrier for the lock-free playback clock */
+#define CLOCK_BARRIER() __sync_synchronize()
 
 static RingBuffer    audio_rb;
 static unsigned int  volume_fade_percent = 100;
 
-static unsigned long buf_read_counter;
-static int           done;
+static volatile int  done;
 static int           have_samplerate, have_channels;
 static SDL_mutex    *audio_mutex2;
 
@@ -44,14 +54,220 @@ static int           device_open;
 
 static unsigned int  volume, volume_internal;
 
+/* Buffer size as time; The size in bytes depends on the audio format */
+static int           buffer_time_ms = AUDIO_BUFFER_TIME_DEFAULT;
+static int           buffer_time_max_ms = AUDIO_BUFFER_TIME_MAX_DEFAULT;
+static int           buffer_time_base_ms = AUDIO_BUFFER_TIME_DEFAULT; /* As configured */
+/*
+ * Updated by the audio callback, which runs with the SDL audio lock held;
+ * Others access it with SDL_LockAudio()
+ */
+static AudioBufferStats stats;
+static int           buffer_primed, buffer_starving;
+/* Decoder thread only */
+static size_t        buffer_size_limit; /* Pending shrink; Writes are limited to this fill level */
+static unsigned long underruns_reported;
+static time_t        underrun_window_start;
+static unsigned long underrun_window_count;
+static time_t        last_underrun_time;
+
+/*
+ * The playback clock is a count of bytes taken from the audio buffer
+ * by the audio callback and a list of segments mapping byte positions
+ * to track positions. A segment starts at the write position at the
+ * time of a track change or seek and becomes active when playback
+ * reaches it. Both parts are published with sequence counters, so
+ * they can be read without locking and the audio callback never
+ * needs to take a lock.
+ */
+typedef struct
+{
+	uint64_t start;  /* Position in bytes written to the audio buffer */
+	int64_t  offset; /* Track position at 'start' in samples */
+} ClockSegment;
+
+/* Written by the audio callback only */
+static volatile unsigned int cb_seq;
+static uint64_t              bytes_consumed, cb_time_us;
+static uint64_t              playing_start, playing_end; /* Data in the period being played */
+static size_t                prev_add;
+/* Written with audio_mutex2 held */
+static volatile unsigned int seg_seq;
+static ClockSegment          seg_current, seg_pending;
+static int                   seg_pending_valid;
+static int                   clock_samplerate = 1, clock_frame_size = 2;
+/* Decoder thread only */
+static uint64_t              bytes_written;
+
+static uint64_t time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-int audio_fill_buffer(char *data, size_t size)
+static void clock_read_callback(uint64_t *consumed, uint64_t *start, uint64_t *end, uint64_t *t)
 {
-	int result = 0;
-	SDL_LockAudio();
-	result = ringbuffer_write(&audio_rb, data, size);
-	SDL_UnlockAudio();
-	return result;
+	unsigned int seq;
+
+	do {
+		seq = cb_seq;
+		CLOCK_BARRIER();
+		*consumed = bytes_consumed;
+		*start    = playing_start;
+		*end      = playing_end;
+		*t        = cb_time_us;
+		CLOCK_BARRIER();
+	} while ((seq & 1) || seq != cb_seq);
+}
+
+/* Segment updates; To be called with audio_mutex2 held */
+static void clock_update_begin(void)
+{
+	uint64_t consumed, start, end, t;
+
+	seg_seq++;
+	CLOCK_BARRIER();
+	/* Activate the pending segment if playback has reached it */
+	clock_read_callback(&consumed, &start, &end, &t);
+	if (seg_pending_valid && consumed >= seg_pending.start) {
+		seg_current = seg_pending;
+		seg_pending_valid = 0;
+	}
+}
+
+static void clock_update_end(void)
+{
+	CLOCK_BARRIER();
+	seg_seq++;
+}
+
+/* Starts a new segment with the next sample written to the audio buffer */
+static void clock_start_segment(int64_t offset)
+{
+	clock_update_begin();
+	seg_pending.start  = bytes_written;
+	seg_pending.offset = offset;
+	seg_pending_valid  = 1;
+	clock_update_end();
+}
+
+/*
+ * Returns the track position of the sample currently being heard, in
+ * samples. When the callback returns, the device starts playing the
+ * period filled by the previous callback. The position is interpolated
+ * from the time of the last callback within the data of that period.
+ */
+static int64_t clock_get_position(int *samplerate)
+{
+	unsigned int seq;
+	uint64_t     consumed, start, end, t;
+	ClockSegment cur, pend;
+	int          pend_valid, rate, frame_size;
+	int64_t      heard, res;
+
+	clock_read_callback(&consumed, &start, &end, &t);
+	do {
+		seq = seg_seq;
+		CLOCK_BARRIER();
+		cur        = seg_current;
+		pend       = seg_pending;
+		pend_valid = seg_pending_valid;
+		rate       = clock_samplerate;
+		frame_size = clock_frame_size;
+		CLOCK_BARRIER();
+	} while ((seq & 1) || seq != seg_seq);
+
+	heard = start;
+	if (t > 0) {
+		uint64_t now = time_us();
+		uint64_t elapsed = now > t ? (now - t) * rate / 1000000 * frame_size : 0;
+
+		heard += elapsed < end - start ? elapsed : end - start;
+	}
+	if (pend_valid && heard >= (int64_t)pend.start) cur = pend;
+	res = cur.offset;
+	if (heard > (int64_t)cur.start) res += (heard - (int64_t)cur.start) / frame_size;
+	if (samplerate) *samplerate = rate;
+	return res;
+}
+
+static size_t buffer_size_for_time(int ms, int samplerate, int channels)
+{
+	size_t frame = 2 * channels;
+	size_t size  = (size_t)ms * samplerate / 1000 * frame;
+
+	if (size < AUDIO_BUFFER_SIZE_MIN) size = (AUDIO_BUFFER_SIZE_MIN + frame - 1) / frame * frame;
+	return size;
+}
+
+/* Space the decoder may use, taking a pending shrink into account */
+static size_t buffer_get_usable_free(void)
+{
+	size_t fill = ringbuffer_get_fill(&audio_rb);
+	size_t size = buffer_size_limit ? buffer_size_limit : ringbuffer_get_size(&audio_rb);
+
+	return size > fill ? size - fill : 0;
+}
+
+
+/**
+ * Writes as much of the given PCM data to the audio buffer as possible
+ * and returns the number of bytes written. The audio buffer is a lock-free
+ * single producer/single consumer ring buffer, so this must only ever be
+ * called from the decoder thread.
+ */
+size_t audio_fill_buffer(char *data, size_t size)
+{
+	if (buffer_size_limit) {
+		size_t avail = buffer_get_usable_free();
+		if (size > avail) size = avail;
+	}
+	size = ringbuffer_write_partial(&audio_rb, data, size);
+	bytes_written += size;
+	return size;
+}
+
+/**
+ * Returns a pointer into the audio buffer where the decoder can write
+ * at least *size bytes of PCM data directly, or NULL if there is not
+ * enough free space. *size is set to the space actually available.
+ * AUDIO_BUFFER_RESERVE_MAX is the largest size that can be requested.
+ * Decoder thread only. Written data has to be committed with
+ * audio_buffer_commit_write().
+ */
+char *audio_buffer_reserve_write(size_t *size)
+{
+	char *res = NULL;
+
+	if (!buffer_size_limit || buffer_get_usable_free() >= *size) {
+		res = ringbuffer_reserve_write(&audio_rb, size);
+		if (res && buffer_size_limit && *size > buffer_get_usable_free())
+			*size = buffer_get_usable_free();
+	}
+	return res;
+}
+
+void audio_buffer_commit_write(size_t size)
+{
+	ringbuffer_commit_write(&audio_rb, size);
+	bytes_written += size;
+}
+
+/**
+ * Blocks until at least 'size' bytes are free in the audio buffer, the
+ * audio callback has consumed data or the timeout (in ms) has expired.
+ * Returns 1 if the requested amount of space is available.
+ */
+int audio_buffer_wait_for_free(size_t size, int timeout_ms)
+{
+	size_t rb_size = ringbuffer_get_size(&audio_rb);
+
+	/* While shrinking, wait for the fill level to drop below the new size */
+	if (buffer_size_limit && buffer_size_limit < rb_size)
+		size += rb_size - buffer_size_limit;
+	return ringbuffer_wait_for_free(&audio_rb, size, timeout_ms);
 }
 
 static void calculate_dft(int16_t *input_signal, int input_signal_size, int *rex, int *imx)
@@ -102,50 +318,78 @@ void audio_spectrum_read_unlock(void)
 	SDL_UnlockMutex(spectrum_mutex);
 }
 
-static void fill_audio(void *udata, Uint8 *stream, int len)
+static void spectrum_update(const Uint8 *data, size_t size)
 {
-	static Uint8 buf[65536];
-	size_t       add = 0;
-
-	if (ringbuffer_read(&audio_rb, (char *)buf, len)) {
-		add = len;
-	} else {
-		size_t avail = ringbuffer_get_fill(&audio_rb);
-		memset(buf, 0, 65536);
-		if (avail > 0 && ringbuffer_read(&audio_rb, (char *)buf, avail))
-			add = avail;
+	int     rex[9], imx[9];
+	size_t  i, j;
+	int16_t samples_l[16];
+	int     channels = have_channels; /* Does not change while the callback is active */
+
+	if (channels > 0) {
+		for (i = 0, j = 0; j < 16; i += (2 * channels), j++) {
+			samples_l[j] = i + 1 < size ? (data[i+1] << 8) + data[i] : 0;
+		}
+		calculate_dft(samples_l, 16, rex, imx);
 	}
+	SDL_LockMutex(spectrum_mutex);
+	if (channels > 0)
+		for (i = 1; i < 9; i++) amplitudes[i-1] = (imx[i] < 0 ? -imx[i] : imx[i]);
+	SDL_UnlockMutex(spectrum_mutex);
+}
+
+/**
+ * Mixes the PCM data straight from the audio ring buffer into the SDL
+ * stream. The data is read in (at most two) contiguous chunks, so no
+ * intermediate copy is necessary. On underrun the rest of the stream
+ * is left silent.
+ */
+static void fill_audio(void *udata, Uint8 *stream, int len)
+{
+	size_t add = 0, fill = ringbuffer_get_fill(&audio_rb);
+	int    spectrum_done = 0;
 
-	if (SDL_LockMutex(audio_mutex2) == 0) {
-		buf_read_counter += add;
-		SDL_UnlockMutex(audio_mutex2);
-	}
 	SDL_memset(stream, 0, len);
-	SDL_MixAudio(stream, buf, len, volume * volume_fade_percent / 100);
-
-	/* When requested, run DFT on a few samples of each block of data for visualization purposes */
-	if (spectrum_reg > 0) {
-		int     rex[9], imx[9];
-		size_t  i, j;
-		int16_t samples_l[16];
-		int     channels = 0;
-
-		if (SDL_LockMutex(audio_mutex2) != -1) {
-			channels = have_channels;
-			SDL_UnlockMutex(audio_mutex2);
+	while (add < (size_t)len) {
+		size_t chunk = len - add;
+		Uint8 *data = (Uint8 *)ringbuffer_peek_read(&audio_rb, &chunk);
+
+		if (!data) break;
+		SDL_MixAudio(stream + add, data, chunk, volume * volume_fade_percent / 100);
+		/* When requested, run DFT on a few samples of each block of data for visualization purposes */
+		if (spectrum_reg > 0 && !spectrum_done) {
+			spectrum_update(data, chunk);
+			spectrum_done = 1;
 		}
-
-		if (channels > 0) {
-			for (i = 0, j = 0; j < 16; i += (2 * channels), j++) {
-				samples_l[j] = (buf[i+1] << 8) + buf[i];
-			}
-			calculate_dft(samples_l, 16, rex, imx);
+		ringbuffer_consume(&audio_rb, chunk);
+		add += chunk;
+	}
+	if (spectrum_reg > 0 && !spectrum_done) spectrum_update(NULL, 0);
+
+	{
+		size_t bucket = fill * AUDIO_FILL_HISTOGRAM_BUCKETS / ringbuffer_get_size(&audio_rb);
+
+		stats.callbacks++;
+		stats.fill_histogram[bucket < AUDIO_FILL_HISTOGRAM_BUCKETS ? bucket : AUDIO_FILL_HISTOGRAM_BUCKETS - 1]++;
+		if (add == (size_t)len) {
+			buffer_primed = 1;
+			buffer_starving = 0;
+		} else if (buffer_primed && !done) {
+			/* Ran out of data while the decoder is still supposed to deliver */
+			if (!buffer_starving) stats.underruns++;
+			buffer_starving = 1;
+			stats.underrun_bytes += len - add;
 		}
-		SDL_LockMutex(spectrum_mutex);
-		if (channels > 0)
-			for (i = 1; i < 9; i++) amplitudes[i-1] = (imx[i] < 0 ? -imx[i] : imx[i]);
-		SDL_UnlockMutex(spectrum_mutex);
 	}
+
+	cb_seq++;
+	CLOCK_BARRIER();
+	playing_start = bytes_consumed - prev_add;
+	playing_end   = bytes_consumed;
+	bytes_consumed += add;
+	prev_add = add;
+	cb_time_us = time_us();
+	CLOCK_BARRIER();
+	cb_seq++;
 }
 
 int audio_device_open(int samplerate, int channels)
@@ -155,12 +399,13 @@ int audio_device_open(int samplerate, int channels)
 
 	/* Keep audio device open unless sampling rate or number of channels change */
 	if (SDL_LockMutex(audio_mutex2) != -1) {
-		buf_read_counter = 0;
 		wdprintf(V_DEBUG, "audio", "Device already open: %s\n", device_open ? "yes" : "no");
 		if (device_open)
 			wdprintf(V_DEBUG, "audio", "Samplerate: have=%d want=%d Channels: have=%d want=%d\n",
 					 have_samplerate, samplerate, have_channels, channels);
 		if (!device_open || samplerate != have_samplerate || channels != have_channels) {
+			size_t size = buffer_size_for_time(buffer_time_ms, samplerate, channels);
+
 			if (device_open) {
 				SDL_UnlockMutex(audio_mutex2);
 				audio_device_close();
@@ -185,13 +430,23 @@ int audio_device_open(int samplerate, int channels)
 				device_open = 1;
 				have_samplerate = samplerate;
 				have_channels   = channels;
+				clock_update_begin();
+				clock_samplerate = obtained.freq;
+				clock_frame_size = 2 * obtained.channels;
+				clock_update_end();
 				wdprintf(V_INFO, "audio", "Device opened with %d Hz, %d channels and sample buffer w/ %d samples.\n",
 						 obtained.freq, obtained.channels, obtained.samples);
 			}
 			if (SDL_UnlockMutex(audio_mutex2) != -1) {
 				SDL_LockAudio();
 				ringbuffer_clear(&audio_rb);
+				bytes_written = bytes_consumed;
+				buffer_primed = 0;
+				buffer_starving = 0;
+				if (size != ringbuffer_get_size(&audio_rb) && ringbuffer_resize(&audio_rb, size))
+					wdprintf(V_INFO, "audio", "Buffer size: %d bytes (%d ms)\n", size, buffer_time_ms);
 				SDL_UnlockAudio();
+				buffer_size_limit = 0;
 				SDL_LockMutex(audio_mutex2);
 			}
 		} else {
@@ -201,12 +456,65 @@ int audio_device_open(int samplerate, int channels)
 
 		if (result == 0) {
 			done = 0;
+			/* The new track starts with the next sample written */
+			clock_update_begin();
+			seg_current.start  = bytes_written;
+			seg_current.offset = 0;
+			seg_pending_valid  = 0;
+			clock_update_end();
 		}
 		SDL_UnlockMutex(audio_mutex2);
 	}
 	return result;
 }
 
+/**
+ * Returns 1 if the audio device is open with the given sample rate and
+ * number of channels, so that data in that format can be appended to the
+ * audio buffer without reopening the device.
+ */
+int audio_device_has_format(int samplerate, int channels)
+{
+	int res = 0;
+	if (SDL_LockMutex(audio_mutex2) != -1) {
+		res = device_open && samplerate == have_samplerate && channels == have_channels;
+		SDL_UnlockMutex(audio_mutex2);
+	}
+	return res;
+}
+
+/**
+ * Marks the current write position of the audio buffer as the beginning
+ * of a new track. Used for gapless playback instead of audio_device_open().
+ * The playback position is reset as soon as playback reaches the
+ * marked position.
+ */
+void audio_mark_track_boundary(void)
+{
+	if (SDL_LockMutex(audio_mutex2) != -1) {
+		clock_start_segment(0);
+		done = 0;
+		SDL_UnlockMutex(audio_mutex2);
+	}
+}
+
+/**
+ * Returns 1 once playback has reached the position marked with
+ * audio_mark_track_boundary() (or audio_set_sample_counter()), or if
+ * there is no such position, 0 otherwise.
+ */
+int audio_track_boundary_reached(void)
+{
+	int res = 1;
+	if (SDL_LockMutex(audio_mutex2) != -1) {
+		clock_update_begin();
+		res = !seg_pending_valid;
+		clock_update_end();
+		SDL_UnlockMutex(audio_mutex2);
+	}
+	return res;
+}
+
 int audio_get_status(void)
 {
 	int res = 0;
@@ -263,32 +571,137 @@ int audio_get_pause(void)
 	return res;
 }
 
+/**
+ * Returns the position of the sample currently being played in the
+ * current track, in microseconds. Does not lock, so it can be called
+ * as often as needed from any thread.
+ */
+int64_t audio_get_playtime_us(void)
+{
+	int     rate;
+	int64_t pos = clock_get_position(&rate);
+
+	return pos > 0 ? pos * 1000000 / rate : 0;
+}
+
 int audio_get_playtime(void)
+{
+	return (int)(audio_get_playtime_us() / 1000);
+}
+
+size_t audio_buffer_get_fill(void)
+{
+	return ringbuffer_get_fill(&audio_rb);
+}
+
+size_t audio_buffer_get_size(void)
+{
+	return ringbuffer_get_size(&audio_rb);
+}
+
+/**
+ * Sets the audio buffer size in milliseconds and the size up to which
+ * the buffer may grow after repeated underruns. The buffer is resized
+ * by the decoder thread (see audio_buffer_adapt()) or when the device
+ * is opened the next time.
+ */
+void audio_buffer_set_time(int ms, int max_ms)
+{
+	if (ms < AUDIO_BUFFER_TIME_MIN) ms = AUDIO_BUFFER_TIME_MIN;
+	if (ms > AUDIO_BUFFER_TIME_MAX) ms = AUDIO_BUFFER_TIME_MAX;
+	if (max_ms < ms) max_ms = ms;
+	if (max_ms > AUDIO_BUFFER_TIME_MAX) max_ms = AUDIO_BUFFER_TIME_MAX;
+	if (SDL_LockMutex(audio_mutex2) != -1) {
+		buffer_time_ms      = ms;
+		buffer_time_base_ms = ms;
+		buffer_time_max_ms  = max_ms;
+		SDL_UnlockMutex(audio_mutex2);
+	}
+	wdprintf(V_INFO, "audio", "Buffer time: %d ms (max. %d ms)\n", ms, max_ms);
+}
+
+int audio_buffer_get_time(void)
 {
 	int res = 0;
 	if (SDL_LockMutex(audio_mutex2) != -1) {
-		res = buf_read_counter / (have_samplerate * 2 * have_channels) * 1000;
+		res = buffer_time_ms;
 		SDL_UnlockMutex(audio_mutex2);
 	}
 	return res;
 }
 
-size_t audio_buffer_get_fill(void)
+void audio_buffer_get_stats(AudioBufferStats *s)
 {
-	size_t res = 0;
 	SDL_LockAudio();
-	res = ringbuffer_get_fill(&audio_rb);
+	memcpy(s, &stats, sizeof(AudioBufferStats));
 	SDL_UnlockAudio();
-	return res;
+	s->buffer_size    = ringbuffer_get_size(&audio_rb);
+	s->buffer_time_ms = audio_buffer_get_time();
 }
 
-size_t audio_buffer_get_size(void)
+/**
+ * To be called regularly by the decoder thread during playback. Reports
+ * new underruns with a GMU_AUDIO_BUFFER_UNDERRUN event, grows the buffer
+ * after repeated underruns, shrinks it back towards the configured size
+ * when underruns stop and applies pending buffer size changes.
+ * Shrinking is delayed until the buffered data fits into the new size.
+ */
+void audio_buffer_adapt(void)
 {
-	size_t res = 0;
+	unsigned long underruns;
+	size_t        size = 0;
+	int           report = 0;
+
 	SDL_LockAudio();
-	res = ringbuffer_get_size(&audio_rb);
+	underruns = stats.underruns;
 	SDL_UnlockAudio();
-	return res;
+	if (SDL_LockMutex(audio_mutex2) != -1) {
+		time_t t = time(NULL);
+
+		if (underruns != underruns_reported) {
+			last_underrun_time = t;
+			if (t - underrun_window_start > AUDIO_UNDERRUN_WINDOW) {
+				underrun_window_start = t;
+				underrun_window_count = 0;
+			}
+			underrun_window_count += underruns - underruns_reported;
+			underruns_reported = underruns;
+			if (underrun_window_count >= AUDIO_UNDERRUN_GROW_COUNT && buffer_time_ms < buffer_time_max_ms) {
+				buffer_time_ms = buffer_time_ms * 3 / 2;
+				if (buffer_time_ms > buffer_time_max_ms) buffer_time_ms = buffer_time_max_ms;
+				underrun_window_count = 0;
+				wdprintf(V_INFO, "audio", "Repeated underruns. Growing buffer to %d ms.\n", buffer_time_ms);
+			}
+			report = 1;
+		} else if (buffer_time_ms > buffer_time_base_ms && t - last_underrun_time > AUDIO_SHRINK_DELAY) {
+			buffer_time_ms = buffer_time_ms * 2 / 3;
+			if (buffer_time_ms < buffer_time_base_ms) buffer_time_ms = buffer_time_base_ms;
+			last_underrun_time = t;
+			wdprintf(V_INFO, "audio", "No recent underruns. Shrinking buffer to %d ms.\n", buffer_time_ms);
+		}
+		if (device_open) size = buffer_size_for_time(buffer_time_ms, have_samplerate, have_channels);
+		SDL_UnlockMutex(audio_mutex2);
+	}
+	if (report) {
+		wdprintf(V_WARNING, "audio", "Buffer underrun (%lu so far).\n", underruns);
+		event_queue_push_with_parameter(gmu_core_get_event_queue(), GMU_AUDIO_BUFFER_UNDERRUN, (int)underruns);
+	}
+	if (size > 0 && size != ringbuffer_get_size(&audio_rb)) {
+		if (size >= ringbuffer_get_fill(&audio_rb)) {
+			int res;
+
+			SDL_LockAudio();
+			res = ringbuffer_resize(&audio_rb, size);
+			if (res) stats.resizes++;
+			SDL_UnlockAudio();
+			if (res) {
+				buffer_size_limit = 0;
+				wdprintf(V_INFO, "audio", "Buffer resized to %d bytes.\n", size);
+			}
+		} else {
+			buffer_size_limit = size;
+		}
+	}
 }
 
 void audio_buffer_init(void)
@@ -300,7 +713,10 @@ void audio_buffer_init(void)
 	device_open = 0;
 	have_samplerate = 1;
 	have_channels = 1;
-	ringbuffer_init(&audio_rb, RINGBUFFER_SIZE);
+	buffer_size_limit = 0;
+	memset(&stats, 0, sizeof(AudioBufferStats));
+	ringbuffer_init_with_reserve(&audio_rb, buffer_size_for_time(buffer_time_ms, 44100, 2),
+	                             AUDIO_BUFFER_RESERVE_MAX);
 	spectrum_mutex = SDL_CreateMutex();
 	audio_mutex2 = SDL_CreateMutex();
 	pause_mutex = SDL_CreateMutex();
@@ -311,7 +727,21 @@ void audio_buffer_clear(void)
 	audio_set_pause(1);
 	SDL_LockAudio();
 	ringbuffer_clear(&audio_rb);
+	bytes_written = bytes_consumed;
+	buffer_primed = 0;
+	buffer_starving = 0;
 	SDL_UnlockAudio();
+	if (SDL_LockMutex(audio_mutex2) != -1) {
+		/* The discarded data will not be played, so a pending segment starts right away */
+		clock_update_begin();
+		if (seg_pending_valid) {
+			seg_current = seg_pending;
+			seg_current.start = bytes_written;
+			seg_pending_valid = 0;
+		}
+		clock_update_end();
+		SDL_UnlockMutex(audio_mutex2);
+	}
 }
 
 void audio_buffer_free(void)
@@ -348,35 +778,38 @@ int audio_get_volume(void)
 	return volume_internal;
 }
 
+/**
+ * Sets the track position of the next sample written to the audio buffer.
+ * To be called by the decoder thread after seeking. Data still in the
+ * buffer keeps its position until it has been played.
+ */
 long audio_set_sample_counter(long sample)
 {
-	long res = 0;
 	if (SDL_LockMutex(audio_mutex2) != -1) {
-		res = buf_read_counter = (sample * 2 * have_channels);
+		clock_start_segment(sample);
 		SDL_UnlockMutex(audio_mutex2);
 	}
-	return res;
+	return sample;
 }
 
 long audio_increase_sample_counter(long sample_offset)
 {
-	long res = 0;
 	if (SDL_LockMutex(audio_mutex2) != -1) {
-		buf_read_counter += (sample_offset * 2 * have_channels);
-		res = buf_read_counter;
+		clock_update_begin();
+		if (seg_pending_valid)
+			seg_pending.offset += sample_offset;
+		else
+			seg_current.offset += sample_offset;
+		clock_update_end();
 		SDL_UnlockMutex(audio_mutex2);
 	}
-	return res;
+	return audio_get_sample_count();
 }
 
 long audio_get_sample_count(void)
 {
-	long res = 0;
-	if (SDL_LockMutex(audio_mutex2) != -1) {
-		res = buf_read_counter / (2 * have_channels);
-		SDL_UnlockMutex(audio_mutex2);
-	}
-	return res;
+	int64_t pos = clock_get_position(NULL);
+	return pos > 0 ? (long)pos : 0;
 }
 
 void audio_set_fade_volume(int percent)
@@ -15,19 +15,52 @@
  */
 #define MIN_BUFFER_FILL 32768
 #define AUDIO_MAX_SW_VOLUME 16
+#define AUDIO_BUFFER_RESERVE_MAX 32768
 #ifndef _AUDIO_H
 #define _AUDIO_H
 #include <sys/types.h>
+#include <stdint.h>
+
+/* Audio buffer size limits in milliseconds */
+#define AUDIO_BUFFER_TIME_DEFAULT     750
+#define AUDIO_BUFFER_TIME_MAX_DEFAULT 3000
+#define AUDIO_BUFFER_TIME_MIN         100
+#define AUDIO_BUFFER_TIME_MAX         10000
+
+#define AUDIO_FILL_HISTOGRAM_BUCKETS 8
+
+typedef struct
+{
+	unsigned long underruns;      /* Number of times the buffer ran empty during playback */
+	unsigned long underrun_bytes; /* Amount of silence inserted due to underruns */
+	unsigned long callbacks;      /* Number of audio callback invocations */
+	/* Buffer fill level at the beginning of each callback, in eighths of the buffer size */
+	unsigned long fill_histogram[AUDIO_FILL_HISTOGRAM_BUCKETS];
+	unsigned long resizes;
+	size_t        buffer_size;    /* Current size in bytes */
+	int           buffer_time_ms; /* Current size in milliseconds */
+} AudioBufferStats;
 
 int      audio_device_open(int samplerate, int channels);
-int      audio_fill_buffer(char *data, size_t size);
-int      audio_get_playtime(void);
+int      audio_device_has_format(int samplerate, int channels);
+void     audio_mark_track_boundary(void);
+int      audio_track_boundary_reached(void);
+size_t   audio_fill_buffer(char *data, size_t size);
+int      audio_buffer_wait_for_free(size_t size, int timeout_ms);
+char    *audio_buffer_reserve_write(size_t *size);
+void     audio_buffer_commit_write(size_t size);
+int      audio_get_playtime(void); /* in milliseconds */
+int64_t  audio_get_playtime_us(void);
 void     audio_buffer_init(void);
 void     audio_buffer_clear(void);
 void     audio_buffer_free(void);
 void     audio_device_close(void);
 size_t   audio_buffer_get_fill(void);
 size_t   audio_buffer_get_size(void);
+void     audio_buffer_set_time(int ms, int max_ms);
+int      audio_buffer_get_time(void);
+void     audio_buffer_get_stats(AudioBufferStats *stats);
+void     audio_buffer_adapt(void);
 int      audio_get_status(void);
 void     audio_force_pause(int pause);
 int      audio_set_pause(int pause_state);
@@ -35,6 +35,8 @@
 #include FILE_HW_H
 #include "util.h"
 #include "reader.h" /* for reader_set_cache_size_kb() */
+#include "httpcache.h"
+#include "httpconn.h"
 #include "medialib.h"
 #include "debug.h"
 #include "gmuerror.h"
@@ -43,6 +45,11 @@
 typedef enum GlobalCommand { NO_CMD, PLAY, PAUSE, STOP, NEXT, 
                              PREVIOUS, PLAY_ITEM, PLAY_FILE } GlobalCommand;
 
+/*
+ * Commands and player_status changes that have to be seen by the decoder
+ * thread (see get_next_track_for_gapless_playback()) are made with the
+ * playlist lock held.
+ */
 static GlobalCommand   global_command = NO_CMD;
 static int             global_param = 0;
 static char            global_filename[256];
@@ -224,6 +231,83 @@ static int play_previous(Playlist *pl)
 	return result;
 }
 
+/**
+ * Called by the file player's decoder thread when the decoder has reached
+ * the end of the current track. Advances the playlist (including the
+ * queue) the same way play_next() does and returns a copy of the next
+ * file's name, which the file player starts decoding while the end of
+ * the current track is still playing. Returns NULL if gapless playback
+ * has been disabled or there is no next track. In that case the playlist
+ * is left alone, so the main loop can advance it as usual. The track
+ * change is announced by gapless_track_started().
+ */
+static char *get_next_track_for_gapless_playback(void)
+{
+	char  *res = NULL;
+	int    gapless;
+	Entry *entry;
+
+	gmu_core_config_acquire_lock();
+	/* Crossfading needs the next track early, too */
+	gapless = cfg_get_boolean_value(config, "Gmu.Gapless") || cfg_get_int_value(config, "Gmu.Crossfade") > 0;
+	gmu_core_config_release_lock();
+	if (gapless) {
+		playlist_get_lock(&pl);
+		if (player_status == PLAYING && global_command == NO_CMD && (entry = playlist_peek_next(&pl))) {
+			char *filename = playlist_get_entry_filename(&pl, entry);
+			if (filename) {
+				size_t len = strlen(filename);
+				res = malloc(len+1);
+				if (res) memcpy(res, filename, len+1);
+			}
+			if (res && !playlist_next(&pl)) {
+				free(res);
+				res = NULL;
+			}
+		}
+		playlist_release_lock(&pl);
+	}
+	return res;
+}
+
+/**
+ * Called by the file player's decoder thread once playback has reached
+ * the track returned by get_next_track_for_gapless_playback().
+ */
+static void gapless_track_started(void)
+{
+	int ppos;
+
+	playlist_get_lock(&pl);
+	ppos = playlist_get_current_position(&pl);
+	playlist_release_lock(&pl);
+	if (ppos >= 0) ppos++;
+	event_queue_push_with_parameter(&event_queue, GMU_TRACK_CHANGE, ppos);
+}
+
+/**
+ * Called by the file player once a track has started playing. Returns a
+ * copy of the file name of the track that is likely to be played next,
+ * so the reader can load its beginning in advance, or NULL.
+ */
+static char *get_next_track_for_prefetch(void)
+{
+	char  *res = NULL;
+	Entry *entry;
+
+	playlist_get_lock(&pl);
+	if ((entry = playlist_peek_next(&pl))) {
+		char *filename = playlist_get_entry_filename(&pl, entry);
+		if (filename) {
+			size_t len = strlen(filename);
+			res = malloc(len+1);
+			if (res) memcpy(res, filename, len+1);
+		}
+	}
+	playlist_release_lock(&pl);
+	return res;
+}
+
 static void add_default_cfg_settings(ConfigFile *config)
 {
 	cfg_add_key(config, "Gmu.DefaultPlayMode", "continue");
@@ -247,15 +331,36 @@ static void add_default_cfg_settings(ConfigFile *config)
 	cfg_add_key(config, "Gmu.FirstRun", "yes");
 	cfg_add_key(config, "Gmu.ResumePlayback", "yes");
 	cfg_key_add_presets(config, "Gmu.ResumePlayback", "yes", "no", NULL);
+	cfg_add_key(config, "Gmu.AudioBufferTime", "750");
+	cfg_key_add_presets(config, "Gmu.AudioBufferTime", "250", "500", "750", "1000", "2000", NULL);
+	cfg_add_key(config, "Gmu.AudioBufferTimeMax", "3000");
+	cfg_key_add_presets(config, "Gmu.AudioBufferTimeMax", "750", "1500", "3000", "5000", NULL);
 	cfg_add_key(config, "Gmu.ReaderCache", "512");
 	cfg_key_add_presets(config, "Gmu.ReaderCache", "256", "512", "1024", NULL);
 	cfg_add_key(config, "Gmu.ReaderCachePrebufferSize", "256");
 	cfg_key_add_presets(config, "Gmu.ReaderCachePrebufferSize", "128", "256", "512", "768", NULL);
+	cfg_add_key(config, "Gmu.ReaderReadAhead", "512");
+	cfg_key_add_presets(config, "Gmu.ReaderReadAhead", "0", "256", "512", "1024", "4096", NULL);
+	cfg_add_key(config, "Gmu.HTTPDiskCacheSize", "0");
+	cfg_key_add_presets(config, "Gmu.HTTPDiskCacheSize", "0", "16", "64", "256", NULL);
+	cfg_add_key(config, "Gmu.HTTPConnectTimeout", "5");
+	cfg_key_add_presets(config, "Gmu.HTTPConnectTimeout", "2", "5", "10", "20", NULL);
+	cfg_add_key(config, "Gmu.HTTPReceiveTimeout", "2");
+	cfg_key_add_presets(config, "Gmu.HTTPReceiveTimeout", "1", "2", "5", "10", NULL);
 	cfg_add_key(config, "Gmu.LyricsFilePattern", "*.txt");
 	cfg_add_key(config, "Gmu.FadeOutOnSkip", "no");
 	cfg_key_add_presets(config, "Gmu.FadeOutOnSkip", "yes", "no", NULL);
 	cfg_add_key(config, "Gmu.DeviceCloseASAP", "no");
 	cfg_key_add_presets(config, "Gmu.DeviceCloseASAP", "yes", "no", NULL);
+	cfg_add_key(config, "Gmu.Crossfade", "0");
+	cfg_key_add_presets(config, "Gmu.Crossfade", "0", "1000", "2000", "3000", "5000", "8000", NULL);
+	cfg_add_key(config, "Gmu.CrossfadeCurve", "equalpower");
+	cfg_key_add_presets(config, "Gmu.CrossfadeCurve", "equalpower", "linear", NULL);
+	cfg_add_key(config, "Gmu.Gapless", "yes");
+	cfg_key_add_presets(config, "Gmu.Gapless", "yes", "no", NULL);
+	cfg_add_key(config, "Gmu.MedialibScanThreads", "2");
+	cfg_key_add_presets(config, "Gmu.MedialibScanThreads", "1", "2", "4", "8", NULL);
+	cfg_add_key(config, "Gmu.ShuffleSeed", "0");
 }
 
 int gmu_core_export_playlist(const char *file)
@@ -283,10 +388,12 @@ int gmu_core_export_playlist(const char *file)
 
 static void set_default_play_mode(ConfigFile *config, Playlist *pl)
 {
-	PlayMode    pmode = PM_CONTINUE;
-	const char *dpm;
+	PlayMode      pmode = PM_CONTINUE;
+	const char   *dpm;
+	unsigned long seed;
 
 	gmu_core_config_acquire_lock();
+	seed = (unsigned long)cfg_get_int_value(config, "Gmu.ShuffleSeed");
 	dpm = cfg_get_key_value(config, "Gmu.DefaultPlayMode");
 	if (strncmp(dpm, "random", 6) == 0)
 		pmode = PM_RANDOM;
@@ -299,6 +406,7 @@ static void set_default_play_mode(ConfigFile *config, Playlist *pl)
 	gmu_core_config_release_lock();
 	playlist_get_lock(pl);
 	playlist_set_play_mode(pl, pmode);
+	if (seed) playlist_set_shuffle_seed(pl, seed);
 	playlist_release_lock(pl);
 }
 
@@ -379,7 +487,9 @@ static int stop_playback(void)
 		gmu_core_playlist_reset_random();
 		gmu_core_playlist_set_current(NULL);
 		file_player_stop_playback();
+		playlist_get_lock(&pl);
 		player_status = STOPPED;
+		playlist_release_lock(&pl);
 		event_queue_push(&event_queue, GMU_PLAYBACK_STATE_CHANGE);
 		res = 1;
 	}
@@ -395,9 +505,11 @@ int gmu_core_stop(void)
 
 int gmu_core_play_pl_item(int item)
 {
+	playlist_get_lock(&pl);
 	global_command = PLAY_ITEM;
 	global_param = item;
 	player_status = PLAYING;
+	playlist_release_lock(&pl);
 	file_player_request_playback_state_change(PBRQ_PLAY);
 	event_queue_push_with_parameter(
 		&event_queue,
@@ -413,10 +525,12 @@ int gmu_core_play_pl_item(int item)
  */
 int gmu_core_play_file(const char *filename)
 {
+	playlist_get_lock(&pl);
 	strncpy(global_filename, filename, 255);
 	global_filename[255] = '\0';
 	global_command = PLAY_FILE;
 	player_status = PLAYING;
+	playlist_release_lock(&pl);
 	file_player_request_playback_state_change(PBRQ_PLAY);
 	event_queue_push_with_parameter(&event_queue, GMU_TRACK_CHANGE, -1);
 	return 1;
@@ -662,6 +776,17 @@ int gmu_core_playlist_entry_get_queue_pos(Entry *entry)
 	return playlist_entry_get_queue_pos(entry);
 }
 
+unsigned long gmu_core_playlist_get_version(size_t *length)
+{
+	if (length) *length = playlist_get_length(&pl);
+	return playlist_get_version(&pl);
+}
+
+size_t gmu_core_playlist_get_changed_since(unsigned long version)
+{
+	return playlist_get_changed_since(&pl, version);
+}
+
 int gmu_core_get_length_current_track(void)
 {
 	int len = 0;
@@ -672,6 +797,12 @@ int gmu_core_get_length_current_track(void)
 	return len;
 }
 
+/* Fills 'stats' with the audio buffer underrun counters and fill level histogram */
+void gmu_core_get_audio_buffer_stats(AudioBufferStats *stats)
+{
+	audio_buffer_get_stats(stats);
+}
+
 EventQueue *gmu_core_get_event_queue(void)
 {
 	return &event_queue;
@@ -811,7 +942,7 @@ static void medialib_refresh_finish_callback(void)
 void gmu_core_medialib_start_refresh(void)
 {
 #ifdef GMU_MEDIALIB
-	medialib_start_refresh(&gm, medialib_refresh_finish_callback);
+	medialib_start_refresh(&gm, GMU_MLIB_REFRESH_INCREMENTAL, medialib_refresh_finish_callback);
 #endif
 }
 
@@ -825,6 +956,16 @@ int gmu_core_medialib_search_find(GmuMedialibDataType type, const char *str)
 #endif
 }
 
+int gmu_core_medialib_search_find_range(GmuMedialibDataType type, const char *str, int offset, int count)
+{
+#ifdef GMU_MEDIALIB
+	event_queue_push(&event_queue, GMU_MEDIALIB_SEARCH_START);
+	return medialib_search_find_range(&gm, type, str, offset, count);
+#else
+	return 0;
+#endif
+}
+
 TrackInfo gmu_core_medialib_search_fetch_next_result(void)
 {
 	TrackInfo res;
@@ -1163,6 +1304,22 @@ int main(int argc, char **argv)
 		prebuffer_size = cfg_get_int_value(config, "Gmu.ReaderCachePrebufferSize");
 		if (prebuffer_size <= 0) prebuffer_size = size / 2;
 		reader_set_cache_size_kb(size, prebuffer_size);
+		size = cfg_get_int_value(config, "Gmu.ReaderReadAhead");
+		reader_set_read_ahead_kb(size > 0 ? size : 0);
+	}
+
+	httpconn_set_timeouts(cfg_get_int_value(config, "Gmu.HTTPConnectTimeout"),
+	                      cfg_get_int_value(config, "Gmu.HTTPReceiveTimeout"));
+
+	/* HTTP disk cache */
+	{
+		int size = cfg_get_int_value(config, "Gmu.HTTPDiskCacheSize");
+
+		if (size > 0) {
+			char *dir = get_cache_dir_with_name_alloc("gmu", 1, "http");
+			httpcache_init(dir, size);
+			if (dir) free(dir);
+		}
 	}
 
 	{
@@ -1190,9 +1347,12 @@ int main(int argc, char **argv)
 	/* Put available file extensions in an array */
 	file_extensions_load();
 
+	audio_buffer_init();
+	audio_buffer_set_time(cfg_get_int_value(config, "Gmu.AudioBufferTime"),
+	                      cfg_get_int_value(config, "Gmu.AudioBufferTimeMax"));
+
 	gmu_core_config_release_lock();
 
-	audio_buffer_init();
 	trackinfo_init(&current_track_ti, 1);
 	playlist_init(&pl);
 	if (alt_playlist) { /* Load user playlist if it has been specified with the -l cmd option */
@@ -1213,6 +1373,7 @@ int main(int argc, char **argv)
 	wdprintf(V_INFO, "gmu", "Playlist length: %d items\n", playlist_get_length(&pl));
 #ifdef GMU_MEDIALIB
 	medialib_open(&gm);
+	medialib_set_scan_threads(&gm, cfg_get_int_value(config, "Gmu.MedialibScanThreads"));
 #endif
 #if 1 // ZIPIT_Z2	
 #if STATIC
@@ -1249,12 +1410,17 @@ int main(int argc, char **argv)
 #endif
 
 	file_player_init(&current_track_ti, cfg_get_boolean_value(config, "Gmu.DeviceCloseASAP"));
+	file_player_set_next_track_callback(get_next_track_for_gapless_playback);
+	file_player_set_track_start_callback(gapless_track_started);
+	file_player_set_prefetch_track_callback(get_next_track_for_prefetch);
 	set_default_play_mode(config, &pl);
 
 	gmu_core_set_volume(-1); /* Load from config */
 
 	gmu_core_config_acquire_lock();
 	file_player_set_lyrics_file_pattern(cfg_get_key_value(config, "Gmu.LyricsFilePattern"));
+	file_player_set_crossfade(cfg_get_int_value(config, "Gmu.Crossfade"),
+	                          crossfade_curve_from_string(cfg_get_key_value(config, "Gmu.CrossfadeCurve")));
 
 	if (cfg_get_boolean_value(config, "Gmu.AutoPlayOnProgramStart")) {
 		global_command = NEXT;
@@ -1340,9 +1506,9 @@ int main(int argc, char **argv)
 				playlist_set_current(&pl, tmp_item);
 				file_player_play_file(playlist_get_entry_filename(&pl, tmp_item), 1, fade_out_on_skip);
 			}
-			playlist_release_lock(&pl);
 			global_command = NO_CMD;
 			global_param = 0;
+			playlist_release_lock(&pl);
 		} else if (global_command == PLAY_FILE && global_filename[0] != '\0') {
 			wdprintf(V_DEBUG, "gmu", "Direct file playback: %s\n", global_filename);
 			playlist_get_lock(&pl);
@@ -1422,9 +1588,13 @@ int main(int argc, char **argv)
 			gmu_core_quit();
 		}
 
-		if (pb_time != file_player_playback_get_time()) {
-			pb_time = file_player_playback_get_time();
-			event_queue_push_with_parameter(&event_queue, GMU_PLAYBACK_TIME_CHANGE, pb_time);
+		{
+			/* Notify once per second of playback (in ms, taken from the sample clock) */
+			int64_t t = file_player_playback_get_time_us();
+			if (pb_time != t / 1000000) {
+				pb_time = t / 1000000;
+				event_queue_push_with_parameter(&event_queue, GMU_PLAYBACK_TIME_CHANGE, (int)(t / 1000));
+			}
 		}
 
 		while (event_queue_is_event_waiting(&event_queue)) {
@@ -1547,6 +1717,8 @@ int main(int argc, char **argv)
 #ifdef GMU_MEDIALIB
 	medialib_close(&gm);
 #endif
+	httpcache_free();
+	httpconn_free();
 
 	wdprintf(V_INFO, "gmu", "Unloading decoders...\n");
 	decloader_free();
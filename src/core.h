@@ -62,6 +62,7 @@ void             gmu_core_set_shutdown_time(int value);
 int              gmu_core_get_shutdown_time_total(void);
 int              gmu_core_get_shutdown_time_remaining(void);
 EventQueue      *gmu_core_get_event_queue(void);
+void             gmu_core_get_audio_buffer_stats(AudioBufferStats *stats);
 /* Playlist wrapper functions:
  * Most playlist wrapper functions acquire a lock for playlist access,
  * except functions working on playlist Entry objects. A lock must be 
@@ -99,9 +100,17 @@ Entry           *gmu_core_playlist_get_next(Entry *entry);
 Entry           *gmu_core_playlist_get_prev(Entry *entry);
 int              gmu_core_playlist_get_played(Entry *entry);
 int              gmu_core_playlist_entry_get_queue_pos(Entry *entry);
+/*
+ * The following two need the playlist lock held by the caller.
+ * gmu_core_playlist_get_version() also stores the playlist length in
+ * 'length', unless it is NULL.
+ */
+unsigned long    gmu_core_playlist_get_version(size_t *length);
+size_t           gmu_core_playlist_get_changed_since(unsigned long version);
 /* Media library wrapper functions: */
 void             gmu_core_medialib_start_refresh(void);
 int              gmu_core_medialib_search_find(GmuMedialibDataType type, const char *str);
+int              gmu_core_medialib_search_find_range(GmuMedialibDataType type, const char *str, int offset, int count);
 TrackInfo        gmu_core_medialib_search_fetch_next_result(void);
 void             gmu_core_medialib_search_finish(void);
 int              gmu_core_medialib_add_id_to_playlist(size_t id);
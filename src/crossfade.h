@@ -0,0 +1,42 @@
+/*
+ * Gmu Music Player
+ *
+ * Copyright (c) 2006-2021 Johannes Heimansberg (wej.k.vu)
+ *
+ * File: crossfade.h  Created: 261017
+ *
+ * Description: Mixing of two tracks for crossfading
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2 of
+ * the License. See the file COPYING in the Gmu's main directory
+ * for details.
+ */
+#ifndef CROSSFADE_H
+#define CROSSFADE_H
+#include <sys/types.h>
+#include <stdint.h>
+
+typedef enum { CROSSFADE_CURVE_LINEAR, CROSSFADE_CURVE_EQUAL_POWER } CrossfadeCurve;
+
+typedef struct
+{
+	CrossfadeCurve curve;
+	size_t         length;   /* Length of the transition in frames */
+	size_t         position; /* Frames mixed so far */
+	int            channels;
+} Crossfade;
+
+void           crossfade_init(Crossfade *xf, size_t length, int channels, CrossfadeCurve curve);
+/*
+ * Fades in the interleaved 16 bit samples in 'fade_in' and mixes the
+ * first 'fade_out_samples' samples of 'fade_out' into it, fading them
+ * out. The rest of 'fade_out' is assumed to be silent.
+ */
+void           crossfade_mix(Crossfade *xf, int16_t *fade_in, const int16_t *fade_out,
+                             size_t samples, size_t fade_out_samples);
+int            crossfade_is_done(Crossfade *xf);
+/* Accepts "linear" and "equalpower" */
+CrossfadeCurve crossfade_curve_from_string(const char *str);
+#endif
@@ -17,6 +17,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <dlfcn.h>
+#include <pthread.h>
 #include "dir.h"
 #include "decloader.h"
 #include "gmudecoder.h"
@@ -29,12 +30,228 @@
 static union {
 	void *ptr;
 	GmuDecoder * (*fptr) (void);
+	GmuDecoderV1 * (*fptr_v1) (void);
 } dlsymunion;
 
 static char         *dir_extensions[] = { ".so", NULL };
 static DecoderChain *dc_root;
 static char          extensions[1024];
 
+/*
+ * Compatibility layer for version 1 decoders. A version 1 decoder keeps its
+ * state in global variables, so it can only handle one file for playback
+ * (for_current_file = 1) and one file for meta data reading
+ * (for_current_file = 0) at a time. The wrapper hands out a context for each
+ * of those two slots. Opening a second file for playback fails, while a
+ * meta data request waits until the meta data slot is free again, so that
+ * concurrent meta data readers (e.g. the media library scanner) are
+ * serialized instead of being turned away.
+ */
+typedef struct _LegacyDecoder LegacyDecoder;
+
+typedef struct _LegacyContext {
+	LegacyDecoder *ld;
+	int            for_current_file;
+} LegacyContext;
+
+struct _LegacyDecoder {
+	GmuDecoder       gd;
+	GmuDecoderV1    *gd1;
+	pthread_mutex_t  mutex;
+	pthread_cond_t   meta_data_free;
+	int              playback_in_use, meta_data_in_use;
+	LegacyContext    playback_ctx, meta_data_ctx;
+};
+
+static int legacy_close_file(void *ctx)
+{
+	LegacyContext *lc = (LegacyContext *)ctx;
+	LegacyDecoder *ld = lc->ld;
+	int            res = 0;
+
+	if (ld->gd1->close_file) res = (*ld->gd1->close_file)();
+	if (ld->gd1->set_reader_handle) (*ld->gd1->set_reader_handle)(NULL);
+	pthread_mutex_lock(&(ld->mutex));
+	ld->playback_in_use = 0;
+	pthread_mutex_unlock(&(ld->mutex));
+	return res;
+}
+
+static int legacy_decode_data(void *ctx, char *target, size_t max_size)
+{
+	return (*((LegacyContext *)ctx)->ld->gd1->decode_data)(target, max_size);
+}
+
+static int legacy_seek(void *ctx, int second)
+{
+	return (*((LegacyContext *)ctx)->ld->gd1->seek)(second);
+}
+
+static int legacy_get_current_bitrate(void *ctx)
+{
+	return (*((LegacyContext *)ctx)->ld->gd1->get_current_bitrate)();
+}
+
+static const char *legacy_get_meta_data(void *ctx, GmuMetaDataType gmdt)
+{
+	LegacyContext *lc = (LegacyContext *)ctx;
+	return (*lc->ld->gd1->get_meta_data)(gmdt, lc->for_current_file);
+}
+
+static int legacy_get_meta_data_int(void *ctx, GmuMetaDataType gmdt)
+{
+	LegacyContext *lc = (LegacyContext *)ctx;
+	return (*lc->ld->gd1->get_meta_data_int)(gmdt, lc->for_current_file);
+}
+
+static int legacy_get_samplerate(void *ctx)
+{
+	return (*((LegacyContext *)ctx)->ld->gd1->get_samplerate)();
+}
+
+static int legacy_get_channels(void *ctx)
+{
+	return (*((LegacyContext *)ctx)->ld->gd1->get_channels)();
+}
+
+static int legacy_get_length(void *ctx)
+{
+	return (*((LegacyContext *)ctx)->ld->gd1->get_length)();
+}
+
+static int legacy_get_bitrate(void *ctx)
+{
+	return (*((LegacyContext *)ctx)->ld->gd1->get_bitrate)();
+}
+
+static const char *legacy_get_file_type(void *ctx)
+{
+	return (*((LegacyContext *)ctx)->ld->gd1->get_file_type)();
+}
+
+static int legacy_meta_data_close(void *ctx)
+{
+	LegacyContext *lc = (LegacyContext *)ctx;
+	LegacyDecoder *ld = lc->ld;
+	int            res = 1;
+
+	if (ld->gd1->meta_data_close) res = (*ld->gd1->meta_data_close)();
+	pthread_mutex_lock(&(ld->mutex));
+	ld->meta_data_in_use = 0;
+	pthread_cond_signal(&(ld->meta_data_free));
+	pthread_mutex_unlock(&(ld->mutex));
+	return res;
+}
+
+/*
+ * Claims one of the two slots of a legacy decoder, returns 1 on success.
+ * If wait_cond is not NULL, waits on it until the slot is free.
+ */
+static int legacy_claim(LegacyDecoder *ld, int *in_use, pthread_cond_t *wait_cond)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&(ld->mutex));
+	while (wait_cond && *in_use)
+		pthread_cond_wait(wait_cond, &(ld->mutex));
+	if (!*in_use) {
+		*in_use = 1;
+		res = 1;
+	}
+	pthread_mutex_unlock(&(ld->mutex));
+	if (!res)
+		wdprintf(V_WARNING, "decloader", "%s: Decoder does not support multiple instances.\n",
+		         ld->gd.identifier);
+	return res;
+}
+
+static void *legacy_open_file(LegacyDecoder *ld, const char *filename, Reader *r)
+{
+	void *ctx = NULL;
+
+	if (ld->gd1->open_file && legacy_claim(ld, &(ld->playback_in_use), NULL)) {
+		if (ld->gd1->set_reader_handle) (*ld->gd1->set_reader_handle)(r);
+		if ((*ld->gd1->open_file)(filename)) {
+			ctx = &(ld->playback_ctx);
+		} else {
+			if (ld->gd1->set_reader_handle) (*ld->gd1->set_reader_handle)(NULL);
+			pthread_mutex_lock(&(ld->mutex));
+			ld->playback_in_use = 0;
+			pthread_mutex_unlock(&(ld->mutex));
+		}
+	}
+	return ctx;
+}
+
+static void *legacy_meta_data_load(LegacyDecoder *ld, const char *filename)
+{
+	void *ctx = NULL;
+
+	if (ld->gd1->meta_data_load && legacy_claim(ld, &(ld->meta_data_in_use), &(ld->meta_data_free))) {
+		if ((*ld->gd1->meta_data_load)(filename)) {
+			ctx = &(ld->meta_data_ctx);
+		} else {
+			pthread_mutex_lock(&(ld->mutex));
+			ld->meta_data_in_use = 0;
+			pthread_cond_signal(&(ld->meta_data_free));
+			pthread_mutex_unlock(&(ld->mutex));
+		}
+	}
+	return ctx;
+}
+
+static GmuDecoder *legacy_decoder_wrap(GmuDecoderV1 *gd1)
+{
+	LegacyDecoder *ld = NULL;
+	GmuDecoder    *gd = NULL;
+
+	if (gd1 && (ld = calloc(1, sizeof(LegacyDecoder)))) {
+		ld->gd1 = gd1;
+		pthread_mutex_init(&(ld->mutex), NULL);
+		pthread_cond_init(&(ld->meta_data_free), NULL);
+		ld->playback_ctx.ld = ld;
+		ld->playback_ctx.for_current_file = 1;
+		ld->meta_data_ctx.ld = ld;
+		ld->meta_data_ctx.for_current_file = 0;
+
+		gd = &(ld->gd);
+		gd->identifier              = gd1->identifier;
+		gd->init_decoder            = gd1->init_decoder;
+		gd->close_decoder           = gd1->close_decoder;
+		gd->get_name                = gd1->get_name;
+		gd->get_info                = gd1->get_info;
+		gd->get_file_extensions     = gd1->get_file_extensions;
+		gd->get_mime_types          = gd1->get_mime_types;
+		gd->get_decoder_buffer_size = gd1->get_decoder_buffer_size;
+		gd->meta_data_get_charset   = gd1->meta_data_get_charset;
+		gd->data_check_magic_bytes  = gd1->data_check_magic_bytes;
+		gd->uses_reader             = gd1->set_reader_handle != NULL;
+		/* open_file and meta_data_load are dispatched by decloader_decoder_open_file()
+		 * and decloader_decoder_meta_data_load() */
+		gd->close_file              = legacy_close_file;
+		gd->decode_data             = gd1->decode_data         ? legacy_decode_data : NULL;
+		gd->seek                    = gd1->seek                ? legacy_seek : NULL;
+		gd->get_current_bitrate     = gd1->get_current_bitrate ? legacy_get_current_bitrate : NULL;
+		gd->get_meta_data           = gd1->get_meta_data       ? legacy_get_meta_data : NULL;
+		gd->get_meta_data_int       = gd1->get_meta_data_int   ? legacy_get_meta_data_int : NULL;
+		gd->get_samplerate          = gd1->get_samplerate      ? legacy_get_samplerate : NULL;
+		gd->get_channels            = gd1->get_channels        ? legacy_get_channels : NULL;
+		gd->get_length              = gd1->get_length          ? legacy_get_length : NULL;
+		gd->get_bitrate             = gd1->get_bitrate         ? legacy_get_bitrate : NULL;
+		gd->get_file_type           = gd1->get_file_type       ? legacy_get_file_type : NULL;
+		gd->meta_data_close         = legacy_meta_data_close;
+		gd->legacy                  = ld;
+	}
+	return gd;
+}
+
+static void legacy_decoder_free(LegacyDecoder *ld)
+{
+	pthread_cond_destroy(&(ld->meta_data_free));
+	pthread_mutex_destroy(&(ld->mutex));
+	free(ld);
+}
+
 static DecoderChain *dc_init_element(void)
 {
 	DecoderChain *dc = NULL;
@@ -58,6 +275,7 @@ static void dc_free(DecoderChain *dc)
 				wdprintf(V_DEBUG, "decloader", "Unloading decoder: %s\n", dc->gd->identifier);
 				if (dc->gd->close_decoder) (*dc->gd->close_decoder)();
 				dlclose(dc->gd->handle);
+				if (dc->gd->legacy) legacy_decoder_free(dc->gd->legacy);
 			}
 			free(dc);
 		}
@@ -88,7 +306,6 @@ GmuDecoder *decloader_load_decoder(const char *so_file)
 {
 	GmuDecoder *result = NULL;
 	void       *handle;
-	GmuDecoder *(*dec_load_func)(void);
 
 	handle = dlopen(so_file, DLOPEN_FLAGS);
 	if (!handle) {
@@ -96,14 +313,30 @@ GmuDecoder *decloader_load_decoder(const char *so_file)
 		result = 0;
 	} else {
 		char *error;
-		dlsymunion.ptr = dlsym(handle, "gmu_register_decoder");
-		dec_load_func  = dlsymunion.fptr;
-		error = dlerror();
-		if (error) {
-			wdprintf(V_ERROR, "decloader", "%s\n", error);
-		} else {
-			result = (*dec_load_func)();
+		dlsymunion.ptr = dlsym(handle, "gmu_register_decoder_v2");
+		if (dlsymunion.ptr) {
+			result = (*dlsymunion.fptr)();
+		} else { /* Old decoder? */
+			dlerror();
+			dlsymunion.ptr = dlsym(handle, "gmu_register_decoder");
+			error = dlerror();
+			if (error) {
+				wdprintf(V_ERROR, "decloader", "%s\n", error);
+			} else {
+				GmuDecoderV1 *gd1 = (*dlsymunion.fptr_v1)();
+				if (gd1) {
+					wdprintf(V_INFO, "decloader", "%s: Using compatibility layer for old decoder interface.\n",
+					         gd1->identifier);
+					gd1->handle = handle;
+				}
+				result = legacy_decoder_wrap(gd1);
+			}
+		}
+		if (result) {
 			result->handle = handle;
+			if (result->init_decoder) (*result->init_decoder)();
+		} else {
+			dlclose(handle);
 		}
 	}
 	dlerror(); /* Clear any possibly existing error */
@@ -111,6 +344,28 @@ GmuDecoder *decloader_load_decoder(const char *so_file)
 	return result;
 }
 
+void *decloader_decoder_open_file(GmuDecoder *gd, const char *filename, Reader *r)
+{
+	void *ctx = NULL;
+
+	if (gd->legacy)
+		ctx = legacy_open_file(gd->legacy, filename, r);
+	else if (gd->open_file)
+		ctx = (*gd->open_file)(filename, r);
+	return ctx;
+}
+
+void *decloader_decoder_meta_data_load(GmuDecoder *gd, const char *filename)
+{
+	void *ctx = NULL;
+
+	if (gd->legacy)
+		ctx = legacy_meta_data_load(gd->legacy, filename);
+	else if (gd->meta_data_load)
+		ctx = (*gd->meta_data_load)(filename);
+	return ctx;
+}
+
 int decloader_load_all(const char *directory)
 {
 	Dir          *dir;
@@ -266,6 +521,7 @@ int decloader_load_builtin_decoders(void)
 	for (i = 0; decload_funcs[i]; i++) {
 		wdprintf(V_INFO, "decloader", "Loading internal decoder %d...\n", i);
 		dc->gd = (*decload_funcs[i])();
+		if (dc->gd->init_decoder) (*dc->gd->init_decoder)();
 		wdprintf(V_INFO, "decloader", "Loading decoder %d was successful.\n", i);
 		wdprintf(V_INFO, "decloader", "%s: Name: %s\n", dc->gd->identifier, (*dc->gd->get_name)());
 		if (dc->gd->get_file_extensions) {
@@ -25,6 +25,12 @@ struct _DecoderChain {
 };
 
 GmuDecoder *decloader_load_decoder(const char *so_file);
+/* Open a file for playback/meta data reading with the given decoder and return
+ * the decoder context or NULL on failure. These must be used instead of calling
+ * gd->open_file()/gd->meta_data_load() directly, since they also take care of
+ * decoders using the old decoder interface. */
+void       *decloader_decoder_open_file(GmuDecoder *gd, const char *filename, Reader *r);
+void       *decloader_decoder_meta_data_load(GmuDecoder *gd, const char *filename);
 int         decloader_load_all(const char *directory);
 GmuDecoder *decloader_get_decoder_for_extension(const char *file_extension);
 GmuDecoder *decloader_get_decoder_for_mime_type(const char *mime_type);
@@ -25,13 +25,15 @@
 #include "../debug.h"
 #define BUF_SIZE 65536
 
-static FLAC__StreamDecoder *fsd;
-static long                 total_samples, seek_to_sample;
-static int                  sample_rate, channels, track_length, bitrate, file_size;
-static unsigned int         size = 1; /* size of decoded data */
-static char                 buf[BUF_SIZE];
-static TrackInfo            ti, ti_metaonly;
-static Reader              *r;
+typedef struct _FlacDecoder {
+	FLAC__StreamDecoder *fsd;
+	long                 seek_to_sample;
+	int                  sample_rate, channels, track_length, bitrate, file_size;
+	unsigned int         size; /* size of decoded data */
+	char                 buf[BUF_SIZE];
+	TrackInfo            ti;
+	Reader              *r;
+} FlacDecoder;
 
 static const char *get_name(void)
 {
@@ -43,6 +45,7 @@ static FLAC__StreamDecoderWriteStatus write_callback(const FLAC__StreamDecoder *
                                                      const FLAC__int32 *const   buffer[],
                                                      void                      *client_data)
 {
+	FlacDecoder *fd = (FlacDecoder *)client_data;
 	unsigned int length = frame->header.blocksize * frame->header.channels
 	                                              * frame->header.bits_per_sample / 8;
 	unsigned int sample, channel, pos = 0, byte_count = 0;
@@ -70,8 +73,8 @@ static FLAC__StreamDecoderWriteStatus write_callback(const FLAC__StreamDecoder *
 	}
 
 	if (byte_count <= BUF_SIZE) {
-		memcpy(buf, (char *)packed, byte_count);
-		size = byte_count;
+		memcpy(fd->buf, (char *)packed, byte_count);
+		fd->size = byte_count;
 	} else {
 		wdprintf(V_DEBUG, "flac", "Sample size > buffer size: %d bytes\n", byte_count);
 	}
@@ -81,6 +84,7 @@ static FLAC__StreamDecoderWriteStatus write_callback(const FLAC__StreamDecoder *
 static FLAC__StreamDecoderReadStatus read_callback(const FLAC__StreamDecoder *decoder, FLAC__byte buffer[], size_t *bytes, void *client_data)
 {
 	FLAC__StreamDecoderReadStatus res;
+	Reader                       *r = ((FlacDecoder *)client_data)->r;
 	/*
 	 * When initializing the stream, some bytes may have been read already,
 	 * which we don't want to skip, so we first check if there is something
@@ -116,15 +120,16 @@ static void metadata_callback(const FLAC__StreamDecoder  *decoder,
                               const FLAC__StreamMetadata *metadata,
                               void                       *client_data)
 {
-	TrackInfo   *ti = (TrackInfo *)client_data;
+	FlacDecoder *fd = (FlacDecoder *)client_data;
+	TrackInfo   *ti = &(fd->ti);
 	unsigned int i;
 
 	switch (metadata->type) {
 		case FLAC__METADATA_TYPE_STREAMINFO:
-			sample_rate        = metadata->data.stream_info.sample_rate;
-			channels           = metadata->data.stream_info.channels;
-			track_length       = metadata->data.stream_info.total_samples / sample_rate;
-			bitrate            = (int)((FLAC__int64)file_size * 8 * sample_rate / metadata->data.stream_info.total_samples);
+			fd->sample_rate    = metadata->data.stream_info.sample_rate;
+			fd->channels       = metadata->data.stream_info.channels;
+			fd->track_length   = metadata->data.stream_info.total_samples / fd->sample_rate;
+			fd->bitrate        = (int)((FLAC__int64)fd->file_size * 8 * fd->sample_rate / metadata->data.stream_info.total_samples);
 
 			ti->samplerate     = metadata->data.stream_info.sample_rate;
 			ti->channels       = metadata->data.stream_info.channels;
@@ -138,7 +143,7 @@ static void metadata_callback(const FLAC__StreamDecoder  *decoder,
 				"Bitstream is %d channel(s), %d bits per sample, %ld kbps, %d Hz\n",
 				ti->channels,
 				metadata->data.stream_info.bits_per_sample,
-				bitrate / 1000,
+				fd->bitrate / 1000,
 				ti->samplerate
 			);
 			break;
@@ -175,24 +180,26 @@ static void error_callback(const FLAC__StreamDecoder      *decoder,
 
 static FLAC__StreamDecoderTellStatus tell_callback(const FLAC__StreamDecoder *decoder, FLAC__uint64 *absolute_byte_offset, void *client_data)
 {
-	*absolute_byte_offset = reader_get_stream_position(r);
+	*absolute_byte_offset = reader_get_stream_position(((FlacDecoder *)client_data)->r);
 	return FLAC__STREAM_DECODER_TELL_STATUS_OK;
 }
 
 static FLAC__StreamDecoderLengthStatus length_callback(const FLAC__StreamDecoder *decoder, FLAC__uint64 *stream_length, void *client_data)
 {
-	*stream_length = reader_get_file_size(r);
+	*stream_length = reader_get_file_size(((FlacDecoder *)client_data)->r);
 	return FLAC__STREAM_DECODER_LENGTH_STATUS_OK;
 }
 
 static FLAC__bool eof_callback(const FLAC__StreamDecoder *decoder, void *client_data)
 {
-	return reader_is_eof(r);
+	return reader_is_eof(((FlacDecoder *)client_data)->r);
 }
 
 static FLAC__StreamDecoderSeekStatus seek_callback(const FLAC__StreamDecoder *decoder, FLAC__uint64 absolute_byte_offset, void *client_data)
 {
 	FLAC__StreamDecoderSeekStatus res;
+	Reader                       *r = ((FlacDecoder *)client_data)->r;
+
 	if (reader_is_seekable(r)) {
 		res = reader_seek(r, absolute_byte_offset) ? FLAC__STREAM_DECODER_SEEK_STATUS_OK : FLAC__STREAM_DECODER_SEEK_STATUS_ERROR;
 	} else {
@@ -201,26 +208,25 @@ static FLAC__StreamDecoderSeekStatus seek_callback(const FLAC__StreamDecoder *de
 	return res;
 }
 
-static int open_file(const char *filename)
+static void *open_file(const char *filename, Reader *r)
 {
-	int result = 1;
-
-	total_samples = 0;
-	seek_to_sample = 0;
-	sample_rate = 0;
-	fsd = FLAC__stream_decoder_new();
-	FLAC__stream_decoder_set_metadata_respond(fsd, FLAC__METADATA_TYPE_VORBIS_COMMENT);
-
-	trackinfo_clear(&ti);
+	FlacDecoder *fd;
 
 	if (!r) {
 		wdprintf(V_WARNING, "flac", "Unable to open stream: %s\n", filename);
-		return 0;
+		return NULL;
 	}
+	if (!(fd = calloc(1, sizeof(FlacDecoder)))) return NULL;
+	fd->r = r;
+	fd->size = 1;
+	fd->fsd = FLAC__stream_decoder_new();
+	FLAC__stream_decoder_set_metadata_respond(fd->fsd, FLAC__METADATA_TYPE_VORBIS_COMMENT);
+
+	trackinfo_clear(&(fd->ti));
 
-	file_size = reader_get_file_size(r);
+	fd->file_size = reader_get_file_size(r);
 
-	if (FLAC__stream_decoder_init_stream(fsd,
+	if (FLAC__stream_decoder_init_stream(fd->fsd,
 		&read_callback,
 		&seek_callback,
 		&tell_callback,
@@ -229,52 +235,61 @@ static int open_file(const char *filename)
 		&write_callback,
 		&metadata_callback,
 		&error_callback,
-		&ti) != FLAC__STREAM_DECODER_INIT_STATUS_OK)  {
+		fd) != FLAC__STREAM_DECODER_INIT_STATUS_OK)  {
 		wdprintf(V_ERROR, "flac", "Could not initialize decoder.\n");
-		result = 0;
+		FLAC__stream_decoder_delete(fd->fsd);
+		free(fd);
+		fd = NULL;
 	} else {
-		if (FLAC__stream_decoder_process_until_end_of_metadata(fsd) == false) {
+		if (FLAC__stream_decoder_process_until_end_of_metadata(fd->fsd) == false) {
 			wdprintf(V_ERROR, "flac", "Stream error.\n");
-			result = 0;
+			FLAC__stream_decoder_finish(fd->fsd);
+			FLAC__stream_decoder_delete(fd->fsd);
+			free(fd);
+			fd = NULL;
 		} else {
 			wdprintf(V_INFO, "flac", "Stream ready.\n");
 		}
 	}
-	return result;
+	return fd;
 }
 
-static int close_file(void)
+static int close_file(void *ctx)
 {
-	FLAC__stream_decoder_finish(fsd);
-	FLAC__stream_decoder_delete(fsd);
+	FlacDecoder *fd = (FlacDecoder *)ctx;
+
+	FLAC__stream_decoder_finish(fd->fsd);
+	FLAC__stream_decoder_delete(fd->fsd);
+	free(fd);
 	return 0;
 }
 
-static int decode_data(char *target, size_t max_size)
+static int decode_data(void *ctx, char *target, size_t max_size)
 {
-	if (seek_to_sample) {
-		if (seek_to_sample < 0) seek_to_sample = 0;
-		FLAC__stream_decoder_seek_absolute(fsd, seek_to_sample);
-		seek_to_sample = 0;
+	FlacDecoder *fd = (FlacDecoder *)ctx;
+
+	if (fd->seek_to_sample) {
+		if (fd->seek_to_sample < 0) fd->seek_to_sample = 0;
+		FLAC__stream_decoder_seek_absolute(fd->fsd, fd->seek_to_sample);
+		fd->seek_to_sample = 0;
 	}
-	if (FLAC__stream_decoder_process_single(fsd) == false)
-		size = 0;
-	if (FLAC__stream_decoder_get_state(fsd) >= FLAC__STREAM_DECODER_END_OF_STREAM)
-		size = 0;
-	if (size <= max_size) {
-		memcpy(target, buf, size);
-		/*total_samples++;
-		size += ret;*/
+	if (FLAC__stream_decoder_process_single(fd->fsd) == false)
+		fd->size = 0;
+	if (FLAC__stream_decoder_get_state(fd->fsd) >= FLAC__STREAM_DECODER_END_OF_STREAM)
+		fd->size = 0;
+	if (fd->size <= max_size) {
+		memcpy(target, fd->buf, fd->size);
 	} else {
-		wdprintf(V_ERROR, "flac", "FATAL: Target buffer too small: %d < %d\n", max_size, size);
-		size = max_size;
+		wdprintf(V_ERROR, "flac", "FATAL: Target buffer too small: %d < %d\n", max_size, fd->size);
+		fd->size = max_size;
 	}
-	return size;
+	return fd->size;
 }
 
-static int seek(int seconds)
+static int seek(void *ctx, int seconds)
 {
-	seek_to_sample = seconds * sample_rate;
+	FlacDecoder *fd = (FlacDecoder *)ctx;
+	fd->seek_to_sample = seconds * fd->sample_rate;
 	return 1;
 }
 
@@ -288,35 +303,35 @@ static const char* get_file_extensions(void)
 	return ".flac";
 }
 
-static int get_current_bitrate(void)
+static int get_current_bitrate(void *ctx)
 {
-	return bitrate;
+	return ((FlacDecoder *)ctx)->bitrate;
 }
 
-static int get_length(void)
+static int get_length(void *ctx)
 {
-	return track_length;
+	return ((FlacDecoder *)ctx)->track_length;
 }
 
-static int get_samplerate(void)
+static int get_samplerate(void *ctx)
 {
-	return sample_rate;
+	return ((FlacDecoder *)ctx)->sample_rate;
 }
 
-static int get_channels(void)
+static int get_channels(void *ctx)
 {
-	return channels;
+	return ((FlacDecoder *)ctx)->channels;
 }
 
-static int get_bitrate(void)
+static int get_bitrate(void *ctx)
 {
-	return bitrate;
+	return ((FlacDecoder *)ctx)->bitrate;
 }
 
-static const char *get_meta_data(GmuMetaDataType gmdt, int for_current_file)
+static const char *get_meta_data(void *ctx, GmuMetaDataType gmdt)
 {
 	char *result = NULL;
-	TrackInfo *ti_res = (for_current_file ? &ti : &ti_metaonly);
+	TrackInfo *ti_res = &(((FlacDecoder *)ctx)->ti);
 
 	switch (gmdt) {
 		case GMU_META_ARTIST:
@@ -340,7 +355,7 @@ static const char *get_meta_data(GmuMetaDataType gmdt, int for_current_file)
 	return result;
 }
 
-static const char *get_file_type(void)
+static const char *get_file_type(void *ctx)
 {
 	return "FLAC";
 }
@@ -353,32 +368,34 @@ static FLAC__StreamDecoderWriteStatus dummy_write_callback(const FLAC__StreamDec
 	return 0;
 }
 
-static int meta_data_load(const char *filename)
+static void *meta_data_load(const char *filename)
 {
 	int                  result = 0;
 	FILE                *file;
 	FLAC__StreamDecoder *decoder;
 	char                *filename_without_path = NULL;
+	FlacDecoder         *fd;
 
+	if (!(fd = calloc(1, sizeof(FlacDecoder)))) return NULL;
 	decoder = FLAC__stream_decoder_new(); 
 	FLAC__stream_decoder_set_metadata_respond(decoder, FLAC__METADATA_TYPE_VORBIS_COMMENT);
 
-	trackinfo_clear(&ti_metaonly);
+	trackinfo_clear(&(fd->ti));
 
 	file = fopen(filename, "rb");
 	if (file) {
 		fseek(file, SEEK_END, 0);
-		ti_metaonly.file_size = ftell(file);
+		fd->ti.file_size = ftell(file);
 		fseek(file, SEEK_SET, 0);
 	}
 	if (!file) {
 		wdprintf(V_WARNING, "flac", "Could not open file.\n");
 	} else if (FLAC__stream_decoder_init_FILE(decoder, file, &dummy_write_callback,
-	                                          &metadata_callback, &error_callback, &ti_metaonly)
+	                                          &metadata_callback, &error_callback, fd)
 	                                         != FLAC__STREAM_DECODER_INIT_STATUS_OK) {
 		wdprintf(V_ERROR, "flac", "Could not initialize decoder.\n");
 	} else {
-		strncpy(ti_metaonly.file_name, filename, SIZE_FILE_NAME-1);
+		strncpy(fd->ti.file_name, filename, SIZE_FILE_NAME-1);
 		filename_without_path = strrchr(filename, '/');
 		if (filename_without_path != NULL)
 			filename_without_path++;
@@ -386,10 +403,10 @@ static int meta_data_load(const char *filename)
 		filename_without_path = charset_filename_convert_alloc(
 			filename_without_path ? filename_without_path : filename
 		);
-		strncpy(ti_metaonly.title, filename_without_path, SIZE_TITLE-1);
+		strncpy(fd->ti.title, filename_without_path, SIZE_TITLE-1);
 		free(filename_without_path);
 
-		strncpy(ti_metaonly.file_type, "FLAC", SIZE_FILE_TYPE-1);
+		strncpy(fd->ti.file_type, "FLAC", SIZE_FILE_TYPE-1);
 
 		if (FLAC__stream_decoder_process_until_end_of_metadata(decoder) == false) {
 			wdprintf(V_ERROR, "flac", "Stream error.\n");
@@ -399,12 +416,17 @@ static int meta_data_load(const char *filename)
 		FLAC__stream_decoder_finish(decoder);
 	}
 	FLAC__stream_decoder_delete(decoder);
-	return result;
+	if (!result) {
+		free(fd);
+		fd = NULL;
+	}
+	return fd;
 }
 
 
-static int meta_data_close(void)
+static int meta_data_close(void *ctx)
 {
+	free(ctx);
 	return 1;
 }
 
@@ -413,11 +435,6 @@ static GmuCharset meta_data_get_charset(void)
 	return M_CHARSET_UTF_8;
 }
 
-static void set_reader_handle(Reader *reader)
-{
-	r = reader;
-}
-
 static GmuDecoder gd = {
 	"FLAC_decoder",
 	NULL,
@@ -443,7 +460,8 @@ static GmuDecoder gd = {
 	meta_data_close,
 	meta_data_get_charset,
 	NULL,
-	set_reader_handle,
+	1,
+	NULL,
 	NULL
 };
 
@@ -16,6 +16,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <mikmod.h>
 #include "../gmudecoder.h"
 #include "../trackinfo.h"
@@ -23,17 +24,44 @@
 #include "../debug.h"
 #define BUF_SIZE 32768
 
-static MODULE *module;
+/* libmikmod has only one global player, so only one module can be
+ * played at a time. The context is the MODULE being played. */
+static int             player_in_use;
+static pthread_mutex_t player_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Claims the player; Returns 0 if it is already in use */
+static int player_claim(void)
+{
+	int res;
+
+	pthread_mutex_lock(&player_mutex);
+	res = !player_in_use;
+	player_in_use = 1;
+	pthread_mutex_unlock(&player_mutex);
+	return res;
+}
+
+static void player_release(void)
+{
+	pthread_mutex_lock(&player_mutex);
+	player_in_use = 0;
+	pthread_mutex_unlock(&player_mutex);
+}
 
 static const char *get_name(void)
 {
 	return "Mikmod module decoder v0.1";
 }
 
-static int open_file(const char *filename)
+static void *open_file(const char *filename, Reader *r)
 {
-	int   res = 0;
-	CHAR *list;
+	MODULE *module = NULL;
+	CHAR   *list;
+
+	if (!player_claim()) {
+		wdprintf(V_WARNING, "mikmod", "Player busy. Cannot open %s.\n", filename);
+		return NULL;
+	}
 
 	md_mixfreq = 44100; 
 	md_mode = DMODE_16BITS; 
@@ -67,8 +95,7 @@ static int open_file(const char *filename)
 		MikMod_RegisterLoader(&load_m15);
 	}
 
-	res = MikMod_Init(NULL);
-	if (res) {
+	if (MikMod_Init(NULL)) {
   		wdprintf(V_ERROR, "mikmod", "Init failed: %s\n", MikMod_strerror(MikMod_errno));
 	}
 	wdprintf(V_INFO, "mikmod", "Loading %s...\n", filename);
@@ -89,20 +116,23 @@ static int open_file(const char *filename)
 			strncpy(ti->title, filename_without_path, SIZE_TITLE-1);
 			free(filename_without_path);
 		}*/
-		res = 1;
 	} else {
 		MikMod_Exit();
+		player_release();
 	}
-	return res;
+	return module;
 }
 
-static int close_file(void)
+static int close_file(void *ctx)
 {
+	MODULE *module = (MODULE *)ctx;
+
 	wdprintf(V_DEBUG, "mikmod", "Stop!\n");
 	if (module) {
 		Player_Stop();
 		Player_Free(module);
 		MikMod_Exit();
+		player_release();
 		wdprintf(V_DEBUG, "mikmod", "Done.\n");
 	} else {
 		wdprintf(V_WARNING, "mikmod", "Am I playing?\n");
@@ -110,9 +140,9 @@ static int close_file(void)
 	return 0;
 }
 
-static int decode_data(char *target, size_t max_size)
+static int decode_data(void *ctx, char *target, size_t max_size)
 {
-	int mlen = VC_WriteBytes((SBYTE*)target, BUF_SIZE);
+	int mlen = VC_WriteBytes((SBYTE*)target, max_size < BUF_SIZE ? max_size : BUF_SIZE);
 	if (!Player_Active()) mlen = 0;
 	return mlen;
 }
@@ -127,34 +157,35 @@ static const char* get_file_extensions(void)
 	return ".mod;.it;.stm;.s3m;.xm;.669;.ult;.m15";
 }
 
-static int get_current_bitrate(void)
+static int get_current_bitrate(void *ctx)
 {
 	return 0;
 }
 
-static int get_length(void)
+static int get_length(void *ctx)
 {
 	return 0;
 }
 
-static int get_samplerate(void)
+static int get_samplerate(void *ctx)
 {
 	return 44100;
 }
 
-static int get_channels(void)
+static int get_channels(void *ctx)
 {
 	return 2;
 }
 
-static int get_bitrate(void)
+static int get_bitrate(void *ctx)
 {
 	return 0;
 }
 
-static const char *get_meta_data(GmuMetaDataType gmdt, int for_current_file)
+static const char *get_meta_data(void *ctx, GmuMetaDataType gmdt)
 {
-	char *result = NULL;
+	MODULE *module = (MODULE *)ctx;
+	char   *result = NULL;
 			
 	switch (gmdt) {
 		case GMU_META_ARTIST:
@@ -175,18 +206,17 @@ static const char *get_meta_data(GmuMetaDataType gmdt, int for_current_file)
 	return result;
 }
 
-static const char *get_file_type(void)
+static const char *get_file_type(void *ctx)
 {
-	return module->modtype;
+	return ((MODULE *)ctx)->modtype;
 }
 
-static int meta_data_load(const char *filename)
+static void *meta_data_load(const char *filename)
 {
-	int result = 0;
-	return result;
+	return NULL;
 }
 
-static int meta_data_close(void)
+static int meta_data_close(void *ctx)
 {
 	return 1;
 }
@@ -221,6 +251,7 @@ static GmuDecoder gd = {
 	meta_data_close,
 	meta_data_get_charset,
 	NULL,
+	0,
 	NULL,
 	NULL
 };
@@ -22,28 +22,30 @@
 #include "../gmudecoder.h"
 #include "../debug.h"
 
-static Reader      *r;
-static ModPlugFile *mpf = NULL;
-static char        *module;
-static TrackInfo    ti;
+typedef struct _ModPlugDecoder {
+	ModPlugFile *mpf;
+	char        *module;
+	TrackInfo    ti;
+} ModPlugDecoder;
 
 static const char *get_name(void)
 {
 	return "ModPlug module decoder v0.8";
 }
 
-static int decode_data(char *stream, size_t len)
+static int decode_data(void *ctx, char *stream, size_t len)
 {
-	return ModPlug_Read(mpf, stream, len);
+	return ModPlug_Read(((ModPlugDecoder *)ctx)->mpf, stream, len);
 }
 
-static int modplug_play_file(const char *mod_file)
+static void *modplug_play_file(const char *mod_file, Reader *r)
 {
-	int    result = 0;
-	size_t size = 0;
+	ModPlugDecoder *md;
+	ModPlugFile    *mpf = NULL;
+	char           *module = NULL;
+	size_t          size = 0;
 
-	mpf = NULL;
-	module = NULL;
+	if (!(md = calloc(1, sizeof(ModPlugDecoder)))) return NULL;
 	if (r) {
 		char *buf = reader_get_buffer(r);
 		int   offset = 0;
@@ -69,35 +71,45 @@ static int modplug_play_file(const char *mod_file)
 			wdprintf(V_DEBUG, "modplug", "Could not load %s.\n", mod_file);
 		} else {
 			ModPlug_Settings settings;
+			TrackInfo       *ti = &(md->ti);
 
-			strncpy(ti.title, ModPlug_GetName(mpf), 63);
-			strcpy(ti.artist, "Module");
-			ti.album[0] = '\0';
-			strcpy(ti.file_type, "Module");
-			ti.samplerate = 44100;
-			ti.channels   = 2;
-			ti.bitrate    = 0; /* ((size / 1000) * 8) / (ModPlug_GetLength(mpf) / 1000) * 1000; */
-			if (strlen(ti.title) == 0) strcpy(ti.title, "Unknown");
+			md->mpf = mpf;
+			md->module = module;
+			strncpy(ti->title, ModPlug_GetName(mpf), 63);
+			strcpy(ti->artist, "Module");
+			ti->album[0] = '\0';
+			strcpy(ti->file_type, "Module");
+			ti->samplerate = 44100;
+			ti->channels   = 2;
+			ti->bitrate    = 0; /* ((size / 1000) * 8) / (ModPlug_GetLength(mpf) / 1000) * 1000; */
+			if (strlen(ti->title) == 0) strcpy(ti->title, "Unknown");
 
 			ModPlug_GetSettings(&settings);
 			settings.mFlags = 0;
 			settings.mResamplingMode = MODPLUG_RESAMPLE_LINEAR;
 			settings.mChannels = 2;
 			settings.mBits = 16;
-			settings.mFrequency = ti.samplerate;
+			settings.mFrequency = ti->samplerate;
 			/* insert more setting changes here */
 			/*settings.mLoopCount = 2;*/
 			ModPlug_SetSettings(&settings);
-			result = 1;
 		}
 	}
-	return result;
+	if (!mpf) {
+		if (module) free(module);
+		free(md);
+		md = NULL;
+	}
+	return md;
 }
 
-static int close_file(void)
+static int close_file(void *ctx)
 {
-	if (module) free(module);
-	ModPlug_Unload(mpf);
+	ModPlugDecoder *md = (ModPlugDecoder *)ctx;
+
+	if (md->module) free(md->module);
+	ModPlug_Unload(md->mpf);
+	free(md);
 	return 0;
 }
 
@@ -112,7 +124,7 @@ static const char* get_file_extensions(void)
 	return ".mod;.xm;.it;.669;.s3m;.amf;.ams;.dbm;.dmf;.dsm;.far;.mdl;.med;.mtm;.okt;.ptm;.stm;.ult;.umx;.mt2;.psm;.mid;.midi";
 }
 
-static const char *get_file_type(void)
+static const char *get_file_type(void *ctx)
 {
 	return "Module";
 }
@@ -122,32 +134,27 @@ static const char *get_mime_types(void)
 	return "audio/mod;audio/xm;audio/it;audio/s3m";
 }
 
-static void set_reader_handle(Reader *reader)
-{
-	r = reader;
-}
-
-static int get_current_bitrate(void)
+static int get_current_bitrate(void *ctx)
 {
 	return 0;
 }
 
-static int get_length(void)
+static int get_length(void *ctx)
 {
-	return ModPlug_GetLength(mpf) / 1000;
+	return ModPlug_GetLength(((ModPlugDecoder *)ctx)->mpf) / 1000;
 }
 
-static int get_samplerate(void)
+static int get_samplerate(void *ctx)
 {
 	return 44100;
 }
 
-static int get_channels(void)
+static int get_channels(void *ctx)
 {
 	return 2;
 }
 
-static int get_bitrate(void)
+static int get_bitrate(void *ctx)
 {
 	return 0;
 }
@@ -162,10 +169,10 @@ static GmuCharset meta_data_get_charset(void)
 	return M_CHARSET_UTF_8;
 }
 
-static int get_meta_data_int(GmuMetaDataType gmdt, int for_current_file)
+static int get_meta_data_int(void *ctx, GmuMetaDataType gmdt)
 {
 	int        result = 0;
-	TrackInfo *t = &ti;
+	TrackInfo *t = &(((ModPlugDecoder *)ctx)->ti);
 
 	switch (gmdt) {
 		case GMU_META_IMAGE_DATA_SIZE:
@@ -180,10 +187,10 @@ static int get_meta_data_int(GmuMetaDataType gmdt, int for_current_file)
 	return result;
 }
 
-static const char *get_meta_data(GmuMetaDataType gmdt, int for_current_file)
+static const char *get_meta_data(void *ctx, GmuMetaDataType gmdt)
 {
 	char      *result = NULL;
-	TrackInfo *t = &ti;
+	TrackInfo *t = &(((ModPlugDecoder *)ctx)->ti);
 
 	switch (gmdt) {
 		case GMU_META_ARTIST:
@@ -238,7 +245,8 @@ static GmuDecoder gd = {
 	NULL,
 	meta_data_get_charset,
 	NULL,
-	set_reader_handle,
+	1,
+	NULL,
 	NULL
 };
 
@@ -26,89 +26,63 @@
 #include "../debug.h"
 #include "../charset.h"
 
-static mpg123_handle *player;
-static int            init = 0;
-static long           seek_to_sample_offset;
-static int            sample_rate, channels = 0, bitrate = 0;
-static TrackInfo      ti, ti_metaonly;
-static Reader        *r;
-static int            metaint = -1, metacount = 0;
-static int            seek_request = 0;
+typedef struct _Mpg123Decoder {
+	mpg123_handle *player;
+	long           seek_to_sample_offset;
+	int            sample_rate, channels, bitrate;
+	TrackInfo      ti;
+	Reader        *r;
+	int            seek_request;
+} Mpg123Decoder;
+
+static int init = 0;
+
+static void init_decoder(void)
+{
+	wdprintf(V_DEBUG, "mpg123", "Initializing.\n");
+	if (mpg123_init() != MPG123_OK)
+		wdprintf(V_ERROR, "mpg123", "Init failed.\n");
+	else
+		init = 1;
+}
+
+static void close_decoder(void)
+{
+	if (init) mpg123_exit();
+	init = 0;
+}
 
 static const char *get_name(void)
 {
 	return "mpg123 MPEG decoder v1.0";
 }
 
-static int decode_data(char *target, size_t max_size)
+static int decode_data(void *ctx, char *target, size_t max_size)
 {
+	Mpg123Decoder          *md = (Mpg123Decoder *)ctx;
+	Reader                 *r = md->r;
 	int                     ret = 1;
 	struct mpg123_frameinfo mi;
 	size_t                  decsize = 0;
-	int                     readsize;
 
 	if (r) {
-		if (metaint > 0 && metacount == 0) { /* Shoutcast stream meta data handling */
-			int metasize = reader_read_byte(r) * 16;
-			if (metasize > 0) {
-				char *metastr;
-				int   s;
-				
-				wdprintf(V_DEBUG, "mpg123", "metadata size = %d bytes\n", metasize);
-				reader_read_bytes(r, metasize);
-				s = reader_get_number_of_bytes_in_buffer(r);
-				wdprintf(V_DEBUG, "mpg123", "got %d bytes\n", s);
-				if (s > 0) {
-					metastr = malloc(s+1);
-					if (metastr) {
-						char *stream_title;
-
-						memcpy(metastr, reader_get_buffer(r), s);
-						metastr[s] = '\0';
-						wdprintf(V_DEBUG, "mpg123", "metadata: [%s]\n", metastr);
-						stream_title = strstr(metastr, "StreamTitle='");
-						if (stream_title && strlen(stream_title) > 13) {
-							char *tmp, stitle_utf8[256];
-							stream_title += 13;
-							tmp = strstr(stream_title, "';");
-							if (tmp) tmp[0]  = '\0';
-							if (charset_is_valid_utf8_string(stream_title))
-								strncpy(stitle_utf8, stream_title, 255);
-							else
-								charset_iso8859_1_to_utf8(stitle_utf8, stream_title, 255);
-							wdprintf(V_DEBUG, "mpg123", "stream_title=[%s]\n", stitle_utf8);
-							trackinfo_set_title(&ti, stitle_utf8);
-							trackinfo_set_updated(&ti);
-						}
-						free(metastr);
-					}
-				}
-			}
-			metacount = metaint;
-		}
-
-		if (seek_request && reader_is_seekable(r) && seek_to_sample_offset >= 0) {
+		if (md->seek_request && reader_is_seekable(r) && md->seek_to_sample_offset >= 0) {
 			off_t offset;
-			wdprintf(V_DEBUG, "mpg123", "Seeking requested to sample %d.\n", seek_to_sample_offset);
-			if (mpg123_feedseek(player, seek_to_sample_offset, SEEK_SET, &offset) >= 0) {
+			wdprintf(V_DEBUG, "mpg123", "Seeking requested to sample %d.\n", md->seek_to_sample_offset);
+			if (mpg123_feedseek(md->player, md->seek_to_sample_offset, SEEK_SET, &offset) >= 0) {
 				wdprintf(V_DEBUG, "mpg123", "Seeking stream to file offset at %d bytes.\n", offset);
 				reader_seek(r, offset);
 			} else {
 				wdprintf(V_WARNING, "mpg123", "Seek error.\n");
 			}
-			seek_to_sample_offset = 0;
-			seek_request = 0;
+			md->seek_to_sample_offset = 0;
+			md->seek_request = 0;
 		}
 
-		readsize = 4096;
-		if (metacount > 0) {
-			if (metacount < readsize) readsize = metacount;
-			metacount -= readsize;
-		}
-		if (reader_read_bytes(r, readsize)) {
+		if (reader_read_bytes(r, 4096)) {
 			int size = reader_get_number_of_bytes_in_buffer(r);
 			if (size > 0) {
-				mpg123_feed(player, (unsigned char *)reader_get_buffer(r), size);
+				mpg123_feed(md->player, (unsigned char *)reader_get_buffer(r), size);
 			}
 		} else {
 			wdprintf(V_WARNING, "mpg123", "Got no data from reader :(\n");
@@ -116,28 +90,18 @@ static int decode_data(char *target, size_t max_size)
 				ret = MPG123_DONE;
 		}
 	}
-	mpg123_info(player, &mi);
-	bitrate = 1000 * (mi.abr_rate ? mi.abr_rate : mi.bitrate);
+	mpg123_info(md->player, &mi);
+	md->bitrate = 1000 * (mi.abr_rate ? mi.abr_rate : mi.bitrate);
 	if (ret != MPG123_DONE) {
 		do {
-			ret = mpg123_read(player, (unsigned char*)target, max_size, &decsize);
+			ret = mpg123_read(md->player, (unsigned char*)target, max_size, &decsize);
 			if (ret == MPG123_NEED_MORE && decsize == 0) {
-				readsize = 4096;
-				if (metaint > 0) { /* Do this only if there is Shoutcast meta data in the stream */
-					if (metacount < readsize) readsize = metacount;
-					metacount -= readsize;
-				}
-				if (readsize > 0) {
-					if (reader_read_bytes(r, readsize)) {
-						int size = reader_get_number_of_bytes_in_buffer(r);
-						if (size > 0) {
-							mpg123_feed(player, (unsigned char *)reader_get_buffer(r), size);
-						}
-					} else { /* Must have reached EOF */
-						break;
+				if (reader_read_bytes(r, 4096)) {
+					int size = reader_get_number_of_bytes_in_buffer(r);
+					if (size > 0) {
+						mpg123_feed(md->player, (unsigned char *)reader_get_buffer(r), size);
 					}
-				} else {
-					wdprintf(V_DEBUG, "mpg123", "Need more data, but can't read. readsize = %d\n", readsize);
+				} else { /* Must have reached EOF */
 					break;
 				}
 			}
@@ -147,54 +111,42 @@ static int decode_data(char *target, size_t max_size)
 	return decsize;
 }
 
-static int mpg123_play_file(const char *mpeg_file)
+static void *mpg123_play_file(const char *mpeg_file, Reader *r)
 {
-	int                     result = 1;
+	Mpg123Decoder          *md;
 	struct mpg123_frameinfo mi;
 
-	seek_to_sample_offset = 0;
-	seek_request = 0;
+	if (!init) init_decoder();
+	if (!(md = calloc(1, sizeof(Mpg123Decoder)))) return NULL;
+	md->r = r;
 
-	if (!init) {
-		wdprintf(V_DEBUG, "mpg123", "Initializing.\n");
-		if (mpg123_init() != MPG123_OK)
-			wdprintf(V_ERROR, "mpg123", "Init failed.\n");
-		wdprintf(V_DEBUG, "mpg123", "Creating decoder.\n");	
-		player = mpg123_new(NULL, NULL);
-		init = 1;
-	}
+	wdprintf(V_DEBUG, "mpg123", "Creating decoder.\n");	
+	md->player = mpg123_new(NULL, NULL);
 
-	if (player) {
+	if (md->player) {
+		TrackInfo     *ti = &(md->ti);
 		int  encoding = 0;
 		long rate = 0;
 
 		wdprintf(V_INFO, "mpg123", "Opening %s...\n", mpeg_file);
-		trackinfo_clear(&ti);
-		id3_read_tag(mpeg_file, &ti, "MP3");
-		trackinfo_set_updated(&ti);
+		trackinfo_clear(ti);
+		id3_read_tag(mpeg_file, ti, "MP3");
+		trackinfo_set_updated(ti);
 		/*strncpy(ti->file_name, mpeg_file, SIZE_FILE_NAME-1);*/
 
 		if (r) { /* Always use stream reader */
 			wdprintf(V_INFO, "mpg123", "Opening stream...\n");
-			if (mpg123_open_feed(player) == MPG123_OK) {
+			if (mpg123_open_feed(md->player) == MPG123_OK) {
 				int   status;
 				int   size = reader_get_number_of_bytes_in_buffer(r); /* There are some bytes in the buffer already, that should be used first */
-				char *metaint_str = cfg_get_key_value(r->streaminfo, "icy-metaint");
 				long  file_size = reader_get_file_size(r);
 				int   need_more_debug = 0;
 				
-				if (file_size > 0) mpg123_set_filesize(player, file_size);
-				if (metaint_str) metaint = atoi(metaint_str); else metaint = -1;
-				if (metaint > 0) {
-					metacount = metaint - size;
-					wdprintf(V_DEBUG, "mpg123", "Metadata every %d bytes.\n", metaint);
-				} else {
-					metacount = 0;
-				}
+				if (file_size > 0) mpg123_set_filesize(md->player, file_size);
 				do {
-					mpg123_feed(player, (unsigned char *)reader_get_buffer(r), size);
+					mpg123_feed(md->player, (unsigned char *)reader_get_buffer(r), size);
 
-					status = mpg123_getformat(player, &rate, &channels, &encoding);
+					status = mpg123_getformat(md->player, &rate, &md->channels, &encoding);
 					if (status == MPG123_NEED_MORE) {
 						if (!need_more_debug) {
 							wdprintf(V_DEBUG, "mpg123", "Need more data to determine format.\n");
@@ -202,41 +154,39 @@ static int mpg123_play_file(const char *mpeg_file)
 						}
 						reader_read_bytes(r, 1024);
 						size = reader_get_number_of_bytes_in_buffer(r);
-						metacount -= size;
 					}
 				} while (status == MPG123_NEED_MORE && !reader_is_eof(r));
-				wdprintf(V_DEBUG, "mpg123", "Next metadata in %d bytes.\n", metacount);
 
 				/* Set meta data */
 				{
 					char *name = cfg_get_key_value(r->streaminfo, "icy-name");
 					/*char *description = cfg_get_key_value(r->streaminfo, "icy-description");
 					if (!description) description = "";*/
-					if (name) trackinfo_set(&ti, "", name, name, "", 0, rate, channels);
+					if (name) trackinfo_set(ti, "", name, name, "", 0, rate, md->channels);
 				}
 
 				if (status != MPG123_OK) {
 					wdprintf(V_ERROR, "mpg123", "Error opening stream.\n");
-					channels = 0;
+					md->channels = 0;
 				}
 			} else {
 				wdprintf(V_ERROR, "mpg123", "Failed opening feed.\n");
-				channels = 0;
+				md->channels = 0;
 			}
 		} else {
 			wdprintf(V_ERROR, "mpg123", "ERROR: Could not open stream/file.\n");
-			channels = 0;
+			md->channels = 0;
 		}
-		if (channels > 0) {
+		if (md->channels > 0) {
 			size_t        dummy;
 			unsigned char dumbuf[1024];
 
-			wdprintf(V_INFO, "mpg123", "Found stream with %d channels and %ld Hz.\n", channels, rate);
-			mpg123_format_none(player);
-			mpg123_format(player, rate, channels, encoding);
-			mpg123_info(player, &mi);
-			sample_rate = mi.rate;
-			bitrate = 1000 * (mi.abr_rate ? mi.abr_rate : mi.bitrate);
+			wdprintf(V_INFO, "mpg123", "Found stream with %d channels and %ld Hz.\n", md->channels, rate);
+			mpg123_format_none(md->player);
+			mpg123_format(md->player, rate, md->channels, encoding);
+			mpg123_info(md->player, &mi);
+			md->sample_rate = mi.rate;
+			md->bitrate = 1000 * (mi.abr_rate ? mi.abr_rate : mi.bitrate);
 			/*ti->samplerate = mi.rate;
 			ti->channels   = mi.mode == MPG123_M_MONO ? 1 : 2;
 			ti->bitrate    = 1000 * (mi.abr_rate ? mi.abr_rate : mi.bitrate);
@@ -245,39 +195,45 @@ static int mpg123_play_file(const char *mpeg_file)
 			wdprintf(V_DEBUG, "mpg123", "Bitstream is %ld kbps, %d channel(s), %d Hz\n", 
 			       ti->bitrate / 1000, ti->channels, ti->samplerate);*/
 
-			if (mpg123_read(player, dumbuf, 1024, &dummy) != MPG123_NEW_FORMAT) {
+			if (mpg123_read(md->player, dumbuf, 1024, &dummy) != MPG123_NEW_FORMAT) {
 				wdprintf(V_DEBUG, "mpg123", "No new format.\n");
 			}
 		} else {
 			wdprintf(V_ERROR, "mpg123", "Problem with stream.\n");
-			mpg123_delete(player);
-			mpg123_exit();
-			player = NULL;
-			init = 0;
-			result = 0;
+			mpg123_delete(md->player);
+			md->player = NULL;
 		}
 	}
-	return result;
+	if (!md->player) {
+		trackinfo_clear(&(md->ti));
+		free(md);
+		md = NULL;
+	}
+	return md;
 }
 
-static int mpg123_seek_to(int offset_seconds)
+static int mpg123_seek_to(void *ctx, int offset_seconds)
 {
-	int res = 0;
+	Mpg123Decoder *md = (Mpg123Decoder *)ctx;
+	int            res = 0;
+
 	if (offset_seconds >= 0) {
-		seek_to_sample_offset = offset_seconds * sample_rate;
-		seek_request = 1;
+		md->seek_to_sample_offset = offset_seconds * md->sample_rate;
+		md->seek_request = 1;
 		res = 1;
 	}
 	return res;
 }
 
-static int close_file(void)
+static int close_file(void *ctx)
 {
+	Mpg123Decoder *md = (Mpg123Decoder *)ctx;
+
 	wdprintf(V_DEBUG, "mpg123", "Closing file.\n");
-	mpg123_close(player);
-	mpg123_delete(player);
-	mpg123_exit();
-	init = 0;
+	mpg123_close(md->player);
+	mpg123_delete(md->player);
+	trackinfo_clear(&(md->ti));
+	free(md);
 	return 0;
 }
 
@@ -291,37 +247,37 @@ static const char* get_file_extensions(void)
 	return ".mp3;.mp2;.mp1";
 }
 
-static int get_current_bitrate(void)
+static int get_current_bitrate(void *ctx)
 {
-	return bitrate;
+	return ((Mpg123Decoder *)ctx)->bitrate;
 }
 
-static int get_length(void)
+static int get_length(void *ctx)
 {
-	return mpg123_length(player) / sample_rate;
+	Mpg123Decoder *md = (Mpg123Decoder *)ctx;
+	return mpg123_length(md->player) / md->sample_rate;
 }
 
-static int get_samplerate(void)
+static int get_samplerate(void *ctx)
 {
-	return sample_rate;
+	return ((Mpg123Decoder *)ctx)->sample_rate;
 }
 
-static int get_channels(void)
+static int get_channels(void *ctx)
 {
-	return channels;
+	return ((Mpg123Decoder *)ctx)->channels;
 }
 
-static int get_bitrate(void)
+static int get_bitrate(void *ctx)
 {
-	return bitrate;
+	return ((Mpg123Decoder *)ctx)->bitrate;
 }
 
-static int get_meta_data_int(GmuMetaDataType gmdt, int for_current_file)
+static int get_meta_data_int(void *ctx, GmuMetaDataType gmdt)
 {
 	int        result = 0;
-	TrackInfo *t = &ti_metaonly;
+	TrackInfo *t = &(((Mpg123Decoder *)ctx)->ti);
 
-	if (for_current_file) t = &ti;
 	switch (gmdt) {
 		case GMU_META_IMAGE_DATA_SIZE:
 			result = trackinfo_get_image_data_size(t);
@@ -335,12 +291,11 @@ static int get_meta_data_int(GmuMetaDataType gmdt, int for_current_file)
 	return result;
 }
 
-static const char *get_meta_data(GmuMetaDataType gmdt, int for_current_file)
+static const char *get_meta_data(void *ctx, GmuMetaDataType gmdt)
 {
 	char      *result = NULL;
-	TrackInfo *t = &ti_metaonly;
+	TrackInfo *t = &(((Mpg123Decoder *)ctx)->ti);
 
-	if (for_current_file) t = &ti;
 	switch (gmdt) {
 		case GMU_META_ARTIST:
 			result = trackinfo_get_artist(t);
@@ -369,7 +324,7 @@ static const char *get_meta_data(GmuMetaDataType gmdt, int for_current_file)
 	return result;
 }
 
-static const char *get_file_type(void)
+static const char *get_file_type(void *ctx)
 {
 	return "MPEG Audio";
 }
@@ -379,14 +334,24 @@ static const char *get_mime_types(void)
 	return "audio/mpeg";
 }
 
-static int meta_data_load(const char *filename)
+static void *meta_data_load(const char *filename)
 {
-	return id3_read_tag(filename, &ti_metaonly, "MP3");
+	Mpg123Decoder *md = calloc(1, sizeof(Mpg123Decoder));
+
+	if (md && !id3_read_tag(filename, &(md->ti), "MP3")) {
+		trackinfo_clear(&(md->ti));
+		free(md);
+		md = NULL;
+	}
+	return md;
 }
 
-static int meta_data_close(void)
+static int meta_data_close(void *ctx)
 {
-	trackinfo_clear(&ti_metaonly);
+	Mpg123Decoder *md = (Mpg123Decoder *)ctx;
+
+	trackinfo_clear(&(md->ti));
+	free(md);
 	return 1;
 }
 
@@ -412,15 +377,10 @@ static int data_check_magic_bytes(const char *data, size_t size)
 	return id3 || sync;
 }
 
-static void set_reader_handle(Reader *reader)
-{
-	r = reader;
-}
-
 static GmuDecoder gd = {
 	"mpg123_decoder",
-	NULL,
-	NULL,
+	init_decoder,
+	close_decoder,
 	get_name,
 	NULL,
 	get_file_extensions,
@@ -442,7 +402,8 @@ static GmuDecoder gd = {
 	meta_data_close,
 	meta_data_get_charset,
 	data_check_magic_bytes,
-	set_reader_handle,
+	1,
+	NULL,
 	NULL
 };
 
@@ -29,14 +29,14 @@ typedef struct reader_data_t {
     mpc_bool_t seekable;
 } reader_data;
 
-static mpc_decoder  decoder;
-static mpc_reader   reader;
-static reader_data  data;
-
-static long         seek_to_sample_offset;
-static int          sample_rate, channels, length, bitrate;
-static FILE        *file;
-static TrackInfo    ti, ti_metaonly;
+typedef struct _MusepackDecoder {
+	mpc_decoder  decoder;
+	mpc_reader   reader;
+	reader_data  data;
+	int          sample_rate, channels, length, bitrate;
+	FILE        *file;
+	TrackInfo    ti;
+} MusepackDecoder;
 
 /*
   Our implementations of the mpc_reader callback functions.
@@ -89,20 +89,25 @@ static const char *get_name(void)
 	return "Musepack decoder v0.9";
 }
 
-static int open_file(const char *filename)
+static void *open_file(const char *filename, Reader *r)
 {
-	int   result = 1;
+	int              result = 1;
+	MusepackDecoder *md;
+	FILE            *file;
 	/*char *filename_without_path;*/
 
-	seek_to_sample_offset = 0;
-
+	if (!(md = calloc(1, sizeof(MusepackDecoder)))) return NULL;
 	wdprintf(V_INFO, "musepack", "Opening %s...\n", filename);
 	if (!(file = fopen(filename, "r"))) {
 		wdprintf(V_WARNING, "musepack", "Could not open file.\n");
 		result = 0;
 	} else {
 		mpc_streaminfo info;
-		trackinfo_clear(&ti);
+		mpc_reader    *reader = &(md->reader);
+		reader_data   *data = &(md->data);
+
+		md->file = file;
+		trackinfo_clear(&(md->ti));
 		/*strncpy(ti->file_name, mpc_file, SIZE_FILE_NAME-1);
 		filename_without_path = strrchr(mpc_file, '/');
 		if (filename_without_path != NULL)
@@ -115,55 +120,65 @@ static int open_file(const char *filename)
 		free(filename_without_path);
 
 		strncpy(ti->file_type, "Musepack", SIZE_FILE_TYPE-1);*/
-		id3_read_id3v1(file, &ti, "Musepack");
+		id3_read_id3v1(file, &(md->ti), "Musepack");
 		fseek(file, 0, SEEK_SET);
 
 		/* initialize our reader_data tag the reader will carry around with it */
-		data.file = file;
-		data.seekable = TRUE;
-		fseek(data.file, 0, SEEK_END);
-		data.size = ftell(data.file);
-		fseek(data.file, 0, SEEK_SET);
+		data->file = file;
+		data->seekable = TRUE;
+		fseek(data->file, 0, SEEK_END);
+		data->size = ftell(data->file);
+		fseek(data->file, 0, SEEK_SET);
 
 		/* set up an mpc_reader linked to our function implementations */
-		reader.read = read_impl;
-		reader.seek = seek_impl;
-		reader.tell = tell_impl;
-		reader.get_size = get_size_impl;
-		reader.canseek = canseek_impl;
-		reader.data = &data;
+		reader->read = read_impl;
+		reader->seek = seek_impl;
+		reader->tell = tell_impl;
+		reader->get_size = get_size_impl;
+		reader->canseek = canseek_impl;
+		reader->data = data;
 
 		/* read file's streaminfo data */
 		mpc_streaminfo_init(&info);
-    	if (mpc_streaminfo_read(&info, &reader) != ERROR_CODE_OK) {
+    	if (mpc_streaminfo_read(&info, reader) != ERROR_CODE_OK) {
 			wdprintf(V_WARNING, "musepack", "Not a valid musepack file: \"%s\"\n", filename);
 			result = 0;
 		} else {
-			sample_rate = info.sample_freq;
-			channels    = info.channels;
-			bitrate     = info.average_bitrate;
-			length      = info.total_file_length / (int)(info.average_bitrate / 8);
+			md->sample_rate = info.sample_freq;
+			md->channels    = info.channels;
+			md->bitrate     = info.average_bitrate;
+			md->length      = info.total_file_length / (int)(info.average_bitrate / 8);
 
 			/* instantiate a decoder with our file reader */
-			mpc_decoder_setup(&decoder, &reader);
-			if (!mpc_decoder_initialize(&decoder, &info)) {
+			mpc_decoder_setup(&(md->decoder), reader);
+			if (!mpc_decoder_initialize(&(md->decoder), &info)) {
 				wdprintf(V_ERROR, "musepack", "Error initializing decoder.\n");
 				result = 0;
 			}
 		}
+		if (!result) fclose(file);
 	}
-	return result;
+	if (!result) {
+		trackinfo_clear(&(md->ti));
+		free(md);
+		md = NULL;
+	}
+	return md;
 }
 
-static int close_file(void)
+static int close_file(void *ctx)
 {
-	fclose(file);
-	trackinfo_clear(&ti);
+	MusepackDecoder *md = (MusepackDecoder *)ctx;
+
+	fclose(md->file);
+	trackinfo_clear(&(md->ti));
+	free(md);
 	return 0;
 }
 
-static int decode_data(char *target, size_t max_size)
+static int decode_data(void *ctx, char *target, size_t max_size)
 {
+	MusepackDecoder  *md = (MusepackDecoder *)ctx;
 	int               size = MPC_DECODER_BUFFER_LENGTH;
 	unsigned          total_samples = 0;
 	mpc_bool_t        successful = FALSE;
@@ -173,7 +188,7 @@ static int decode_data(char *target, size_t max_size)
 
 	memset(sample_buffer, 0, sizeof(MPC_SAMPLE_FORMAT) * MPC_DECODER_BUFFER_LENGTH);
 
-	status = mpc_decoder_decode(&decoder, sample_buffer, 0, 0);
+	status = mpc_decoder_decode(&(md->decoder), sample_buffer, 0, 0);
 	if (status == (unsigned)(-1)) {
 		size = 0;
 		wdprintf(V_ERROR, "musepack", "Error decoding file.\n");
@@ -223,10 +238,11 @@ static int decode_data(char *target, size_t max_size)
 	return size;
 }
 
-static int seek(int second)
+static int seek(void *ctx, int second)
 {
-	int seek_to_sample = (second > 0 ? second * sample_rate : 0);
-	mpc_decoder_seek_sample(&decoder, seek_to_sample);
+	MusepackDecoder *md = (MusepackDecoder *)ctx;
+	int              seek_to_sample = (second > 0 ? second * md->sample_rate : 0);
+	mpc_decoder_seek_sample(&(md->decoder), seek_to_sample);
 	return 1;
 }
 
@@ -240,99 +256,86 @@ static const char* get_file_extensions(void)
 	return ".mpc;.mp+";
 }
 
-static int get_current_bitrate(void)
+static int get_current_bitrate(void *ctx)
 {
 	return 0;
 }
 
-static int get_length(void)
+static int get_length(void *ctx)
 {
-	return length;
+	return ((MusepackDecoder *)ctx)->length;
 }
 
-static int get_samplerate(void)
+static int get_samplerate(void *ctx)
 {
-	return sample_rate;
+	return ((MusepackDecoder *)ctx)->sample_rate;
 }
 
-static int get_channels(void)
+static int get_channels(void *ctx)
 {
-	return channels;
+	return ((MusepackDecoder *)ctx)->channels;
 }
 
-static int get_bitrate(void)
+static int get_bitrate(void *ctx)
 {
-	return bitrate;
+	return ((MusepackDecoder *)ctx)->bitrate;
 }
 
-static const char *get_meta_data(GmuMetaDataType gmdt, int for_current_file)
+static const char *get_meta_data(void *ctx, GmuMetaDataType gmdt)
 {
-	char *result = NULL;
-
-	if (for_current_file) {
-		switch (gmdt) {
-			case GMU_META_ARTIST:
-				result = trackinfo_get_artist(&ti);
-				break;
-			case GMU_META_TITLE:
-				result = trackinfo_get_title(&ti);
-				break;
-			case GMU_META_ALBUM:
-				result = trackinfo_get_album(&ti);
-				break;
-			case GMU_META_TRACKNR:
-				result = trackinfo_get_tracknr(&ti);
-				break;
-			case GMU_META_DATE:
-				result = trackinfo_get_date(&ti);
-				break;
-			default:
-				break;
-		}
-	} else {
-		switch (gmdt) {
-			case GMU_META_ARTIST:
-				result = trackinfo_get_artist(&ti_metaonly);
-				break;
-			case GMU_META_TITLE:
-				result = trackinfo_get_title(&ti_metaonly);
-				break;
-			case GMU_META_ALBUM:
-				result = trackinfo_get_album(&ti_metaonly);
-				break;
-			case GMU_META_TRACKNR:
-				result = trackinfo_get_tracknr(&ti_metaonly);
-				break;
-			case GMU_META_DATE:
-				result = trackinfo_get_date(&ti_metaonly);
-				break;
-			default:
-				break;
-		}
+	char      *result = NULL;
+	TrackInfo *ti = &(((MusepackDecoder *)ctx)->ti);
+
+	switch (gmdt) {
+		case GMU_META_ARTIST:
+			result = trackinfo_get_artist(ti);
+			break;
+		case GMU_META_TITLE:
+			result = trackinfo_get_title(ti);
+			break;
+		case GMU_META_ALBUM:
+			result = trackinfo_get_album(ti);
+			break;
+		case GMU_META_TRACKNR:
+			result = trackinfo_get_tracknr(ti);
+			break;
+		case GMU_META_DATE:
+			result = trackinfo_get_date(ti);
+			break;
+		default:
+			break;
 	}
 	return result;
 }
 
-static int meta_data_close(void)
+static int meta_data_close(void *ctx)
 {
-	trackinfo_clear(&ti_metaonly);
+	MusepackDecoder *md = (MusepackDecoder *)ctx;
+
+	trackinfo_clear(&(md->ti));
+	free(md);
 	return 1;
 }
 
-static const char *get_file_type(void)
+static const char *get_file_type(void *ctx)
 {
 	return "Musepack";
 }
 
-static int meta_data_load(const char *filename)
+static void *meta_data_load(const char *filename)
 {
-	FILE *file = fopen(filename, "r");
-	int   result = 0;
+	FILE            *file = fopen(filename, "r");
+	MusepackDecoder *md = NULL;
+
 	if (file) {
-		result = id3_read_id3v1(file, &ti_metaonly, "Musepack");
+		md = calloc(1, sizeof(MusepackDecoder));
+		if (md && !id3_read_id3v1(file, &(md->ti), "Musepack")) {
+			free(md);
+			md = NULL;
+		}
 		fclose(file);
 	}
-	return result;
+	return md;
 }
 
 static GmuCharset meta_data_get_charset(void)
@@ -365,6 +368,7 @@ static GmuDecoder gd = {
 	meta_data_close,
 	meta_data_get_charset,
 	NULL,
+	0,
 	NULL,
 	NULL
 };
@@ -23,19 +23,20 @@
 #include "../gmudecoder.h"
 #include "../debug.h"
 
-static Reader         *r;
-static openmpt_module *mod = 0;
-static TrackInfo       ti;
+typedef struct _OpenMPTDecoder {
+	openmpt_module *mod;
+	TrackInfo       ti;
+} OpenMPTDecoder;
 
 static const char *get_name(void)
 {
 	return "OpenMPT module decoder v0.1";
 }
 
-static int decode_data(char *stream, size_t len)
+static int decode_data(void *ctx, char *stream, size_t len)
 {
 	size_t count = openmpt_module_read_interleaved_stereo(
-		mod,
+		((OpenMPTDecoder *)ctx)->mod,
 		44100,
 		len / 4,
 		(int16_t *)stream
@@ -43,13 +44,14 @@ static int decode_data(char *stream, size_t len)
 	return count * 4;
 }
 
-static int openmpt_play_file(const char *mod_file)
+static void *openmpt_play_file(const char *mod_file, Reader *r)
 {
-	int    result = 0;
-	size_t size = 0;
-	char  *module = NULL;
+	OpenMPTDecoder *od;
+	openmpt_module *mod = NULL;
+	size_t          size = 0;
+	char           *module = NULL;
 
-	mod = NULL;
+	if (!(od = calloc(1, sizeof(OpenMPTDecoder)))) return NULL;
 	if (r) {
 		char *buf = reader_get_buffer(r);
 		int   offset = 0;
@@ -79,26 +81,35 @@ static int openmpt_play_file(const char *mod_file)
 		if (!mod) {
 			wdprintf(V_WARNING, "openmpt", "Could not load %s.\n", mod_file);
 		} else {
+			TrackInfo  *ti = &(od->ti);
 			const char *meta = openmpt_module_get_metadata(mod, "title");
+
+			od->mod = mod;
 			if (strlen(meta) == 0) meta = "Unknown";
-			trackinfo_set_title(&ti, meta);
+			trackinfo_set_title(ti, meta);
 			meta = openmpt_module_get_metadata(mod, "artist");
 			if (strlen(meta) == 0) meta = "Module";
-			trackinfo_set_artist(&ti, meta);
-			ti.album[0] = '\0';
-			trackinfo_set_file_type(&ti, openmpt_module_get_metadata(mod, "type_long"));
-			ti.samplerate = 44100;
-			ti.channels   = 2;
-			ti.bitrate    = 0;
-			result = 1;
+			trackinfo_set_artist(ti, meta);
+			ti->album[0] = '\0';
+			trackinfo_set_file_type(ti, openmpt_module_get_metadata(mod, "type_long"));
+			ti->samplerate = 44100;
+			ti->channels   = 2;
+			ti->bitrate    = 0;
 		}
 	}
-	return result;
+	if (!mod) {
+		free(od);
+		od = NULL;
+	}
+	return od;
 }
 
-static int close_file(void)
+static int close_file(void *ctx)
 {
-	openmpt_module_destroy(mod);
+	OpenMPTDecoder *od = (OpenMPTDecoder *)ctx;
+
+	openmpt_module_destroy(od->mod);
+	free(od);
 	return 0;
 }
 
@@ -113,9 +124,9 @@ static const char* get_file_extensions(void)
 	return ".mod;.s3m;.xm;.it;.mptm;.stm;.nst;.m15;.stk;.wow;.ult;.669;.mtm;.med;.far;.mdl;.ams;.dsm;.amf;.okt;.dmf;.ptm;.psm;.mt2;.dbm;.digi;.imf;.j2b;.gdm;.umx;.plm;.mo3;.xpk;.ppm;.mmcmp";
 }
 
-static const char *get_file_type(void)
+static const char *get_file_type(void *ctx)
 {
-	return ti.file_type;
+	return ((OpenMPTDecoder *)ctx)->ti.file_type;
 }
 
 static const char *get_mime_types(void)
@@ -123,32 +134,27 @@ static const char *get_mime_types(void)
 	return "audio/mod;audio/xm;audio/it;audio/s3m";
 }
 
-static void set_reader_handle(Reader *reader)
-{
-	r = reader;
-}
-
-static int get_current_bitrate(void)
+static int get_current_bitrate(void *ctx)
 {
 	return 0;
 }
 
-static int get_length(void)
+static int get_length(void *ctx)
 {
-	return openmpt_module_get_duration_seconds(mod);
+	return openmpt_module_get_duration_seconds(((OpenMPTDecoder *)ctx)->mod);
 }
 
-static int get_samplerate(void)
+static int get_samplerate(void *ctx)
 {
 	return 44100;
 }
 
-static int get_channels(void)
+static int get_channels(void *ctx)
 {
 	return 2;
 }
 
-static int get_bitrate(void)
+static int get_bitrate(void *ctx)
 {
 	return 0;
 }
@@ -163,10 +169,10 @@ static GmuCharset meta_data_get_charset(void)
 	return M_CHARSET_UTF_8;
 }
 
-static int get_meta_data_int(GmuMetaDataType gmdt, int for_current_file)
+static int get_meta_data_int(void *ctx, GmuMetaDataType gmdt)
 {
 	int        result = 0;
-	TrackInfo *t = &ti;
+	TrackInfo *t = &(((OpenMPTDecoder *)ctx)->ti);
 
 	switch (gmdt) {
 		case GMU_META_IMAGE_DATA_SIZE:
@@ -181,10 +187,10 @@ static int get_meta_data_int(GmuMetaDataType gmdt, int for_current_file)
 	return result;
 }
 
-static const char *get_meta_data(GmuMetaDataType gmdt, int for_current_file)
+static const char *get_meta_data(void *ctx, GmuMetaDataType gmdt)
 {
 	char      *result = NULL;
-	TrackInfo *t = &ti;
+	TrackInfo *t = &(((OpenMPTDecoder *)ctx)->ti);
 
 	switch (gmdt) {
 		case GMU_META_ARTIST:
@@ -239,7 +245,8 @@ static GmuDecoder gd = {
 	NULL,
 	meta_data_get_charset,
 	NULL,
-	set_reader_handle,
+	1,
+	NULL,
 	NULL
 };
 
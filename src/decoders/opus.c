@@ -16,6 +16,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <opusfile.h>
 #include "../gmudecoder.h"
 #include "../trackinfo.h"
@@ -23,13 +24,15 @@
 #include "../reader.h"
 #include "../debug.h"
 
-static int          init = 0;
-static long         seek_to_sample_offset;
-static int          sample_rate, channels = 0, bitrate = 0;
-static TrackInfo    ti, ti_metaonly;
-static Reader      *r;
-static OggOpusFile *oof;
-static int          seek_request = 0;
+typedef struct _OpusFileDecoder {
+	long         seek_to_sample_offset;
+	int          sample_rate, channels, bitrate;
+	TrackInfo    ti;
+	Reader      *r;
+	OggOpusFile *oof;
+	int          seek_request;
+	int          prev_li;
+} OpusFileDecoder;
 
 static const char *get_name(void)
 {
@@ -88,32 +91,22 @@ static int close_func(void *_stream)
 }
 
 struct _trackinfo_mapping {
-	char *key;
-	char *target;
-	int   maxlen;
+	char   *key;
+	size_t  offset; /* offset of the target field in TrackInfo */
+	int     maxlen;
 };
 
-static struct _trackinfo_mapping tim[] = {
-	{ "artist=",      ti.artist,  SIZE_ARTIST },
-	{ "title=",       ti.title,   SIZE_TITLE },
-	{ "album=",       ti.album,   SIZE_ALBUM },
-	{ "tracknumber=", ti.tracknr, SIZE_TRACKNR },
-	{ "date=",        ti.date,    SIZE_DATE },
-	{ "comment=",     ti.comment, SIZE_COMMENT },
-	{ NULL,           NULL,       0 }
+static const struct _trackinfo_mapping tim[] = {
+	{ "artist=",      offsetof(TrackInfo, artist),  SIZE_ARTIST },
+	{ "title=",       offsetof(TrackInfo, title),   SIZE_TITLE },
+	{ "album=",       offsetof(TrackInfo, album),   SIZE_ALBUM },
+	{ "tracknumber=", offsetof(TrackInfo, tracknr), SIZE_TRACKNR },
+	{ "date=",        offsetof(TrackInfo, date),    SIZE_DATE },
+	{ "comment=",     offsetof(TrackInfo, comment), SIZE_COMMENT },
+	{ NULL,           0,                            0 }
 };
 
-static struct _trackinfo_mapping tim_metaonly[] = {
-	{ "artist=",      ti_metaonly.artist,  SIZE_ARTIST },
-	{ "title=",       ti_metaonly.title,   SIZE_TITLE },
-	{ "album=",       ti_metaonly.album,   SIZE_ALBUM },
-	{ "tracknumber=", ti_metaonly.tracknr, SIZE_TRACKNR },
-	{ "date=",        ti_metaonly.date,    SIZE_DATE },
-	{ "comment=",     ti_metaonly.comment, SIZE_COMMENT },
-	{ NULL,           NULL,       0 }
-};
-
-static int read_tags(OggOpusFile *oof, int li, struct _trackinfo_mapping *tim)
+static int read_tags(OggOpusFile *oof, int li, TrackInfo *ti)
 {
 	const OpusTags *tags = op_tags(oof, li);
 	int             ci, i;
@@ -125,8 +118,9 @@ static int read_tags(OggOpusFile *oof, int li, struct _trackinfo_mapping *tim)
 				int len = strlen(tim[i].key);
 				if (strncasecmp(tags->user_comments[ci], tim[i].key, len) == 0) {
 					wdprintf(V_INFO, "opus", "%s> %s\n", tim[i].key, tags->user_comments[ci]+len);
-					strncpy(tim[i].target, tags->user_comments[ci]+len, tim[i].maxlen);
-					tim[i].target[tim[i].maxlen-1] = '\0';
+					char *target = (char *)ti + tim[i].offset;
+					strncpy(target, tags->user_comments[ci]+len, tim[i].maxlen);
+					target[tim[i].maxlen-1] = '\0';
 					res = 1;
 				}
 			}
@@ -135,43 +129,47 @@ static int read_tags(OggOpusFile *oof, int li, struct _trackinfo_mapping *tim)
 	return res;
 }
 
-static int decode_data(char *target, size_t max_size)
+static int decode_data(void *ctx, char *target, size_t max_size)
 {
-	int        res = 0;
-	static int prev_li = -1;
-	int        samples = 0;
-	int        li = op_current_link(oof);
-
-	if (li != prev_li) {
-		prev_li = li;
-		if (read_tags(oof, li, tim)) trackinfo_set_updated(&ti);
+	OpusFileDecoder *od = (OpusFileDecoder *)ctx;
+	int              res = 0;
+	int              samples = 0;
+	int              li = op_current_link(od->oof);
+
+	if (li != od->prev_li) {
+		od->prev_li = li;
+		if (read_tags(od->oof, li, &(od->ti))) trackinfo_set_updated(&(od->ti));
 	}
 
-	if (seek_request && reader_is_seekable(r) && seek_to_sample_offset >= 0) {
-		wdprintf(V_DEBUG, "opus", "Seeking requested to sample %d.\n", seek_to_sample_offset);
-		if (op_pcm_seek(oof, seek_to_sample_offset) != 0)
+	if (od->seek_request && reader_is_seekable(od->r) && od->seek_to_sample_offset >= 0) {
+		wdprintf(V_DEBUG, "opus", "Seeking requested to sample %d.\n", od->seek_to_sample_offset);
+		if (op_pcm_seek(od->oof, od->seek_to_sample_offset) != 0)
 			wdprintf(V_WARNING, "opus", "Seeking failed.\n");
-		seek_to_sample_offset = 0;
-		seek_request = 0;
+		od->seek_to_sample_offset = 0;
+		od->seek_request = 0;
 	}
 
-	if (channels > 1)
-		samples = op_read_stereo(oof, (opus_int16 *)target, max_size / 2);
-	else if (channels == 1)
-		samples = op_read(oof, (opus_int16 *)target, max_size / 2, NULL);
+	if (od->channels > 1)
+		samples = op_read_stereo(od->oof, (opus_int16 *)target, max_size / 2);
+	else if (od->channels == 1)
+		samples = op_read(od->oof, (opus_int16 *)target, max_size / 2, NULL);
 	if (samples > 0)
-		res = samples * 2 * channels;
+		res = samples * 2 * od->channels;
 	return res;
 }
 
-static int opus_play_file(const char *opus_file)
+static void *opus_play_file(const char *opus_file, Reader *r)
 {
-	int result = 1, error;
+	int               result = 1, error;
 	OpusFileCallbacks ofc;
-	int available_bytes;
+	int               available_bytes;
+	OpusFileDecoder  *od;
 
 	wdprintf(V_DEBUG, "opus", "Initializing.\n");
-	trackinfo_init(&ti, 0);
+	if (!(od = calloc(1, sizeof(OpusFileDecoder)))) return NULL;
+	trackinfo_init(&(od->ti), 0);
+	od->r = r;
+	od->prev_li = -1;
 
 	ofc.read  = read_func;
 	ofc.seek  = seek_func;
@@ -182,42 +180,52 @@ static int opus_play_file(const char *opus_file)
 		available_bytes = reader_get_number_of_bytes_in_buffer(r);
 
 		wdprintf(V_DEBUG, "opus", "Available bytes in buffer: %d\n", available_bytes);
-		oof = op_open_callbacks(r, &ofc, (unsigned char *)reader_get_buffer(r),
-								available_bytes, &error);
+		od->oof = op_open_callbacks(r, &ofc, (unsigned char *)reader_get_buffer(r),
+		                            available_bytes, &error);
 
 		wdprintf(V_INFO, "opus", "Stream open result: %d\n", error);
 		if (error) {
 			result = 0;
 		} else {
-			int li = op_current_link(oof);
-			read_tags(oof, li, tim);
-			channels = op_channel_count(oof, -1);
-			bitrate  = op_bitrate(oof, -1);
-			sample_rate = 48000;
+			int li = op_current_link(od->oof);
+			read_tags(od->oof, li, &(od->ti));
+			od->channels = op_channel_count(od->oof, -1);
+			od->bitrate  = op_bitrate(od->oof, -1);
+			od->sample_rate = 48000;
 		}
 	} else {
 		wdprintf(V_WARNING, "opus", "Reader was unable to open stream/file.\n");
 		result = 0;
 	}
-	return result;
+	if (!result) {
+		trackinfo_clear(&(od->ti));
+		free(od);
+		od = NULL;
+	}
+	return od;
 }
 
-static int opus_seek_to(int offset_seconds)
+static int opus_seek_to(void *ctx, int offset_seconds)
 {
-	int res = 0;
+	OpusFileDecoder *od = (OpusFileDecoder *)ctx;
+	int              res = 0;
+
 	if (offset_seconds >= 0) {
-		seek_to_sample_offset = offset_seconds * sample_rate;
-		seek_request = 1;
+		od->seek_to_sample_offset = offset_seconds * od->sample_rate;
+		od->seek_request = 1;
 		res = 1;
 	}
 	return res;
 }
 
-static int close_file(void)
+static int close_file(void *ctx)
 {
+	OpusFileDecoder *od = (OpusFileDecoder *)ctx;
+
 	wdprintf(V_DEBUG, "opus", "Closing file.\n");
-	op_free(oof);
-	init = 0;
+	op_free(od->oof);
+	trackinfo_clear(&(od->ti));
+	free(od);
 	return 0;
 }
 
@@ -231,37 +239,36 @@ static const char* get_file_extensions(void)
 	return ".opus";
 }
 
-static int get_current_bitrate(void)
+static int get_current_bitrate(void *ctx)
 {
-	return op_bitrate_instant(oof);
+	return op_bitrate_instant(((OpusFileDecoder *)ctx)->oof);
 }
 
-static int get_length(void)
+static int get_length(void *ctx)
 {
-	ogg_int64_t samples = op_pcm_total(oof, -1);
+	ogg_int64_t samples = op_pcm_total(((OpusFileDecoder *)ctx)->oof, -1);
 	return samples == OP_EINVAL ? 0 : samples / 48000;
 }
 
-static int get_samplerate(void)
+static int get_samplerate(void *ctx)
 {
-	return sample_rate;
+	return ((OpusFileDecoder *)ctx)->sample_rate;
 }
 
-static int get_channels(void)
+static int get_channels(void *ctx)
 {
-	return channels;
+	return ((OpusFileDecoder *)ctx)->channels;
 }
 
-static int get_bitrate(void)
+static int get_bitrate(void *ctx)
 {
-	return bitrate;
+	return ((OpusFileDecoder *)ctx)->bitrate;
 }
 
-static int get_meta_data_int(GmuMetaDataType gmdt, int for_current_file)
+static int get_meta_data_int(void *ctx, GmuMetaDataType gmdt)
 {
 	int result = 0;
-	TrackInfo *t = &ti_metaonly;;
-	if (for_current_file) t = &ti;
+	TrackInfo *t = &(((OpusFileDecoder *)ctx)->ti);
 
 	switch (gmdt) {
 		case GMU_META_IMAGE_DATA_SIZE:
@@ -276,11 +283,10 @@ static int get_meta_data_int(GmuMetaDataType gmdt, int for_current_file)
 	return result;
 }
 
-static const char *get_meta_data(GmuMetaDataType gmdt, int for_current_file)
+static const char *get_meta_data(void *ctx, GmuMetaDataType gmdt)
 {
 	char *result = NULL;
-	TrackInfo *t = &ti_metaonly;;
-	if (for_current_file) t = &ti;
+	TrackInfo *t = &(((OpusFileDecoder *)ctx)->ti);
 
 	switch (gmdt) {
 		case GMU_META_ARTIST:
@@ -310,7 +316,7 @@ static const char *get_meta_data(GmuMetaDataType gmdt, int for_current_file)
 	return result;
 }
 
-static const char *get_file_type(void)
+static const char *get_file_type(void *ctx)
 {
 	return "Ogg Opus Audio";
 }
@@ -320,15 +326,17 @@ static const char *get_mime_types(void)
 	return "audio/ogg";
 }
 
-static int meta_data_load(const char *filename)
+static void *meta_data_load(const char *filename)
 {
 	int result = 0, error;
 	OpusFileCallbacks ofc;
 	Reader *re;
 	OggOpusFile *oof_tmp;
+	OpusFileDecoder *od;
 
 	wdprintf(V_DEBUG, "opus", "Initializing.\n");
-	trackinfo_init(&ti, 0);
+	if (!(od = calloc(1, sizeof(OpusFileDecoder)))) return NULL;
+	trackinfo_init(&(od->ti), 0);
 
 	ofc.read  = read_func;
 	ofc.seek  = seek_func;
@@ -344,18 +352,25 @@ static int meta_data_load(const char *filename)
 			result = 0;
 		} else {
 			int li = op_current_link(oof_tmp);
-			read_tags(oof_tmp, li, tim_metaonly);
+			read_tags(oof_tmp, li, &(od->ti));
 			result = 1;
 		}
 		op_free(oof_tmp);
 		reader_close(re);
 	}
-	return result;
+	if (!result) {
+		free(od);
+		od = NULL;
+	}
+	return od;
 }
 
-static int meta_data_close(void)
+static int meta_data_close(void *ctx)
 {
-	trackinfo_clear(&ti_metaonly);
+	OpusFileDecoder *od = (OpusFileDecoder *)ctx;
+
+	trackinfo_clear(&(od->ti));
+	free(od);
 	return 1;
 }
 
@@ -376,11 +391,6 @@ static int data_check_magic_bytes(const char *data, size_t size)
 	return res;
 }
 
-static void set_reader_handle(Reader *reader)
-{
-	r = reader;
-}
-
 static GmuDecoder gd = {
 	"opus_decoder",
 	NULL,
@@ -406,7 +416,8 @@ static GmuDecoder gd = {
 	meta_data_close,
 	meta_data_get_charset,
 	data_check_magic_bytes,
-	set_reader_handle,
+	1,
+	NULL,
 	NULL
 };
 
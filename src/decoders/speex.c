@@ -28,29 +28,31 @@
 
 #define MAX_FRAME_SIZE 2000
 
-static ogg_sync_state   oy;
-static ogg_page         og;
-static ogg_packet       op;
-static ogg_stream_state os;
-static SpeexBits        bits;
-static int              packet_count = 0;
-static FILE            *file;
-static void            *st = NULL;
-static ogg_int64_t      page_granule = 0, last_granule = 0;
-static int              frame_size = 0, granule_frame_size = 0;
-static int              skip_samples = 0, page_nb_packets;
-static int              nframes = 2, eos = 0, enh_enabled;
-static int              speex_serialno = -1;
-static int              rate = 0, channels = -1;
-static SpeexStereoState stereo = SPEEX_STEREO_STATE_INIT;
-static int              extra_headers = 0;
-static int              audio_size = 0;
-static short            output[MAX_FRAME_SIZE];
-static int              nb_read;
-static int              packet_no;
-static int              lookahead;
-static int              stream_init;
-static spx_int32_t      current_bitrate, bitrate;
+typedef struct _SpeexFileDecoder {
+	ogg_sync_state   oy;
+	ogg_page         og;
+	ogg_packet       op;
+	ogg_stream_state os;
+	SpeexBits        bits;
+	int              packet_count;
+	FILE            *file;
+	void            *st;
+	ogg_int64_t      page_granule, last_granule;
+	int              frame_size, granule_frame_size;
+	int              skip_samples, page_nb_packets;
+	int              nframes, eos, enh_enabled;
+	int              speex_serialno;
+	int              rate, channels;
+	SpeexStereoState stereo;
+	int              extra_headers;
+	int              audio_size;
+	short            output[MAX_FRAME_SIZE];
+	int              nb_read;
+	int              packet_no;
+	int              lookahead;
+	int              stream_init;
+	spx_int32_t      current_bitrate, bitrate;
+} SpeexFileDecoder;
 
 static const char *get_name(void)
 {
@@ -132,144 +134,162 @@ static void *header_process(ogg_packet *op, spx_int32_t enh_enabled, spx_int32_t
 	return st;
 }
 
-static int read_block(void)
+static int read_block(SpeexFileDecoder *sd)
 {
 	int   res = 0;
 	char *data;
 
 	/* Get the ogg buffer for writing */
-	data = ogg_sync_buffer(&oy, 200);
+	data = ogg_sync_buffer(&sd->oy, 200);
 	if (data) {
-		nb_read = fread(data, sizeof(char), 200, file);      
-		ogg_sync_wrote(&oy, nb_read);
-		if (nb_read > 0) res = 1;
+		sd->nb_read = fread(data, sizeof(char), 200, sd->file);      
+		ogg_sync_wrote(&sd->oy, sd->nb_read);
+		if (sd->nb_read > 0) res = 1;
 	}
 	return res;
 }
 
-static int block_data_process(void)
+static int block_data_process(SpeexFileDecoder *sd)
 {
 	int res = 0;
 	/* Read one complete page */
-	if (ogg_sync_pageout(&oy, &og) == 1) {
-		if (stream_init == 0) {
+	if (ogg_sync_pageout(&sd->oy, &sd->og) == 1) {
+		if (sd->stream_init == 0) {
 			wdprintf(V_DEBUG, "speex", "Initializing Ogg stream.\n");
-			ogg_stream_init(&os, ogg_page_serialno(&og));
-			stream_init = 1;
+			ogg_stream_init(&sd->os, ogg_page_serialno(&sd->og));
+			sd->stream_init = 1;
 		}
-		if (ogg_page_serialno(&og) != os.serialno) {
+		if (ogg_page_serialno(&sd->og) != sd->os.serialno) {
 			/* so all streams are read. */
-			ogg_stream_reset_serialno(&os, ogg_page_serialno(&og));
+			ogg_stream_reset_serialno(&sd->os, ogg_page_serialno(&sd->og));
 		}
 		/* Add page to the bitstream */
-		ogg_stream_pagein(&os, &og);
-		page_granule = ogg_page_granulepos(&og);
-		page_nb_packets = ogg_page_packets(&og);
-		if (page_granule > 0 && frame_size) {
-			skip_samples = frame_size * (page_nb_packets * granule_frame_size * nframes 
-			               - (page_granule - last_granule)) / granule_frame_size;
-			if (ogg_page_eos(&og)) skip_samples = -skip_samples;
+		ogg_stream_pagein(&sd->os, &sd->og);
+		sd->page_granule = ogg_page_granulepos(&sd->og);
+		sd->page_nb_packets = ogg_page_packets(&sd->og);
+		if (sd->page_granule > 0 && sd->frame_size) {
+			sd->skip_samples = sd->frame_size * (sd->page_nb_packets * sd->granule_frame_size * sd->nframes 
+			               - (sd->page_granule - sd->last_granule)) / sd->granule_frame_size;
+			if (ogg_page_eos(&sd->og)) sd->skip_samples = -sd->skip_samples;
 		} else {
-			skip_samples = 0;
+			sd->skip_samples = 0;
 		}
-		last_granule = page_granule;
-		packet_no = 0;
+		sd->last_granule = sd->page_granule;
+		sd->packet_no = 0;
 		res = 1;
 	}
 	return res;
 }
 
-static int open_file(const char *filename)
+static void *open_file(const char *filename, Reader *r)
 {
-	int res = 1;
-
-	ogg_sync_init(&oy);
-	speex_bits_init(&bits);
-
-	rate = 0;
-	channels = -1;
-	bitrate = 0;
-	current_bitrate = 0;
-	eos = 0;
-	packet_no = 0;
-	audio_size = 0;
-	stream_init = 0;
+	SpeexFileDecoder *sd;
+	SpeexStereoState  stereo_init = SPEEX_STEREO_STATE_INIT;
+	int               res = 1;
+
+	if (!(sd = calloc(1, sizeof(SpeexFileDecoder)))) return NULL;
+	sd->stereo = stereo_init;
+	sd->nframes = 2;
+	sd->speex_serialno = -1;
+	ogg_sync_init(&sd->oy);
+	speex_bits_init(&sd->bits);
+
+	sd->rate = 0;
+	sd->channels = -1;
+	sd->bitrate = 0;
+	sd->current_bitrate = 0;
+	sd->eos = 0;
+	sd->packet_no = 0;
+	sd->audio_size = 0;
+	sd->stream_init = 0;
 	wdprintf(V_INFO, "speex", "Opening %s...\n", filename);
-	if (!(file = fopen(filename, "rb"))) {
+	if (!(sd->file = fopen(filename, "rb"))) {
 		wdprintf(V_WARNING, "speex", "Could not open file.\n");
 		res = 0;
 	} else {
-		st = 0;
-		read_block();
-		block_data_process();
-		if (ogg_stream_packetout(&os, &op) == 1) { /* Process first packet as Speex header */
-			st = header_process(&op, enh_enabled, &frame_size, &granule_frame_size, 
-			                    &rate, &nframes, &channels, &stereo, &extra_headers);
-			if (op.bytes >= 5 && !memcmp(op.packet, "Speex", 5)) {
-				speex_serialno = os.serialno;
+		sd->st = 0;
+		read_block(sd);
+		block_data_process(sd);
+		if (ogg_stream_packetout(&sd->os, &sd->op) == 1) { /* Process first packet as Speex header */
+			sd->st = header_process(&sd->op, sd->enh_enabled, &sd->frame_size, &sd->granule_frame_size, 
+			                    &sd->rate, &sd->nframes, &sd->channels, &sd->stereo, &sd->extra_headers);
+			if (sd->op.bytes >= 5 && !memcmp(sd->op.packet, "Speex", 5)) {
+				sd->speex_serialno = sd->os.serialno;
 			}
 		}
-		if (!st) {
+		if (!sd->st) {
 			res = 0;
-			fclose(file);
+			fclose(sd->file);
+			sd->file = NULL;
 			wdprintf(V_WARNING, "speex", "Problem with Speex file.\n");
 		} else {
-			speex_decoder_ctl(st, SPEEX_GET_LOOKAHEAD, &lookahead);
-			speex_decoder_ctl(st, SPEEX_GET_BITRATE, &bitrate);
-			if (!nframes) nframes = 1;
-			wdprintf(V_INFO, "speex", "Found file with %d channel(s) and %d Hz.\n", channels, rate);
+			speex_decoder_ctl(sd->st, SPEEX_GET_LOOKAHEAD, &sd->lookahead);
+			speex_decoder_ctl(sd->st, SPEEX_GET_BITRATE, &sd->bitrate);
+			if (!sd->nframes) sd->nframes = 1;
+			wdprintf(V_INFO, "speex", "Found file with %d channel(s) and %d Hz.\n", sd->channels, sd->rate);
 		}
 	}
-	return res;
+	if (!res) {
+		speex_bits_destroy(&sd->bits);
+		if (sd->stream_init) ogg_stream_clear(&sd->os);
+		ogg_sync_clear(&sd->oy);
+		free(sd);
+		sd = NULL;
+	}
+	return sd;
 }
 
-static int close_file(void)
+static int close_file(void *ctx)
 {
-	if (st) speex_decoder_destroy(st);
-	speex_bits_destroy(&bits);
-	if (stream_init) ogg_stream_clear(&os);
-	ogg_sync_clear(&oy);
-	if (file) fclose(file);
+	SpeexFileDecoder *sd = (SpeexFileDecoder *)ctx;
+
+	if (sd->st) speex_decoder_destroy(sd->st);
+	speex_bits_destroy(&sd->bits);
+	if (sd->stream_init) ogg_stream_clear(&sd->os);
+	ogg_sync_clear(&sd->oy);
+	if (sd->file) fclose(sd->file);
+	free(sd);
 	wdprintf(V_DEBUG, "speex", "File closed.\n");
 	return 0;
 }
 
-static int decode_data(char *target, size_t max_size)
+static int decode_data(void *ctx, char *target, size_t max_size)
 {
-	int size = 1;
-	int i, j;
+	SpeexFileDecoder *sd = (SpeexFileDecoder *)ctx;
+	int               size = 1;
+	int               i, j;
 
-	if (!eos) {
-		int osp = ogg_stream_packetout(&os, &op);
+	if (!sd->eos) {
+		int osp = ogg_stream_packetout(&sd->os, &sd->op);
 		while (osp == 0) {
-			if (!block_data_process()) {
-				if (!read_block()) break;
+			if (!block_data_process(sd)) {
+				if (!read_block(sd)) break;
 			}
-			osp = ogg_stream_packetout(&os, &op);
+			osp = ogg_stream_packetout(&sd->os, &sd->op);
 		}
-		if (op.bytes >= 5 && !memcmp(op.packet, "Speex", 5)) {
-			speex_serialno = os.serialno;
+		if (sd->op.bytes >= 5 && !memcmp(sd->op.packet, "Speex", 5)) {
+			sd->speex_serialno = sd->os.serialno;
 		}
-		if (speex_serialno == -1 || os.serialno != speex_serialno) {
+		if (sd->speex_serialno == -1 || sd->os.serialno != sd->speex_serialno) {
 			/* nothing */
 		} else {
-			if (packet_count == 1) { /* comments packet */
-				/*print_comments((char*)op.packet, op.bytes);*/
-			} else if (packet_count <= 1 + extra_headers) {
+			if (sd->packet_count == 1) { /* comments packet */
+				/*print_comments((char*)sd->op.packet, sd->op.bytes);*/
+			} else if (sd->packet_count <= 1 + sd->extra_headers) {
 				/* Ignore extra headers */
 			} else {
-				packet_no++;
+				sd->packet_no++;
 
 				/* End of stream condition */
-				if (op.e_o_s && os.serialno == speex_serialno) /* don't care for anything except speex eos */
-					eos = 1;
+				if (sd->op.e_o_s && sd->os.serialno == sd->speex_serialno) /* don't care for anything except speex sd->eos */
+					sd->eos = 1;
 
 				/* Copy Ogg packet to Speex bitstream */
-				speex_bits_read_from(&bits, (char*)op.packet, op.bytes);
-				for (j = 0; j != nframes; j++) {
+				speex_bits_read_from(&sd->bits, (char*)sd->op.packet, sd->op.bytes);
+				for (j = 0; j != sd->nframes; j++) {
 					int ret;
 					/* Decode frame */
-					ret = speex_decode_int(st, &bits, output);
+					ret = speex_decode_int(sd->st, &sd->bits, sd->output);
 
 					if (ret == -1) {
 						break;
@@ -278,43 +298,43 @@ static int decode_data(char *target, size_t max_size)
 						wdprintf(V_WARNING, "speex", "Decoding error: Corrupted stream?\n");
 						break;
 					}
-					if (speex_bits_remaining(&bits) < 0) {
+					if (speex_bits_remaining(&sd->bits) < 0) {
 						wdprintf(V_WARNING, "speex", "Decoding overflow: Corrupted stream?\n");
 						break;
 					}
-					if (channels == 2)
-						speex_decode_stereo_int(output, frame_size, &stereo);
+					if (sd->channels == 2)
+						speex_decode_stereo_int(sd->output, sd->frame_size, &sd->stereo);
 
-					speex_decoder_ctl(st, SPEEX_GET_BITRATE, &current_bitrate);
+					speex_decoder_ctl(sd->st, SPEEX_GET_BITRATE, &sd->current_bitrate);
 
 					{
 						/*int frame_offset = 0;*/
-						int new_frame_size = frame_size;
+						int new_frame_size = sd->frame_size;
 
-						if (packet_no == 1 && j == 0 && skip_samples > 0) {
-							new_frame_size -= skip_samples + lookahead;
-							/*frame_offset = skip_samples + lookahead;*/
+						if (sd->packet_no == 1 && j == 0 && sd->skip_samples > 0) {
+							new_frame_size -= sd->skip_samples + sd->lookahead;
+							/*frame_offset = sd->skip_samples + sd->lookahead;*/
 						}
-						if (packet_no == page_nb_packets && skip_samples < 0) {
-							int packet_length = nframes * frame_size + skip_samples + lookahead;
-							new_frame_size = packet_length - j * frame_size;
+						if (sd->packet_no == sd->page_nb_packets && sd->skip_samples < 0) {
+							int packet_length = sd->nframes * sd->frame_size + sd->skip_samples + sd->lookahead;
+							new_frame_size = packet_length - j * sd->frame_size;
 							if (new_frame_size < 0)
 							   new_frame_size = 0;
-							if (new_frame_size > frame_size)
-							   new_frame_size = frame_size;
+							if (new_frame_size > sd->frame_size)
+							   new_frame_size = sd->frame_size;
 						}
 
 						if (new_frame_size > 0) {
-							char *audio = (char *)output;
-							for (i = 0; i < frame_size * channels * 2 && i < max_size; i++)
+							char *audio = (char *)sd->output;
+							for (i = 0; i < sd->frame_size * sd->channels * 2 && i < max_size; i++)
 								target[i] = audio[i];
 							size = i;
-							audio_size += sizeof(short) * new_frame_size * channels;
+							sd->audio_size += sizeof(short) * new_frame_size * sd->channels;
 						}
 					}
 				}
 			}
-			packet_count++;
+			sd->packet_count++;
 		}
 	} else {
 		size = 0;
@@ -322,7 +342,7 @@ static int decode_data(char *target, size_t max_size)
 	return size;
 }
 
-static int seek(int seconds)
+static int seek(void *ctx, int seconds)
 {
 	int  unsuccessful = 1;
 	/*long pos = seconds * 1000;
@@ -341,32 +361,32 @@ static const char* get_file_extensions(void)
 	return ".spx";
 }
 
-static int get_current_bitrate(void)
+static int get_current_bitrate(void *ctx)
 {
-	return current_bitrate;
+	return ((SpeexFileDecoder *)ctx)->current_bitrate;
 }
 
-static int get_length(void)
+static int get_length(void *ctx)
 {
 	return 0;
 }
 
-static int get_samplerate(void)
+static int get_samplerate(void *ctx)
 {
-	return rate;
+	return ((SpeexFileDecoder *)ctx)->rate;
 }
 
-static int get_channels(void)
+static int get_channels(void *ctx)
 {
-	return channels;
+	return ((SpeexFileDecoder *)ctx)->channels;
 }
 
-static int get_bitrate(void)
+static int get_bitrate(void *ctx)
 {
-	return bitrate;
+	return ((SpeexFileDecoder *)ctx)->bitrate;
 }
 
-static const char *get_meta_data(GmuMetaDataType gmdt, int for_current_file)
+static const char *get_meta_data(void *ctx, GmuMetaDataType gmdt)
 {
 	char *result = NULL;
 	/*char **ptr   = NULL;
@@ -409,15 +429,15 @@ static const char *get_meta_data(GmuMetaDataType gmdt, int for_current_file)
 	return result;
 }
 
-static const char *get_file_type(void)
+static const char *get_file_type(void *ctx)
 {
 	return "Ogg Speex";
 }
 
-static int meta_data_load(const char *filename)
+static void *meta_data_load(const char *filename)
 {
 	/*FILE *file;*/
-	int   result = 0;
+	void *result = NULL;
 
 	/*if ((file = fopen(filename, "r"))) {
 		if (ov_open(file, &vf_metaonly, NULL, 0) < 0) {
@@ -430,7 +450,7 @@ static int meta_data_load(const char *filename)
 	return result;
 }
 
-static int meta_data_close(void)
+static int meta_data_close(void *ctx)
 {
 	return 1;
 }
@@ -465,6 +485,7 @@ static GmuDecoder gd = {
 	meta_data_close,
 	meta_data_get_charset,
 	NULL,
+	0,
 	NULL,
 	NULL
 };
@@ -23,9 +23,12 @@
 #include "tremor/ivorbisfile.h"
 #include "../debug.h"
 
-static OggVorbis_File  vf, vf_metaonly;
-static vorbis_info    *vi;
-static Reader         *r;
+typedef struct _VorbisDecoder {
+	OggVorbis_File  vf;
+	vorbis_info    *vi;
+	Reader         *r;
+	int             current_section;
+} VorbisDecoder;
 
 static const char *get_name(void)
 {
@@ -34,6 +37,7 @@ static const char *get_name(void)
 
 static size_t read_callback(void *buffer, size_t size, size_t nmemb, void *datasource)
 {
+	Reader *r = ((VorbisDecoder *)datasource)->r;
 	/*
 	 * When initializing the stream, some bytes may have been read already,
 	 * which we don't want to skip, so we first check if there is something
@@ -63,14 +67,14 @@ static size_t read_callback(void *buffer, size_t size, size_t nmemb, void *datas
 
 static long tell_callback(void *datasource)
 {
-	return reader_get_stream_position(r);
+	return reader_get_stream_position(((VorbisDecoder *)datasource)->r);
 }
 
 /* Returns 0 on success or -1 if seeking is unsupported or an error occured */
 static int seek_callback(void *datasource, ogg_int64_t offset, int whence)
 {
 	int     res = -1;
-	Reader *r = (Reader *)datasource;
+	Reader *r = ((VorbisDecoder *)datasource)->r;
 
 	if (reader_is_seekable(r)) {
 		res = reader_seek_whence(r, offset, whence) ? 0 : -1;
@@ -78,51 +82,57 @@ static int seek_callback(void *datasource, ogg_int64_t offset, int whence)
 	return res;
 }
 
-static ov_callbacks callbacks;
-
-static int open_file(const char *filename)
+static void *open_file(const char *filename, Reader *r)
 {
-	int res = 0;
+	VorbisDecoder *vd;
+	ov_callbacks   callbacks;
 
-	callbacks.read_func = read_callback;
-	callbacks.tell_func = tell_callback;
-	callbacks.seek_func = seek_callback;
+	callbacks.read_func  = read_callback;
+	callbacks.tell_func  = tell_callback;
+	callbacks.seek_func  = seek_callback;
+	callbacks.close_func = NULL;
 
 	if (!r) {
-		wdprintf(V_WARNING, "flac", "Unable to open stream: %s\n", filename);
-		return 0;
+		wdprintf(V_WARNING, "vorbis", "Unable to open stream: %s\n", filename);
+		return NULL;
 	}
+	if (!(vd = calloc(1, sizeof(VorbisDecoder)))) return NULL;
+	vd->r = r;
 	/* We need to seek back to position 0, because Gmu might have already
 	 * read some bytes from the file/stream to determine mime type, which
 	 * upsets the Vorbis decoder, when it tries to do a relative seek at
 	 * the beginning and expects to be at absolute position 0: */
 	reader_seek(r, 0);
 
-	if (ov_open_callbacks(r, &vf, NULL, 0, callbacks) < 0) {
+	if (ov_open_callbacks(vd, &(vd->vf), NULL, 0, callbacks) < 0) {
 		wdprintf(V_WARNING, "vorbis", "Input does not appear to be an Ogg bitstream.\n");
+		free(vd);
+		vd = NULL;
 	} else {
-		vi  = ov_info(&vf, -1);
-		res = 1;
+		vd->vi = ov_info(&(vd->vf), -1);
 	}
-	return res;
+	return vd;
 }
 
-static int close_file(void)
+static int close_file(void *ctx)
 {
-	ov_clear(&vf);
+	VorbisDecoder *vd = (VorbisDecoder *)ctx;
+
+	ov_clear(&(vd->vf));
+	free(vd);
 	return 0;
 }
 
-static int decode_data(char *target, size_t max_size)
+static int decode_data(void *ctx, char *target, size_t max_size)
 {
-	int        size = -1;
-	static int current_section;
+	VorbisDecoder *vd = (VorbisDecoder *)ctx;
+	int            size = -1;
 
 	if (4096 <= max_size) {
 		int i;
 		/* In case of a (temporary) error (e.g. OV_HOLE), we retry a few times before giving up */
 		for (i = 0; i < 10 && size < 0; i++) {
-			size = ov_read(&vf, target, 4096, &current_section);
+			size = ov_read(&(vd->vf), target, 4096, &(vd->current_section));
 			if (size > 0) break;
 		}
 	} else {
@@ -131,13 +141,13 @@ static int decode_data(char *target, size_t max_size)
 	return size;
 }
 
-static int seek(int seconds)
+static int seek(void *ctx, int seconds)
 {
 	int  unsuccessful = 1;
 	long pos = seconds * 1000;
 
 	if (pos <= 0) pos = 0;
-	unsuccessful = ov_time_seek_page(&vf, pos);
+	unsuccessful = ov_time_seek_page(&(((VorbisDecoder *)ctx)->vf), pos);
 	return !unsuccessful;
 }
 
@@ -151,41 +161,35 @@ static const char* get_file_extensions(void)
 	return ".ogg;.oga";
 }
 
-static int get_current_bitrate(void)
+static int get_current_bitrate(void *ctx)
 {
-	return ov_bitrate_instant(&vf);
+	return ov_bitrate_instant(&(((VorbisDecoder *)ctx)->vf));
 }
 
-static int get_length(void)
+static int get_length(void *ctx)
 {
-	return ov_time_total(&vf, -1) / 1000;
+	return ov_time_total(&(((VorbisDecoder *)ctx)->vf), -1) / 1000;
 }
 
-static int get_samplerate(void)
+static int get_samplerate(void *ctx)
 {
-	return vi->rate;
+	return ((VorbisDecoder *)ctx)->vi->rate;
 }
 
-static int get_channels(void)
+static int get_channels(void *ctx)
 {
-	return vi->channels;
+	return ((VorbisDecoder *)ctx)->vi->channels;
 }
 
-static int get_bitrate(void)
+static int get_bitrate(void *ctx)
 {
-	return ov_bitrate(&vf, -1);
+	return ov_bitrate(&(((VorbisDecoder *)ctx)->vf), -1);
 }
 
-static const char *get_meta_data(GmuMetaDataType gmdt, int for_current_file)
+static const char *get_meta_data(void *ctx, GmuMetaDataType gmdt)
 {
 	char *result = NULL;
-	char **ptr   = NULL;
-
-	if (for_current_file) {
-		ptr = ov_comment(&vf, -1)->user_comments;
-	} else {
-		ptr = ov_comment(&vf_metaonly, -1)->user_comments;
-	}
+	char **ptr   = ov_comment(&(((VorbisDecoder *)ctx)->vf), -1)->user_comments;
 
 	while (*ptr) {
 		char buf[80];
@@ -219,30 +223,35 @@ static const char *get_meta_data(GmuMetaDataType gmdt, int for_current_file)
 	return result;
 }
 
-static const char *get_file_type(void)
+static const char *get_file_type(void *ctx)
 {
 	return "Ogg Vorbis";
 }
 
-static int meta_data_load(const char *filename)
+static void *meta_data_load(const char *filename)
 {
-	FILE *file;
-	int   result = 1;
+	FILE          *file;
+	VorbisDecoder *vd = NULL;
 
 	if ((file = fopen(filename, "r"))) {
-		if (ov_open(file, &vf_metaonly, NULL, 0) < 0) {
+		if (!(vd = calloc(1, sizeof(VorbisDecoder)))) {
+			fclose(file);
+		} else if (ov_open(file, &(vd->vf), NULL, 0) < 0) {
 			wdprintf(V_WARNING, "vorbis", "Input does not appear to be an Ogg bitstream.\n");
-			result = 0;
+			fclose(file);
+			free(vd);
+			vd = NULL;
 		}
-	} else {
-		result = 0;
 	}
-	return result;
+	return vd;
 }
 
-static int meta_data_close(void)
+static int meta_data_close(void *ctx)
 {
-	ov_clear(&vf_metaonly);
+	VorbisDecoder *vd = (VorbisDecoder *)ctx;
+
+	ov_clear(&(vd->vf));
+	free(vd);
 	return 1;
 }
 
@@ -251,11 +260,6 @@ static GmuCharset meta_data_get_charset(void)
 	return M_CHARSET_UTF_8;
 }
 
-static void set_reader_handle(Reader *reader)
-{
-	r = reader;
-}
-
 static GmuDecoder gd = {
 	"vorbis_decoder",
 	NULL,
@@ -281,7 +285,8 @@ static GmuDecoder gd = {
 	meta_data_close,
 	meta_data_get_charset,
 	NULL,
-	set_reader_handle,
+	1,
+	NULL,
 	NULL
 };
 
@@ -22,10 +22,12 @@
 #include "../util.h"
 #include "../debug.h"
 
-static int32_t         temp_buffer[256];
-static WavpackContext *wpc;
-static long            total_unpacked_samples;
-static int             get_channels(void);
+typedef struct _WavPackDecoder {
+	int32_t         temp_buffer[256];
+	WavpackContext *wpc;
+	long            total_unpacked_samples;
+} WavPackDecoder;
+
 typedef unsigned char  uchar;
 
 static uchar *format_samples(int bps, uchar *dst, int32_t *src, uint32_t samcnt)
@@ -68,43 +70,51 @@ static const char *get_name(void)
 	return "WavPack decoder v0.3";
 }
 
-static int open_file(const char *filename)
+static void *open_file(const char *filename, Reader *r)
 {
-	char error[80];
+	char            error[80];
+	WavPackDecoder *wd;
+
 	wdprintf(V_INFO, "wavpack", "Opening %s ...", filename);
-	wpc = 0;
-	wpc = WavpackOpenFileInput(filename, error, OPEN_TAGS, 0);
-	total_unpacked_samples = 0;
-	wdprintf(V_DEBUG, "wavpack", "Status: %s", wpc ? "OK" : "Error");
-	return (wpc ? 1 : 0);
+	if (!(wd = calloc(1, sizeof(WavPackDecoder)))) return NULL;
+	wd->wpc = WavpackOpenFileInput(filename, error, OPEN_TAGS, 0);
+	wdprintf(V_DEBUG, "wavpack", "Status: %s", wd->wpc ? "OK" : "Error");
+	if (!wd->wpc) {
+		free(wd);
+		wd = NULL;
+	}
+	return wd;
 }
 
-static int close_file(void)
+static int close_file(void *ctx)
 {
-	WavpackCloseFile(wpc);
-	//fclose(file);
+	WavPackDecoder *wd = (WavPackDecoder *)ctx;
+
+	WavpackCloseFile(wd->wpc);
+	free(wd);
 	return 0;
 }
 
-static int decode_data(char *target, size_t max_size)
+static int decode_data(void *ctx, char *target, size_t max_size)
 {
-	int      bps, channels;
-	uint32_t samples_unpacked = 0;
+	WavPackDecoder *wd = (WavPackDecoder *)ctx;
+	int             bps, channels;
+	uint32_t        samples_unpacked = 0;
 
-	channels = get_channels();
-	bps = WavpackGetBytesPerSample(wpc);
+	channels = WavpackGetReducedChannels(wd->wpc);
+	bps = WavpackGetBytesPerSample(wd->wpc);
 	if (max_size >= 1024) {
-		samples_unpacked = WavpackUnpackSamples(wpc, temp_buffer, 256 / channels);
-		total_unpacked_samples += samples_unpacked;
+		samples_unpacked = WavpackUnpackSamples(wd->wpc, wd->temp_buffer, 256 / channels);
+		wd->total_unpacked_samples += samples_unpacked;
 		if (samples_unpacked)
-            format_samples(bps, (uchar *)target, temp_buffer, samples_unpacked * channels);
+            format_samples(bps, (uchar *)target, wd->temp_buffer, samples_unpacked * channels);
 	} else {
 		wdprintf(V_ERROR, "wavpack", "Target buffer too small: %d < 1024\n", max_size);
 	}
-	return samples_unpacked * (WavpackGetBitsPerSample(wpc) / 4);
+	return samples_unpacked * (WavpackGetBitsPerSample(wd->wpc) / 4);
 }
 
-static int seek(int seconds)
+static int seek(void *ctx, int seconds)
 {
 	int  unsuccessful = 1;
 	long pos = seconds * 1000;
@@ -124,32 +134,33 @@ static const char* get_file_extensions(void)
 	return ".wv;.wvc";
 }
 
-static int get_current_bitrate(void)
+static int get_current_bitrate(void *ctx)
 {
 	return 0; /* WavpackGetInstantBitrate(wpc);*/
 }
 
-static int get_length(void)
+static int get_length(void *ctx)
 {
+	WavpackContext *wpc = ((WavPackDecoder *)ctx)->wpc;
 	return WavpackGetNumSamples(wpc) / WavpackGetSampleRate(wpc);
 }
 
-static int get_samplerate(void)
+static int get_samplerate(void *ctx)
 {
-	return WavpackGetSampleRate(wpc);
+	return WavpackGetSampleRate(((WavPackDecoder *)ctx)->wpc);
 }
 
-static int get_channels(void)
+static int get_channels(void *ctx)
 {
-	return WavpackGetReducedChannels(wpc);
+	return WavpackGetReducedChannels(((WavPackDecoder *)ctx)->wpc);
 }
 
-static int get_bitrate(void)
+static int get_bitrate(void *ctx)
 {
 	return 0; /*WavpackGetAverageBitrate(wpc);*/
 }
 
-static const char *get_meta_data(GmuMetaDataType gmdt, int for_current_file)
+static const char *get_meta_data(void *ctx, GmuMetaDataType gmdt)
 {
 	char *result = NULL;
 	/*char **ptr   = NULL;*/
@@ -192,20 +203,17 @@ static const char *get_meta_data(GmuMetaDataType gmdt, int for_current_file)
 	return result;
 }
 
-static const char *get_file_type(void)
+static const char *get_file_type(void *ctx)
 {
 	return "WavPack";
 }
 
-static int meta_data_load(const char *filename)
+static void *meta_data_load(const char *filename)
 {
-	/*FILE *file;*/
-	int   result = 0;
-
-	return result;
+	return NULL;
 }
 
-static int meta_data_close(void)
+static int meta_data_close(void *ctx)
 {
 	return 1;
 }
@@ -240,6 +248,7 @@ static GmuDecoder gd = {
 	meta_data_close,
 	meta_data_get_charset,
 	NULL,
+	0,
 	NULL,
 	NULL
 };
@@ -9,6 +9,11 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "debug.h"
 #include "util.h"
 #include "dir.h"
@@ -65,3 +70,96 @@ int dirparser_walk_through_directory_tree(const char *directory, int (fn(void *a
 	wdprintf(V_INFO, "dirparser", "Done parsing %s.\n", directory);
 	return result;
 }
+
+/* Checks the file name against the file extensions known to Gmu */
+static int has_supported_extension(const char *filename)
+{
+	char **exts = gmu_core_get_file_extensions();
+	int    filename_len = strlen(filename);
+	int    k, res = 0;
+
+	for (k = 0; exts && exts[k] != NULL && !res; k++) {
+		int ext_len = strlen(exts[k]);
+		ext_len = (ext_len > 15 ? 15 : ext_len);
+		if (filename_len - ext_len >= 0 &&
+		    strncasecmp(filename + filename_len - ext_len, exts[k], ext_len) == 0)
+			res = 1;
+	}
+	return res;
+}
+
+/*
+ * Like dirparser_walk_through_directory_tree(), but reads the directories
+ * with readdir() instead of the Dir API, so that file types are taken from
+ * the directory entries where possible, and reports size and modification
+ * time of files and directories. See DirparserCallbacks for details.
+ * Paths are normalized and joined the same way as with the Dir API.
+ */
+int dirparser_scan_directory_tree(const char *directory, const DirparserCallbacks *cb, void *arg, int dir_depth)
+{
+	DIR           *d;
+	struct dirent *de;
+	struct stat    attr;
+	char           cwd[256];
+	char          *path;
+	size_t         path_len;
+
+	if (directory[0] == '/' || !getcwd(cwd, 255)) strcpy(cwd, "/");
+	if (!(path = dir_get_new_dir_alloc(cwd, directory))) return 0;
+	if (stat(path, &attr) != 0 || !S_ISDIR(attr.st_mode)) {
+		free(path);
+		return 0;
+	}
+	path_len = strlen(path);
+	if (cb->enter_dir) (*cb->enter_dir)(arg, path, attr.st_mtime);
+	wdprintf(V_DEBUG, "dirparser", "Scanning '%s'...\n", path);
+	if ((d = opendir(path))) {
+		while ((de = readdir(d))) {
+			int   is_dir = 0, is_file = 0, type_known = 0;
+			char *f;
+
+			if (de->d_name[0] == '.') continue;
+#ifdef _DIRENT_HAVE_D_TYPE
+			if (de->d_type == DT_DIR) {
+				is_dir = type_known = 1;
+			} else if (de->d_type == DT_REG) {
+				is_file = type_known = 1;
+				if (!has_supported_extension(de->d_name)) continue;
+			} else if (de->d_type != DT_LNK && de->d_type != DT_UNKNOWN) {
+				continue;
+			}
+#endif
+			f = malloc(path_len + strlen(de->d_name) + 1);
+			if (!f) break;
+			memcpy(f, path, path_len);
+			strcpy(f + path_len, de->d_name);
+			if (!type_known || is_file) {
+				if (stat(f, &attr) == 0) {
+					is_dir  = S_ISDIR(attr.st_mode);
+					is_file = S_ISREG(attr.st_mode);
+				} else {
+					is_dir = is_file = 0;
+				}
+			}
+			if (is_dir) {
+				if (dir_depth < DIRPARSER_MAX_DEPTH) {
+					dirparser_scan_directory_tree(f, cb, arg, dir_depth + 1);
+				} else {
+					wdprintf(
+						V_WARNING,
+						"dirparser",
+						"Maximum directory depth of %d exceeded for directory: %s\n",
+						DIRPARSER_MAX_DEPTH,
+						f);
+				}
+			} else if (is_file && has_supported_extension(de->d_name)) {
+				if (cb->file) (*cb->file)(arg, f, attr.st_size, attr.st_mtime);
+			}
+			free(f);
+		}
+		closedir(d);
+	}
+	if (cb->leave_dir) (*cb->leave_dir)(arg, path);
+	free(path);
+	return 1;
+}
@@ -10,7 +10,24 @@
 #ifndef WEJ_DIRPARSER_H
 #define WEJ_DIRPARSER_H
 
+#include <time.h>
+#include <sys/types.h>
+
 #define DIRPARSER_MAX_DEPTH (10)
 
+/*
+ * Callbacks for dirparser_scan_directory_tree(). enter_dir() gets called
+ * for every directory before its contents are processed, file() for every
+ * file with a supported extension and leave_dir() after all files and sub
+ * directories of a directory have been processed. Directory paths passed
+ * to the callbacks are normalized and end with a '/'.
+ */
+typedef struct DirparserCallbacks {
+	void (*enter_dir)(void *arg, const char *directory, time_t mtime);
+	void (*file)(void *arg, const char *filename, off_t size, time_t mtime);
+	void (*leave_dir)(void *arg, const char *directory);
+} DirparserCallbacks;
+
 int dirparser_walk_through_directory_tree(const char *directory, int (fn(void *arg, const char *filename)), void *arg, int dir_depth);
+int dirparser_scan_directory_tree(const char *directory, const DirparserCallbacks *cb, void *arg, int dir_depth);
 #endif
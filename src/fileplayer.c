@@ -26,6 +26,7 @@
 #include "pbstatus.h"
 #include "gmudecoder.h"
 #include "decloader.h"
+#include "crossfade.h"
 #include "charset.h"
 #include "debug.h"
 #include "reader.h"
@@ -34,7 +35,8 @@
 #include "gmuerror.h"
 #include "pthread_helper.h"
 
-#define BUF_SIZE 65536
+/* Minimum amount of free space a decoder gets to write to */
+#define DECODE_CHUNK_SIZE AUDIO_BUFFER_RESERVE_MAX
 
 static char            lyrics_file_pattern[256];
 static long            seek_second;
@@ -66,11 +68,42 @@ static char             *file = NULL;
 static pthread_mutex_t   file_mutex;
 
 static TrackInfo        *ti;
+/*
+ * Info on the next track of a gapless transition. It replaces ti once
+ * playback reaches the new track. Only used by the decoder thread.
+ */
+static TrackInfo         ti_next;
+
+/* Shoutcast stream title reported by the reader; Applied to ti in the decoder loop */
+static char              stream_title[SIZE_TITLE];
+static int               stream_title_updated;
 
 static pthread_mutex_t   mutex;
 
+/* Crossfade length in ms (0 = disabled) and curve */
+static int               crossfade_ms;
+static CrossfadeCurve    crossfade_curve = CROSSFADE_CURVE_EQUAL_POWER;
+
+/*
+ * Track that is being faded out while the next track starts playing.
+ * Only used by the decoder thread.
+ */
+static struct
+{
+	GmuDecoder *gd;
+	void       *dec_ctx; /* NULL if there is no such track */
+	Reader     *r;
+	Crossfade   xf;
+	int         eof;
+} outgoing;
+static int16_t           outgoing_buf[DECODE_CHUNK_SIZE / 2];
+
 static int               dev_close_asap; /* When true, the device isn't kept open, but closed ASAP */
 
+static char           *(*next_track_callback)(void);
+static char           *(*prefetch_track_callback)(void);
+static void            (*track_start_callback)(void);
+
 static void set_item_status(PB_Status status)
 {
 	pthread_mutex_lock(&item_status_mutex);
@@ -127,6 +160,11 @@ int file_player_playback_get_time(void)
  	return audio_get_playtime();
 }
 
+int64_t file_player_playback_get_time_us(void)
+{
+	return audio_get_playtime_us();
+}
+
 /**
  * Returns the actual item status, which can be PLAYING, PAUSED,
  * FINISHED or STOPPED. A FINISHED item has been played until the end,
@@ -188,6 +226,104 @@ void file_player_start_playback(void)
 	locked = 0;
 }
 
+/**
+ * Sets a function that is called by the decoder thread as soon as the
+ * decoder has reached the end of the current track. It should return the
+ * next file to play (allocated with malloc(), the file player takes care
+ * of freeing it) or NULL if playback should stop after the current track.
+ * The returned track is opened and decoded while the audio buffer still
+ * holds the end of the current track, which results in gapless playback.
+ * Set to NULL to disable gapless playback.
+ */
+void file_player_set_next_track_callback(char *(*callback)(void))
+{
+	next_track_callback = callback;
+}
+
+/*
+ * Sets a callback which is called by the decoder thread once playback
+ * has reached a track returned by the next track callback.
+ */
+void file_player_set_track_start_callback(void (*callback)(void))
+{
+	track_start_callback = callback;
+}
+
+/*
+ * Sets a callback which is called once playback of a track has started.
+ * It should return the file that is likely to be played next (allocated
+ * with malloc()) or NULL. The beginning of that file is read into the
+ * cache in the background, so the track starts without delay.
+ */
+void file_player_set_prefetch_track_callback(char *(*callback)(void))
+{
+	prefetch_track_callback = callback;
+}
+
+/*
+ * Sets the crossfade length in ms. With a length > 0 the next track is
+ * started that many ms before the end of the current track (if the
+ * track's length is known) and both tracks are mixed. Requires the next
+ * track callback to be set.
+ */
+void file_player_set_crossfade(int length_ms, CrossfadeCurve curve)
+{
+	crossfade_ms    = length_ms > 0 ? length_ms : 0;
+	crossfade_curve = curve;
+}
+
+static void outgoing_close(void)
+{
+	if (outgoing.dec_ctx) {
+		(*outgoing.gd->close_file)(outgoing.dec_ctx);
+		if (outgoing.r) reader_close(outgoing.r);
+		wdprintf(V_DEBUG, "fileplayer", "Crossfade finished.\n");
+	}
+	outgoing.dec_ctx = NULL;
+	outgoing.r       = NULL;
+	outgoing.gd      = NULL;
+}
+
+/* Plays the rest of the outgoing track without fading, e.g. when the next track cannot be mixed with it */
+static void outgoing_play_out(void)
+{
+	int ret = 1;
+
+	if (outgoing.dec_ctx) wdprintf(V_DEBUG, "fileplayer", "Cannot crossfade. Playing out previous track.\n");
+	while (outgoing.dec_ctx && !outgoing.eof && ret > 0 &&
+	       get_item_status() == PLAYING && !file_player_check_shutdown()) {
+		size_t avail = DECODE_CHUNK_SIZE;
+		char  *target = audio_buffer_reserve_write(&avail);
+		if (target) {
+			ret = (*outgoing.gd->decode_data)(outgoing.dec_ctx, target, avail);
+			if (ret > 0) audio_buffer_commit_write(ret);
+		} else {
+			audio_buffer_wait_for_free(DECODE_CHUNK_SIZE, 100);
+		}
+	}
+	outgoing_close();
+}
+
+/* Mixes the outgoing track into 'size' bytes of freshly decoded data of the next track */
+static void outgoing_mix(char *target, size_t size)
+{
+	while (size > 0 && outgoing.dec_ctx) {
+		size_t chunk = size < sizeof(outgoing_buf) ? size : sizeof(outgoing_buf), got = 0;
+
+		while (!outgoing.eof && got < chunk) {
+			int ret = (*outgoing.gd->decode_data)(outgoing.dec_ctx, (char *)outgoing_buf + got, chunk - got);
+			if (ret > 0)
+				got += ret;
+			else
+				outgoing.eof = 1;
+		}
+		crossfade_mix(&outgoing.xf, (int16_t *)target, outgoing_buf, chunk / 2, got / 2);
+		if (crossfade_is_done(&outgoing.xf)) outgoing_close();
+		target += chunk;
+		size   -= chunk;
+	}
+}
+
 int file_player_init(TrackInfo *ti_ref, int device_close_asap)
 {
 	pthread_mutex_init(&mutex, NULL);
@@ -196,6 +332,7 @@ int file_player_init(TrackInfo *ti_ref, int device_close_asap)
 	pthread_mutex_init(&item_status_mutex, NULL);
 	file_player_set_filename(NULL);
 	ti = ti_ref;
+	trackinfo_init(&ti_next, 1);
 	pthread_create_with_stack_size(&thread, DEFAULT_THREAD_STACK_SIZE, decode_audio_thread, NULL);
 	dev_close_asap = device_close_asap;
 	return 0;
@@ -209,8 +346,35 @@ void file_player_stop_playback(void)
 }
 
 
+/* Called from the decoder thread while reading from the stream */
+static void stream_title_callback(const char *title, void *arg)
+{
+	strncpy(stream_title, title, SIZE_TITLE-1);
+	stream_title[SIZE_TITLE-1] = '\0';
+	stream_title_updated = 1;
+}
+
+/*
+ * Makes the track info of a gapless transition the current one and
+ * announces the track change. To be called once playback has reached
+ * the new track.
+ */
+static void apply_next_trackinfo(void)
+{
+	if (trackinfo_acquire_lock(ti)) {
+		trackinfo_clear(ti);
+		trackinfo_copy(ti, &ti_next);
+		ti_next.image.data = NULL; /* Now owned by ti */
+		trackinfo_set_updated(ti);
+		trackinfo_release_lock(ti);
+	}
+	trackinfo_clear(&ti_next);
+	if (track_start_callback) (*track_start_callback)();
+	event_queue_push(gmu_core_get_event_queue(), GMU_TRACKINFO_CHANGE);
+}
+
 /* Return 1 when new meta data differs from previous data, 0 otherwise */
-static int update_metadata(GmuDecoder *gd, TrackInfo *ti, GmuCharset charset)
+static int update_metadata(GmuDecoder *gd, void *dec_ctx, TrackInfo *ti, GmuCharset charset)
 {
 	TrackInfo ti_tmp;
 	int       differ = 0;
@@ -220,16 +384,16 @@ static int update_metadata(GmuDecoder *gd, TrackInfo *ti, GmuCharset charset)
 		trackinfo_set_artist(&ti_tmp, "");
 		trackinfo_set_title(&ti_tmp, "");
 		trackinfo_set_album(&ti_tmp, "");
-		if ((*gd->get_meta_data)(GMU_META_ARTIST, 1))
-			strncpy_charset_conv(ti_tmp.artist,  (*gd->get_meta_data)(GMU_META_ARTIST, 1), SIZE_ARTIST-1, 0, charset);
-		if ((*gd->get_meta_data)(GMU_META_TITLE, 1))
-			strncpy_charset_conv(ti_tmp.title,   (*gd->get_meta_data)(GMU_META_TITLE, 1), SIZE_TITLE-1, 0, charset);
-		if ((*gd->get_meta_data)(GMU_META_ALBUM, 1))
-			strncpy_charset_conv(ti_tmp.album,   (*gd->get_meta_data)(GMU_META_ALBUM, 1), SIZE_ALBUM-1, 0, charset);
-		if ((*gd->get_meta_data)(GMU_META_TRACKNR, 1))
-			strncpy_charset_conv(ti_tmp.tracknr, (*gd->get_meta_data)(GMU_META_TRACKNR, 1), SIZE_TRACKNR-1, 0, charset);
-		if ((*gd->get_meta_data)(GMU_META_DATE, 1))
-			strncpy_charset_conv(ti_tmp.date,    (*gd->get_meta_data)(GMU_META_DATE, 1), SIZE_DATE-1, 0, charset);
+		if ((*gd->get_meta_data)(dec_ctx, GMU_META_ARTIST))
+			strncpy_charset_conv(ti_tmp.artist,  (*gd->get_meta_data)(dec_ctx, GMU_META_ARTIST), SIZE_ARTIST-1, 0, charset);
+		if ((*gd->get_meta_data)(dec_ctx, GMU_META_TITLE))
+			strncpy_charset_conv(ti_tmp.title,   (*gd->get_meta_data)(dec_ctx, GMU_META_TITLE), SIZE_TITLE-1, 0, charset);
+		if ((*gd->get_meta_data)(dec_ctx, GMU_META_ALBUM))
+			strncpy_charset_conv(ti_tmp.album,   (*gd->get_meta_data)(dec_ctx, GMU_META_ALBUM), SIZE_ALBUM-1, 0, charset);
+		if ((*gd->get_meta_data)(dec_ctx, GMU_META_TRACKNR))
+			strncpy_charset_conv(ti_tmp.tracknr, (*gd->get_meta_data)(dec_ctx, GMU_META_TRACKNR), SIZE_TRACKNR-1, 0, charset);
+		if ((*gd->get_meta_data)(dec_ctx, GMU_META_DATE))
+			strncpy_charset_conv(ti_tmp.date,    (*gd->get_meta_data)(dec_ctx, GMU_META_DATE), SIZE_DATE-1, 0, charset);
 
 		if (ti_tmp.title[0] == '\0') {
 			char *filename_without_path = strrchr(ti_tmp.file_name, '/');
@@ -269,14 +433,14 @@ static int update_metadata(GmuDecoder *gd, TrackInfo *ti, GmuCharset charset)
 		if (differ) {
 			trackinfo_copy(ti, &ti_tmp);
 			if (*gd->get_meta_data_int) {
-				if ((*gd->get_meta_data_int)(GMU_META_IMAGE_DATA_SIZE, 1) &&
-				   ((*gd->get_meta_data)(GMU_META_IMAGE_DATA, 1)) &&
-				   (*gd->get_meta_data)(GMU_META_IMAGE_MIME_TYPE, 1)) {
+				if ((*gd->get_meta_data_int)(dec_ctx, GMU_META_IMAGE_DATA_SIZE) &&
+				   ((*gd->get_meta_data)(dec_ctx, GMU_META_IMAGE_DATA)) &&
+				   (*gd->get_meta_data)(dec_ctx, GMU_META_IMAGE_MIME_TYPE)) {
 					trackinfo_set_image(
 						ti,
-						((*gd->get_meta_data)(GMU_META_IMAGE_DATA, 1)),
-						(*gd->get_meta_data_int)(GMU_META_IMAGE_DATA_SIZE, 1),
-						((*gd->get_meta_data)(GMU_META_IMAGE_MIME_TYPE, 1))
+						((*gd->get_meta_data)(dec_ctx, GMU_META_IMAGE_DATA)),
+						(*gd->get_meta_data_int)(dec_ctx, GMU_META_IMAGE_DATA_SIZE),
+						((*gd->get_meta_data)(dec_ctx, GMU_META_IMAGE_MIME_TYPE))
 					);
 				}
 			}
@@ -289,41 +453,53 @@ static int update_metadata(GmuDecoder *gd, TrackInfo *ti, GmuCharset charset)
 static void *decode_audio_thread(void *udata)
 {
 	GmuDecoder *gd = NULL;
+	void       *dec_ctx = NULL;
 	Reader     *r;
-	static char pcmout[BUF_SIZE];
 	GmuCharset  charset = M_CHARSET_AUTODETECT;
+	char       *gapless_next = NULL;
+	TrackInfo  *tid = ti; /* Track info of the track being decoded */
 
 	wdprintf(V_INFO, "fileplayer", "File player thread initialized.\n");
 	seek_second = -1;
 	while (!file_player_check_shutdown()) {
 		char *filename = NULL;
 		int   len = 0, set_playing = 0;
-
-		pthread_mutex_lock(&mutex);  /* Wait for playback to be started */
-		pthread_mutex_unlock(&mutex);
-		wdprintf(V_DEBUG, "fileplayer", "decode_audio_thread(): Playback has been requested...\n");
-
-		pthread_mutex_lock(&file_mutex);
-		if (file) len = strlen(file);
-		if (len > 0) {
-			filename = malloc(len+1);
-			if (filename) {
-				strncpy(filename, file, len);
-				filename[len] = '\0';
-				set_playing = 1; /* Since the global file pointer points to a filename, we want play that file */
-				wdprintf(V_DEBUG, "fileplayer", "Preparing playback of: %s\n", filename);
+		int   gapless_transition = 0;
+
+		if (gapless_next) {
+			/* Continue with the next track right away, while the end of
+			 * the previous track is still in the audio buffer */
+			filename = gapless_next;
+			gapless_next = NULL;
+			gapless_transition = 1;
+			wdprintf(V_DEBUG, "fileplayer", "Preparing gapless playback of: %s\n", filename);
+		} else {
+			pthread_mutex_lock(&mutex);  /* Wait for playback to be started */
+			pthread_mutex_unlock(&mutex);
+			wdprintf(V_DEBUG, "fileplayer", "decode_audio_thread(): Playback has been requested...\n");
+
+			pthread_mutex_lock(&file_mutex);
+			if (file) len = strlen(file);
+			if (len > 0) {
+				filename = malloc(len+1);
+				if (filename) {
+					strncpy(filename, file, len);
+					filename[len] = '\0';
+					set_playing = 1; /* Since the global file pointer points to a filename, we want play that file */
+					wdprintf(V_DEBUG, "fileplayer", "Preparing playback of: %s\n", filename);
+				} else {
+					wdprintf(V_ERROR, "fileplayer", "ERROR: malloc() failed!\n");
+				}
+				free(file); file = NULL; /* Clear the global file pointer/memory */
 			} else {
-				wdprintf(V_ERROR, "fileplayer", "ERROR: malloc() failed!\n");
+				wdprintf(V_WARNING, "fileplayer", "WARNING: Zero length filename detected!\n");
 			}
-			free(file); file = NULL; /* Clear the global file pointer/memory */
-		} else {
-			wdprintf(V_WARNING, "fileplayer", "WARNING: Zero length filename detected!\n");
+			pthread_mutex_unlock(&file_mutex);
+			if (set_playing)
+				set_item_status(PLAYING);
+			else
+				wdprintf(V_WARNING, "fileplayer", "Uh, no proper filename set. Not starting playback!\n");
 		}
-		pthread_mutex_unlock(&file_mutex);
-		if (set_playing)
-			set_item_status(PLAYING);
-		else
-			wdprintf(V_WARNING, "fileplayer", "Uh, no proper filename set. Not starting playback!\n");
 		r = NULL;
 		if (!file_player_check_shutdown() && filename && get_item_status() == PLAYING) {
 			const char *tmp = get_file_extension(filename);
@@ -342,11 +518,12 @@ static void *decode_audio_thread(void *udata)
 			}
 			if (gd && gd->identifier && !file_player_check_shutdown()) {
 				wdprintf(V_INFO, "fileplayer", "Selected decoder: %s\n", gd->identifier);
-				if (gd->set_reader_handle) {
+				if (gd->uses_reader) {
 					if (!r) {
 						r = reader_open(filename);
 						if (r) reader_read_bytes(r, 4096);
 					}
+					if (r) reader_enable_read_ahead(r);
 				} else {
 					if (r) {
 						reader_close(r);
@@ -355,49 +532,81 @@ static void *decode_audio_thread(void *udata)
 				}
 
 				if (*gd->meta_data_get_charset) charset = (*gd->meta_data_get_charset)();
-				if (gd->set_reader_handle) (*gd->set_reader_handle)(r);
+
+				stream_title_updated = 0;
+				if (r) reader_set_meta_data_callback(r, stream_title_callback, NULL);
 
 				audio_reset_fade_volume();
-				if (get_item_status() == PLAYING && !file_player_check_shutdown() && (*gd->open_file)(filename)) {
-					int channels = 0;
-					if (trackinfo_acquire_lock(ti)) {
-						trackinfo_clear(ti);
+				if (outgoing.dec_ctx && get_item_status() == PLAYING &&
+				    !(dec_ctx = decloader_decoder_open_file(gd, filename, r))) {
+					/* Some decoders cannot be used twice at the same time */
+					outgoing_play_out();
+				}
+				if (get_item_status() == PLAYING && !file_player_check_shutdown() &&
+				    (dec_ctx || (dec_ctx = decloader_decoder_open_file(gd, filename, r)))) {
+					int     channels = 0, samplerate = 0, length = 0;
+					int64_t decoded_bytes = 0, crossfade_start = -1;
+					if (tid != ti) {
+						if (gapless_transition) /* Previous track was shorter than the audio buffer */
+							apply_next_trackinfo();
+						else
+							trackinfo_clear(&ti_next);
+					}
+					/* During a gapless transition ti describes the previous track until it has been played */
+					tid = gapless_transition ? &ti_next : ti;
+					if (trackinfo_acquire_lock(tid)) {
+						trackinfo_clear(tid);
 						if (charset_is_valid_utf8_string(filename))
-							strncpy(ti->file_name, filename, SIZE_FILE_NAME-1);
+							strncpy(tid->file_name, filename, SIZE_FILE_NAME-1);
 						else
-							charset_iso8859_1_to_utf8(ti->file_name, filename, SIZE_FILE_NAME-1);
+							charset_iso8859_1_to_utf8(tid->file_name, filename, SIZE_FILE_NAME-1);
 
 						/* Assume 44.1 kHz stereo as default */
-						ti->samplerate = 44100;
-						ti->channels   = 2;
-						ti->bitrate    = 0;
+						tid->samplerate = 44100;
+						tid->channels   = 2;
+						tid->bitrate    = 0;
 
 						if (*gd->get_samplerate)
-							ti->samplerate = (*gd->get_samplerate)();
+							tid->samplerate = (*gd->get_samplerate)(dec_ctx);
 						if (*gd->get_channels)
-							ti->channels   = (*gd->get_channels)();
+							tid->channels   = (*gd->get_channels)(dec_ctx);
 						if (*gd->get_bitrate)
-							ti->bitrate    = (*gd->get_bitrate)();
+							tid->bitrate    = (*gd->get_bitrate)(dec_ctx);
 						if (*gd->get_length)
-							ti->length     = (*gd->get_length)();
+							tid->length     = (*gd->get_length)(dec_ctx);
 						if (*gd->get_file_type)
-							strncpy_charset_conv(ti->file_type, (*gd->get_file_type)(),
+							strncpy_charset_conv(tid->file_type, (*gd->get_file_type)(dec_ctx),
 												 SIZE_FILE_TYPE-1, 0, charset);
-						channels = ti->channels;
-						trackinfo_release_lock(ti);
+						channels   = tid->channels;
+						samplerate = tid->samplerate;
+						length     = tid->length;
+						trackinfo_release_lock(tid);
 					}
 
-					if (channels > 0 && trackinfo_acquire_lock(ti)) {
+					if (gapless_transition && channels > 0 && !audio_device_has_format(samplerate, channels)) {
+						outgoing_play_out();
+						/* The audio device needs to be reopened, so the previous track has to be played out first */
+						wdprintf(V_DEBUG, "fileplayer", "Audio format changed. Waiting for audio buffer to drain...\n");
+						while (audio_buffer_get_fill() > 0 && get_item_status() == PLAYING) {
+							if (get_pb_request() == PBRQ_PLAY && audio_get_pause()) audio_set_pause(0);
+							SDL_Delay(10);
+						}
+						gapless_transition = 0;
+						apply_next_trackinfo();
+						tid = ti;
+					}
+
+					if (channels > 0 && trackinfo_acquire_lock(tid)) {
 						int ret;
 
 						wdprintf(V_INFO, "fileplayer", "Found %s stream w/ %d channel(s), %d Hz, %ld bps, %d seconds\n",
-								 ti->file_type, ti->channels, ti->samplerate, ti->bitrate, ti->length);
+								 tid->file_type, tid->channels, tid->samplerate, tid->bitrate, tid->length);
 
-						if (!trackinfo_has_lyrics(ti)) {
+						if (!trackinfo_has_lyrics(tid)) {
 							char *lyrics_file = get_file_matching_given_pattern_alloc(filename, lyrics_file_pattern);
 							if (lyrics_file) {
 								wdprintf(V_DEBUG, "fileplayer", "Trying to load lyrics from file %s...\n", lyrics_file);
-								if (trackinfo_load_lyrics_from_file(ti, lyrics_file))
+								if (trackinfo_load_lyrics_from_file(tid, lyrics_file))
 									wdprintf(V_DEBUG, "fileplayer", "Loading lyrics was successful.\n");
 								else
 									wdprintf(V_WARNING, "fileplayer", "Loading lyrics from file failed.\n");
@@ -406,16 +615,18 @@ static void *decode_audio_thread(void *udata)
 							/*wdprintf(V_DEBUG, "fileplayer", "LYRICS:%s\n",ti->lyrics);*/
 						}
 
-						if (audio_device_open(ti->samplerate, ti->channels) < 0) {
+						if (gapless_transition) {
+							audio_mark_track_boundary();
+						} else if (audio_device_open(tid->samplerate, tid->channels) < 0) {
 							wdprintf(V_ERROR, "fileplayer", "Couldn't open audio: %s\n", SDL_GetError());
 						} else {
 							wdprintf(V_DEBUG, "fileplayer", "Audio device ready!\n");
 						}
 
 						/* read meta data */
-						if (update_metadata(gd, ti, charset))
+						if (update_metadata(gd, dec_ctx, tid, charset) && tid == ti)
 							event_queue_push(gmu_core_get_event_queue(), GMU_TRACKINFO_CHANGE);
-						trackinfo_release_lock(ti);
+						trackinfo_release_lock(tid);
 
 						if (get_pb_request() == PBRQ_PLAY) audio_set_pause(0);
 
@@ -432,7 +643,7 @@ static void *decode_audio_thread(void *udata)
 								} else {
 									check_count--;
 								}
-								SDL_Delay(200);
+								reader_wait_until_ready(r, 200);
 							}
 							if (check_count <= 0) {
 								set_item_status(FINISHED);
@@ -443,6 +654,18 @@ static void *decode_audio_thread(void *udata)
 							}
 						}
 
+						if (prefetch_track_callback && get_item_status() == PLAYING) {
+							char *prefetch_file = (*prefetch_track_callback)();
+							if (prefetch_file) {
+								reader_prefetch_file(prefetch_file);
+								free(prefetch_file);
+							}
+						}
+
+						/* Start the crossfade at the end of tracks of known length that are long enough */
+						if (crossfade_ms > 0 && length > 0 && (long)length * 1000 > 2 * crossfade_ms)
+							crossfade_start = ((int64_t)length * 1000 - crossfade_ms) * samplerate / 1000 * channels * 2;
+
 						ret = 1;
 						while (
 							( get_item_status() == PLAYING || audio_fade_out_in_progress()
@@ -451,26 +674,74 @@ static void *decode_audio_thread(void *udata)
 						) {
 							int size = 0, br = 0;
 
+							if (tid != ti && audio_track_boundary_reached()) {
+								apply_next_trackinfo();
+								tid = ti;
+							}
 							if (seek_second >= 0) {
-								if (get_item_status() == PLAYING && (!gd->set_reader_handle || reader_is_seekable(r))) {
-									if (*gd->seek && (*gd->seek)(seek_second))
-										audio_set_sample_counter(seek_second * ti->samplerate);
+								if (get_item_status() == PLAYING && (!gd->uses_reader || reader_is_seekable(r))) {
+									outgoing_close();
+									if (*gd->seek && (*gd->seek)(dec_ctx, seek_second)) {
+										audio_set_sample_counter(seek_second * tid->samplerate);
+										decoded_bytes = (int64_t)seek_second * samplerate * channels * 2;
+									}
 								}
 								seek_second = -1;
 							}
 							if (audio_fade_out_in_progress()) {
 								if (audio_fade_out_step(15)) set_item_status(STOPPED);
 							}
-							while (ret > 0 && size < BUF_SIZE / 2 && item_status != STOPPED) {
-								ret = (*gd->decode_data)(pcmout+size, BUF_SIZE-size);
-								if (ret > 0) size += ret;
+							/* Decode straight into the audio buffer */
+							while (ret > 0 && size < DECODE_CHUNK_SIZE && get_item_status() == PLAYING) {
+								size_t avail = DECODE_CHUNK_SIZE;
+								char  *target = audio_buffer_reserve_write(&avail);
+								if (target) {
+									ret = (*gd->decode_data)(dec_ctx, target, avail);
+									if (ret > 0) {
+										if (outgoing.dec_ctx) outgoing_mix(target, ret);
+										audio_buffer_commit_write(ret);
+										size += ret;
+										decoded_bytes += ret;
+									}
+								} else {
+									/* Sleep until the audio callback has consumed some data */
+									audio_buffer_wait_for_free(DECODE_CHUNK_SIZE, 100);
+									break;
+								}
+							}
+							audio_buffer_adapt();
+							/* The buffer running empty at the end of the track is no underrun */
+							if (ret == 0) audio_set_done();
+							if (ret == 0 && next_track_callback && get_item_status() == PLAYING) {
+								/* Decoder reached the end; Switch to the next track right away */
+								gapless_next = (*next_track_callback)();
+								if (gapless_next) break;
+							}
+							if (ret > 0 && crossfade_start >= 0 && decoded_bytes >= crossfade_start &&
+							    !outgoing.dec_ctx && next_track_callback && get_item_status() == PLAYING) {
+								/* Keep decoding this track, mixed with the next one */
+								crossfade_start = -1;
+								gapless_next = (*next_track_callback)();
+								if (gapless_next) {
+									wdprintf(V_DEBUG, "fileplayer", "Starting crossfade.\n");
+									if (r) reader_set_meta_data_callback(r, NULL, NULL);
+									outgoing.gd      = gd;
+									outgoing.dec_ctx = dec_ctx;
+									outgoing.r       = r;
+									outgoing.eof     = 0;
+									crossfade_init(&outgoing.xf, (size_t)crossfade_ms * samplerate / 1000,
+									               channels, crossfade_curve);
+									dec_ctx = NULL;
+									r = NULL;
+									break;
+								}
 							}
 							if (ret <= 0) SDL_Delay(50);
-							if (gd->get_current_bitrate) br = (*gd->get_current_bitrate)();
+							if (gd->get_current_bitrate) br = (*gd->get_current_bitrate)(dec_ctx);
 							if (br > 0) {
-								if (trackinfo_acquire_lock(ti)) {
-									ti->recent_bitrate = br;
-									trackinfo_release_lock(ti);
+								if (trackinfo_acquire_lock(tid)) {
+									tid->recent_bitrate = br;
+									trackinfo_release_lock(tid);
 								}
 							}
 							if (ret == 0 && audio_buffer_get_fill() == 0) { /* EOF while decoding data and no data lef in buffer */
@@ -480,14 +751,9 @@ static void *decode_audio_thread(void *udata)
 								audio_set_pause(1);
 								break;
 							} else {
-								int ret = 0;
-								while (!ret && get_item_status() == PLAYING) {
-									ret = audio_fill_buffer(pcmout, size);
-									if (!ret) SDL_Delay(10);
-									if (get_item_status() == PLAYING && get_pb_request() == PBRQ_PLAY && audio_get_pause()) {
-										wdprintf(V_DEBUG, "fileplayer", "Unpause audio due to user request...\n");
-										audio_set_pause(0);
-									}
+								if (get_item_status() == PLAYING && get_pb_request() == PBRQ_PLAY && audio_get_pause()) {
+									wdprintf(V_DEBUG, "fileplayer", "Unpause audio due to user request...\n");
+									audio_set_pause(0);
 								}
 								if (audio_get_status() != SDL_AUDIO_PLAYING &&
 									!audio_get_pause() &&
@@ -498,24 +764,35 @@ static void *decode_audio_thread(void *udata)
 								}
 							}
 							if (*gd->get_meta_data_int) {
-								if ((*gd->get_meta_data_int)(GMU_META_IS_UPDATED, 1)) {
-									if (trackinfo_acquire_lock(ti)) {
-										if (update_metadata(gd, ti, charset)) {
+								if ((*gd->get_meta_data_int)(dec_ctx, GMU_META_IS_UPDATED)) {
+									if (trackinfo_acquire_lock(tid)) {
+										if (update_metadata(gd, dec_ctx, tid, charset) && tid == ti) {
 											event_queue_push(gmu_core_get_event_queue(), GMU_TRACKINFO_CHANGE);
 											wdprintf(V_DEBUG, "fileplayer", "Meta data change detected!\n");
 										}
-										trackinfo_release_lock(ti);
+										trackinfo_release_lock(tid);
 									}
 								}
 							}
+							if (stream_title_updated && trackinfo_acquire_lock(tid)) {
+								stream_title_updated = 0;
+								trackinfo_set_title(tid, stream_title);
+								trackinfo_set_updated(tid);
+								trackinfo_release_lock(tid);
+								if (tid == ti) event_queue_push(gmu_core_get_event_queue(), GMU_TRACKINFO_CHANGE);
+								wdprintf(V_DEBUG, "fileplayer", "Stream title changed: %s\n", stream_title);
+							}
 						}
+						/* Unless this track has just become the outgoing one, a crossfade into it is over */
+						if (dec_ctx) outgoing_close();
 						wdprintf(V_INFO, "fileplayer", "Playback stopped: %d\n", item_status);
 						wdprintf(V_DEBUG, "fileplayer", "Buffer: %d\n", audio_buffer_get_fill());
 						seek_second = -1;
 					} else {
 						wdprintf(V_WARNING, "fileplayer", "Broken audio stream.\n");
 					}
-					(*gd->close_file)();
+					if (dec_ctx) (*gd->close_file)(dec_ctx);
+					dec_ctx = NULL;
 				} else {
 					wdprintf(V_DEBUG, "fileplayer", "Unable to open file.\n");
 					event_queue_push_with_parameter(
@@ -525,15 +802,28 @@ static void *decode_audio_thread(void *udata)
 					);
 				}
 			}
-			if (get_item_status() == STOPPED) audio_buffer_clear();
-			audio_set_done();
-			if (item_status != STOPPED) set_item_status(FINISHED);
-			wdprintf(V_DEBUG, "fileplayer", "Decoder thread: Playback done.\n");
-			if (trackinfo_acquire_lock(ti)) {
-				trackinfo_clear(ti);
-				trackinfo_release_lock(ti);
+			if (gapless_next && get_item_status() == PLAYING) {
+				wdprintf(V_DEBUG, "fileplayer", "Decoder thread: Continuing with next track.\n");
+			} else {
+				if (gapless_next) {
+					free(gapless_next);
+					gapless_next = NULL;
+				}
+				outgoing_play_out(); /* In case the next track could not be played */
+				if (get_item_status() == STOPPED) audio_buffer_clear();
+				audio_set_done();
+				if (item_status != STOPPED) set_item_status(FINISHED);
+				wdprintf(V_DEBUG, "fileplayer", "Decoder thread: Playback done.\n");
+				if (tid != ti) {
+					trackinfo_clear(&ti_next);
+					tid = ti;
+				}
+				if (trackinfo_acquire_lock(ti)) {
+					trackinfo_clear(ti);
+					trackinfo_release_lock(ti);
+				}
+				event_queue_push(gmu_core_get_event_queue(), GMU_TRACKINFO_CHANGE);
 			}
-			event_queue_push(gmu_core_get_event_queue(), GMU_TRACKINFO_CHANGE);
 		} else {
 			wdprintf(V_DEBUG, "fileplayer", "wrong item status? %d\n", item_status);
 		}
@@ -542,14 +832,15 @@ static void *decode_audio_thread(void *udata)
 			filename = NULL;
 		}
 		if (r) reader_close(r);
-		if (gd && gd->set_reader_handle) {
-			(*gd->set_reader_handle)(NULL);
+		if (!gapless_next) {
+			pthread_mutex_lock(&file_mutex);
+			if (dev_close_asap && !file) audio_device_close();
+			pthread_mutex_unlock(&file_mutex);
+			usleep(100000);
 		}
-		pthread_mutex_lock(&file_mutex);
-		if (dev_close_asap && !file) audio_device_close();
-		pthread_mutex_unlock(&file_mutex);
-		usleep(100000);
 	}
+	if (gapless_next) free(gapless_next);
+	outgoing_close();
 	wdprintf(V_DEBUG, "fileplayer", "Decoder thread finished.\n");
 	return NULL;
 }
@@ -580,7 +871,7 @@ int file_player_play_file(char *filename, int skip_current, int fade_out_on_skip
  */
 int file_player_seek(long offset)
 {
-	seek_second = audio_get_playtime() / 1000 + offset;
+	seek_second = audio_get_playtime_us() / 1000000 + offset;
 	if (seek_second < 0) seek_second = 0;
 	return 0;
 }
@@ -15,12 +15,15 @@
  */
 #ifndef _FILEPLAYER_H
 #define _FILEPLAYER_H
+#include <stdint.h>
 #include "trackinfo.h"
 #include "pbstatus.h"
+#include "crossfade.h"
 
 int       file_player_check_shutdown(void);
 void      file_player_set_lyrics_file_pattern(const char *pattern);
-int       file_player_playback_get_time(void);
+int       file_player_playback_get_time(void); /* in milliseconds */
+int64_t   file_player_playback_get_time_us(void);
 PB_Status file_player_get_item_status(void);
 void      file_player_stop_playback(void);
 int       file_player_play_file(char *file, int skip_current, int fade_out_on_skip);
@@ -31,6 +34,10 @@ void      file_player_shutdown(void);
 void      file_player_set_filename(char *filename);
 void      file_player_start_playback(void);
 int       file_player_init(TrackInfo *ti_ref, int device_close_asap);
+void      file_player_set_next_track_callback(char *(*callback)(void));
+void      file_player_set_track_start_callback(void (*callback)(void));
+void      file_player_set_prefetch_track_callback(char *(*callback)(void));
+void      file_player_set_crossfade(int length_ms, CrossfadeCurve curve);
 TrackInfo *file_player_get_trackinfo_ref(void);
 int       file_player_request_playback_state_change(PB_Status_Request request);
 #endif
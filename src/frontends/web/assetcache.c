@@ -0,0 +1,86 @@
+/* 
+ * Gmu Music Player
+ *
+ * Copyright (c) 2006-2021 Johannes Heimansberg (wej.k.vu)
+ *
+ * File: assetcache.c  Created: 261017
+ *
+ * Description: In-memory cache for small static files served by httpd
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2 of
+ * the License. See the file COPYING in the Gmu's main directory
+ * for details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "assetcache.h"
+#include "debug.h"
+
+/* The cache is only used from the web server thread, thus no locking */
+static Asset         cache[ASSETCACHE_ENTRIES];
+static unsigned long use_counter;
+
+static void asset_clear(Asset *a)
+{
+	if (a->filename) free(a->filename);
+	if (a->data) free(a->data);
+	memset(a, 0, sizeof(Asset));
+}
+
+static int asset_load(Asset *a, const char *filename, const struct stat *st)
+{
+	FILE *f = fopen(filename, "r");
+	int   res = 0;
+
+	asset_clear(a);
+	if (f) {
+		a->filename = malloc(strlen(filename)+1);
+		a->data = malloc(st->st_size > 0 ? st->st_size : 1);
+		if (a->filename && a->data) {
+			strcpy(a->filename, filename);
+			a->size = fread(a->data, 1, st->st_size, f);
+			a->mtime = st->st_mtime;
+			res = (a->size == (size_t)st->st_size);
+		}
+		fclose(f);
+	}
+	if (res)
+		wdprintf(V_DEBUG, "assetcache", "Cached %s (%zd bytes).\n", filename, a->size);
+	else
+		asset_clear(a);
+	return res;
+}
+
+const Asset *assetcache_get(const char *filename, const struct stat *st)
+{
+	Asset *a = NULL, *lru = &cache[0];
+	size_t i;
+
+	if (st->st_size > ASSETCACHE_MAX_FILE_SIZE) return NULL;
+	for (i = 0; i < ASSETCACHE_ENTRIES && !a; i++) {
+		if (cache[i].filename && strcmp(cache[i].filename, filename) == 0)
+			a = &cache[i];
+		else if (cache[i].last_used < lru->last_used)
+			lru = &cache[i];
+	}
+	if (a && (a->mtime != st->st_mtime || a->size != (size_t)st->st_size)) {
+		wdprintf(V_DEBUG, "assetcache", "%s has changed.\n", filename);
+		if (!asset_load(a, filename, st)) a = NULL;
+	} else if (!a) {
+		a = asset_load(lru, filename, st) ? lru : NULL;
+	}
+	if (a) a->last_used = ++use_counter;
+	return a;
+}
+
+void assetcache_free(void)
+{
+	size_t i;
+
+	for (i = 0; i < ASSETCACHE_ENTRIES; i++)
+		asset_clear(&cache[i]);
+	use_counter = 0;
+}
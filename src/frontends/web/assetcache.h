@@ -0,0 +1,40 @@
+/* 
+ * Gmu Music Player
+ *
+ * Copyright (c) 2006-2021 Johannes Heimansberg (wej.k.vu)
+ *
+ * File: assetcache.h  Created: 261017
+ *
+ * Description: In-memory cache for small static files served by httpd
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2 of
+ * the License. See the file COPYING in the Gmu's main directory
+ * for details.
+ */
+#ifndef GMU_ASSETCACHE_H
+#define GMU_ASSETCACHE_H
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define ASSETCACHE_ENTRIES        32
+#define ASSETCACHE_MAX_FILE_SIZE  (64*1024)
+
+typedef struct {
+	char          *filename;
+	char          *data;
+	size_t         size;
+	time_t         mtime;
+	unsigned long  last_used;
+} Asset;
+
+/*
+ * Returns the cached contents of 'filename', reading the file into the
+ * cache if it is not cached yet or has changed according to 'st'.
+ * Returns NULL if the file is too large to be cached or cannot be read.
+ * The returned asset is valid until the next call.
+ */
+const Asset *assetcache_get(const char *filename, const struct stat *st);
+void         assetcache_free(void);
+#endif
@@ -29,12 +29,15 @@ static const char *get_name(void)
 	return "Gmu HTTP server frontend v0.1";
 }
 
-static pthread_t fe_thread;
+static pthread_t   fe_thread;
+/* Event callbacks are called from one thread only, so a single writer will do */
+static JSON_Writer jw;
 
 static void server_stop(void)
 {
 	httpd_stop_server();
 	pthread_join(fe_thread, NULL);
+	json_writer_free(&jw);
 }
 
 static int init(void)
@@ -45,6 +48,7 @@ static int init(void)
 
 	ip = malloc(sizeof(HTTPD_Init_Params));
 	ip->local_only = 1;
+	ip->max_connections = MAX_CONNECTIONS;
 	if (config) {
 		gmu_core_config_acquire_lock();
 		cfg_add_key_if_not_present(config, "gmuhttp.Listen", "Local");
@@ -53,8 +57,10 @@ static int init(void)
 		cfg_key_add_presets(config, "gmuhttp.DisableLocalPassword", "yes", "no", NULL);
 		cfg_add_key_if_not_present(config, "gmuhttp.Password", "change.me");
 		cfg_add_key_if_not_present(config, "gmuhttp.BaseDir", "/");
+		cfg_add_key_if_not_present(config, "gmuhttp.MaxConnections", "100");
 		if (cfg_compare_value(config, "gmuhttp.Listen", "All", 1))
 			ip->local_only = 0;
+		ip->max_connections = cfg_get_int_value(config, "gmuhttp.MaxConnections");
 		gmu_core_config_release_lock();
 	}
 	ip->webserver_root = gmu_core_get_base_dir();
@@ -66,107 +72,79 @@ static int init(void)
 	return res;
 }
 
-#define MSG_MAX_LEN 512
-
 static int event_callback(GmuEvent event, int param)
 {
-	char msg[MSG_MAX_LEN];
-	int  r;
+	int send = 1;
 
+	json_writer_reset(&jw);
+	json_writer_object_begin(&jw, NULL);
 	switch (event) {
-		case GMU_QUIT:
-			break;
-		case GMU_TRACK_CHANGE: {
-			r = snprintf(
-				msg,
-				MSG_MAX_LEN,
-				"{ \"cmd\": \"track_change\", \"playlist_pos\": %d }",
-				param
-			);
-			if (r < MSG_MAX_LEN && r > 0) httpd_send_websocket_broadcast(msg);
+		case GMU_TRACK_CHANGE:
+			json_writer_string(&jw, "cmd", "track_change");
+			json_writer_integer(&jw, "playlist_pos", param);
 			break;
-		}
 		case GMU_TRACKINFO_CHANGE: {
 			TrackInfo *ti = gmu_core_get_current_trackinfo_ref();
-			char *tmp_title, *tmp_artist, *tmp_album;
-			
+
 			if (trackinfo_acquire_lock(ti)) {
-				tmp_title  = json_string_escape_alloc(trackinfo_get_title(ti));
-				tmp_artist = json_string_escape_alloc(trackinfo_get_artist(ti));
-				tmp_album  = json_string_escape_alloc(trackinfo_get_album(ti));
-				r = snprintf(
-					msg,
-					MSG_MAX_LEN,
-					"{ \"cmd\": \"trackinfo\", \"title\" : \"%s\", \"artist\" : \"%s\", " \
-					"\"album\" : \"%s\", \"length_min\": %d, \"length_sec\": %d }",
-					tmp_title ? tmp_title : "",
-					tmp_artist ? tmp_artist : "",
-					tmp_album ? tmp_album : "",
-					trackinfo_get_length_minutes(ti),
-					trackinfo_get_length_seconds(ti)
-				);
-				if (r < MSG_MAX_LEN && r > 0) httpd_send_websocket_broadcast(msg);
-				if (tmp_title)  free(tmp_title);
-				if (tmp_artist) free(tmp_artist);
-				if (tmp_album)  free(tmp_album);
+				json_writer_string(&jw, "cmd", "trackinfo");
+				json_writer_string(&jw, "title", trackinfo_get_title(ti));
+				json_writer_string(&jw, "artist", trackinfo_get_artist(ti));
+				json_writer_string(&jw, "album", trackinfo_get_album(ti));
+				json_writer_integer(&jw, "length_min", trackinfo_get_length_minutes(ti));
+				json_writer_integer(&jw, "length_sec", trackinfo_get_length_seconds(ti));
 				trackinfo_release_lock(ti);
+			} else {
+				send = 0;
 			}
 			break;
 		}
-		case GMU_PLAYBACK_STATE_CHANGE: {
-			r = snprintf(
-				msg,
-				MSG_MAX_LEN,
-				"{ \"cmd\": \"playback_state\", \"state\" : %d }",
-				gmu_core_get_status()
-			);
-			if (r < MSG_MAX_LEN && r > 0) httpd_send_websocket_broadcast(msg);
+		case GMU_PLAYBACK_STATE_CHANGE:
+			json_writer_string(&jw, "cmd", "playback_state");
+			json_writer_integer(&jw, "state", gmu_core_get_status());
 			break;
-		}
 		case GMU_PLAYLIST_CHANGE: {
-			r = snprintf(
-				msg,
-				MSG_MAX_LEN,
-				"{ \"cmd\": \"playlist_change\", \"changed_at_position\" : %d, \"length\" : %zd }",
-				param,
-				gmu_core_playlist_get_length()
-			);
-			if (r < MSG_MAX_LEN && r > 0) httpd_send_websocket_broadcast(msg);
+			size_t        length;
+			unsigned long version;
+
+			gmu_core_playlist_acquire_lock();
+			version = gmu_core_playlist_get_version(&length);
+			gmu_core_playlist_release_lock();
+			json_writer_string(&jw, "cmd", "playlist_change");
+			json_writer_integer(&jw, "changed_at_position", param);
+			json_writer_unsigned(&jw, "length", length);
+			json_writer_unsigned(&jw, "version", version);
 			break;
 		}
-		case GMU_PLAYBACK_TIME_CHANGE: {
-			r = snprintf(
-				msg,
-				MSG_MAX_LEN,
-				"{ \"cmd\": \"playback_time\", \"time\" : %d }",
-				param
-			);
-			if (r < MSG_MAX_LEN && r > 0) httpd_send_websocket_broadcast(msg);
+		case GMU_PLAYBACK_TIME_CHANGE:
+			json_writer_string(&jw, "cmd", "playback_time");
+			json_writer_integer(&jw, "time", param);
 			break;
-		}
-		case GMU_PLAYMODE_CHANGE: {
-			r = snprintf(
-				msg,
-				MSG_MAX_LEN,
-				"{ \"cmd\": \"playmode_info\", \"mode\" : %d }",
-				gmu_core_playlist_get_play_mode()
-			);
-			if (r < MSG_MAX_LEN && r > 0) httpd_send_websocket_broadcast(msg);
+		case GMU_PLAYMODE_CHANGE:
+			json_writer_string(&jw, "cmd", "playmode_info");
+			json_writer_integer(&jw, "mode", gmu_core_playlist_get_play_mode());
 			break;
-		}
-		case GMU_VOLUME_CHANGE: {
-			r = snprintf(
-				msg,
-				MSG_MAX_LEN,
-				"{ \"cmd\": \"volume_info\", \"volume\" : %d }",
-				gmu_core_get_volume()
-			);
-			if (r < MSG_MAX_LEN && r > 0) httpd_send_websocket_broadcast(msg);
+		case GMU_VOLUME_CHANGE:
+			json_writer_string(&jw, "cmd", "volume_info");
+			json_writer_integer(&jw, "volume", gmu_core_get_volume());
+			break;
+		case GMU_AUDIO_BUFFER_UNDERRUN: {
+			AudioBufferStats stats;
+
+			gmu_core_get_audio_buffer_stats(&stats);
+			json_writer_string(&jw, "cmd", "audio_buffer_info");
+			json_writer_unsigned(&jw, "underruns", stats.underruns);
+			json_writer_unsigned(&jw, "underrun_bytes", stats.underrun_bytes);
+			json_writer_unsigned(&jw, "resizes", stats.resizes);
+			json_writer_integer(&jw, "buffer_time_ms", stats.buffer_time_ms);
 			break;
 		}
-		default:
+		default: /* Including GMU_QUIT */
+			send = 0;
 			break;
 	}
+	json_writer_object_end(&jw);
+	if (send) httpd_send_websocket_broadcast(json_writer_get_string(&jw));
 	return 0;
 }
 
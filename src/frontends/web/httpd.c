@@ -6,6 +6,10 @@
  * File: httpd.c  Created: 111209
  *
  * Description: Simple (single-threaded) HTTP server (with websocket support)
+ *
+ * The server runs an edge-triggered epoll reactor. Idle HTTP connections
+ * are closed through a timer wheel, and broadcast messages wake up the
+ * reactor through a pipe signaled by the broadcast queue.
  */
 #include <unistd.h>
 #include <stdio.h>
@@ -21,6 +25,9 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include "util.h"
 #include "base64.h"
@@ -36,7 +43,7 @@
 #include "dir.h"
 #include "trackinfo.h"
 #include "wejconfig.h"
-#include "charset.h"
+#include "assetcache.h"
 #include <assert.h>
 
 #define OKAY 0
@@ -52,13 +59,15 @@
  * 505 HTTP Version not supported
  */
 
-static Queue queue;
-static char  webserver_root[256];
+static Queue  queue;
+static char   webserver_root[256];
+static size_t max_connections = MAX_CONNECTIONS;
 
 static const char *http_status[] = {
 	"100", "Continue",
 	"101", "Switching Protocols",
 	"200", "OK",
+	"304", "Not Modified",
 	"400", "Bad Request",
 	"404", "Not Found",
 	"403", "Forbidden",
@@ -144,19 +153,86 @@ static const char *get_next_key_value_pair(
 
 static int server_running = 0;
 
+/* Determines the message kind from the message's "cmd" value */
+static MessageKind get_message_kind(const char *str)
+{
+	static const struct { const char *cmd; MessageKind kind; } kinds[] = {
+		{ "playback_time", MSG_PLAYBACK_TIME },
+		{ "volume_info",   MSG_VOLUME_INFO },
+		{ "trackinfo",     MSG_TRACKINFO },
+		{ NULL,            MSG_OTHER }
+	};
+	const char *cmd = strstr(str, "\"cmd\"");
+	MessageKind res = MSG_OTHER;
+
+	if (cmd) {
+		size_t i;
+
+		for (cmd += 5; *cmd == ' ' || *cmd == ':'; cmd++);
+		if (*cmd == '"') {
+			cmd++;
+			for (i = 0; kinds[i].cmd; i++) {
+				size_t len = strlen(kinds[i].cmd);
+				if (strncmp(cmd, kinds[i].cmd, len) == 0 && cmd[len] == '"') {
+					res = kinds[i].kind;
+					break;
+				}
+			}
+		}
+	}
+	return res;
+}
+
+static WebSocketFrame *websocket_frame_new(const char *str)
+{
+	WebSocketFrame *f = malloc(sizeof(WebSocketFrame));
+
+	if (f) {
+		f->data = websocket_frame_alloc(str, 0, &(f->len));
+		if (f->data) {
+			f->refcount = 1;
+			f->kind = get_message_kind(str);
+		} else {
+			free(f);
+			f = NULL;
+		}
+	}
+	return f;
+}
+
+static void websocket_frame_unref(WebSocketFrame *f)
+{
+	if (--f->refcount == 0) {
+		free(f->data);
+		free(f);
+	}
+}
+
+/*
+ * Queues a message on the connection. The data is sent by the event loop
+ * once the current event has been handled.
+ */
 static int websocket_send_string(Connection *c, const char *str)
 {
 	int res = 0;
 	if (str && c->fd) {
-		res = websocket_send_str(c->fd, str, 0);
-		if (res)
-			connection_reset_timeout(c);
-		else
+		WebSocketFrame *f = websocket_frame_new(str);
+		if (f) {
+			res = connection_queue_frame(c, f);
+			websocket_frame_unref(f);
+		} else {
 			c->state = CON_ERROR;
+		}
 	}
 	return res;
 }
 
+/* Sends the message built with the connection's JSON writer */
+static int websocket_send_json(Connection *c)
+{
+	return websocket_send_string(c, json_writer_get_string(&(c->json_out)));
+}
+
 /**
  * Initializes a new connection with a given file descriptor fd and
  * attaches the connection before the connection supplied with 'prev'
@@ -175,6 +251,9 @@ Connection *connection_init(int fd, const char *client_ip, Connection *prev)
 		c->fd = fd;
 		c->http_request_header = NULL;
 		c->authentication_okay = 0;
+		c->timer_slot = -1;
+		c->local_fd = -1;
+		json_writer_init(&(c->json_out));
 		c->next = prev ? prev : NULL;
 		c->prev = prev ? prev->prev : NULL;
 		if (client_ip) {
@@ -216,6 +295,15 @@ void connection_close(Connection *c)
 		free(c->http_request_header);
 		c->http_request_header = NULL;
 	}
+	connection_file_close(c);
+	if (c->out_buf) free(c->out_buf);
+	json_writer_free(&(c->json_out));
+	while (c->ws_out_first) {
+		OutgoingFrame *of = c->ws_out_first;
+		c->ws_out_first = of->next;
+		websocket_frame_unref(of->frame);
+		free(of);
+	}
 	ringbuffer_free(&(c->rb_receive));
 	if (c->prev) c->prev->next = c->next;
 	if (c->next) c->next->prev = c->prev;
@@ -255,38 +343,39 @@ int connection_is_authenticated(Connection *c)
 
 int connection_file_is_open(Connection *c)
 {
-	return (c->local_file ? 1 : 0);
+	return (c->local_fd >= 0 ? 1 : 0);
 }
 
 int connection_file_open(Connection *c, const char *filename)
 {
 	struct stat fst;
-	if (c->local_file) fclose(c->local_file);
-	c->total_size = 0;
-	c->local_file = NULL;
-	if (stat(filename, &fst) == 0) {
-		if (S_ISREG(fst.st_mode)) {
+
+	connection_file_close(c);
+	c->local_fd = open(filename, O_RDONLY);
+	if (c->local_fd >= 0) {
+		if (fstat(c->local_fd, &fst) == 0 && S_ISREG(fst.st_mode)) {
 			wdprintf(
 				V_DEBUG,
 				"httpd", "Connection: Opening file %s (%zd bytes)...\n",
 				filename,
 				fst.st_size
 			);
-			c->local_file = fopen(filename, "r");
 			c->total_size = fst.st_size;
+		} else {
+			connection_file_close(c);
 		}
 	}
+	c->file_offset = 0;
 	c->remaining_bytes_to_send = c->total_size;
-	return (c->local_file ? 1 : 0);
+	return connection_file_is_open(c);
 }
 
 void connection_file_close(Connection *c)
 {
-	if (c->local_file) {
-		fclose(c->local_file);
-		c->total_size = 0;
-		c->local_file = NULL;
-	}
+	if (c->local_fd >= 0) close(c->local_fd);
+	c->local_fd = -1;
+	c->total_size = 0;
+	c->remaining_bytes_to_send = 0;
 }
 
 int connection_get_number_of_bytes_to_send(Connection *c)
@@ -294,41 +383,151 @@ int connection_get_number_of_bytes_to_send(Connection *c)
 	return c->remaining_bytes_to_send;
 }
 
-int connection_file_read_chunk(Connection *c)
+int connection_queue_data(Connection *c, const void *data, size_t len)
 {
-	if (c->local_file) {
-		char blob[CHUNK_SIZE];
-		if (c->fd && c->local_file && c->remaining_bytes_to_send > 0) {
-			size_t size = CHUNK_SIZE;
-			size_t actual_size;
+	if (c->out_len + len > c->out_size) {
+		size_t size = c->out_size ? c->out_size : 1024;
+		char  *tmp;
+
+		while (size < c->out_len + len) size *= 2;
+		tmp = realloc(c->out_buf, size);
+		if (!tmp) return 0;
+		c->out_buf = tmp;
+		c->out_size = size;
+	}
+	memcpy(c->out_buf + c->out_len, data, len);
+	c->out_len += len;
+	return 1;
+}
 
-			if (c->remaining_bytes_to_send < CHUNK_SIZE) size = c->remaining_bytes_to_send;
-			wdprintf(V_DEBUG, "httpd", "Connection %d: Reading chunk of data: %d bytes\n", c->fd, size);
-			actual_size = fread(blob, 1, size, c->local_file);
-			if (actual_size > 0) {
-				if (!net_send_block(c->fd, (unsigned char *)blob, actual_size))
-					connection_set_state(c, CON_ERROR);
-				c->remaining_bytes_to_send -= actual_size;
-			} else { /* Reading from file returned no data */
-				c->remaining_bytes_to_send = 0;
+int connection_send_pending_data(Connection *c)
+{
+	ssize_t len = -1;
+	int     res = 0;
+
+	errno = 0;
+	if (c->out_pos < c->out_len) {
+		/* Let the kernel merge the header with the beginning of the file */
+		int flags = c->remaining_bytes_to_send > 0 ? MSG_MORE : 0;
+
+		len = send(c->fd, c->out_buf + c->out_pos, c->out_len - c->out_pos, flags);
+		if (len > 0) {
+			c->out_pos += len;
+			if (c->out_pos == c->out_len) c->out_pos = c->out_len = 0;
+		}
+	} else if (c->local_fd >= 0 && c->remaining_bytes_to_send > 0) {
+		len = sendfile(c->fd, c->local_fd, &(c->file_offset), c->remaining_bytes_to_send);
+		if (len > 0)
+			c->remaining_bytes_to_send -= len;
+		else if (len == 0) /* File got shorter */
+			c->remaining_bytes_to_send = 0;
+	} else {
+		len = 0;
+	}
+	if (len > 0) {
+		connection_reset_timeout(c);
+		res = 1;
+	} else if (len < 0 && errno == EINTR) {
+		res = 1;
+	} else if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+		wdprintf(V_DEBUG, "httpd", "Connection %d: Sending failed: %s\n", c->fd, strerror(errno));
+		connection_set_state(c, CON_ERROR);
+	}
+	/* If all data has been sent, set connection state to HTTP_IDLE and close file */
+	if (c->state != CON_ERROR && c->out_len == 0 && c->remaining_bytes_to_send == 0) {
+		connection_file_close(c);
+		if (c->state == CON_HTTP_BUSY) connection_set_state(c, CON_HTTP_IDLE);
+		res = 0;
+	}
+	return res;
+}
+
+int connection_queue_frame(Connection *c, WebSocketFrame *f)
+{
+	OutgoingFrame *of, *prev = NULL;
+
+	/* Long replies (e.g. search results) are passed on to the socket early */
+	if (c->ws_out_bytes > WEBSOCKET_OUT_SOFT_LIMIT && connection_get_state(c) != CON_ERROR)
+		while (connection_send_frames(c));
+	if (f->kind != MSG_OTHER) {
+		/* Latest wins: Drop a queued message of the same kind, unless it is partially sent */
+		for (of = c->ws_out_first; of; prev = of, of = of->next) {
+			if (of->frame->kind == f->kind && !(of == c->ws_out_first && c->ws_out_pos > 0)) {
+				if (prev) prev->next = of->next; else c->ws_out_first = of->next;
+				if (c->ws_out_last == of) c->ws_out_last = prev;
+				c->ws_out_bytes -= of->frame->len;
+				websocket_frame_unref(of->frame);
+				free(of);
+				break;
 			}
-			c->connection_time = time(NULL);
-		} else {
-			connection_set_state(c, CON_HTTP_IDLE);
-			if (c->local_file) fclose(c->local_file);
-			c->local_file = NULL;
 		}
-		/* If eof, set connection state to HTTP_IDLE and close file, 
-		 * set local_file to NULL */
-		if (c->local_file && feof(c->local_file)) {
-			fclose(c->local_file);
-			c->local_file = NULL;
-			connection_set_state(c, CON_HTTP_IDLE);
+		/* The next update is due in a second anyway */
+		if (f->kind == MSG_PLAYBACK_TIME && c->ws_out_bytes > WEBSOCKET_OUT_SOFT_LIMIT)
+			return 1;
+	}
+	if (c->ws_out_bytes + f->len > WEBSOCKET_OUT_MAX) {
+		wdprintf(V_WARNING, "httpd", "Client %d does not keep up. Disconnecting.\n", c->fd);
+		connection_set_state(c, CON_ERROR);
+		return 0;
+	}
+	of = malloc(sizeof(OutgoingFrame));
+	if (!of) {
+		connection_set_state(c, CON_ERROR);
+		return 0;
+	}
+	f->refcount++;
+	of->frame = f;
+	of->next = NULL;
+	if (c->ws_out_last)
+		c->ws_out_last->next = of;
+	else
+		c->ws_out_first = of;
+	c->ws_out_last = of;
+	c->ws_out_bytes += f->len;
+	return 1;
+}
+
+#define IOV_MAX_FRAMES 32
+
+int connection_send_frames(Connection *c)
+{
+	struct iovec   iov[IOV_MAX_FRAMES];
+	OutgoingFrame *of;
+	int            n = 0, res = 0;
+	ssize_t        len;
+
+	/* The rest of the handshake response goes out before any frame */
+	if (c->out_len > 0) {
+		res = connection_send_pending_data(c);
+		if (c->out_len > 0) return res;
+	}
+	for (of = c->ws_out_first; of && n < IOV_MAX_FRAMES; of = of->next, n++) {
+		iov[n].iov_base = of->frame->data + (n == 0 ? c->ws_out_pos : 0);
+		iov[n].iov_len  = of->frame->len - (n == 0 ? c->ws_out_pos : 0);
+	}
+	if (n == 0) return 0;
+	len = writev(c->fd, iov, n);
+	if (len > 0) {
+		c->ws_out_bytes -= len;
+		len += c->ws_out_pos;
+		/* Release completely sent frames */
+		while (c->ws_out_first && (size_t)len >= c->ws_out_first->frame->len) {
+			of = c->ws_out_first;
+			len -= of->frame->len;
+			c->ws_out_first = of->next;
+			websocket_frame_unref(of->frame);
+			free(of);
 		}
-	} else {
-		wdprintf(V_DEBUG, "httpd", "Connection: ERROR, file handle invalid.\n");
+		if (!c->ws_out_first) c->ws_out_last = NULL;
+		c->ws_out_pos = len;
+		res = c->ws_out_first ? 1 : 0;
+	} else if (len < 0 && errno == EINTR) {
+		res = 1;
+	} else if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+		wdprintf(V_DEBUG, "httpd", "Connection %d: Sending failed: %s\n", c->fd, strerror(errno));
+		connection_set_state(c, CON_ERROR);
 	}
-	return 0;
+	return res;
 }
 
 /* Returns true if connection originates from localhost */
@@ -366,15 +565,22 @@ int connection_authenticate(Connection *c, const char *password)
 	return c->authentication_okay;
 }
 
+/*
+ * Queues the response header. The Content-Length is omitted for 304
+ * responses, etag, content_type and content_encoding are optional.
+ */
 static void send_http_header(
-	int         soc,
+	Connection *c,
 	const char *code,
 	size_t      length,
 	time_t     *time_modified,
-	const char *content_type
+	const char *etag,
+	const char *content_type,
+	const char *content_encoding
 )
 {
-	char        msg[255] = {0};
+	char        msg[1024];
+	size_t      pos;
 	struct tm  *ptm = NULL;
 	time_t      stime;
 	const char *code_text = "";
@@ -386,27 +592,34 @@ static void send_http_header(
 			break;
 		}
 	}
-	snprintf(msg, 254, "HTTP/1.1 %s %s\r\n", code, code_text);
-	net_send_buf(soc, msg);
+	snprintf(msg, 255, "HTTP/1.1 %s %s\r\n", code, code_text);
+	pos = strlen(msg);
 	stime = time(NULL);
 	ptm = gmtime(&stime);
-	strftime(msg, 255, "Date: %a, %d %b %Y %H:%M:%S %Z\r\n", ptm);
-	net_send_buf(soc, msg);
-	net_send_buf(soc, "Server: Gmu http server\r\n");
+	pos += strftime(msg+pos, 255, "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", ptm);
+	pos += snprintf(msg+pos, 255, "Server: Gmu http server\r\n");
 
 	if (time_modified != NULL) {
 		struct tm *tm_modified = gmtime(time_modified);
-		strftime(msg, 255, "Last-Modified: %a, %d %b %Y %H:%M:%S %Z\r\n", tm_modified);
-		net_send_buf(soc, msg);
+		pos += strftime(msg+pos, 255, "Last-Modified: %a, %d %b %Y %H:%M:%S GMT\r\n", tm_modified);
+	}
+	if (etag) {
+		/* Clients have to revalidate, which is cheap thanks to the ETag */
+		pos += snprintf(msg+pos, 255, "ETag: %s\r\nCache-Control: no-cache\r\n", etag);
+		pos += snprintf(msg+pos, 255, "Vary: Accept-Encoding\r\n");
 	}
 
-	net_send_buf(soc, "Accept-Ranges: none\r\n");
-	snprintf(msg, 254, "Content-Length: %zd\r\n", length);
-	net_send_buf(soc, msg);
+	pos += snprintf(msg+pos, 255, "Accept-Ranges: none\r\n");
+	if (strcmp(code, "304") != 0)
+		pos += snprintf(msg+pos, 255, "Content-Length: %zd\r\n", length);
 	/*send_buf(soc, "Connection: close\r\n");*/
-	snprintf(msg, 254, "Content-Type: %s\r\n", content_type);
-	net_send_buf(soc, msg);
-	net_send_buf(soc, "\r\n");
+	if (content_type)
+		pos += snprintf(msg+pos, 255, "Content-Type: %s\r\n", content_type);
+	if (content_encoding)
+		pos += snprintf(msg+pos, 255, "Content-Encoding: %s\r\n", content_encoding);
+	pos += snprintf(msg+pos, 255, "\r\n");
+	if (!connection_queue_data(c, msg, pos))
+		connection_set_state(c, CON_ERROR);
 }
 
 static void webserver_main_loop(int listen_fd);
@@ -422,15 +635,18 @@ void *httpd_run_server(void *data)
 		strncpy(webserver_root, ip->webserver_root, 255);
 	else
 		webserver_root[0] = '\0';
-	if (ip)
+	if (ip) {
 		local_only = ip->local_only;
-	else
+		if (ip->max_connections > 0) max_connections = ip->max_connections;
+	} else {
 		wdprintf(V_WARNING, "httpd", "Warning: Init params missing!\n");
+	}
 	queue_init(&queue);
 	wdprintf(V_INFO, "httpd", "Starting server on port %d.\n", port);
 	wdprintf(V_INFO, "httpd", "Listening on %s.\n",
 	         local_only ? "LOCAL interface only" : "ALL available interfaces");
 	wdprintf(V_INFO, "httpd", "Webserver root directory: %s\n", webserver_root);
+	wdprintf(V_INFO, "httpd", "Maximum number of connections: %d\n", (int)max_connections);
 	if (ip) free(ip);
 	server_running = 1;
 	do {
@@ -477,8 +693,11 @@ static int tcp_server_init(unsigned port, int local_only)
 			} else {
 				struct addrinfo *r;
 				for (r = res; r != NULL; r = r->ai_next) {
-					listen_fd = socket(r->ai_family, r->ai_socktype, r->ai_protocol);
-					if (listen_fd != -1) {
+					int fd = socket(r->ai_family, r->ai_socktype, r->ai_protocol);
+					if (fd != -1) {
+						close(listen_fd);
+						listen_fd = fd;
+						setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
 						ret = bind(listen_fd, r->ai_addr, r->ai_addrlen);
 						break;
 					} else {
@@ -489,7 +708,7 @@ static int tcp_server_init(unsigned port, int local_only)
 			}
 
 			if (ret == 0) {
-				ret = listen(listen_fd, 5);
+				ret = listen(listen_fd, SOMAXCONN);
 				if (ret < 0) listen_fd = ERROR;
 			} else {
 				listen_fd = ERROR;
@@ -546,29 +765,6 @@ static Connection tcp_server_client_init(int listen_fd)
 	return conn;
 }
 
-/**
- * Write to client socket
- * Returns OKAY when the message could be written completely, ERROR otherwise
- */
-static int tcp_server_write(int fd, const char buf[], size_t buflen)
-{
-	return write(fd, buf, buflen) == buflen ? OKAY : ERROR;
-}
-
-/**
- * Read from client socket
- * Returns OKAY when reading was successful, ERROR otherwise
- */
-static int tcp_server_read(int fd, char buf[], ssize_t *buflen)
-{
-	int res = OKAY;
-	*buflen = read(fd, buf, *buflen);
-	if (*buflen <= 0) { /* End of TCP connection */
-		res = ERROR; /* Connection fd should be closed */
-	}
-	return res;
-}
-
 static int is_valid_resource(const char *str)
 {
 	int    res = 1;
@@ -600,23 +796,23 @@ static HTTPCommand get_command(const char *str)
 	return cmd;
 }
 
-static void http_response_bad_request(int fd, int head_only)
+static void http_response_bad_request(Connection *c, int head_only)
 {
 	const char *str = "<h1>400 Bad Request</h1>";
 	size_t      body_len = strlen(str);
-	send_http_header(fd, "400", body_len, NULL, "text/html");
-	if (!head_only) tcp_server_write(fd, str, body_len);
+	send_http_header(c, "400", body_len, NULL, NULL, "text/html", NULL);
+	if (!head_only) connection_queue_data(c, str, body_len);
 }
 
-static void http_response_not_found(int fd, int head_only)
+static void http_response_not_found(Connection *c, int head_only)
 {
 	const char *str = "<h1>404 File not found</h1>";
 	size_t      body_len = strlen(str);
-	send_http_header(fd, "404", body_len, NULL, "text/html");
-	if (!head_only) tcp_server_write(fd, str, body_len);
+	send_http_header(c, "404", body_len, NULL, NULL, "text/html", NULL);
+	if (!head_only) connection_queue_data(c, str, body_len);
 }
 
-static void http_response_not_implemented(int fd)
+static void http_response_not_implemented(Connection *c)
 {
 		const char *str =
 			"<html><head><title>501 Not implemented</title></head>\n"
@@ -624,8 +820,63 @@ static void http_response_not_implemented(int fd)
 			"<p><hr /><i>Gmu http server</i></p>\n</body>\n"
 			"</html>\r\n\r\n";
 		size_t      body_len = strlen(str);
-		send_http_header(fd, "501", body_len, NULL, "text/html");
-		tcp_server_write(fd, str, body_len);
+		send_http_header(c, "501", body_len, NULL, NULL, "text/html", NULL);
+		connection_queue_data(c, str, body_len);
+}
+
+/*
+ * Responds with the file 'filename'. A pre-compressed variant
+ * (filename.gz) is used instead, if the client accepts gzip encoding and
+ * the variant is not older than the file. Small files are served from
+ * the asset cache, larger ones are sent with sendfile().
+ */
+static void http_response_file(
+	Connection  *c,
+	const char  *filename,
+	struct stat *st,
+	int          head_only,
+	int          accept_gzip,
+	const char  *if_none_match
+)
+{
+	char         gz_filename[520], etag[64];
+	struct stat  gz_st;
+	const char  *content_type = get_mime_type(filename);
+	const char  *content_encoding = NULL;
+	const Asset *asset = NULL;
+
+	snprintf(gz_filename, sizeof(gz_filename), "%s.gz", filename);
+	if (accept_gzip && stat(gz_filename, &gz_st) == 0 && S_ISREG(gz_st.st_mode) &&
+	    gz_st.st_mtime >= st->st_mtime) {
+		filename = gz_filename;
+		st = &gz_st;
+		content_encoding = "gzip";
+	}
+	snprintf(
+		etag,
+		sizeof(etag),
+		"\"%lx-%lx%s\"",
+		(unsigned long)st->st_size,
+		(unsigned long)st->st_mtime,
+		content_encoding ? "-gz" : ""
+	);
+	/* Weak comparison is fine for If-None-Match, thus W/"..." matches as well */
+	if (if_none_match && (strstr(if_none_match, etag) || strcmp(if_none_match, "*") == 0)) {
+		wdprintf(V_DEBUG, "httpd", "%04d %s not modified.\n", c->fd, filename);
+		send_http_header(c, "304", 0, &(st->st_mtime), etag, NULL, NULL);
+	} else if (!head_only && !(asset = assetcache_get(filename, st)) && !connection_file_open(c, filename)) {
+		http_response_not_found(c, head_only);
+	} else {
+		size_t size = (size_t)st->st_size;
+
+		if (asset)
+			size = asset->size;
+		else if (connection_file_is_open(c))
+			size = c->total_size;
+
+		send_http_header(c, "200", size, &(st->st_mtime), etag, content_type, content_encoding);
+		if (asset) connection_queue_data(c, asset->data, asset->size);
+	}
 }
 
 static int process_command(int rfd, Connection *c)
@@ -633,6 +884,8 @@ static int process_command(int rfd, Connection *c)
 	const char *command = NULL, *resource = NULL;
 	const char *http_version = NULL, *options = NULL;
 	char       *host = NULL, websocket_key[32] = "";
+	char       *if_none_match = NULL;
+	int         accept_gzip = 0;
 
 	if (c->http_request_header) {
 		size_t len = strlen(c->http_request_header);
@@ -710,6 +963,12 @@ static int process_command(int rfd, Connection *c)
 					}
 					if (strcasecmp(key, "Sec-WebSocket-Version") == 0 && value[0]) 
 						websocket_version = atoi(value);
+					if (strcasecmp(key, "Accept-Encoding") == 0 && strcasestr(value, "gzip"))
+						accept_gzip = 1;
+					if (strcasecmp(key, "If-None-Match") == 0 && value[0]) {
+						if (if_none_match) free(if_none_match);
+						if_none_match = strdup(value);
+					}
 				}
 				if (!(key[0])) break;
 			}
@@ -750,66 +1009,64 @@ static int process_command(int rfd, Connection *c)
 							memset(str, 0, 127);
 							base64_encode_data((unsigned char *)digest, 20, str, 30);
 							wdprintf(V_DEBUG, "httpd", "Calculated base 64 response value: '%s'\n", str);
-							/* 2) Send 101 response with appropriate data */
-							net_send_buf(rfd, "HTTP/1.1 101 Switching Protocols\r\n");
-							net_send_buf(rfd, "Server: Gmu http server\r\n");
-							net_send_buf(rfd, "Upgrade: websocket\r\n");
-							net_send_buf(rfd, "Connection: Upgrade\r\n");
-							snprintf(str2, 255, "Sec-WebSocket-Accept: %s\r\n", str);
-							wdprintf(V_DEBUG, "httpd", str2);
-							net_send_buf(rfd, str2);
-							net_send_buf(rfd, "\r\n");
-							/* 3) Set flags in connection struct to WebSocket */
-							connection_set_state(c, CON_WEBSOCKET_OPEN);
-							gmu_core_config_acquire_lock();
-							hellostr = cfg_get_boolean_value(cf, "gmuhttp.DisableLocalPassword") ?
-								"{ \"cmd\": \"hello\", \"need_password\": \"no\" }" :
-								"{ \"cmd\": \"hello\", \"need_password\": \"yes\" }";
-							gmu_core_config_release_lock();
-							websocket_send_string(c, hellostr);
+							/* 2) Queue 101 response with appropriate data */
+							snprintf(str2, 255,
+							         "HTTP/1.1 101 Switching Protocols\r\n"
+							         "Server: Gmu http server\r\n"
+							         "Upgrade: websocket\r\n"
+							         "Connection: Upgrade\r\n"
+							         "Sec-WebSocket-Accept: %s\r\n\r\n", str);
+							str2[255] = '\0';
+							wdprintf(V_DEBUG, "httpd", "%s", str2);
+							if (!connection_queue_data(c, str2, strlen(str2))) {
+								connection_set_state(c, CON_ERROR);
+							} else {
+								/* 3) Set flags in connection struct to WebSocket */
+								connection_set_state(c, CON_WEBSOCKET_OPEN);
+								gmu_core_config_acquire_lock();
+								hellostr = cfg_get_boolean_value(cf, "gmuhttp.DisableLocalPassword") ?
+									"{ \"cmd\": \"hello\", \"need_password\": \"no\" }" :
+									"{ \"cmd\": \"hello\", \"need_password\": \"yes\" }";
+								gmu_core_config_release_lock();
+								websocket_send_string(c, hellostr);
+							}
 						} else if (!connection_file_is_open(c)) { /* ?? open file (if not open already) ?? */
-							char filename[512] = {0};
+							char        filename[512] = {0};
+							struct stat st;
 
 							snprintf(filename, 511, "%s/htdocs%s", webserver_root, resource);
-							file_okay = connection_file_open(c, filename);
+							file_okay = stat(filename, &st) == 0 && S_ISREG(st.st_mode);
 							if (!file_okay) {
 								snprintf(filename, 511, "%s/htdocs%s/%s", webserver_root, resource, INDEX_FILE);
-								file_okay = connection_file_open(c, filename);
+								file_okay = stat(filename, &st) == 0 && S_ISREG(st.st_mode);
 							}
 							if (file_okay) {
-								int         time_ok = 0;
-								struct stat st;
-
-								if (stat(filename, &st) == 0) time_ok = 1;
-								if (!head_only) connection_set_state(c, CON_HTTP_BUSY);
-								send_http_header(
-									rfd,
-									"200",
-									connection_get_number_of_bytes_to_send(c),
-									time_ok ? &(st.st_ctime) : NULL,
-									get_mime_type(resource)
-								);
-								if (head_only) connection_file_close(c);
+								http_response_file(c, filename, &st, head_only, accept_gzip, if_none_match);
 							} else { /* 404 */
-								http_response_not_found(rfd, head_only);
+								http_response_not_found(c, head_only);
 							}
 						}
 					} else {
-						http_response_bad_request(rfd, head_only);
+						http_response_bad_request(c, head_only);
 					}
 					break;
 				}
 				case POST:
-					http_response_not_implemented(rfd);
+					http_response_not_implemented(c);
 					break;
 				default:
-					http_response_bad_request(rfd, 0);
+					http_response_bad_request(c, 0);
 					break;
 			}
 		} else { /* Invalid resource string */
-			http_response_not_found(rfd, 0);
+			http_response_not_found(c, 0);
 		}
+		/* The response is sent from the event loop as the socket accepts the data */
+		if (connection_get_state(c) != CON_WEBSOCKET_OPEN && connection_get_state(c) != CON_ERROR &&
+		    (c->out_len > 0 || c->remaining_bytes_to_send > 0))
+			connection_set_state(c, CON_HTTP_BUSY);
 
+		if (if_none_match) free(if_none_match);
 		if (host) free(host);
 		if (str) free(str);
 		connection_free_request_header(c);
@@ -825,134 +1082,165 @@ void httpd_send_websocket_broadcast(const char *str)
 	queue_push(&queue, str);
 }
 
-#define MSG_MAX_LEN 1024
-
 void gmu_http_playlist_get_info(Connection *c)
 {
-	char msg[MSG_MAX_LEN];
-	int  r = snprintf(
-		msg,
-		MSG_MAX_LEN,
-		"{ \"cmd\": \"playlist_info\", \"changed_at_position\" : 0, \"length\" : %zd }",
-		gmu_core_playlist_get_length()
-	);
-	if (r < MSG_MAX_LEN && r > 0) websocket_send_string(c, msg);
+	JSON_Writer  *jw = &(c->json_out);
+	size_t        length;
+	unsigned long version;
+
+	gmu_core_playlist_acquire_lock();
+	version = gmu_core_playlist_get_version(&length);
+	gmu_core_playlist_release_lock();
+	json_writer_reset(jw);
+	json_writer_object_begin(jw, NULL);
+	json_writer_string(jw, "cmd", "playlist_info");
+	json_writer_integer(jw, "changed_at_position", 0);
+	json_writer_unsigned(jw, "length", length);
+	json_writer_unsigned(jw, "version", version);
+	json_writer_object_end(jw);
+	websocket_send_json(c);
 }
 
 void gmu_http_playlist_get_item(int id, Connection *c)
 {
-	char   msg[MSG_MAX_LEN], *tmp_title = NULL;
-	Entry *item;
-	int    r;
+	JSON_Writer *jw = &(c->json_out);
+	Entry       *item;
 
+	json_writer_reset(jw);
+	json_writer_object_begin(jw, NULL);
+	json_writer_string(jw, "cmd", "playlist_item");
+	json_writer_integer(jw, "position", id);
 	gmu_core_playlist_acquire_lock();
 	item = gmu_core_playlist_get_entry(id);
-	tmp_title = json_string_escape_alloc(gmu_core_playlist_get_entry_name(item));
+	json_writer_string(jw, "title", item ? gmu_core_playlist_get_entry_name(item) : "??");
 	gmu_core_playlist_release_lock();
-	r = snprintf(
-		msg,
-		MSG_MAX_LEN,
-		"{ \"cmd\": \"playlist_item\", \"position\" : %d, \"title\": \"%s\", \"length\": %d }",
-		id,
-		tmp_title ? tmp_title : "??",
-		0
-	);
-	if (tmp_title) free(tmp_title);
-	if (r > 0 && !charset_is_valid_utf8_string(msg)) {
-		r = snprintf(
-			msg,
-			MSG_MAX_LEN,
-			"{ \"cmd\": \"playlist_item\", \"position\" : %d, \"title\": \"(Invalid UTF-8)\", \"length\": %d }",
-			id,
-			0
-		);
+	json_writer_integer(jw, "length", 0);
+	json_writer_object_end(jw);
+	websocket_send_json(c);
+}
+
+/* Maximum number of entries sent in reply to a single range request */
+#define PLAYLIST_RANGE_MAX   1000
+/* Range replies are split into frames of about this size */
+#define PLAYLIST_RANGE_BATCH 16384
+
+/*
+ * Sends up to 'count' playlist entry titles starting at 'offset'. If the
+ * client passes the playlist version its data is from ('since'), only
+ * entries from the first position changed since then are sent. The
+ * entries are sent in batches, each carrying a "next" position and the
+ * last one having "last" set to 1.
+ */
+void gmu_http_playlist_get_range(Connection *c, size_t offset, size_t count, unsigned long since)
+{
+	JSON_Writer  *jw = &(c->json_out);
+	Entry        *item;
+	size_t        length, pos, end;
+	unsigned long version;
+
+	if (count > PLAYLIST_RANGE_MAX) count = PLAYLIST_RANGE_MAX;
+	gmu_core_playlist_acquire_lock();
+	version = gmu_core_playlist_get_version(&length);
+	if (since > 0) {
+		size_t changed = gmu_core_playlist_get_changed_since(since);
+		if (changed > offset) offset = changed;
 	}
-	if (r < MSG_MAX_LEN && r > 0) websocket_send_string(c, msg);
+	if (offset > length) offset = length;
+	end = length - offset > count ? offset + count : length;
+	item = offset < end ? gmu_core_playlist_get_entry(offset) : NULL;
+	pos = offset;
+	do {
+		char key[24];
+
+		json_writer_reset(jw);
+		json_writer_object_begin(jw, NULL);
+		json_writer_string(jw, "cmd", "playlist_range");
+		json_writer_unsigned(jw, "version", version);
+		json_writer_unsigned(jw, "length", length);
+		json_writer_unsigned(jw, "offset", pos);
+		json_writer_object_begin(jw, "items");
+		for (; pos < end && item && json_writer_get_length(jw) < PLAYLIST_RANGE_BATCH; pos++) {
+			snprintf(key, sizeof(key), "%zd", pos);
+			json_writer_string(jw, key, gmu_core_playlist_get_entry_name(item));
+			item = gmu_core_playlist_get_next(item);
+		}
+		json_writer_object_end(jw);
+		json_writer_unsigned(jw, "next", pos);
+		json_writer_integer(jw, "last", pos >= end || !item);
+		json_writer_object_end(jw);
+	} while (websocket_send_json(c) && pos < end && item);
+	gmu_core_playlist_release_lock();
 }
 
 void gmu_http_get_current_trackinfo(Connection *c)
 {
-	int        r = 0;
-	char       msg[MSG_MAX_LEN];
-	TrackInfo *ti = gmu_core_get_current_trackinfo_ref();
+	JSON_Writer *jw = &(c->json_out);
+	TrackInfo   *ti = gmu_core_get_current_trackinfo_ref();
 
 	if (trackinfo_acquire_lock(ti)) {
-		char *ti_artist = json_string_escape_alloc(trackinfo_get_artist(ti));
-		char *ti_title  = json_string_escape_alloc(trackinfo_get_title(ti));
-		char *ti_album  = json_string_escape_alloc(trackinfo_get_album(ti));
-		char *ti_date   = json_string_escape_alloc(trackinfo_get_date(ti));
-		r = snprintf(
-			msg,
-			MSG_MAX_LEN,
-			"{ \"cmd\": \"trackinfo\", \"artist\": \"%s\", \"title\": \"%s\", " \
-			"\"album\": \"%s\", \"date\": \"%s\", " \
-			"\"length_min\": %d, \"length_sec\": %d, \"pl_pos\": %d  }",
-			ti_artist ? ti_artist : "",
-			ti_title  ? ti_title  : "",
-			ti_album  ? ti_album  : "",
-			ti_date   ? ti_date   : "",
-			trackinfo_get_length_minutes(ti),
-			trackinfo_get_length_seconds(ti),
-			0
-		);
-		if (ti_artist) free(ti_artist);
-		if (ti_title)  free(ti_title);
-		if (ti_album)  free(ti_album);
-		if (ti_date)   free(ti_date);
-		if (r > 0 && !charset_is_valid_utf8_string(msg)) {
-			snprintf(
-				msg,
-				MSG_MAX_LEN,
-				"{ \"cmd\": \"trackinfo\", \"artist\": \"(Invalid UTF-8)\", " \
-				"\"title\": \"(Invalid UTF-8)\", \"album\": \"(Invalid UTF-8)\", " \
-				"\"date\": \"(Invalid UTF-8)\", " \
-				"\"length_min\": %d, \"length_sec\": %d, \"pl_pos\": %d  }",
-				trackinfo_get_length_minutes(ti),
-				trackinfo_get_length_seconds(ti),
-				0
-			);
-		}
+		json_writer_reset(jw);
+		json_writer_object_begin(jw, NULL);
+		json_writer_string(jw, "cmd", "trackinfo");
+		json_writer_string(jw, "artist", trackinfo_get_artist(ti));
+		json_writer_string(jw, "title", trackinfo_get_title(ti));
+		json_writer_string(jw, "album", trackinfo_get_album(ti));
+		json_writer_string(jw, "date", trackinfo_get_date(ti));
+		json_writer_integer(jw, "length_min", trackinfo_get_length_minutes(ti));
+		json_writer_integer(jw, "length_sec", trackinfo_get_length_seconds(ti));
+		json_writer_integer(jw, "pl_pos", 0);
+		json_writer_object_end(jw);
 		trackinfo_release_lock(ti);
+		websocket_send_json(c);
 	}
-	if (r < MSG_MAX_LEN && r > 0) websocket_send_string(c, msg);
 }
 
 void gmu_http_playmode_get_info(Connection *c)
 {
-	char msg[MSG_MAX_LEN];
-	int  r = snprintf(msg, MSG_MAX_LEN,
-	                  "{ \"cmd\": \"playmode_info\", \"mode\" : %d }",
-	                  gmu_core_playlist_get_play_mode());
-	if (r < MSG_MAX_LEN && r > 0) httpd_send_websocket_broadcast(msg);
+	JSON_Writer *jw = &(c->json_out);
+
+	json_writer_reset(jw);
+	json_writer_object_begin(jw, NULL);
+	json_writer_string(jw, "cmd", "playmode_info");
+	json_writer_integer(jw, "mode", gmu_core_playlist_get_play_mode());
+	json_writer_object_end(jw);
+	httpd_send_websocket_broadcast(json_writer_get_string(jw));
 }
 
 void gmu_http_send_initial_information(Connection *c)
 {
-	char msg[MSG_MAX_LEN];
-	int  r = snprintf(
-		msg,
-		MSG_MAX_LEN,
-		"{ \"cmd\": \"playlist_change\", \"changed_at_position\" : 0, \"length\" : %zd }",
-		gmu_core_playlist_get_length()
-	);
-	if (r < MSG_MAX_LEN && r > 0) websocket_send_string(c, msg);
-	r = snprintf(
-		msg,
-		MSG_MAX_LEN,
-		"{ \"cmd\": \"playback_state\", \"state\" : %d }",
-		gmu_core_get_status()
-	);
-	if (r < MSG_MAX_LEN && r > 0) websocket_send_string(c, msg);
-	r = snprintf(
-		msg,
-		MSG_MAX_LEN,
-		"{ \"cmd\": \"volume_info\", \"volume\" : %d }",
-		gmu_core_get_volume()
-	);
-	if (r < MSG_MAX_LEN && r > 0) httpd_send_websocket_broadcast(msg);
+	JSON_Writer  *jw = &(c->json_out);
+	size_t        length;
+	unsigned long version;
+
+	gmu_core_playlist_acquire_lock();
+	version = gmu_core_playlist_get_version(&length);
+	gmu_core_playlist_release_lock();
+	json_writer_reset(jw);
+	json_writer_object_begin(jw, NULL);
+	json_writer_string(jw, "cmd", "playlist_change");
+	json_writer_integer(jw, "changed_at_position", 0);
+	json_writer_unsigned(jw, "length", length);
+	json_writer_unsigned(jw, "version", version);
+	json_writer_object_end(jw);
+	websocket_send_json(c);
+
+	json_writer_reset(jw);
+	json_writer_object_begin(jw, NULL);
+	json_writer_string(jw, "cmd", "playback_state");
+	json_writer_integer(jw, "state", gmu_core_get_status());
+	json_writer_object_end(jw);
+	websocket_send_json(c);
+
+	json_writer_reset(jw);
+	json_writer_object_begin(jw, NULL);
+	json_writer_string(jw, "cmd", "volume_info");
+	json_writer_integer(jw, "volume", gmu_core_get_volume());
+	json_writer_object_end(jw);
+	httpd_send_websocket_broadcast(json_writer_get_string(jw));
 }
 
-#define MAX_LEN 32768
+/* Directory listings are split into messages of about this size */
+#define DIR_READ_BATCH 16384
 
 static void gmu_http_read_dir(const char *directory, Connection *c)
 {
@@ -976,58 +1264,37 @@ static void gmu_http_read_dir(const char *directory, Connection *c)
 	dir_set_ext_filter(dir, gmu_core_get_file_extensions(), 1);
 
 	if (dir_read(dir, directory, 1)) {
-		size_t i = 0;
-		int    num_files = dir_get_number_of_files(dir);
-		while (i < num_files) {
-			char   res[MAX_LEN], *jpath = NULL, *spath;
-			size_t pos;
+		JSON_Writer *jw = &(c->json_out);
+		size_t       i = 0;
+		int          num_files = dir_get_number_of_files(dir);
+		char        *spath = dir_get_new_dir_alloc("/", directory);
 
-			spath = dir_get_new_dir_alloc("/", directory);
-			if (spath) {
-				jpath = json_string_escape_alloc(spath);
-				free(spath);
+		while (i < num_files) {
+			char key[24];
+
+			json_writer_reset(jw);
+			json_writer_object_begin(jw, NULL);
+			json_writer_string(jw, "cmd", "dir_read");
+			json_writer_string(jw, "res", "ok");
+			json_writer_string(jw, "path", spath);
+			json_writer_object_begin(jw, "data");
+			for (; i < num_files && json_writer_get_length(jw) < DIR_READ_BATCH; i++) {
+				snprintf(key, sizeof(key), "%zd", i);
+				json_writer_object_begin(jw, key);
+				json_writer_string(jw, "name", dir_get_filename(dir, i));
+				json_writer_integer(jw, "size", dir_get_filesize(dir, i));
+				json_writer_integer(jw, "is_dir", dir_get_flag(dir, i) == DIRECTORY);
+				json_writer_object_end(jw);
 			}
-			if (jpath) {
-				snprintf(
-					res,
-					MAX_LEN,
-					"{ \"cmd\": \"dir_read\", \"res\": \"ok\", \"path\": \"%s\", \"data\": {",
-					jpath
-				);
-				free(jpath);
-				for (pos = strlen(res); i < num_files; i++) {
-					char  *tmp = json_string_escape_alloc(dir_get_filename(dir, i));
-					long   filesize = dir_get_filesize(dir, i);
-					size_t pos_prev = pos;
-
-					if (tmp) {
-						snprintf(
-							res+pos,
-							MAX_LEN-pos,
-							"\"%zd\": { \"name\": \"%s\", \"size\": %ld, \"is_dir\": %d },",
-							i,
-							tmp,
-							filesize,
-							dir_get_flag(dir, i) == DIRECTORY
-						);
-						free(tmp);
-					}
-					pos = strlen(res);
-					if (pos > MAX_LEN - 65) {
-						pos = pos_prev;
-						break;
-					}
-				}
-				snprintf(res+pos, MAX_LEN-pos, "\"-1\": \"END\" } }");
-				wdprintf(V_DEBUG, "httpd", "dir_read result: [%s] size=%d\n", res, pos);
-				if (!charset_is_valid_utf8_string(res))
-					wdprintf(V_DEBUG, "httpd", "Invalid UTF-8 found!!\n", res);
-				else if (!websocket_send_string(c, res))
-					wdprintf(V_DEBUG, "httpd", "Sending websocket message failed! :(\n");
-			} else {
-				websocket_send_string(c, "{ \"cmd\": \"dir_read\", \"res\" : \"error\", \"msg\" : \"Unable to read directory\" }");
+			json_writer_string(jw, "-1", "END");
+			json_writer_object_end(jw);
+			json_writer_object_end(jw);
+			if (!websocket_send_json(c)) {
+				wdprintf(V_DEBUG, "httpd", "Sending websocket message failed! :(\n");
+				break;
 			}
 		}
+		if (spath) free(spath);
 	} else { /* Error condition */
 		websocket_send_string(c, "{ \"cmd\": \"dir_read\", \"res\" : \"error\", \"msg\" : \"Unable to read directory\" }");
 	}
@@ -1039,12 +1306,24 @@ static void gmu_http_ping(Connection *c)
 	websocket_send_string(c, "{\"cmd\":\"pong\"}");
 }
 
-static void gmu_http_medialib_search(Connection *c, const char *type, const char *str)
+static void gmu_http_medialib_search(Connection *c, const char *type, const char *str, int offset, int count)
 {
-	TrackInfo ti;
-	size_t    i = 0;
-	char      rstr[1024];
-	int       res = gmu_core_medialib_search_find(GMU_MLIB_ANY, str);
+	TrackInfo           ti;
+	size_t              i = offset;
+	JSON_Writer        *jw = &(c->json_out);
+	GmuMedialibDataType t = GMU_MLIB_ANY;
+	int                 res;
+
+	switch (atoi(type)) {
+		case GMU_MLIB_ARTIST: t = GMU_MLIB_ARTIST; break;
+		case GMU_MLIB_TITLE:  t = GMU_MLIB_TITLE;  break;
+		case GMU_MLIB_ALBUM:  t = GMU_MLIB_ALBUM;  break;
+		default: break;
+	}
+	if (count > 0)
+		res = gmu_core_medialib_search_find_range(t, str, offset, count);
+	else
+		res = gmu_core_medialib_search_find(t, str);
 
 	websocket_send_string(c, "{ \"cmd\": \"mlib_search_start\" }");
 
@@ -1052,29 +1331,18 @@ static void gmu_http_medialib_search(Connection *c, const char *type, const char
 		for (ti = gmu_core_medialib_search_fetch_next_result();
 			 ti.id >= 0;
 			 ti = gmu_core_medialib_search_fetch_next_result(), i++) {
-			char *artist = json_string_escape_alloc(ti.artist);
-			char *title  = json_string_escape_alloc(ti.title);
-			char *album  = json_string_escape_alloc(ti.album);
-			char *date   = json_string_escape_alloc(ti.date);
-			char *file   = json_string_escape_alloc(ti.file_name);
-			snprintf(
-				rstr,
-				1023,
-				"{\"cmd\":\"mlib_result\", \"pos\":%zd,\"id\":%d,\"artist\":\"%s\",\"title\":\"%s\",\"album\":\"%s\",\"date\":\"%s\",\"file\":\"%s\"}",
-				i,
-				ti.id,
-				artist,
-				title,
-				album,
-				date,
-				file
-			);
-			free(artist);
-			free(title);
-			free(album);
-			free(date);
-			free(file);
-			websocket_send_string(c, rstr);
+			json_writer_reset(jw);
+			json_writer_object_begin(jw, NULL);
+			json_writer_string(jw, "cmd", "mlib_result");
+			json_writer_unsigned(jw, "pos", i);
+			json_writer_integer(jw, "id", ti.id);
+			json_writer_string(jw, "artist", ti.artist);
+			json_writer_string(jw, "title", ti.title);
+			json_writer_string(jw, "album", ti.album);
+			json_writer_string(jw, "date", ti.date);
+			json_writer_string(jw, "file", ti.file_name);
+			json_writer_object_end(jw);
+			websocket_send_json(c);
 		}
 	}
 	gmu_core_medialib_search_finish();
@@ -1085,23 +1353,20 @@ static void gmu_http_medialib_browse_artists(Connection *c)
 {
 	const char  *str = NULL;
 	size_t       i = 0;
-	char         rstr[1024];
+	JSON_Writer *jw = &(c->json_out);
 	int          res = gmu_core_medialib_browse_artists();
 
 	if (res) {
 		for (str = gmu_core_medialib_browse_fetch_next_result();
 			 str;
 			 str = gmu_core_medialib_browse_fetch_next_result(), i++) {
-			char *artist = json_string_escape_alloc(str);
-			snprintf(
-				rstr,
-				1023,
-				"{\"cmd\":\"mlib_browse_result\", \"pos\":%zd,\"artist\":\"%s\"}",
-				i,
-				artist
-			);
-			free(artist);
-			websocket_send_string(c, rstr);
+			json_writer_reset(jw);
+			json_writer_object_begin(jw, NULL);
+			json_writer_string(jw, "cmd", "mlib_browse_result");
+			json_writer_unsigned(jw, "pos", i);
+			json_writer_string(jw, "artist", str);
+			json_writer_object_end(jw);
+			websocket_send_json(c);
 		}
 	}
 	gmu_core_medialib_browse_finish();
@@ -1165,6 +1430,13 @@ static int gmu_http_handle_websocket_message(const char *message, Connection *c)
 					wdprintf(V_DEBUG, "httpd", "item=%d\n", item);
 					gmu_http_playlist_get_item(item, c);
 				}
+			} else if (strcmp(cmd, "playlist_get_range") == 0) {
+				/* Optional: "since" to get only the entries changed since that playlist version */
+				int    offset = json_get_integer_value_for_key(json, "offset");
+				int    count  = json_get_integer_value_for_key(json, "count");
+				double since  = json_get_number_value_for_key(json, "since");
+				if (offset >= 0 && count > 0)
+					gmu_http_playlist_get_range(c, offset, count, since > 0 ? (unsigned long)since : 0);
 			} else if (strcmp(cmd, "playlist_get_info") == 0) {
 				gmu_http_playlist_get_info(c);
 			} else if (strcmp(cmd, "dir_read") == 0) {
@@ -1213,8 +1485,11 @@ static int gmu_http_handle_websocket_message(const char *message, Connection *c)
 			} else if (strcmp(cmd, "medialib_search") == 0) {
 				const char *type = json_get_string_value_for_key(json, "type");
 				const char *str  = json_get_string_value_for_key(json, "str");
+				/* Optional: "offset" and "count" for fetching results page by page */
+				int         offset = json_get_integer_value_for_key(json, "offset");
+				int         count  = json_get_integer_value_for_key(json, "count");
 				if (type && str) {
-					gmu_http_medialib_search(c, type, str);
+					gmu_http_medialib_search(c, type, str, offset > 0 ? offset : 0, count);
 				}
 			} else if (strcmp(cmd, "medialib_add_id_to_playlist") == 0) {
 				int id = json_get_number_value_for_key(json, "id");
@@ -1234,250 +1509,424 @@ static int gmu_http_handle_websocket_message(const char *message, Connection *c)
 	return res;
 }
 
-/**
- * Webserver main loop
- * listen_fd is the socket file descriptor where the server is 
- * listening for client connections.
+#define EPOLL_MAX_EVENTS  64
+/* One slot per second; must be larger than CONNECTION_TIMEOUT_HTTP+1 */
+#define TIMER_WHEEL_SLOTS 16
+
+static int         epoll_fd = -1;
+static int         wakeup_pipe[2] = { -1, -1 };
+static Connection *first_connection;
+static size_t      con_count;
+static Connection *closing_connections;
+static Connection *timer_wheel[TIMER_WHEEL_SLOTS];
+static size_t      timer_wheel_entries;
+static time_t      timer_wheel_time;
+
+/*
+ * Schedules the idle timeout check of a connection. The slot is derived
+ * from the connection's last activity. Activity does not move the
+ * connection in the wheel, instead it gets rescheduled when its slot
+ * comes up and it turns out not to be timed out yet.
  */
-static void webserver_main_loop(int listen_fd)
+static void timer_wheel_add(Connection *c)
 {
-	fd_set      the_state;
-	int         maxfd;
-	int         rb_ok = 1;
-	Connection *con_ptr;
-	Connection *first_connection = NULL;
-	size_t      con_count = 0;
+	int slot = (c->connection_time + CONNECTION_TIMEOUT_HTTP + 1) % TIMER_WHEEL_SLOTS;
+
+	c->timer_slot = slot;
+	c->timer_prev = NULL;
+	c->timer_next = timer_wheel[slot];
+	if (c->timer_next) c->timer_next->timer_prev = c;
+	timer_wheel[slot] = c;
+	timer_wheel_entries++;
+}
 
-	FD_ZERO(&the_state);
-	FD_SET(listen_fd, &the_state);
-	maxfd = listen_fd;
+static void timer_wheel_remove(Connection *c)
+{
+	if (c->timer_slot >= 0) {
+		if (c->timer_prev)
+			c->timer_prev->timer_next = c->timer_next;
+		else
+			timer_wheel[c->timer_slot] = c->timer_next;
+		if (c->timer_next) c->timer_next->timer_prev = c->timer_prev;
+		c->timer_slot = -1;
+		timer_wheel_entries--;
+	}
+}
 
-	assign_signal_handler(SIGPIPE, SIG_IGN);
+/* Connections are closed after the current batch of events has been handled */
+static void connection_defer_close(Connection *c)
+{
+	if (!c->closing) {
+		c->closing = 1;
+		c->close_next = closing_connections;
+		closing_connections = c;
+	}
+}
 
-	while (server_running) {
-		fd_set         readfds, exceptfds;
-		int            ret;
-		struct timeval tv;
-		char          *websocket_msg;
-
-		/* previously: 2 seconds timeout */
-		tv.tv_sec  = 0;
-		tv.tv_usec = 1000;
-
-		readfds = the_state; /* select() changes readfds */
-		exceptfds = the_state;
-		ret = select(maxfd + 1, &readfds, NULL, &exceptfds, &tv);
-		if (ret == -1 && errno == EINTR) {
-			/* A signal has occured; ignore it. */
-			continue;
-		}
-		if (ret < 0) {
-			wdprintf(V_DEBUG, "httpd", "An error occured: (%d) %s\n", ret, strerror(errno));
-		}
+static void close_deferred_connections(void)
+{
+	while (closing_connections) {
+		Connection *c = closing_connections;
+
+		closing_connections = c->close_next;
+		/* Try to get out pending messages, e.g. a login failure notice */
+		if (c->ws_out_first) connection_send_frames(c);
+		timer_wheel_remove(c);
+		if (c == first_connection) first_connection = c->next;
+		con_count--;
+		connection_close(c);
+		wdprintf(V_INFO, "httpd", "Connection count: %d (--)\n", con_count);
+	}
+}
 
-		/* Check TCP listen port for incoming connections... */
-		if (FD_ISSET(listen_fd, &readfds)) {
-			Connection ctmp = tcp_server_client_init(listen_fd);
-
-			if (ctmp.state != CON_ERROR) {
-				fcntl(ctmp.fd, F_SETFL, O_NONBLOCK);
-				if (con_count < MAX_CONNECTIONS) {
-					con_count++;
-					if (ctmp.fd >= 0) {
-						Connection *tmp_con;
-						FD_SET(ctmp.fd, &the_state); /* add new client */
-						if (ctmp.fd > maxfd) maxfd = ctmp.fd;
-						wdprintf(V_DEBUG, "httpd", "Initializing new connection...\n");
-						tmp_con = connection_init(ctmp.fd, ctmp.client_ip, first_connection);
-						if (tmp_con && connection_get_state(tmp_con) != CON_ERROR) {
-							wdprintf(V_DEBUG, "httpd", "Incoming connection %d. Connection count: %d (++)\n", ctmp.fd, con_count);
-							first_connection = tmp_con;
-						} else {
-							wdprintf(V_DEBUG, "httpd", "Error with incoming connection %d.\n", ctmp.fd);
-							connection_close(tmp_con);
-						}
-					}
+/* Checks all connections whose slots have come up since the last call */
+static void timer_wheel_advance(time_t now)
+{
+	time_t t = timer_wheel_time;
+
+	if (now - t > TIMER_WHEEL_SLOTS) t = now - TIMER_WHEEL_SLOTS;
+	for (; t < now; t++) {
+		int         slot = (t + 1) % TIMER_WHEEL_SLOTS;
+		Connection *c = timer_wheel[slot];
+
+		timer_wheel[slot] = NULL;
+		while (c) {
+			Connection *next = c->timer_next;
+
+			c->timer_slot = -1;
+			timer_wheel_entries--;
+			/* WebSocket connections stay open until the client goes away */
+			if (connection_get_state(c) != CON_WEBSOCKET_OPEN) {
+				if (connection_is_timed_out(c)) {
+					wdprintf(V_DEBUG, "httpd", "Closing connection to idle client %d...\n", c->fd);
+					connection_defer_close(c);
 				} else {
-					wdprintf(
-						V_WARNING,
-						"httpd",
-						"Connection limit reached of %d. Cannot accept incoming connection %d.\n",
-						MAX_CONNECTIONS,
-						con_count
-					);
-					close(ctmp.fd);
+					timer_wheel_add(c);
 				}
-			} else {
-				wdprintf(V_WARNING, "httpd", "ERROR: Could not accept client connection.\n");
 			}
+			c = next;
 		}
+	}
+	timer_wheel_time = now;
+}
 
-		/* Check WebSocket data send queue and fetch the next item if at
-		 * least one is available */
-		websocket_msg = queue_pop_alloc(&queue);
-
-		/* Check all open TCP connections for incoming data. 
-		 * Also handle ongoing http file requests and pending 
-		 * WebSocket transmit requests here. */
-		for (con_ptr = first_connection; con_ptr; ) {
-			Connection *tmp_con = NULL;
-			if (FD_ISSET(con_ptr->fd, &exceptfds)) {
-				wdprintf(V_INFO, "httpd", "Error on connection %d.\n", con_ptr->fd);
-				FD_CLR(con_ptr->fd, &the_state);
-				if (con_ptr == first_connection) first_connection = con_ptr->next;
-				tmp_con = con_ptr->next;
-				connection_close(con_ptr);
-				con_ptr = tmp_con;
-				con_count--;
+/* Registers interest in write readiness only while sending is stalled */
+static void connection_update_events(Connection *c)
+{
+	uint32_t events = EPOLLIN | EPOLLET;
+
+	if (connection_get_state(c) == CON_HTTP_BUSY || c->ws_out_first || c->out_len > 0) events |= EPOLLOUT;
+	if (events != c->epoll_events) {
+		struct epoll_event ev;
+
+		ev.events = events;
+		ev.data.ptr = c;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) == 0)
+			c->epoll_events = events;
+		else
+			connection_set_state(c, CON_ERROR);
+	}
+}
+
+static void accept_connections(int listen_fd)
+{
+	for (;;) {
+		Connection  ctmp = tcp_server_client_init(listen_fd);
+		Connection *tmp_con;
+
+		if (ctmp.fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				wdprintf(V_WARNING, "httpd", "ERROR: Could not accept client connection: %s\n", strerror(errno));
+			if (errno != EINTR) break;
+			continue;
+		}
+		if (ctmp.state == CON_ERROR) {
+			close(ctmp.fd);
+			continue;
+		}
+		if (con_count >= max_connections) {
+			wdprintf(V_WARNING, "httpd", "Connection limit of %d reached. Cannot accept incoming connection %d.\n",
+			         (int)max_connections, ctmp.fd);
+			close(ctmp.fd);
+			continue;
+		}
+		fcntl(ctmp.fd, F_SETFL, O_NONBLOCK);
+		wdprintf(V_DEBUG, "httpd", "Initializing new connection...\n");
+		tmp_con = connection_init(ctmp.fd, ctmp.client_ip, first_connection);
+		if (tmp_con && connection_get_state(tmp_con) != CON_ERROR) {
+			struct epoll_event ev;
+
+			ev.events = EPOLLIN | EPOLLET;
+			ev.data.ptr = tmp_con;
+			if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ctmp.fd, &ev) == 0) {
+				tmp_con->epoll_events = ev.events;
+				first_connection = tmp_con;
+				con_count++;
+				timer_wheel_add(tmp_con);
+				wdprintf(V_DEBUG, "httpd", "Incoming connection %d. Connection count: %d (++)\n", ctmp.fd, con_count);
 				continue;
-			} else {
-				if (connection_get_state(con_ptr) == CON_HTTP_BUSY) { /* feed data */
-					/* Read CHUNK_SIZE bytes from file and send data to socket & update remaining bytes counter */
-					connection_file_read_chunk(con_ptr);
-				} else if (connection_get_state(con_ptr) == CON_WEBSOCKET_OPEN) {
-					/* If data for sending through websocket has been fetched
-					 * from the broadcast queue, send the data to all open WebSocket connections */
-					if (websocket_msg) {
-						if (connection_is_authenticated(con_ptr))
-							websocket_send_string(con_ptr, websocket_msg);
-					}
-				}
-				if (FD_ISSET(con_ptr->fd, &readfds)) { /* Data received on connection socket */
-					char    msgbuf[MAXLEN+1];
-					ssize_t msgbuflen;
-					int     request_header_complete = 0;
-
-					/* Read message from client */
-					msgbuf[MAXLEN] = '\0';
-					msgbuflen = sizeof(msgbuf);
-					ret = tcp_server_read(con_ptr->fd, msgbuf, &msgbuflen);
-					if (ret == ERROR) {
-						FD_CLR(con_ptr->fd, &the_state); /* remove dead client */
-						con_count--;
-						wdprintf(V_INFO, "httpd", "Connection count: %d (--)\n", con_count);
-						if (con_ptr == first_connection) first_connection = con_ptr->next;
-						tmp_con = con_ptr->next;
-						connection_close(con_ptr);
-						con_ptr = tmp_con;
-						continue;
-					} else {
-						size_t len = msgbuflen;
-						size_t len_header = 0;
-
-						if (connection_get_state(con_ptr) != CON_WEBSOCKET_OPEN) {
-							char *tmp;
-							wdprintf(V_DEBUG, "httpd", "%04d http message.\n", con_ptr->fd);
-							if (con_ptr->http_request_header)
-								len_header = strlen(con_ptr->http_request_header);
-							tmp = realloc(con_ptr->http_request_header, len_header+len+1);
-							if (tmp) {
-								con_ptr->http_request_header = tmp;
-							} else {
-								connection_free_request_header(con_ptr);
-							}
-							if (con_ptr->http_request_header) {
-								memcpy(con_ptr->http_request_header+len_header, msgbuf, len);
-								con_ptr->http_request_header[len_header+len] = '\0';
-								if (strstr(con_ptr->http_request_header, "\r\n\r\n") || 
-								    strstr(con_ptr->http_request_header, "\n\n")) { /* we got a complete header */
-									request_header_complete = 1;
-								}
-							}
-						} else {
-							char   tmp_buf[16];
-							size_t size = 0;
-							int    loop = 1;
-
-							wdprintf(V_DEBUG, "httpd", "%04d websocket message received.\n", con_ptr->fd);
-							if (msgbuflen > 0) {
-								rb_ok = ringbuffer_write(&(con_ptr->rb_receive), msgbuf, msgbuflen);
-								if (!rb_ok) wdprintf(V_WARNING, "httpd", "WARNING: Cannot write to ring buffer. Ring buffer full.\n");
-							}
+			}
+		}
+		wdprintf(V_DEBUG, "httpd", "Error with incoming connection %d.\n", ctmp.fd);
+		if (tmp_con)
+			connection_close(tmp_con);
+		else
+			close(ctmp.fd);
+	}
+}
+
+static int request_header_complete(Connection *c)
+{
+	return c->http_request_header &&
+	       (strstr(c->http_request_header, "\r\n\r\n") || strstr(c->http_request_header, "\n\n"));
+}
 
-							do {
-								ringbuffer_set_unread_pos(&(con_ptr->rb_receive));
-								if (ringbuffer_read(&(con_ptr->rb_receive), tmp_buf, 10)) {
-									size = websocket_calculate_packet_size(tmp_buf);
-									wdprintf(V_DEBUG, "httpd", "Size of websocket message: %d bytes\n", size);
-									ringbuffer_unread(&(con_ptr->rb_receive));
-								}
-								if (ringbuffer_get_fill(&(con_ptr->rb_receive)) >= size && size > 0) {
-									char *wspacket = malloc(size+1); /* packet size+1 byte null terminator */
-									char *payload;
-									if (wspacket) {
-										ringbuffer_read(&(con_ptr->rb_receive), wspacket, size);
-										wspacket[size] = '\0';
-										payload = websocket_unmask_message_alloc(wspacket, size);
-										if (payload) {
-											wdprintf(V_DEBUG, "httpd", "Payload data=[%s]\n", payload);
-											if (!gmu_http_handle_websocket_message(payload, con_ptr)) {
-												Connection *tmp_con = con_ptr;
-												FD_CLR(con_ptr->fd, &the_state);
-												if (con_ptr == first_connection) first_connection = con_ptr->next;
-												con_count--;
-												con_ptr = con_ptr->next;
-												connection_close(tmp_con);
-												free(payload);
-												continue;
-											}
-											free(payload);
-										}
-										free(wspacket);
-										size = 0;
-									}
-								} else if (size > 0) {
-									wdprintf(
-										V_DEBUG,
-										"httpd", "Not enough data available. Need %d bytes, but only %d avail.\n",
-										size,
-										ringbuffer_get_fill(&(con_ptr->rb_receive))
-									);
-									ringbuffer_unread(&(con_ptr->rb_receive));
-									loop = 0;
-								} else {
-									loop = 0;
-								}
-							} while (loop);
-							connection_reset_timeout(con_ptr);
+/*
+ * Handles data received on a connection.
+ * Returns 1 if connection is still open and usable or 0 if the
+ * connection must be considered dead and needs to be closed
+ */
+static int connection_handle_data(Connection *c, const char *msgbuf, size_t len)
+{
+	int res = 1;
+
+	if (connection_get_state(c) != CON_WEBSOCKET_OPEN) {
+		char  *tmp;
+		size_t len_header = 0;
+
+		wdprintf(V_DEBUG, "httpd", "%04d http message.\n", c->fd);
+		if (c->http_request_header)
+			len_header = strlen(c->http_request_header);
+		tmp = realloc(c->http_request_header, len_header+len+1);
+		if (tmp) {
+			c->http_request_header = tmp;
+		} else {
+			connection_free_request_header(c);
+		}
+		if (c->http_request_header) {
+			memcpy(c->http_request_header+len_header, msgbuf, len);
+			c->http_request_header[len_header+len] = '\0';
+			/* A request arriving during a response is handled once the response is done */
+			if (connection_get_state(c) != CON_HTTP_BUSY && request_header_complete(c))
+				process_command(c->fd, c);
+		}
+	} else {
+		char   tmp_buf[16];
+		size_t size = 0;
+		int    loop = 1;
+
+		wdprintf(V_DEBUG, "httpd", "%04d websocket message received.\n", c->fd);
+		if (!ringbuffer_write(&(c->rb_receive), msgbuf, len))
+			wdprintf(V_WARNING, "httpd", "WARNING: Cannot write to ring buffer. Ring buffer full.\n");
+
+		do {
+			ringbuffer_set_unread_pos(&(c->rb_receive));
+			if (ringbuffer_read(&(c->rb_receive), tmp_buf, 10)) {
+				size = websocket_calculate_packet_size(tmp_buf);
+				wdprintf(V_DEBUG, "httpd", "Size of websocket message: %d bytes\n", size);
+				ringbuffer_unread(&(c->rb_receive));
+			}
+			if (ringbuffer_get_fill(&(c->rb_receive)) >= size && size > 0) {
+				char *wspacket = malloc(size+1); /* packet size+1 byte null terminator */
+				char *payload;
+				if (wspacket) {
+					ringbuffer_read(&(c->rb_receive), wspacket, size);
+					wspacket[size] = '\0';
+					payload = websocket_unmask_message_alloc(wspacket, size);
+					if (payload) {
+						wdprintf(V_DEBUG, "httpd", "Payload data=[%s]\n", payload);
+						if (!gmu_http_handle_websocket_message(payload, c)) {
+							res = 0;
+							loop = 0;
 						}
+						free(payload);
 					}
-					if (request_header_complete)
-						process_command(con_ptr->fd, con_ptr);
-				} else { /* no data received */
-					if (connection_is_valid(con_ptr) &&
-						connection_is_timed_out(con_ptr) &&
-						connection_get_state(con_ptr) != CON_WEBSOCKET_OPEN) { /* close idle connection */
-						wdprintf(V_DEBUG, "httpd", "Closing connection to idle client %d...\n", con_ptr->fd);
-						FD_CLR(con_ptr->fd, &the_state);
-						if (con_ptr == first_connection) first_connection = con_ptr->next;
-						tmp_con = con_ptr->next;
-						con_count--;
-						connection_close(con_ptr);
-						con_ptr = tmp_con;
-						wdprintf(V_INFO, "httpd", "Connection count: %d (--) (idle)\n", con_count);
-						continue;
-					}
+					free(wspacket);
+					size = 0;
 				}
+			} else if (size > 0) {
+				wdprintf(
+					V_DEBUG,
+					"httpd", "Not enough data available. Need %d bytes, but only %d avail.\n",
+					size,
+					ringbuffer_get_fill(&(c->rb_receive))
+				);
+				ringbuffer_unread(&(c->rb_receive));
+				loop = 0;
+			} else {
+				loop = 0;
 			}
-			tmp_con = con_ptr;
-			con_ptr = con_ptr->next;
-			if (tmp_con->state == CON_ERROR) {
-				if (first_connection == tmp_con) first_connection = con_ptr;
-				connection_close(tmp_con);
+		} while (loop);
+		connection_reset_timeout(c);
+	}
+	return res;
+}
+
+/*
+ * Reads everything available on the connection (the socket is edge
+ * triggered). Returns 0 if the connection needs to be closed.
+ */
+static int connection_receive(Connection *c)
+{
+	char msgbuf[MAXLEN+1];
+	int  res = 1;
+
+	while (res && connection_get_state(c) != CON_ERROR) {
+		ssize_t len = read(c->fd, msgbuf, MAXLEN);
+
+		if (len > 0) {
+			res = connection_handle_data(c, msgbuf, len);
+		} else if (len < 0 && errno == EINTR) {
+			continue;
+		} else {
+			/* End of TCP connection unless there is just no more data for now */
+			if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) res = 0;
+			break;
+		}
+	}
+	return res;
+}
+
+static void connection_handle_event(Connection *c, uint32_t events)
+{
+	if (c->closing) return;
+	if ((events & EPOLLERR) || ((events & EPOLLHUP) && !(events & EPOLLIN))) {
+		wdprintf(V_INFO, "httpd", "Error on connection %d.\n", c->fd);
+		connection_set_state(c, CON_ERROR);
+	} else if ((events & EPOLLIN) && !connection_receive(c)) {
+		connection_set_state(c, CON_ERROR);
+	}
+	/* Send the response until the socket's send buffer is full */
+	while (connection_get_state(c) == CON_HTTP_BUSY) {
+		if (!connection_send_pending_data(c)) {
+			if (connection_get_state(c) != CON_HTTP_IDLE || !request_header_complete(c)) break;
+			process_command(c->fd, c);
+		}
+	}
+	if (connection_get_state(c) == CON_WEBSOCKET_OPEN)
+		while (connection_send_frames(c));
+	if (connection_get_state(c) != CON_ERROR) connection_update_events(c);
+	if (connection_get_state(c) == CON_ERROR) connection_defer_close(c);
+}
+
+/*
+ * Sends the queued broadcast messages to all authenticated WebSocket
+ * clients. Each message is serialized once and the frame is shared by
+ * all connections. Everything is queued first and sent afterwards, so
+ * that messages of the same kind get coalesced and each client gets
+ * all new messages in a single write.
+ */
+static void send_broadcast_messages(void)
+{
+	char        buf[64];
+	char       *websocket_msg;
+	Connection *con_ptr;
+
+	while (read(wakeup_pipe[0], buf, sizeof(buf)) > 0);
+	while ((websocket_msg = queue_pop_alloc(&queue)) != NULL) {
+		WebSocketFrame *f = websocket_frame_new(websocket_msg);
+
+		for (con_ptr = first_connection; con_ptr && f; con_ptr = con_ptr->next) {
+			if (!con_ptr->closing &&
+			    connection_get_state(con_ptr) == CON_WEBSOCKET_OPEN &&
+			    connection_is_authenticated(con_ptr)) {
+				if (!connection_queue_frame(con_ptr, f))
+					connection_defer_close(con_ptr);
 			}
 		}
-		if (websocket_msg) free(websocket_msg);
+		if (f) websocket_frame_unref(f);
+		free(websocket_msg);
 	}
-	queue_free(&queue);
-	for (con_ptr = first_connection; con_ptr; ) {
-		Connection *tmp_con = con_ptr->next;
-		connection_close(con_ptr);
-		con_ptr = tmp_con;
+	for (con_ptr = first_connection; con_ptr; con_ptr = con_ptr->next) {
+		if (!con_ptr->closing && con_ptr->ws_out_first) {
+			while (connection_send_frames(con_ptr));
+			if (connection_get_state(con_ptr) == CON_ERROR)
+				connection_defer_close(con_ptr);
+			else
+				connection_update_events(con_ptr);
+		}
 	}
+}
+
+static int reactor_init(int listen_fd)
+{
+	struct epoll_event ev;
+	int                res = 0;
+
+	epoll_fd = epoll_create(EPOLL_MAX_EVENTS);
+	if (epoll_fd >= 0 && pipe(wakeup_pipe) == 0) {
+		fcntl(wakeup_pipe[0], F_SETFL, O_NONBLOCK);
+		fcntl(wakeup_pipe[1], F_SETFL, O_NONBLOCK);
+		fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.ptr = NULL; /* The listening socket */
+		res = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == 0;
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.ptr = wakeup_pipe;
+		if (res) res = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_pipe[0], &ev) == 0;
+		if (res) queue_set_notify_fd(&queue, wakeup_pipe[1]);
+	}
+	timer_wheel_time = time(NULL);
+	return res;
+}
+
+static void reactor_free(void)
+{
+	queue_set_notify_fd(&queue, -1);
+	if (wakeup_pipe[0] >= 0) close(wakeup_pipe[0]);
+	if (wakeup_pipe[1] >= 0) close(wakeup_pipe[1]);
+	wakeup_pipe[0] = wakeup_pipe[1] = -1;
+	if (epoll_fd >= 0) close(epoll_fd);
+	epoll_fd = -1;
+}
+
+/**
+ * Webserver main loop
+ * listen_fd is the socket file descriptor where the server is 
+ * listening for client connections.
+ */
+static void webserver_main_loop(int listen_fd)
+{
+	struct epoll_event events[EPOLL_MAX_EVENTS];
+	Connection        *con_ptr;
+
+	assign_signal_handler(SIGPIPE, SIG_IGN);
+
+	if (!reactor_init(listen_fd)) {
+		wdprintf(V_ERROR, "httpd", "Unable to set up event loop: %s\n", strerror(errno));
+		server_running = 0;
+	}
+	while (server_running) {
+		int n, i;
+
+		/* Sleep until something happens, or until the next idle connection check */
+		n = epoll_wait(epoll_fd, events, EPOLL_MAX_EVENTS, timer_wheel_entries > 0 ? 1000 : -1);
+		if (n < 0 && errno != EINTR)
+			wdprintf(V_DEBUG, "httpd", "An error occured: (%d) %s\n", n, strerror(errno));
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == NULL)
+				accept_connections(listen_fd);
+			else if (events[i].data.ptr == wakeup_pipe)
+				send_broadcast_messages();
+			else
+				connection_handle_event((Connection *)events[i].data.ptr, events[i].events);
+		}
+		timer_wheel_advance(time(NULL));
+		close_deferred_connections();
+	}
+	for (con_ptr = first_connection; con_ptr; con_ptr = con_ptr->next)
+		connection_defer_close(con_ptr);
+	close_deferred_connections();
+	reactor_free();
+	assetcache_free();
+	queue_free(&queue);
 	shutdown(listen_fd, SHUT_RDWR);
+	close(listen_fd);
 }
 
 void httpd_stop_server(void)
 {
 	server_running = 0;
+	/* Wake up the event loop */
+	queue_notify(&queue);
 }
@@ -12,6 +12,9 @@
 #include <stdio.h>
 #include "../../ringbuffer.h"
 #include <arpa/inet.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "json.h"
 
 #define bool int
 #define true  1
@@ -21,31 +24,68 @@
 
 #define VERBOSE (0)
 
+/* Default for the gmuhttp.MaxConnections setting */
 #define MAX_CONNECTIONS              (100)
 #define CONNECTION_TYPE_HTTP         (1)
 #define CONNECTION_TYPE_WEBSOCKET    (2)
 #define CONNECTION_TIMEOUT_HTTP      (10)
 #define CONNECTION_TIMEOUT_WEBSOCKET (30)
-#define CHUNK_SIZE (1300)
+
+/* Above this amount of queued data, playback time updates are dropped */
+#define WEBSOCKET_OUT_SOFT_LIMIT     (64*1024)
+/* Clients with more queued data than this get disconnected */
+#define WEBSOCKET_OUT_MAX            (2048*1024)
 
 typedef enum ConnectionState {
 	CON_HTTP_NEW, CON_HTTP_IDLE, CON_HTTP_BUSY, CON_HTTP_CLOSED,
 	CON_WEBSOCKET_CONNECTING, CON_WEBSOCKET_OPEN, CON_ERROR
 } ConnectionState;
 
+/* Messages of the same kind replace each other while still queued */
+typedef enum MessageKind {
+	MSG_OTHER, MSG_PLAYBACK_TIME, MSG_VOLUME_INFO, MSG_TRACKINFO
+} MessageKind;
+
+/* A serialized WebSocket frame, shared by all connections it is queued on */
+typedef struct WebSocketFrame {
+	int         refcount;
+	MessageKind kind;
+	size_t      len;
+	char       *data;
+} WebSocketFrame;
+
+typedef struct OutgoingFrame OutgoingFrame;
+
+struct OutgoingFrame {
+	WebSocketFrame *frame;
+	OutgoingFrame  *next;
+};
+
 typedef struct ConnectionStruct Connection;
 
 struct ConnectionStruct {
 	int             fd;
 	time_t          connection_time;
-	FILE           *local_file;
+	int             local_fd;               /* File being sent with sendfile(), -1 if none */
+	off_t           file_offset;
 	size_t          total_size, remaining_bytes_to_send;
+	char           *out_buf;                /* Response data not yet accepted by the socket */
+	size_t          out_size, out_len, out_pos;
+	OutgoingFrame  *ws_out_first, *ws_out_last;
+	size_t          ws_out_pos;             /* Bytes of the first frame already sent */
+	size_t          ws_out_bytes;           /* Total size of all queued frames */
+	JSON_Writer     json_out;               /* For building outgoing messages */
 	ConnectionState state;
 	char           *http_request_header;
 	RingBuffer      rb_receive;
 	int             authentication_okay;
 	char            client_ip[INET6_ADDRSTRLEN];
 	Connection     *prev, *next;
+	uint32_t        epoll_events;           /* Currently registered event mask */
+	int             timer_slot;             /* Timer wheel slot, -1 if not scheduled */
+	Connection     *timer_prev, *timer_next;
+	int             closing;
+	Connection     *close_next;
 };
 
 typedef enum HTTPCommand {
@@ -54,6 +94,7 @@ typedef enum HTTPCommand {
 
 typedef struct HTTPD_Init_Params {
 	int   local_only;
+	int   max_connections;
 	char *webserver_root;
 } HTTPD_Init_Params;
 
@@ -76,10 +117,22 @@ int  connection_file_is_open(Connection *c);
 int  connection_file_open(Connection *c, const char *filename);
 void connection_file_close(Connection *c);
 int  connection_get_number_of_bytes_to_send(Connection *c);
-int  connection_file_read_chunk(Connection *c);
+/* Appends data to the connection's output buffer */
+int  connection_queue_data(Connection *c, const void *data, size_t len);
+/*
+ * Sends queued data followed by the open file without blocking. Returns
+ * 1 if more data can be sent right away, 0 if the response is done or
+ * the socket does not accept more data for now.
+ */
+int  connection_send_pending_data(Connection *c);
+/* Queues a WebSocket frame, returns 0 if the connection had to be given up */
+int  connection_queue_frame(Connection *c, WebSocketFrame *f);
+/* Sends queued WebSocket frames, return value as above */
+int  connection_send_frames(Connection *c);
 
 void gmu_http_playlist_get_info(Connection *c);
 void gmu_http_playlist_get_item(int id, Connection *c);
+void gmu_http_playlist_get_range(Connection *c, size_t offset, size_t count, unsigned long since);
 void gmu_http_send_initial_information(Connection *c);
 void gmu_http_get_current_trackinfo(Connection *c);
 void gmu_http_playmode_get_info(Connection *c);
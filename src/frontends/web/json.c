@@ -16,7 +16,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <stdarg.h>
 #include "json.h"
 #include "debug.h"
 
@@ -376,105 +375,164 @@ JSON_Key_Type json_get_type_for_key(JSON_Object *object, const char *key)
 	return res;
 }
 
-/**
- * target must point to an array of char with at least 256 bytes of space.
- */
-static void jema_prepare_kv_string(
-	va_list      *args,
-	char         *target,
-	JSON_Key_Type key_type,
-	const char   *key_name,
-	int           first_key
-)
+#define JSON_WRITER_INITIAL_SIZE 256
+
+void json_writer_init(JSON_Writer *w)
 {
-	switch (key_type) {
-		case JSON_STRING: {
-			char *val_str = va_arg(*args, char *);
-			val_str = json_string_escape_alloc(val_str);
-			if (val_str) {
-				if (snprintf(target, 256, "%s\"%s\":\"%s\"", first_key ? "" : ",", key_name, val_str) >= 256)
-					target[0] = '\0';
-				free(val_str);
-			}
-			break;
-		}
-		case JSON_NUMBER:
-		case JSON_FLOAT: {
-			double val_double = va_arg(*args, double);
-			if (snprintf(target, 256, "%s\"%s\":%f", first_key ? "" : ",", key_name, val_double) >= 256)
-				target[0] = '\0';
-			break;
-		}
-		case JSON_INTEGER: {
-			int val = va_arg(*args, int);
-			if (snprintf(target, 256, "%s\"%s\":%d", first_key ? "" : ",", key_name, val) >= 256)
-				target[0] = '\0';
-			break;
+	w->buf = NULL;
+	w->size = 0;
+	w->len = 0;
+	w->need_separator = 0;
+	w->error = 0;
+}
+
+void json_writer_free(JSON_Writer *w)
+{
+	if (w->buf) free(w->buf);
+	json_writer_init(w);
+}
+
+void json_writer_reset(JSON_Writer *w)
+{
+	w->len = 0;
+	w->need_separator = 0;
+	w->error = 0;
+	if (w->buf) w->buf[0] = '\0';
+}
+
+/* Makes sure there is room for 'n' more bytes (plus the terminator) */
+static int jw_reserve(JSON_Writer *w, size_t n)
+{
+	if (w->error) return 0;
+	if (w->len + n + 1 > w->size) {
+		size_t size = w->size ? w->size : JSON_WRITER_INITIAL_SIZE;
+		char  *buf;
+
+		while (w->len + n + 1 > size) size *= 2;
+		buf = realloc(w->buf, size);
+		if (!buf) {
+			w->error = 1;
+			return 0;
 		}
-		case JSON_BOOLEAN:
-			va_arg(*args, char *);
-			break;
-		default:
-			/* Ignore more complex types */
-			va_arg(*args, char *);
-			break;
+		w->buf = buf;
+		w->size = size;
 	}
+	return 1;
 }
 
-static char *jema_concat(const char *kv_str, char *msg, size_t *msg_size, size_t *msg_pos)
+static void jw_append_char(JSON_Writer *w, char ch)
 {
-	if (kv_str[0]) {
-		size_t len = strlen(kv_str);
-		if (*msg_size - *msg_pos > len) {
-			strcat(msg, kv_str);
-			*msg_pos += len;
-		} else {
-			*msg_size += len + 256;
-			msg = realloc(msg, *msg_size);
-		}
+	if (jw_reserve(w, 1)) {
+		w->buf[w->len++] = ch;
+		w->buf[w->len] = '\0';
 	}
-	return msg;
 }
 
-/**
- * Function for creating a JSON message string from an arbitrary number
- * of keys. Only a flat list of keys is supported, no arrays or nested
- * objects.
- * To be called with a variable list of arguments. The number of arguments
- * always must be a multiple of 3 plus 1, with the last argument always
- * being JSON_EMPTY. The three arguments are: key type, key name and key value.
- * The type of key value depends on the selected key type.
- * Returns a valid JSON message on success or NULL on error.
- * Memory will be allocated for the JSON message as needed and needs to
- * be free'd.
+/* Returns the length of the UTF-8 sequence at 's', or 0 if it is invalid */
+static size_t utf8_sequence_length(const unsigned char *s)
+{
+	size_t len, i;
+
+	if (s[0] < 0x80) return 1;
+	if (s[0] < 0xC2) return 0;
+	else if (s[0] < 0xE0) len = 2;
+	else if (s[0] < 0xF0) len = 3;
+	else if (s[0] < 0xF5) len = 4;
+	else return 0;
+	for (i = 1; i < len; i++) /* This also stops at the terminating \0 */
+		if ((s[i] & 0xC0) != 0x80) return 0;
+	/* Overlong sequences, UTF-16 surrogates and code points beyond U+10FFFF */
+	if ((s[0] == 0xE0 && s[1] < 0xA0) || (s[0] == 0xED && s[1] >= 0xA0) ||
+	    (s[0] == 0xF0 && s[1] < 0x90) || (s[0] == 0xF4 && s[1] >= 0x90))
+		return 0;
+	return len;
+}
+
+/*
+ * Writes 'str' as a quoted string, escaping it on the fly. Control
+ * characters are replaced by spaces. Returns 0 (and writes nothing)
+ * if 'str' is not valid UTF-8.
  */
-char *json_encode_message_alloc(JSON_Key_Type type_1, const char *key, ...)
+static int jw_quoted_string(JSON_Writer *w, const char *str)
 {
-	char       *msg;
-	va_list     args;
-	size_t      msg_size = 256;
-
-	msg = malloc(msg_size);
-	if (msg) {
-		JSON_Key_Type key_type;
-		const char   *key_name;
-		size_t        msg_pos = 0;
-		char          tmp[256];
-
-		va_start(args, key);
-		msg[0] = '{';
-		msg[1] = '\0';
-		tmp[0] = '\0';
-		key_name = key;
-		jema_prepare_kv_string(&args, tmp, type_1, key_name, 1);
-		msg = jema_concat(tmp, msg, &msg_size, &msg_pos);
-		for (key_type = va_arg(args, JSON_Key_Type); key_type != JSON_EMPTY; key_type = va_arg(args, JSON_Key_Type)) {
-			key_name = va_arg(args, char *);
-			jema_prepare_kv_string(&args, tmp, key_type, key_name, 0);
-			msg = jema_concat(tmp, msg, &msg_size, &msg_pos);
+	const unsigned char *s = (const unsigned char *)(str ? str : "");
+	size_t               start = w->len;
+
+	/* Worst case: every char escaped, plus the quotes */
+	if (!jw_reserve(w, strlen((const char *)s) * 2 + 2)) return 1;
+	w->buf[w->len++] = '"';
+	while (*s) {
+		size_t n = utf8_sequence_length(s);
+
+		if (n == 0) {
+			w->len = start;
+			w->buf[w->len] = '\0';
+			return 0;
+		}
+		if (*s < 32) {
+			w->buf[w->len++] = ' ';
+		} else {
+			if (*s == '"' || *s == '\\') w->buf[w->len++] = '\\';
+			memcpy(w->buf + w->len, s, n);
+			w->len += n;
 		}
-		strcat(msg, "}");
-		va_end(args);
+		s += n;
 	}
-	return msg;
+	w->buf[w->len++] = '"';
+	w->buf[w->len] = '\0';
+	return 1;
+}
+
+/* Writes the separator and key (if any) in front of a value */
+static void jw_key(JSON_Writer *w, const char *key)
+{
+	if (w->need_separator) jw_append_char(w, ',');
+	if (key) {
+		if (!jw_quoted_string(w, key)) jw_quoted_string(w, "(Invalid UTF-8)");
+		jw_append_char(w, ':');
+	}
+	w->need_separator = 0;
+}
+
+void json_writer_object_begin(JSON_Writer *w, const char *key)
+{
+	jw_key(w, key);
+	jw_append_char(w, '{');
+}
+
+void json_writer_object_end(JSON_Writer *w)
+{
+	jw_append_char(w, '}');
+	w->need_separator = 1;
+}
+
+void json_writer_string(JSON_Writer *w, const char *key, const char *value)
+{
+	jw_key(w, key);
+	if (!jw_quoted_string(w, value)) jw_quoted_string(w, "(Invalid UTF-8)");
+	w->need_separator = 1;
+}
+
+void json_writer_integer(JSON_Writer *w, const char *key, long value)
+{
+	jw_key(w, key);
+	if (jw_reserve(w, 24)) w->len += sprintf(w->buf + w->len, "%ld", value);
+	w->need_separator = 1;
+}
+
+void json_writer_unsigned(JSON_Writer *w, const char *key, unsigned long value)
+{
+	jw_key(w, key);
+	if (jw_reserve(w, 24)) w->len += sprintf(w->buf + w->len, "%lu", value);
+	w->need_separator = 1;
+}
+
+const char *json_writer_get_string(JSON_Writer *w)
+{
+	return w->error ? NULL : (w->buf ? w->buf : "");
+}
+
+size_t json_writer_get_length(JSON_Writer *w)
+{
+	return w->error ? 0 : w->len;
 }
@@ -50,6 +50,19 @@ struct _JSON_Object {
 	int          parse_error;
 };
 
+/**
+ * Streaming JSON writer. Messages are written to a buffer that grows as
+ * needed and can be reused for any number of messages. Strings are
+ * escaped and checked for valid UTF-8 while being copied into the buffer.
+ * String values that are not valid UTF-8 are replaced by "(Invalid UTF-8)".
+ */
+typedef struct _JSON_Writer {
+	char  *buf;
+	size_t size, len;
+	int    need_separator;
+	int    error; /* Set when running out of memory */
+} JSON_Writer;
+
 JSON_Object  *json_object_new(JSON_Object *parent);
 JSON_Object  *json_parse_alloc(const char *json_data);
 int           json_object_has_parse_error(JSON_Object *jo);
@@ -64,5 +77,18 @@ double        json_get_number_value_for_key(JSON_Object *object, const char *key
 int           json_get_integer_value_for_key(JSON_Object *object, const char *key);
 char         *json_get_first_key_string(JSON_Object *object);
 JSON_Key_Type json_get_type_for_key(JSON_Object *object, const char *key);
-char         *json_encode_message_alloc(JSON_Key_Type type_1, const char *key, ...);
+
+void          json_writer_init(JSON_Writer *w);
+void          json_writer_free(JSON_Writer *w);
+/* Starts a new message, keeping the buffer */
+void          json_writer_reset(JSON_Writer *w);
+/* 'key' is NULL for the outermost object */
+void          json_writer_object_begin(JSON_Writer *w, const char *key);
+void          json_writer_object_end(JSON_Writer *w);
+void          json_writer_string(JSON_Writer *w, const char *key, const char *value);
+void          json_writer_integer(JSON_Writer *w, const char *key, long value);
+void          json_writer_unsigned(JSON_Writer *w, const char *key, unsigned long value);
+/* Returns the message written so far, or NULL on error */
+const char   *json_writer_get_string(JSON_Writer *w);
+size_t        json_writer_get_length(JSON_Writer *w);
 #endif
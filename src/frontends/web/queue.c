@@ -18,17 +18,29 @@
 #include <string.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <unistd.h>
 #include "queue.h"
 
 void queue_init(Queue *q)
 {
 	q->first = NULL;
 	q->last = NULL;
+	q->notify_fd = -1;
 	pthread_mutex_init(&(q->mutex), NULL);
 	pthread_mutex_init(&(q->mutex_cond), NULL);
 	pthread_cond_init(&(q->cond), NULL);
 }
 
+/* Must be called with q->mutex held */
+static void notify(Queue *q)
+{
+	if (q->notify_fd >= 0) {
+		/* A full pipe means the reader is going to wake up anyway */
+		ssize_t w = write(q->notify_fd, "", 1);
+		(void)w;
+	}
+}
+
 int queue_push(Queue *q, const char *str)
 {
 	QueueEntry *new_entry;
@@ -53,10 +65,18 @@ int queue_push(Queue *q, const char *str)
 		}
 	}
 	pthread_cond_broadcast(&(q->cond));
+	if (result) notify(q);
 	pthread_mutex_unlock(&(q->mutex));
 	return result;
 }
 
+void queue_notify(Queue *q)
+{
+	pthread_mutex_lock(&(q->mutex));
+	notify(q);
+	pthread_mutex_unlock(&(q->mutex));
+}
+
 char *queue_pop_alloc(Queue *q)
 {
 	char *result = NULL;
@@ -100,6 +120,13 @@ void queue_free(Queue *q)
 	pthread_mutex_destroy(&(q->mutex_cond));
 }
 
+void queue_set_notify_fd(Queue *q, int fd)
+{
+	pthread_mutex_lock(&(q->mutex));
+	q->notify_fd = fd;
+	pthread_mutex_unlock(&(q->mutex));
+}
+
 int queue_is_empty(Queue *q)
 {
 	int res;
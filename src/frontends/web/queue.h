@@ -30,6 +30,7 @@ struct _Queue
 	QueueEntry     *first, *last;
 	pthread_mutex_t mutex, mutex_cond;
 	pthread_cond_t  cond;
+	int             notify_fd; /* Written to on every push, -1 if unused */
 };
 
 typedef struct _Queue Queue;
@@ -40,4 +41,8 @@ char    *queue_pop_alloc(Queue *q);
 void     queue_clear(Queue *q);
 int      queue_is_empty(Queue *q);
 void     queue_free(Queue *q);
+/* Sets a file descriptor (e.g. a pipe) that gets a byte written to it on every push */
+void     queue_set_notify_fd(Queue *q, int fd);
+/* Writes to the notify fd without pushing anything */
+void     queue_notify(Queue *q);
 #endif
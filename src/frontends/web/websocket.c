@@ -81,51 +81,58 @@ char *websocket_client_generate_sec_websocket_key_alloc(void)
 	return res;
 }
 
-/* Returns 1 on success, 0 otherwise */
-int websocket_send_str(int sock, const char *str, int mask)
+/*
+ * Builds a complete text frame containing 'str' and stores its size in
+ * *frame_len. Returns NULL on failure or if 'str' is too long.
+ */
+char *websocket_frame_alloc(const char *str, int mask, size_t *frame_len)
 {
-	int res = 0;
-	if (str) {
-		char *buf, mask_key[4];
-		int   i, len = strlen(str);
+	char  *buf = NULL, mask_key[4];
+	size_t i, len = str ? strlen(str) : 0, hlen = 2;
 
-		srand(time(NULL));
-		for (i = 0; i < 4; i++) {
-			mask_key[i] = rand() % 256;
+	if (str && len < 65535) {
+		if (len > 125) hlen += 2;
+		if (mask) {
+			srand(time(NULL));
+			for (i = 0; i < 4; i++) {
+				mask_key[i] = rand() % 256;
+			}
 		}
-
-		buf = malloc(len+10); /* data length + 1 byte for flags + 9 bytes for length (1+8) */
+		buf = malloc(hlen+(mask ? 4 : 0)+len);
 		if (buf) {
-			char *msg = NULL;
-			if (mask) msg = mask_message_alloc(str, len, mask_key);
-			memset(buf, 0, len);
+			buf[0] = (char)(0x80+0x01);
 			if (len <= 125) {
-				if (mask) {
-					snprintf(buf, len+10, "%c%c%c%c%c%c", 0x80+0x01, len+0x80,
-					         mask_key[0], mask_key[1], mask_key[2], mask_key[3]);
-					memcpy(buf+6, msg ? msg : str, len);
-				} else {
-					snprintf(buf, len+10, "%c%c%s", 0x80+0x01, len, msg ? msg : str);
-				}
-				res = net_send_block(sock, (unsigned char *)buf, len+2+(mask ? 4 : 0));
-			} else if (len > 125 && len < 65535) {
-				if (mask) {
-					snprintf(buf, len+10, "%c%c%c%c%c%c%c%c", 0x80+0x01, 126+0x80, 
-					         (unsigned char)(len >> 8), (unsigned char)(len & 0xFF),
-					         mask_key[0], mask_key[1], mask_key[2], mask_key[3]);
-					memcpy(buf+8, msg ? msg : str, len);
-				} else {
-					snprintf(buf, len+10, "%c%c%c%c%s", 0x80+0x01, 126, 
-					         (unsigned char)(len >> 8), (unsigned char)(len & 0xFF), msg ? msg : str);
-				}
-				res = net_send_block(sock, (unsigned char *)buf, len+4+(mask ? 4 : 0));
-			} else { /* More than 64k bytes */
-				/* Such long strings are not supported right now */
+				buf[1] = (char)(len + (mask ? 0x80 : 0));
+			} else {
+				buf[1] = (char)(126 + (mask ? 0x80 : 0));
+				buf[2] = (char)(len >> 8);
+				buf[3] = (char)(len & 0xFF);
+			}
+			if (mask) {
+				memcpy(buf+hlen, mask_key, 4);
+				hlen += 4;
+				for (i = 0; i < len; i++)
+					buf[hlen+i] = str[i] ^ mask_key[i % 4];
+			} else {
+				memcpy(buf+hlen, str, len);
 			}
-			if (mask) free(msg);
-			free(buf);
+			*frame_len = hlen+len;
 		}
 	}
+	return buf;
+}
+
+/* Returns 1 on success, 0 otherwise */
+int websocket_send_str(int sock, const char *str, int mask)
+{
+	int    res = 0;
+	size_t len;
+	char  *buf = websocket_frame_alloc(str, mask, &len);
+
+	if (buf) {
+		res = net_send_block(sock, (unsigned char *)buf, len);
+		free(buf);
+	}
 	return res;
 }
 
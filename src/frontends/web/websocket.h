@@ -10,9 +10,11 @@
 
 #ifndef WEBSOCKET_H
 #define WEBSOCKET_H
+#include <stddef.h>
 char *websocket_unmask_message_alloc(const char *msgbuf, int msgbuf_size);
 char *websocket_prepare_message_from_str_alloc(const char *str, int mask);
 char *websocket_client_generate_sec_websocket_key_alloc(void);
+char *websocket_frame_alloc(const char *str, int mask, size_t *frame_len);
 int   websocket_send_str(int sock, const char *str, int mask);
 int   websocket_calculate_payload_size(const char *websocket_packet_header);
 const char *websocket_get_payload(const char *websocket_packet);
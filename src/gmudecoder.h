@@ -30,6 +30,19 @@ typedef enum GmuCharset {
 	M_CHARSET_AUTODETECT
 } GmuCharset;
 
+/*
+ * Decoder interface, version 2
+ *
+ * Every file (or stream) opened by a decoder is represented by an opaque
+ * decoder context returned by open_file() or meta_data_load(). All functions
+ * working on a file take that context as their first argument, so a decoder
+ * must not keep any per-file state in global variables. This allows Gmu to
+ * use several instances of the same decoder at the same time, e.g. for
+ * playback while reading meta data of other files.
+ *
+ * The functions not taking a context (init_decoder(), get_name(), ...) work
+ * on the decoder as a whole and may be called at any time.
+ */
 typedef struct _GmuDecoder {
 	/* Short identifier such as "vorbis_decoder" */
 	const char   *identifier;
@@ -51,48 +64,51 @@ typedef struct _GmuDecoder {
 	 * This function is optional, but required for http streaming audio. */
 	const char * (*get_mime_types)(void);
 	/* Open function, parameter is the filename (with absolute path) of 
-	 * the file to be decoded. Must return TRUE on success, FALSE otherwise. 
-	 * If set_reader_handle() has been defined, the supplied Reader handle should
-	 * be used for file/stream access, instead of doing file access with fopen() etc. */
-	int          (*open_file)(const char *filename);
-	/* Function to close the previously opened file, free memory etc. */
-	int          (*close_file)(void);
+	 * the file to be decoded. Must return a new decoder context on success,
+	 * NULL otherwise. If uses_reader is TRUE, r is a Reader handle which
+	 * should be used for file/stream access, instead of doing file access
+	 * with fopen() etc. The Reader is owned by Gmu and stays valid until
+	 * close_file() has been called. */
+	void        *(*open_file)(const char *filename, Reader *r);
+	/* Function to close the previously opened file, free the context etc. */
+	int          (*close_file)(void *ctx);
 	/* Decodes up to max_size bytes of audio data and writes it to target,
 	 * returns actual size; Returns number of bytes decoded or 0 on EOF
 	 * a negative value in case of a permanent decoder error */
-	int          (*decode_data)(char *target, size_t max_size);
+	int          (*decode_data)(void *ctx, char *target, size_t max_size);
 	/* Seeks in the audio stream, can be NULL if seeking is not supported.
 	 * Returns TRUE on success. "second" is the second in the stream to seek to
 	 * from the beginning, that is second=0 would be the beginning of the track */
-	int          (*seek)(int second);
+	int          (*seek)(void *ctx, int second);
 	/* Returns the current bitrate (in bps) (if available) */
-	int          (*get_current_bitrate)(void);
+	int          (*get_current_bitrate)(void *ctx);
 	/* Returns meta data of the track such as artist, title, album, ... 
-	 * If for_current_file is TRUE meta data is returned for the current file
-	 * otherwise meta data previously loaded with meta_data_load is returned */
-	const char * (*get_meta_data)(GmuMetaDataType gmdt, int for_current_file);
+	 * ctx can be either a context returned by open_file() or one returned
+	 * by meta_data_load() */
+	const char * (*get_meta_data)(void *ctx, GmuMetaDataType gmdt);
 	/* Returns meta data similar to the above function, except it returns data
 	 * of type 'int' instead of 'char *'. Can be NULL. */
-	int          (*get_meta_data_int)(GmuMetaDataType gmdt, int for_current_file);
+	int          (*get_meta_data_int)(void *ctx, GmuMetaDataType gmdt);
 	/* Returns the sample rate of the current file in Hz such as 44100 */
-	int          (*get_samplerate)(void);
+	int          (*get_samplerate)(void *ctx);
 	/* Returns the numer of channels of the current file such as 2 for stereo */
-	int          (*get_channels)(void);
+	int          (*get_channels)(void *ctx);
 	/* Returns the length of the current file (in seconds) */
-	int          (*get_length)(void);
+	int          (*get_length)(void *ctx);
 	/* Returns the (average) overall bitrate of the current file (in bps) */
-	int          (*get_bitrate)(void);
+	int          (*get_bitrate)(void *ctx);
 	/* Returns the file type of the current file (such as "Ogg Vorbis") */
-	const char * (*get_file_type)(void);
+	const char * (*get_file_type)(void *ctx);
 	/* Returns the buffer size (in bytes) used by the decoder (e.g. 2048) */
 	int          (*get_decoder_buffer_size)(void);
 	/* Loads the meta data for a given file only. No decoding is done.
-	 * Returns 1 on success, 0 otherwise. Can be NULL if not available. */
-	int          (*meta_data_load)(const char *filename);
+	 * Returns a new decoder context on success, NULL otherwise.
+	 * Can be NULL if not available. */
+	void        *(*meta_data_load)(const char *filename);
 	/* Clean up function for the meta data loader. You should free any memory
-	 * allocated by meta_data_load and close any files opened by meta_data_load
-	 * here. Returns TRUE on success. Can be NULL not neccessary. */
-	int          (*meta_data_close)(void);
+	 * allocated by meta_data_load (including the context) and close any files
+	 * opened by meta_data_load here. Returns TRUE on success. */
+	int          (*meta_data_close)(void *ctx);
 	/* Returns the charset encoding of the meta data. Valid values are
 	 * M_CHARSET_UTF_8, M_CHARSET_ISO_8859_1, M_CHARSET_UTF_16_BOM, 
 	 * M_CHARSET_UTF_16_BE, M_CHARSET_UTF_16_LE and M_CHARSET_AUTODETECT.
@@ -102,15 +118,57 @@ typedef struct _GmuDecoder {
 	 * This function is optional, but is recommended for streaming audio. Returns 1
 	 * on success and 0 otherwise. */
 	int          (*data_check_magic_bytes)(const char *data, size_t size);
-	/* Supplies a Reader handle for reading file/stream data. This function is
-	 * optional, but required for http streaming audio. If this function is not NULL
-	 * the decoder has to close the supplied handle, when finished. */
-	void         (*set_reader_handle)(Reader *r);
-	/* internal handle, do not use */
+	/* TRUE if the decoder reads through the Reader handle supplied to
+	 * open_file(). This is required for http streaming audio. */
+	int           uses_reader;
+	/* internal handles, do not use */
 	void         *handle;
+	void         *legacy;
 } GmuDecoder;
 
 /* This function must be implemented by the decoder. It must return a valid
  * GmuDecoder object */
 GmuDecoder *GMU_REGISTER_DECODER(void);
+
+/*
+ * Decoder interface, version 1 (deprecated)
+ *
+ * Decoders built against this interface keep their state in global
+ * variables and thus can only handle one file for playback and one file
+ * for meta data reading at a time. They register with gmu_register_decoder()
+ * and are still supported through a compatibility layer in the decoder
+ * loader. See the version 2 interface above for a description of the
+ * functions.
+ */
+typedef struct _GmuDecoderV1 {
+	const char   *identifier;
+	void         (*init_decoder)(void);
+	void         (*close_decoder)(void);
+	const char * (*get_name)(void);
+	const char * (*get_info)(void);
+	const char * (*get_file_extensions)(void);
+	const char * (*get_mime_types)(void);
+	int          (*open_file)(const char *filename);
+	int          (*close_file)(void);
+	int          (*decode_data)(char *target, size_t max_size);
+	int          (*seek)(int second);
+	int          (*get_current_bitrate)(void);
+	/* If for_current_file is TRUE meta data is returned for the current file
+	 * otherwise meta data previously loaded with meta_data_load is returned */
+	const char * (*get_meta_data)(GmuMetaDataType gmdt, int for_current_file);
+	int          (*get_meta_data_int)(GmuMetaDataType gmdt, int for_current_file);
+	int          (*get_samplerate)(void);
+	int          (*get_channels)(void);
+	int          (*get_length)(void);
+	int          (*get_bitrate)(void);
+	const char * (*get_file_type)(void);
+	int          (*get_decoder_buffer_size)(void);
+	int          (*meta_data_load)(const char *filename);
+	int          (*meta_data_close)(void);
+	GmuCharset   (*meta_data_get_charset)(void);
+	int          (*data_check_magic_bytes)(const char *data, size_t size);
+	/* Supplies a Reader handle; the decoder uses it for the next open_file() */
+	void         (*set_reader_handle)(Reader *r);
+	void         *handle;
+} GmuDecoderV1;
 #endif
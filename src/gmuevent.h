@@ -26,6 +26,6 @@ typedef enum GmuEvent {
 	GMU_BUFFERING, GMU_BUFFERING_FAILED, GMU_BUFFERING_DONE,
 	GMU_PLAYBACK_TIME_CHANGE, GMU_MEDIALIB_REFRESH_DONE,
 	GMU_MEDIALIB_SEARCH_START, GMU_MEDIALIB_SEARCH_DONE,
-	GMU_ERROR
+	GMU_ERROR, GMU_AUDIO_BUFFER_UNDERRUN
 } GmuEvent;
 #endif
@@ -0,0 +1,351 @@
+/*
+ * Gmu Music Player
+ *
+ * Copyright (c) 2006-2021 Johannes Heimansberg (wej.k.vu)
+ *
+ * File: httpcache.c  Created: 261017
+ *
+ * Description: Persistent on-disk cache for files fetched via HTTP
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2 of
+ * the License. See the file COPYING in the Gmu's main directory
+ * for details.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "httpcache.h"
+#include "wejconfig.h"
+#include "util.h"
+#include "debug.h"
+
+/*
+ * Each cached file is stored as <key>.data together with a <key>.meta
+ * file holding the URL and response details. The key is a hash of the
+ * URL. Downloads in progress are written to <key>.part.XXXXXX files.
+ * The modification time of the data file is used as last access time
+ * for LRU eviction.
+ */
+#define DATA_SUFFIX ".data"
+#define META_SUFFIX ".meta"
+#define PART_SUFFIX ".part."
+
+static char           *cache_dir;
+static long            cache_size_max;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct
+{
+	char   key[HTTPCACHE_KEY_LENGTH+1];
+	time_t atime;
+	long   size;
+} CacheFileInfo;
+
+static unsigned long fnv1a_hash(const char *str, unsigned long hash)
+{
+	for (; *str; str++) {
+		hash ^= (unsigned char)*str;
+		hash  = (hash * 16777619UL) & 0xFFFFFFFFUL;
+	}
+	return hash;
+}
+
+/* Two differently seeded 32 bit hashes make up the 64 bit key */
+static void cache_key(const char *url, char *key)
+{
+	snprintf(key, HTTPCACHE_KEY_LENGTH+1, "%08lx%08lx",
+	         fnv1a_hash(url, 2166136261UL), fnv1a_hash(url, 84696351UL));
+}
+
+static char *cache_path_alloc(const char *key, const char *suffix)
+{
+	size_t len  = strlen(cache_dir) + 1 + strlen(key) + strlen(suffix) + 1;
+	char  *path = malloc(len);
+
+	if (path) snprintf(path, len, "%s/%s%s", cache_dir, key, suffix);
+	return path;
+}
+
+static char *strdup_or_empty(const char *str)
+{
+	char *res;
+
+	if (!str) str = "";
+	if ((res = malloc(strlen(str) + 1))) strcpy(res, str);
+	return res;
+}
+
+static void cache_entry_remove(const char *key)
+{
+	char *path;
+
+	if ((path = cache_path_alloc(key, DATA_SUFFIX))) {
+		unlink(path);
+		free(path);
+	}
+	if ((path = cache_path_alloc(key, META_SUFFIX))) {
+		unlink(path);
+		free(path);
+	}
+}
+
+static int cmp_file_info(const void *a, const void *b)
+{
+	const CacheFileInfo *fa = (const CacheFileInfo *)a, *fb = (const CacheFileInfo *)b;
+	return fa->atime < fb->atime ? -1 : fa->atime > fb->atime ? 1 : 0;
+}
+
+/*
+ * Removes the least recently used entries until 'space_needed' bytes
+ * can be added without exceeding the maximum cache size. With
+ * 'remove_parts' set, temporary files of incomplete downloads are
+ * removed as well. Must be called with cache_mutex held.
+ */
+static void cache_evict(long space_needed, int remove_parts)
+{
+	DIR           *dir = opendir(cache_dir);
+	struct dirent *de;
+	CacheFileInfo *files = NULL;
+	size_t         num_files = 0, files_allocated = 0, i;
+	long           total = 0;
+
+	if (!dir) return;
+	while ((de = readdir(dir))) {
+		size_t      len = strlen(de->d_name);
+		struct stat st;
+		char       *path;
+
+		if (remove_parts && strstr(de->d_name, PART_SUFFIX)) {
+			if ((path = cache_path_alloc(de->d_name, ""))) {
+				wdprintf(V_DEBUG, "httpcache", "Removing incomplete download %s.\n", de->d_name);
+				unlink(path);
+				free(path);
+			}
+			continue;
+		}
+		if (len != HTTPCACHE_KEY_LENGTH + strlen(DATA_SUFFIX) ||
+		    strcmp(de->d_name + HTTPCACHE_KEY_LENGTH, DATA_SUFFIX) != 0)
+			continue;
+		if (!(path = cache_path_alloc(de->d_name, ""))) continue;
+		if (stat(path, &st) == 0) {
+			if (num_files == files_allocated) {
+				size_t         n   = files_allocated ? files_allocated * 2 : 64;
+				CacheFileInfo *tmp = realloc(files, n * sizeof(CacheFileInfo));
+
+				if (tmp) {
+					files = tmp;
+					files_allocated = n;
+				}
+			}
+			if (num_files < files_allocated) {
+				memcpy(files[num_files].key, de->d_name, HTTPCACHE_KEY_LENGTH);
+				files[num_files].key[HTTPCACHE_KEY_LENGTH] = '\0';
+				files[num_files].atime = st.st_mtime;
+				files[num_files].size  = st.st_size;
+				num_files++;
+			}
+			total += st.st_size;
+		}
+		free(path);
+	}
+	closedir(dir);
+	if (total + space_needed > cache_size_max && num_files > 0) {
+		qsort(files, num_files, sizeof(CacheFileInfo), cmp_file_info);
+		for (i = 0; i < num_files && total + space_needed > cache_size_max; i++) {
+			wdprintf(V_DEBUG, "httpcache", "Evicting %s (%ld bytes).\n", files[i].key, files[i].size);
+			cache_entry_remove(files[i].key);
+			total -= files[i].size;
+		}
+	}
+	if (files) free(files);
+}
+
+int httpcache_init(const char *dir, int max_size_mb)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&cache_mutex);
+	if (cache_dir) free(cache_dir);
+	cache_dir = NULL;
+	cache_size_max = 0;
+	if (dir && max_size_mb > 0 && (rmkdir(dir, S_IRWXU) == 0 || errno == EEXIST) &&
+	    (cache_dir = strdup_or_empty(dir))) {
+		cache_size_max = (long)max_size_mb * 1024 * 1024;
+		wdprintf(V_INFO, "httpcache", "Using %s (max. %d MB).\n", cache_dir, max_size_mb);
+		cache_evict(0, 1);
+		res = 1;
+	} else if (max_size_mb > 0) {
+		wdprintf(V_WARNING, "httpcache", "Unable to use cache directory %s.\n", dir ? dir : "(none)");
+	}
+	pthread_mutex_unlock(&cache_mutex);
+	return res;
+}
+
+void httpcache_free(void)
+{
+	pthread_mutex_lock(&cache_mutex);
+	if (cache_dir) free(cache_dir);
+	cache_dir = NULL;
+	cache_size_max = 0;
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+int httpcache_is_cacheable(long size)
+{
+	int res;
+
+	pthread_mutex_lock(&cache_mutex);
+	res = cache_dir && size > 0 && size <= cache_size_max;
+	pthread_mutex_unlock(&cache_mutex);
+	return res;
+}
+
+char *httpcache_lookup_alloc(const char *url, char *content_type, size_t content_type_size,
+                             char *etag, size_t etag_size, long *size)
+{
+	char        key[HTTPCACHE_KEY_LENGTH+1];
+	char       *data_path = NULL, *meta_path = NULL;
+	ConfigFile *meta = NULL;
+	struct stat st;
+	int         hit = 0;
+
+	pthread_mutex_lock(&cache_mutex);
+	if (cache_dir && url) {
+		cache_key(url, key);
+		data_path = cache_path_alloc(key, DATA_SUFFIX);
+		meta_path = cache_path_alloc(key, META_SUFFIX);
+		if (data_path && meta_path && stat(data_path, &st) == 0 && (meta = cfg_init()) &&
+		    cfg_read_config_file(meta, meta_path) == CFG_SUCCESS) {
+			char *val = cfg_get_key_value(meta, "URL");
+
+			/* The data is only used if it belongs to the URL and is complete */
+			if (val && strcmp(val, url) == 0 &&
+			    (val = cfg_get_key_value(meta, "Length")) && atol(val) == st.st_size) {
+				hit = 1;
+				if (content_type && content_type_size > 0) {
+					val = cfg_get_key_value(meta, "ContentType");
+					snprintf(content_type, content_type_size, "%s", val ? val : "");
+				}
+				if (etag && etag_size > 0) {
+					val = cfg_get_key_value(meta, "ETag");
+					snprintf(etag, etag_size, "%s", val ? val : "");
+				}
+				if (size) *size = st.st_size;
+				utimes(data_path, NULL); /* Mark as recently used */
+			}
+		}
+		if (meta) cfg_free(meta);
+	}
+	pthread_mutex_unlock(&cache_mutex);
+	if (meta_path) free(meta_path);
+	if (!hit && data_path) {
+		free(data_path);
+		data_path = NULL;
+	}
+	return data_path;
+}
+
+void httpcache_remove(const char *url)
+{
+	char key[HTTPCACHE_KEY_LENGTH+1];
+
+	pthread_mutex_lock(&cache_mutex);
+	if (cache_dir && url) {
+		cache_key(url, key);
+		cache_entry_remove(key);
+		wdprintf(V_DEBUG, "httpcache", "Removed %s.\n", key);
+	}
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+void httpcache_entry_init(HttpCacheEntry *e)
+{
+	memset(e, 0, sizeof(HttpCacheEntry));
+	e->fd = -1;
+}
+
+int httpcache_entry_create(HttpCacheEntry *e, const char *url, const char *etag,
+                           const char *content_type, long size)
+{
+	int res = 0;
+
+	httpcache_entry_init(e);
+	pthread_mutex_lock(&cache_mutex);
+	if (cache_dir && url && size > 0 && size <= cache_size_max) {
+		cache_key(url, e->key);
+		/* Make room for the new file */
+		cache_entry_remove(e->key);
+		cache_evict(size, 0);
+		e->part_file = cache_path_alloc(e->key, PART_SUFFIX "XXXXXX");
+		if (e->part_file && (e->fd = mkstemp(e->part_file)) >= 0) {
+			e->url          = strdup_or_empty(url);
+			e->etag         = strdup_or_empty(etag);
+			e->content_type = strdup_or_empty(content_type);
+			e->size         = size;
+			res = e->url && e->etag && e->content_type;
+		} else {
+			wdprintf(V_WARNING, "httpcache", "Unable to create cache file: %s\n", strerror(errno));
+		}
+	}
+	pthread_mutex_unlock(&cache_mutex);
+	if (!res) httpcache_entry_close(e);
+	return res;
+}
+
+int httpcache_entry_commit(HttpCacheEntry *e)
+{
+	int         res = 0;
+	char       *data_path = NULL, *meta_path = NULL;
+	ConfigFile *meta = cfg_init();
+	char        size_str[24];
+
+	pthread_mutex_lock(&cache_mutex);
+	if (meta && cache_dir && e->fd >= 0 &&
+	    (data_path = cache_path_alloc(e->key, DATA_SUFFIX)) &&
+	    (meta_path = cache_path_alloc(e->key, META_SUFFIX))) {
+		snprintf(size_str, sizeof(size_str), "%ld", e->size);
+		cfg_add_key(meta, "URL", e->url);
+		cfg_add_key(meta, "ETag", e->etag);
+		cfg_add_key(meta, "Length", size_str);
+		cfg_add_key(meta, "ContentType", e->content_type);
+		/* The meta file is written first; The entry becomes valid with the rename */
+		if (cfg_write_config_file(meta, meta_path) == CFG_SUCCESS &&
+		    rename(e->part_file, data_path) == 0) {
+			free(e->part_file);
+			e->part_file = NULL;
+			wdprintf(V_DEBUG, "httpcache", "Added %s as %s.\n", e->url, e->key);
+			cache_evict(0, 0);
+			res = 1;
+		} else {
+			wdprintf(V_WARNING, "httpcache", "Unable to store cache entry %s.\n", e->key);
+			unlink(meta_path);
+		}
+	}
+	pthread_mutex_unlock(&cache_mutex);
+	if (data_path) free(data_path);
+	if (meta_path) free(meta_path);
+	if (meta) cfg_free(meta);
+	return res;
+}
+
+void httpcache_entry_close(HttpCacheEntry *e)
+{
+	if (e->fd >= 0) close(e->fd);
+	if (e->part_file) {
+		unlink(e->part_file);
+		free(e->part_file);
+	}
+	if (e->url) free(e->url);
+	if (e->etag) free(e->etag);
+	if (e->content_type) free(e->content_type);
+	httpcache_entry_init(e);
+}
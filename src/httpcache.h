@@ -0,0 +1,64 @@
+/*
+ * Gmu Music Player
+ *
+ * Copyright (c) 2006-2021 Johannes Heimansberg (wej.k.vu)
+ *
+ * File: httpcache.h  Created: 261017
+ *
+ * Description: Persistent on-disk cache for files fetched via HTTP
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2 of
+ * the License. See the file COPYING in the Gmu's main directory
+ * for details.
+ */
+#ifndef HTTPCACHE_H
+#define HTTPCACHE_H
+
+#define HTTPCACHE_KEY_LENGTH 16
+
+/* A cache entry that is being downloaded */
+typedef struct
+{
+	int   fd;                              /* Temporary data file; -1 if not in use */
+	char *part_file;                       /* Path of the temporary data file */
+	char  key[HTTPCACHE_KEY_LENGTH+1];
+	char *url;
+	char *etag;
+	char *content_type;
+	long  size;
+} HttpCacheEntry;
+
+/*
+ * Enables the cache with the given directory and maximum size in MB.
+ * Incomplete downloads from earlier sessions are removed.
+ * Returns 1 on success, 0 otherwise.
+ */
+int   httpcache_init(const char *dir, int max_size_mb);
+void  httpcache_free(void);
+/* Returns 1 if a file of 'size' bytes fits into the (enabled) cache */
+int   httpcache_is_cacheable(long size);
+/*
+ * Looks up 'url' in the cache. Returns the path of the cached data file
+ * or NULL if the file is not cached. The entry's content type and ETag
+ * are copied to 'content_type' and 'etag' (if not NULL), its size to
+ * 'size'. The caller is expected to check these against the server
+ * before using the data. The returned path needs to be free'd.
+ */
+char *httpcache_lookup_alloc(const char *url, char *content_type, size_t content_type_size,
+                             char *etag, size_t etag_size, long *size);
+/* Removes the entry for 'url' (e.g. because it is outdated) */
+void  httpcache_remove(const char *url);
+void  httpcache_entry_init(HttpCacheEntry *e);
+/*
+ * Starts a new cache entry. The data is written to e->fd and becomes
+ * visible in the cache when the entry is committed. Returns 1 on success.
+ */
+int   httpcache_entry_create(HttpCacheEntry *e, const char *url, const char *etag,
+                             const char *content_type, long size);
+/* Adds the completely downloaded entry to the cache. Returns 1 on success. */
+int   httpcache_entry_commit(HttpCacheEntry *e);
+/* Closes the entry, discarding its data unless it has been committed */
+void  httpcache_entry_close(HttpCacheEntry *e);
+#endif
@@ -0,0 +1,317 @@
+/*
+ * Gmu Music Player
+ *
+ * Copyright (c) 2006-2021 Johannes Heimansberg (wej.k.vu)
+ *
+ * File: httpconn.c  Created: 261017
+ *
+ * Description: HTTP connection handling with keep-alive pool and DNS cache
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2 of
+ * the License. See the file COPYING in the Gmu's main directory
+ * for details.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include "httpconn.h"
+#include "debug.h"
+
+#define HOST_NAME_SIZE 256
+
+/* Idle connections kept open for reuse */
+#define POOL_SIZE     4
+#define POOL_IDLE_MAX 15 /* seconds */
+
+/* Resolved addresses are kept for DNS_CACHE_TTL seconds */
+#define DNS_CACHE_SIZE     8
+#define DNS_CACHE_TTL      120
+#define DNS_CACHE_ADDR_MAX 4
+
+typedef struct
+{
+	char   host[HOST_NAME_SIZE];
+	int    port;
+	int    sockfd; /* -1 if unused */
+	time_t since;
+} PooledConnection;
+
+typedef struct
+{
+	int                     family, socktype, protocol;
+	socklen_t               addrlen;
+	struct sockaddr_storage addr;
+} HostAddress;
+
+typedef struct
+{
+	char        host[HOST_NAME_SIZE];
+	int         port;
+	time_t      expires; /* 0 if unused */
+	int         num_addr;
+	HostAddress addr[DNS_CACHE_ADDR_MAX];
+} DnsCacheEntry;
+
+static PooledConnection pool[POOL_SIZE] = {
+	{ "", 0, -1, 0 }, { "", 0, -1, 0 }, { "", 0, -1, 0 }, { "", 0, -1, 0 }
+};
+static DnsCacheEntry    dns_cache[DNS_CACHE_SIZE];
+static int              connect_timeout = HTTPCONN_CONNECT_TIMEOUT_DEFAULT;
+static int              recv_timeout    = HTTPCONN_RECV_TIMEOUT_DEFAULT;
+static pthread_mutex_t  mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static time_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+void httpconn_set_timeouts(int connect_timeout_s, int recv_timeout_s)
+{
+	pthread_mutex_lock(&mutex);
+	if (connect_timeout_s > 0) connect_timeout = connect_timeout_s;
+	if (recv_timeout_s > 0) recv_timeout = recv_timeout_s;
+	pthread_mutex_unlock(&mutex);
+	wdprintf(V_INFO, "httpconn", "Timeouts: connect %d s, receive %d s\n", connect_timeout, recv_timeout);
+}
+
+/* Returns 1 if the idle connection has been closed by the server (or sent unexpected data) */
+static int connection_is_stale(int sockfd)
+{
+	struct pollfd pfd;
+
+	pfd.fd = sockfd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return poll(&pfd, 1, 0) != 0;
+}
+
+/* Takes an idle connection to host:port from the pool. Must be called with mutex held. */
+static int pool_take(const char *host, int port)
+{
+	int    i, sockfd = -1;
+	time_t t = now();
+
+	for (i = 0; i < POOL_SIZE && sockfd < 0; i++) {
+		PooledConnection *pc = &pool[i];
+
+		if (pc->sockfd < 0 || pc->port != port || strcmp(pc->host, host) != 0) continue;
+		if (t - pc->since <= POOL_IDLE_MAX && !connection_is_stale(pc->sockfd))
+			sockfd = pc->sockfd;
+		else
+			close(pc->sockfd);
+		pc->sockfd = -1;
+	}
+	return sockfd;
+}
+
+void httpconn_release(const char *host, int port, int sockfd)
+{
+	int    i, slot = -1;
+	time_t t = now();
+
+	if (!host || strlen(host) >= HOST_NAME_SIZE) {
+		close(sockfd);
+		return;
+	}
+	pthread_mutex_lock(&mutex);
+	/* Use a free slot, or replace the connection that has been idle the longest */
+	for (i = 0; i < POOL_SIZE; i++) {
+		if (pool[i].sockfd >= 0 && t - pool[i].since > POOL_IDLE_MAX) {
+			close(pool[i].sockfd);
+			pool[i].sockfd = -1;
+		}
+	}
+	for (i = 0; i < POOL_SIZE; i++) {
+		if (pool[i].sockfd < 0) {
+			slot = i;
+			break;
+		}
+		if (slot < 0 || pool[i].since < pool[slot].since) slot = i;
+	}
+	if (pool[slot].sockfd >= 0) close(pool[slot].sockfd);
+	strcpy(pool[slot].host, host);
+	pool[slot].port   = port;
+	pool[slot].sockfd = sockfd;
+	pool[slot].since  = t;
+	pthread_mutex_unlock(&mutex);
+	wdprintf(V_DEBUG, "httpconn", "Keeping connection to %s:%d for reuse.\n", host, port);
+}
+
+/*
+ * Resolves host:port, using cached results if available. Fills 'addr'
+ * with up to DNS_CACHE_ADDR_MAX addresses and returns their number.
+ */
+static int resolve(const char *host, int port, HostAddress *addr)
+{
+	int    i, num_addr = 0, slot = 0;
+	time_t t = now();
+
+	pthread_mutex_lock(&mutex);
+	for (i = 0; i < DNS_CACHE_SIZE; i++) {
+		DnsCacheEntry *e = &dns_cache[i];
+
+		if (e->expires > t && e->port == port && strcmp(e->host, host) == 0) {
+			num_addr = e->num_addr;
+			memcpy(addr, e->addr, num_addr * sizeof(HostAddress));
+			break;
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+
+	if (num_addr == 0) {
+		struct addrinfo  hints, *servinfo, *p;
+		char             port_str[6];
+		int              rv;
+
+		snprintf(port_str, 6, "%d", port);
+		memset(&hints, 0, sizeof hints);
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if ((rv = getaddrinfo(host, port_str, &hints, &servinfo)) != 0) {
+			wdprintf(V_ERROR, "httpconn", "getaddrinfo: %s\n", gai_strerror(rv));
+		} else {
+			for (p = servinfo; p != NULL && num_addr < DNS_CACHE_ADDR_MAX; p = p->ai_next) {
+				if (p->ai_addrlen > sizeof(struct sockaddr_storage)) continue;
+				addr[num_addr].family   = p->ai_family;
+				addr[num_addr].socktype = p->ai_socktype;
+				addr[num_addr].protocol = p->ai_protocol;
+				addr[num_addr].addrlen  = p->ai_addrlen;
+				memcpy(&(addr[num_addr].addr), p->ai_addr, p->ai_addrlen);
+				num_addr++;
+			}
+			freeaddrinfo(servinfo);
+		}
+		if (num_addr > 0 && strlen(host) < HOST_NAME_SIZE) {
+			pthread_mutex_lock(&mutex);
+			/* Replace an expired entry or the one expiring first */
+			for (i = 1; i < DNS_CACHE_SIZE; i++)
+				if (dns_cache[i].expires < dns_cache[slot].expires) slot = i;
+			strcpy(dns_cache[slot].host, host);
+			dns_cache[slot].port     = port;
+			dns_cache[slot].expires  = t + DNS_CACHE_TTL;
+			dns_cache[slot].num_addr = num_addr;
+			memcpy(dns_cache[slot].addr, addr, num_addr * sizeof(HostAddress));
+			pthread_mutex_unlock(&mutex);
+		}
+	} else {
+		wdprintf(V_DEBUG, "httpconn", "Using cached address of %s.\n", host);
+	}
+	return num_addr;
+}
+
+/* get sockaddr, IPv4 or IPv6 */
+static void *get_in_addr(struct sockaddr *sa)
+{
+	if (sa->sa_family == AF_INET)
+		return &(((struct sockaddr_in*)sa)->sin_addr);
+	return &(((struct sockaddr_in6*)sa)->sin6_addr);
+}
+
+/* Connects to 'addr' without blocking longer than 'timeout_s' seconds */
+static int connect_with_timeout(HostAddress *addr, int timeout_s, int recv_timeout_s)
+{
+	int            sockfd, flags, err = 0;
+	struct timeval tv;
+
+	if ((sockfd = socket(addr->family, addr->socktype, addr->protocol)) == -1) {
+		wdprintf(V_INFO, "httpconn", "socket: %s\n", strerror(errno));
+		return -1;
+	}
+	tv.tv_sec = recv_timeout_s;
+	tv.tv_usec = 0;
+	if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof tv))
+		wdprintf(V_INFO, "httpconn", "setsockopt: %s\n", strerror(errno));
+
+	flags = fcntl(sockfd, F_GETFL, 0);
+	fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+	if (connect(sockfd, (struct sockaddr *)&(addr->addr), addr->addrlen) == -1) {
+		err = errno;
+		if (err == EINPROGRESS) {
+			struct pollfd pfd;
+			int           res;
+
+			wdprintf(V_DEBUG, "httpconn", "Connection in progress. Waiting...\n");
+			pfd.fd = sockfd;
+			pfd.events = POLLOUT;
+			do {
+				res = poll(&pfd, 1, timeout_s * 1000);
+			} while (res < 0 && errno == EINTR);
+			if (res > 0) {
+				socklen_t len = sizeof(int);
+				if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, (void *)&err, &len) < 0)
+					err = errno;
+			} else {
+				err = res == 0 ? ETIMEDOUT : errno;
+			}
+		}
+	}
+	if (err) {
+		wdprintf(V_INFO, "httpconn", "connect: %s\n", strerror(err));
+		close(sockfd);
+		sockfd = -1;
+	} else {
+		fcntl(sockfd, F_SETFL, flags & (~O_NONBLOCK));
+	}
+	return sockfd;
+}
+
+int httpconn_open(const char *host, int port, int allow_reuse, int *reused)
+{
+	HostAddress addr[DNS_CACHE_ADDR_MAX];
+	int         sockfd = -1, num_addr, i, timeout_s, recv_timeout_s;
+
+	*reused = 0;
+	pthread_mutex_lock(&mutex);
+	if (allow_reuse) sockfd = pool_take(host, port);
+	timeout_s = connect_timeout;
+	recv_timeout_s = recv_timeout;
+	pthread_mutex_unlock(&mutex);
+	if (sockfd >= 0) {
+		wdprintf(V_INFO, "httpconn", "Reusing connection to %s:%d.\n", host, port);
+		*reused = 1;
+		return sockfd;
+	}
+
+	wdprintf(V_INFO, "httpconn", "Opening connection to host %s on port %d.\n", host, port);
+	num_addr = resolve(host, port, addr);
+	/* Try all addresses and use the first one we can connect to */
+	for (i = 0; i < num_addr && sockfd < 0; i++)
+		sockfd = connect_with_timeout(&addr[i], timeout_s, recv_timeout_s);
+	if (sockfd >= 0) {
+		char s[INET6_ADDRSTRLEN];
+
+		inet_ntop(addr[i-1].family, get_in_addr((struct sockaddr *)&(addr[i-1].addr)), s, sizeof s);
+		wdprintf(V_INFO, "httpconn", "Connected to %s:%d.\n", s, port);
+	} else {
+		wdprintf(V_ERROR, "httpconn", "Failed to connect.\n");
+	}
+	return sockfd;
+}
+
+void httpconn_free(void)
+{
+	int i;
+
+	pthread_mutex_lock(&mutex);
+	for (i = 0; i < POOL_SIZE; i++) {
+		if (pool[i].sockfd >= 0) close(pool[i].sockfd);
+		pool[i].sockfd = -1;
+	}
+	memset(dns_cache, 0, sizeof(dns_cache));
+	pthread_mutex_unlock(&mutex);
+}
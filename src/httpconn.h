@@ -0,0 +1,33 @@
+/*
+ * Gmu Music Player
+ *
+ * Copyright (c) 2006-2021 Johannes Heimansberg (wej.k.vu)
+ *
+ * File: httpconn.h  Created: 261017
+ *
+ * Description: HTTP connection handling with keep-alive pool and DNS cache
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; version 2 of
+ * the License. See the file COPYING in the Gmu's main directory
+ * for details.
+ */
+#ifndef HTTPCONN_H
+#define HTTPCONN_H
+
+#define HTTPCONN_CONNECT_TIMEOUT_DEFAULT 5 /* seconds */
+#define HTTPCONN_RECV_TIMEOUT_DEFAULT    2 /* seconds */
+
+void httpconn_set_timeouts(int connect_timeout_s, int recv_timeout_s);
+/*
+ * Returns a socket connected to host:port, or -1 on failure. An idle
+ * connection to the host is reused if available, in which case *reused
+ * is set to 1. With 'allow_reuse' set to 0 a new connection is opened.
+ */
+int  httpconn_open(const char *host, int port, int allow_reuse, int *reused);
+/* Hands a connection with no pending response data back for reuse */
+void httpconn_release(const char *host, int port, int sockfd);
+/* Closes all idle connections and clears the DNS cache */
+void httpconn_free(void);
+#endif
@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sys/stat.h>
 #include <sqlite3.h>
 #include "medialib.h"
 #include "medialibsql.h"
@@ -22,15 +23,172 @@
 #include "core.h" /* For DEFAULT_THREAD_STACK_SIZE */
 #include "pthread_helper.h"
 
+/* Limits of the media library scanner */
+#define SCAN_MAX_THREADS  16
+#define SCAN_QUEUE_SIZE   64
+
+/* Number of rows written per transaction by bulk operations */
+#define MEDIALIB_TRANSACTION_CHUNK 256
+
+/* Number of results returned by medialib_search_find() */
+#define MEDIALIB_SEARCH_PAGE_SIZE 200
+
+static const char *stmt_cache_sql[MLIB_STMT_MAX] = {
+	"SELECT id FROM track WHERE file = ?1 LIMIT 1",
+	"INSERT INTO track (file, artist, title, album, comment, file_missing, file_size, file_mtime, dir_id, scan_gen) " \
+	"SELECT ?1, ?2, ?3, ?4, ?5, 0, ?6, ?7, ?8, ?9 " \
+	"WHERE NOT EXISTS (SELECT 1 FROM track WHERE file = ?1)",
+	"SELECT * FROM track WHERE id = ?1 LIMIT 1",
+	"UPDATE track SET file_missing = ?1 WHERE id = ?2",
+	"UPDATE track SET rating_explicit = ?2 WHERE id = ?1",
+	"UPDATE track SET rating_explicit = rating_explicit + 1 WHERE id = ?1",
+	"UPDATE track SET rating_explicit = rating_explicit - 1 WHERE id = ?1",
+	"INSERT INTO path (path) SELECT ?1 WHERE NOT EXISTS (SELECT 1 FROM path WHERE path = ?1)",
+	"DELETE FROM path WHERE path = ?1",
+	"DELETE FROM path WHERE id = ?1"
+};
+
+/*
+ * Returns the prepared statement s from the statement cache, preparing it
+ * on first use. The statement cache stays locked until the statement is
+ * handed back with medialib_stmt_release(). Returns NULL on failure.
+ */
+static sqlite3_stmt *medialib_stmt_get(GmuMedialib *gm, GmuMedialibStatement s)
+{
+	sqlite3_stmt *pp_stmt;
+
+	pthread_mutex_lock(&(gm->stmt_cache_mutex));
+	if (!gm->stmt_cache[s] &&
+	    sqlite3_prepare_v2(gm->db, stmt_cache_sql[s], -1, &(gm->stmt_cache[s]), NULL) != SQLITE_OK) {
+		wdprintf(V_ERROR, "medialib", "ERROR: Unable to prepare statement: %s\n", sqlite3_errmsg(gm->db));
+		sqlite3_finalize(gm->stmt_cache[s]);
+		gm->stmt_cache[s] = NULL;
+	}
+	pp_stmt = gm->stmt_cache[s];
+	if (!pp_stmt) pthread_mutex_unlock(&(gm->stmt_cache_mutex));
+	return pp_stmt;
+}
+
+static void medialib_stmt_release(GmuMedialib *gm, sqlite3_stmt *pp_stmt)
+{
+	sqlite3_reset(pp_stmt);
+	sqlite3_clear_bindings(pp_stmt);
+	pthread_mutex_unlock(&(gm->stmt_cache_mutex));
+}
+
+/*
+ * Transactions of different threads share the database connection, so
+ * they are serialized. medialib_transaction_chunk() commits the current
+ * transaction and starts a new one every MEDIALIB_TRANSACTION_CHUNK calls,
+ * giving other threads a chance to run their transactions in between.
+ */
+static void medialib_transaction_begin(GmuMedialib *gm)
+{
+	pthread_mutex_lock(&(gm->transaction_mutex));
+	sqlite3_exec(gm->db, "BEGIN", 0, 0, 0);
+}
+
+static void medialib_transaction_commit(GmuMedialib *gm)
+{
+	if (sqlite3_exec(gm->db, "COMMIT", 0, 0, 0) != SQLITE_OK)
+		wdprintf(V_ERROR, "medialib", "ERROR: Commit failed: %s\n", sqlite3_errmsg(gm->db));
+	pthread_mutex_unlock(&(gm->transaction_mutex));
+}
+
+static void medialib_transaction_rollback(GmuMedialib *gm)
+{
+	sqlite3_exec(gm->db, "ROLLBACK", 0, 0, 0);
+	pthread_mutex_unlock(&(gm->transaction_mutex));
+}
+
+static void medialib_transaction_chunk(GmuMedialib *gm, int *count)
+{
+	if (++(*count) % MEDIALIB_TRANSACTION_CHUNK == 0) {
+		medialib_transaction_commit(gm);
+		medialib_transaction_begin(gm);
+	}
+}
+
+/*
+ * Use write-ahead logging, so that readers on the separate query connection
+ * (searches and browsing from a frontend) are not blocked by a refresh
+ * writing on the main connection, and only sync at checkpoints.
+ */
+static void medialib_configure_connection(GmuMedialib *gm)
+{
+	const char *pragmas =
+		"PRAGMA journal_mode = WAL;" \
+		"PRAGMA synchronous = NORMAL;" \
+		"PRAGMA temp_store = MEMORY;" \
+		"PRAGMA cache_size = -4096;";
+
+	sqlite3_busy_timeout(gm->db, 5000);
+	if (sqlite3_exec(gm->db, pragmas, 0, 0, 0) != SQLITE_OK)
+		wdprintf(V_WARNING, "medialib", "Unable to configure database: %s\n", sqlite3_errmsg(gm->db));
+}
+
+/*
+ * Brings databases created by older versions of Gmu up to date. Version 2
+ * requires SQLite's FTS5 extension; without it the database stays at
+ * version 1 and searches fall back to LIKE queries.
+ */
+static int medialib_upgrade(GmuMedialib *gm)
+{
+	sqlite3_stmt *pp_stmt = NULL;
+	int           version = -1, res = 1;
+
+	if (sqlite3_prepare_v2(gm->db, "PRAGMA user_version", -1, &pp_stmt, NULL) == SQLITE_OK &&
+	    sqlite3_step(pp_stmt) == SQLITE_ROW)
+		version = sqlite3_column_int(pp_stmt, 0);
+	sqlite3_finalize(pp_stmt);
+	if (version == 0) {
+		wdprintf(V_INFO, "medialib", "Upgrading database to version 1...\n");
+		res = (sqlite3_exec(gm->db, medialib_sql_upgrade_1, 0, 0, 0) == SQLITE_OK);
+		if (!res) wdprintf(V_ERROR, "medialib", "ERROR: Upgrade failed: %s\n", sqlite3_errmsg(gm->db));
+		else version = 1;
+	}
+	if (version == 1) {
+		wdprintf(V_INFO, "medialib", "Upgrading database to version 2 (building search index)...\n");
+		medialib_transaction_begin(gm);
+		if (sqlite3_exec(gm->db, medialib_sql_upgrade_2, 0, 0, 0) == SQLITE_OK) {
+			version = 2;
+			medialib_transaction_commit(gm);
+		} else {
+			wdprintf(V_WARNING, "medialib", "No full-text search index: %s\n", sqlite3_errmsg(gm->db));
+			medialib_transaction_rollback(gm);
+		}
+	}
+	gm->have_fts = (version >= 2);
+	return res;
+}
+
+/*
+ * Searches and browsing use their own read-only connection. Each connection
+ * serialises its calls on its own mutex, so queries on the main connection
+ * would have to wait for the statements of a running refresh.
+ */
+static void medialib_open_query_connection(GmuMedialib *gm, const char *gmu_db)
+{
+	gm->db_query = gm->db;
+	if (sqlite3_open_v2(gmu_db, &(gm->db_query), SQLITE_OPEN_READONLY | SQLITE_OPEN_FULLMUTEX, NULL) == SQLITE_OK) {
+		sqlite3_busy_timeout(gm->db_query, 5000);
+	} else {
+		wdprintf(V_WARNING, "medialib", "No separate query connection: %s\n", sqlite3_errmsg(gm->db_query));
+		sqlite3_close(gm->db_query);
+		gm->db_query = gm->db;
+	}
+}
+
 int medialib_create_db_and_open(GmuMedialib *gm)
 {
 	int   res = 0;
 	char *gmu_db = get_data_dir_with_name_alloc("gmu", 1, "gmu.db");
 
 	if (gmu_db && sqlite3_open_v2(gmu_db, &(gm->db), SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, NULL) == SQLITE_OK) {
+		medialib_configure_connection(gm);
 		res = sqlite3_exec(gm->db, medialib_sql, 0, 0, 0);
 		wdprintf(V_DEBUG, "medialib", "Create result: %d\n", res);
-		if (res == SQLITE_OK) res = 1;
+		if (res == SQLITE_OK) res = medialib_upgrade(gm);
 	}
 	free(gmu_db);
 	return res;
@@ -42,6 +200,13 @@ int medialib_open(GmuMedialib *gm)
 	char *gmu_db = get_data_dir_with_name_alloc("gmu", 1, "gmu.db");
 
 	gm->refresh_in_progress = 0;
+	gm->scan_threads = 1;
+	gm->have_fts = 0;
+	gm->pp_stmt_search = NULL;
+	gm->db_query = NULL;
+	memset(gm->stmt_cache, 0, sizeof(gm->stmt_cache));
+	pthread_mutex_init(&(gm->stmt_cache_mutex), NULL);
+	pthread_mutex_init(&(gm->transaction_mutex), NULL);
 	wdprintf(V_INFO, "medialib", "Opening medialib...\n");
 	if (gmu_db && sqlite3_open_v2(gmu_db, &(gm->db), SQLITE_OPEN_READWRITE | SQLITE_OPEN_FULLMUTEX, NULL) != SQLITE_OK) {
 		wdprintf(V_ERROR, "medialib", "ERROR: Can't open database: %s\n", sqlite3_errmsg(gm->db));
@@ -50,41 +215,103 @@ int medialib_open(GmuMedialib *gm)
 		res = medialib_create_db_and_open(gm);
 		if (res) wdprintf(V_INFO, "medialib", "New database created!\n");
 	} else {
-		res = 1;
+		medialib_configure_connection(gm);
+		res = medialib_upgrade(gm);
 		wdprintf(V_INFO, "medialib", "OK!\n");
 	}
+	if (res) medialib_open_query_connection(gm, gmu_db);
 	free(gmu_db);
 	return res;
 }
 
 void medialib_close(GmuMedialib *gm)
 {
+	int i;
+
+	for (i = 0; i < MLIB_STMT_MAX; i++) {
+		sqlite3_finalize(gm->stmt_cache[i]);
+		gm->stmt_cache[i] = NULL;
+	}
+	if (gm->db_query && gm->db_query != gm->db) sqlite3_close(gm->db_query);
 	if (gm->db) sqlite3_close(gm->db);
+	gm->db_query = NULL;
+	pthread_mutex_destroy(&(gm->transaction_mutex));
+	pthread_mutex_destroy(&(gm->stmt_cache_mutex));
 }
 
 /*
- * Adds a single file (file = filename with full path) to the medialib
- * Returns 1 on success, 0 otherwise
+ * Inserts a track with its meta data, if its file is not in the medialib
+ * already. Returns the number of tracks inserted (0 or 1).
  */
-int medialib_add_file(GmuMedialib *gm, const char *file)
+static int insert_track(GmuMedialib *gm, const GmuMedialibTrack *t)
+{
+	sqlite3_stmt *pp_stmt = medialib_stmt_get(gm, MLIB_STMT_TRACK_INSERT);
+	int           res = 0;
+
+	if (pp_stmt) {
+		int a, b, c, d, e, f, g, h, i;
+
+		a = sqlite3_bind_text(pp_stmt, 1, t->file,    -1, SQLITE_STATIC);
+		b = sqlite3_bind_text(pp_stmt, 2, t->artist,  -1, SQLITE_STATIC);
+		c = sqlite3_bind_text(pp_stmt, 3, t->title,   -1, SQLITE_STATIC);
+		d = sqlite3_bind_text(pp_stmt, 4, t->album,   -1, SQLITE_STATIC);
+		e = sqlite3_bind_text(pp_stmt, 5, t->comment, -1, SQLITE_STATIC);
+		f = sqlite3_bind_int64(pp_stmt, 6, (sqlite3_int64)t->size);
+		g = sqlite3_bind_int64(pp_stmt, 7, (sqlite3_int64)t->mtime);
+		h = t->dir_id ? sqlite3_bind_int64(pp_stmt, 8, t->dir_id) : SQLITE_OK;
+		i = t->scan_gen ? sqlite3_bind_int(pp_stmt, 9, t->scan_gen) : SQLITE_OK;
+		if (a == SQLITE_OK && b == SQLITE_OK && c == SQLITE_OK && d == SQLITE_OK && e == SQLITE_OK &&
+		    f == SQLITE_OK && g == SQLITE_OK && h == SQLITE_OK && i == SQLITE_OK) {
+			int sqres = sqlite3_step(pp_stmt);
+			if (sqres != SQLITE_DONE)
+				wdprintf(V_ERROR, "medialib", "ERROR while inserting into database: ERROR %d\n", sqres);
+			else
+				res = sqlite3_changes(gm->db);
+		} else {
+			wdprintf(V_ERROR, "medialib", "Problem with SQL parameters.\n");
+		}
+		medialib_stmt_release(gm, pp_stmt);
+	}
+	return res;
+}
+
+/*
+ * Adds count tracks in chunked transactions, skipping files that are in
+ * the medialib already. Returns the number of tracks added.
+ */
+int medialib_add_tracks(GmuMedialib *gm, const GmuMedialibTrack *tracks, int count)
+{
+	int i, n = 0, res = 0;
+
+	medialib_transaction_begin(gm);
+	for (i = 0; i < count; i++) {
+		if (insert_track(gm, &(tracks[i]))) {
+			res++;
+			medialib_transaction_chunk(gm, &n);
+		}
+	}
+	medialib_transaction_commit(gm);
+	return res;
+}
+
+/* Adds a single file to the medialib, if it is not there already */
+static int add_file(GmuMedialib *gm, const char *file)
 {
 	TrackInfo     ti;
 	char          filetype[16];
 	const char   *tmp = get_file_extension(file);
-	const char   *q;
-	sqlite3_stmt *pp_stmt = NULL;
+	sqlite3_stmt *pp_stmt;
 	int           sqres;
 	int           new_file = 1;
 	int           res = 0;
+	struct stat   attr;
 
 	filetype[0] = '\0';
 	if (tmp != NULL)
 		strtoupper(filetype, tmp, 15);
 
 	wdprintf(V_DEBUG, "medialib", "file=%s type=%s\n", file, filetype);
-	q = "SELECT id FROM track WHERE file = ?1 LIMIT 1";
-	sqres = sqlite3_prepare_v2(gm->db, q, -1, &pp_stmt, NULL);
-	if (sqres == SQLITE_OK) {
+	if ((pp_stmt = medialib_stmt_get(gm, MLIB_STMT_TRACK_FIND))) {
 		if (sqlite3_bind_text(pp_stmt, 1, file, -1, SQLITE_STATIC) == SQLITE_OK) {
 			sqres = sqlite3_step(pp_stmt);
 			if (sqres == SQLITE_ROW) {
@@ -92,46 +319,40 @@ int medialib_add_file(GmuMedialib *gm, const char *file)
 				wdprintf(V_DEBUG, "medialib", "File already in media library.\n");
 			}
 		}
-		sqlite3_finalize(pp_stmt);
+		medialib_stmt_release(gm, pp_stmt);
 	}
 
 	trackinfo_init(&ti, 0);
-	if (new_file && metadatareader_read(file, filetype, &ti)) {
+	if (new_file && stat(file, &attr) == 0 && metadatareader_read(file, filetype, &ti)) {
 		/* Add file with metadata to media library... */
-		int         a, b, c, d, e;
-		const char *q = "INSERT INTO track (file, artist, title, album, comment, file_missing) VALUES (?1, ?2, ?3, ?4, ?5, 0)";
-
-		sqres = sqlite3_prepare_v2(gm->db, q, -1, &pp_stmt, NULL);
-		if (sqres == SQLITE_OK) {
-			a = sqlite3_bind_text(pp_stmt, 1, file,       -1, SQLITE_STATIC);
-			b = sqlite3_bind_text(pp_stmt, 2, ti.artist,  -1, SQLITE_STATIC);
-			c = sqlite3_bind_text(pp_stmt, 3, ti.title,   -1, SQLITE_STATIC);
-			d = sqlite3_bind_text(pp_stmt, 4, ti.album,   -1, SQLITE_STATIC);
-			e = sqlite3_bind_text(pp_stmt, 5, ti.comment, -1, SQLITE_STATIC);
-			if (a == SQLITE_OK && b == SQLITE_OK && c == SQLITE_OK && d == SQLITE_OK && e == SQLITE_OK) {
-				sqres = sqlite3_step(pp_stmt);
-				if (sqres != SQLITE_DONE) {
-					wdprintf(V_ERROR, "medialib", "ERROR while inserting into database: ERROR %d\n", sqres);
-				} else {
-					res = 1;
-				}
-			} else {
-				wdprintf(V_ERROR, "medialib", "Problem with SQL parameters.\n");
-			}
-			sqlite3_finalize(pp_stmt);
-		}
+		GmuMedialibTrack t;
+
+		memset(&t, 0, sizeof(GmuMedialibTrack));
+		t.file    = file;
+		t.artist  = ti.artist;
+		t.title   = ti.title;
+		t.album   = ti.album;
+		t.comment = ti.comment;
+		t.size    = attr.st_size;
+		t.mtime   = attr.st_mtime;
+		res = insert_track(gm, &t);
 	}
 	return res;
 }
 
-static int _medialib_add_file(void *gm, const char *file)
+/*
+ * Adds a single file (file = filename with full path) to the medialib
+ * Returns 1 on success, 0 otherwise
+ */
+int medialib_add_file(GmuMedialib *gm, const char *file)
 {
-	return medialib_add_file((GmuMedialib *)gm, file);
+	return add_file(gm, file);
 }
 
 typedef struct gml_thread_params {
-	GmuMedialib *gm;
-	void       (*finished_callback)(void);
+	GmuMedialib            *gm;
+	GmuMedialibRefreshMode  mode;
+	void                  (*finished_callback)(void);
 } gml_thread_params;
 
 static void *thread_gml_refresh(void *udata)
@@ -139,14 +360,14 @@ static void *thread_gml_refresh(void *udata)
 	struct gml_thread_params *tp = (struct gml_thread_params *)udata;
 
 	wdprintf(V_INFO, "medialib", "Refresh thread created.\n");
-	medialib_refresh(tp->gm);
+	medialib_refresh(tp->gm, tp->mode);
 	wdprintf(V_INFO, "medialib", "Refresh thread finished.\n");
 	tp->gm->refresh_in_progress = 0;
 	if (tp->finished_callback) (tp->finished_callback)();
 	return NULL;
 }
 
-int medialib_start_refresh(GmuMedialib *gm, void (*finished_callback)(void))
+int medialib_start_refresh(GmuMedialib *gm, GmuMedialibRefreshMode mode, void (*finished_callback)(void))
 {
 	static pthread_t          thread;
 	static gml_thread_params  tp;
@@ -155,6 +376,7 @@ int medialib_start_refresh(GmuMedialib *gm, void (*finished_callback)(void))
 	if (!gm->refresh_in_progress) {
 		gm->refresh_in_progress = 1;
 		tp.gm = gm;
+		tp.mode = mode;
 		tp.finished_callback = finished_callback;
 		pthread_create_with_stack_size(&thread, DEFAULT_THREAD_STACK_SIZE, thread_gml_refresh, &tp);
 		pthread_detach(thread);
@@ -170,9 +392,9 @@ int medialib_is_refresh_in_progress(GmuMedialib *gm)
 
 void medialib_flag_track_as_bad(GmuMedialib *gm, unsigned int id, int bad)
 {
-	sqlite3_stmt *pp_stmt = NULL;
-	const char *q = "UPDATE track SET file_missing = ?1 WHERE id = ?2";
-	if (sqlite3_prepare_v2(gm->db, q, -1, &pp_stmt, NULL) == SQLITE_OK) {
+	sqlite3_stmt *pp_stmt = medialib_stmt_get(gm, MLIB_STMT_TRACK_FLAG_MISSING);
+
+	if (pp_stmt) {
 		if (sqlite3_bind_int(pp_stmt, 1, bad) == SQLITE_OK &&
 		    sqlite3_bind_int(pp_stmt, 2, id) == SQLITE_OK) {
 			int sqres = sqlite3_step(pp_stmt);
@@ -182,33 +404,581 @@ void medialib_flag_track_as_bad(GmuMedialib *gm, unsigned int id, int bad)
 		} else {
 			wdprintf(V_ERROR, "medialib", "ERROR while updating database!\n");
 		}
+		medialib_stmt_release(gm, pp_stmt);
 	}
-	sqlite3_finalize(pp_stmt);
 }
 
-void medialib_refresh(GmuMedialib *gm)
+void medialib_set_scan_threads(GmuMedialib *gm, int threads)
 {
-	sqlite3_stmt *pp_stmt = NULL;
-	sqlite3_exec(gm->db, "BEGIN", 0, 0, 0);
-	/* Fetch all medialib filesystem paths */
-	if (sqlite3_prepare_v2(gm->db, "SELECT path FROM path", -1, &pp_stmt, NULL) == SQLITE_OK) {
-		for (; sqlite3_step(pp_stmt) == SQLITE_ROW; ) {
-			const char *path = (const char *)sqlite3_column_text(pp_stmt, 0);
-			wdprintf(V_INFO, "medialib", "Scanning '%s'...\n", path);
-			/* Scan path recursively... */
-			dirparser_walk_through_directory_tree(path, _medialib_add_file, (void *)gm, 0);
+	if (threads < 1) threads = 1;
+	if (threads > SCAN_MAX_THREADS) threads = SCAN_MAX_THREADS;
+	gm->scan_threads = threads;
+}
+
+/*
+ * Media library scanner
+ *
+ * The directory walker (the refresh thread) compares the size and
+ * modification time of each file with the fingerprint stored in the track
+ * table, and new or changed files are put into the file queue. Editing a
+ * file in place does not change its directory's modification time, so the
+ * directory's modification time is only used to tell whether entries have
+ * been added or removed: If it is unchanged, all of the directory's tracks
+ * still exist and get marked as seen at once, and unchanged files need no
+ * operation of their own. A pool of reader threads takes files from that queue, reads their
+ * meta data and passes them on to a single writer thread through the
+ * operation queue. The walker sends its directory and "file unchanged"
+ * operations through the same queue. The writer applies the operations in
+ * chunks of MEDIALIB_TRANSACTION_CHUNK per transaction. Both queues are bounded, so a
+ * slow stage throttles the stages in front of it.
+ *
+ * A directory's modification time is stored only after all of its files
+ * have been written, so an interrupted refresh picks up the unfinished
+ * directories the next time. Every refresh has a generation number, which
+ * is stored with each track and directory seen during that refresh.
+ */
+typedef struct ScanQueue {
+	void           *item[SCAN_QUEUE_SIZE];
+	int             head, count, closed;
+	pthread_mutex_t mutex;
+	pthread_cond_t  not_empty, not_full;
+} ScanQueue;
+
+typedef enum {
+	SCAN_OP_DIR_ENTER, SCAN_OP_DIR_LEAVE, SCAN_OP_FILE_SEEN, SCAN_OP_FILE_READ
+} ScanOpType;
+
+typedef struct ScanDir {
+	char          *path;
+	sqlite3_int64  id;        /* 0 if the directory is not in the database yet */
+	time_t         mtime;
+	int            unchanged; /* No entries added or removed since the last refresh */
+	int            issued;    /* Number of file operations, set by the walker */
+	struct ScanOp *leave_op;  /* Allocated in advance, so leaving cannot fail */
+	int            done, left; /* Only used by the writer */
+} ScanDir;
+
+typedef struct ScanOp {
+	ScanOpType     type;
+	ScanDir       *dir;
+	sqlite3_int64  track_id;  /* 0 for new files */
+	char          *file;
+	off_t          size;
+	time_t         mtime;
+	int            have_meta_data;
+	char           artist[SIZE_ARTIST];
+	char           title[SIZE_TITLE];
+	char           album[SIZE_ALBUM];
+	char           comment[SIZE_COMMENT];
+} ScanOp;
+
+typedef struct ScanContext {
+	GmuMedialib            *gm;
+	GmuMedialibRefreshMode  mode;
+	int                     gen;
+	ScanQueue               files, ops;
+	sqlite3_stmt           *pp_stmt_track, *pp_stmt_dir;
+	ScanDir                *dir_stack[DIRPARSER_MAX_DEPTH+2];
+	int                     dir_depth;
+	int                     added, updated;
+} ScanContext;
+
+static void scan_queue_init(ScanQueue *q)
+{
+	memset(q->item, 0, sizeof(q->item));
+	q->head = 0;
+	q->count = 0;
+	q->closed = 0;
+	pthread_mutex_init(&(q->mutex), NULL);
+	pthread_cond_init(&(q->not_empty), NULL);
+	pthread_cond_init(&(q->not_full), NULL);
+}
+
+static void scan_queue_free(ScanQueue *q)
+{
+	pthread_cond_destroy(&(q->not_full));
+	pthread_cond_destroy(&(q->not_empty));
+	pthread_mutex_destroy(&(q->mutex));
+}
+
+/* Adds an item to the queue, blocks while the queue is full */
+static void scan_queue_push(ScanQueue *q, void *item)
+{
+	pthread_mutex_lock(&(q->mutex));
+	while (q->count == SCAN_QUEUE_SIZE)
+		pthread_cond_wait(&(q->not_full), &(q->mutex));
+	q->item[(q->head + q->count) % SCAN_QUEUE_SIZE] = item;
+	q->count++;
+	pthread_cond_signal(&(q->not_empty));
+	pthread_mutex_unlock(&(q->mutex));
+}
+
+/*
+ * Takes an item from the queue, blocks while the queue is empty.
+ * Returns NULL once the queue has been closed and all items are taken.
+ */
+static void *scan_queue_pop(ScanQueue *q)
+{
+	void *item = NULL;
+
+	pthread_mutex_lock(&(q->mutex));
+	while (q->count == 0 && !q->closed)
+		pthread_cond_wait(&(q->not_empty), &(q->mutex));
+	if (q->count > 0) {
+		item = q->item[q->head];
+		q->head = (q->head + 1) % SCAN_QUEUE_SIZE;
+		q->count--;
+		pthread_cond_signal(&(q->not_full));
+	}
+	pthread_mutex_unlock(&(q->mutex));
+	return item;
+}
+
+/* No more items will be added; wakes up everyone waiting for items */
+static void scan_queue_close(ScanQueue *q)
+{
+	pthread_mutex_lock(&(q->mutex));
+	q->closed = 1;
+	pthread_cond_broadcast(&(q->not_empty));
+	pthread_mutex_unlock(&(q->mutex));
+}
+
+static ScanOp *scan_op_new(ScanOpType type, ScanDir *sd)
+{
+	ScanOp *op = malloc(sizeof(ScanOp));
+	if (op) {
+		op->type = type;
+		op->dir = sd;
+		op->track_id = 0;
+		op->file = NULL;
+		op->size = 0;
+		op->mtime = 0;
+		op->have_meta_data = 0;
+	}
+	return op;
+}
+
+/* Directory walker callbacks */
+static void scan_enter_dir(void *arg, const char *directory, time_t mtime)
+{
+	ScanContext  *sc = (ScanContext *)arg;
+	ScanDir      *sd = calloc(1, sizeof(ScanDir));
+	ScanOp       *op = NULL;
+	sqlite3_stmt *st = sc->pp_stmt_dir;
+
+	if (sd && (!(sd->path = strdup(directory)) || !(sd->leave_op = scan_op_new(SCAN_OP_DIR_LEAVE, sd)))) {
+		free(sd->path);
+		free(sd);
+		sd = NULL;
+	}
+	if (sd) {
+		sd->mtime = mtime;
+		if (sqlite3_bind_text(st, 1, directory, -1, SQLITE_STATIC) == SQLITE_OK &&
+		    sqlite3_step(st) == SQLITE_ROW) {
+			sd->id = sqlite3_column_int64(st, 0);
+			sd->unchanged = sc->mode == GMU_MLIB_REFRESH_INCREMENTAL &&
+			                sqlite3_column_type(st, 1) != SQLITE_NULL &&
+			                sqlite3_column_int64(st, 1) == (sqlite3_int64)mtime;
+		}
+		sqlite3_reset(st);
+		sqlite3_clear_bindings(st);
+		if ((op = scan_op_new(SCAN_OP_DIR_ENTER, sd))) {
+			scan_queue_push(&(sc->ops), op);
+		} else {
+			free(sd->leave_op);
+			free(sd->path);
+			free(sd);
+			sd = NULL;
+		}
+	}
+	if (sc->dir_depth < DIRPARSER_MAX_DEPTH+2) sc->dir_stack[sc->dir_depth] = sd;
+	sc->dir_depth++;
+	if (sd && sd->unchanged)
+		wdprintf(V_DEBUG, "medialib", "No entries added or removed: %s\n", directory);
+}
+
+static void scan_file(void *arg, const char *file, off_t size, time_t mtime)
+{
+	ScanContext  *sc = (ScanContext *)arg;
+	ScanDir      *sd = NULL;
+	ScanOp       *op;
+	sqlite3_stmt *st = sc->pp_stmt_track;
+	int           unchanged = 0;
+
+	if (sc->dir_depth > 0 && sc->dir_depth <= DIRPARSER_MAX_DEPTH+2)
+		sd = sc->dir_stack[sc->dir_depth-1];
+	if ((op = scan_op_new(SCAN_OP_FILE_READ, sd))) {
+		op->size = size;
+		op->mtime = mtime;
+		if (sqlite3_bind_text(st, 1, file, -1, SQLITE_STATIC) == SQLITE_OK &&
+		    sqlite3_step(st) == SQLITE_ROW) {
+			op->track_id = sqlite3_column_int64(st, 0);
+			unchanged = sc->mode == GMU_MLIB_REFRESH_INCREMENTAL &&
+			            sqlite3_column_int64(st, 1) == (sqlite3_int64)size &&
+			            sqlite3_column_int64(st, 2) == (sqlite3_int64)mtime &&
+			            sqlite3_column_type(st, 2) != SQLITE_NULL;
+		}
+		sqlite3_reset(st);
+		sqlite3_clear_bindings(st);
+		if (unchanged && sd && sd->unchanged) {
+			/* Already marked as seen together with the directory's other tracks */
+			free(op);
+			op = NULL;
+		} else if (unchanged) {
+			op->type = SCAN_OP_FILE_SEEN;
+			scan_queue_push(&(sc->ops), op);
+		} else if ((op->file = strdup(file))) {
+			scan_queue_push(&(sc->files), op);
+		} else {
+			free(op);
+			op = NULL;
+		}
+		if (op && sd) sd->issued++;
+	}
+}
+
+static void scan_leave_dir(void *arg, const char *directory)
+{
+	ScanContext *sc = (ScanContext *)arg;
+	ScanDir     *sd = NULL;
+	ScanOp      *op;
+
+	sc->dir_depth--;
+	if (sc->dir_depth < DIRPARSER_MAX_DEPTH+2) sd = sc->dir_stack[sc->dir_depth];
+	if (sd) {
+		op = sd->leave_op;
+		sd->leave_op = NULL;
+		scan_queue_push(&(sc->ops), op);
+	}
+}
+
+static void *thread_scan_reader(void *udata)
+{
+	ScanContext *sc = (ScanContext *)udata;
+	TrackInfo   *ti = malloc(sizeof(TrackInfo));
+	ScanOp      *op;
+
+	if (ti) trackinfo_init(ti, 0);
+	while ((op = scan_queue_pop(&(sc->files)))) {
+		char        filetype[16];
+		const char *ext = get_file_extension(op->file);
+
+		filetype[0] = '\0';
+		if (ext != NULL) strtoupper(filetype, ext, 15);
+		if (ti && metadatareader_read(op->file, filetype, ti)) {
+			op->have_meta_data = 1;
+			strncpy(op->artist,  ti->artist,  SIZE_ARTIST-1);  op->artist[SIZE_ARTIST-1] = '\0';
+			strncpy(op->title,   ti->title,   SIZE_TITLE-1);   op->title[SIZE_TITLE-1] = '\0';
+			strncpy(op->album,   ti->album,   SIZE_ALBUM-1);   op->album[SIZE_ALBUM-1] = '\0';
+			strncpy(op->comment, ti->comment, SIZE_COMMENT-1); op->comment[SIZE_COMMENT-1] = '\0';
+		} else {
+			wdprintf(V_DEBUG, "medialib", "No meta data for %s\n", op->file);
+		}
+		scan_queue_push(&(sc->ops), op);
+	}
+	if (ti) {
+		trackinfo_clear(ti);
+		free(ti);
+	}
+	return NULL;
+}
+
+/* Statements used by the writer thread */
+enum {
+	SW_DIR_INSERT, SW_DIR_ID, SW_DIR_FINISH, SW_DIR_TRACKS_SEEN,
+	SW_TRACK_SEEN, SW_TRACK_UPDATE, SW_MAX
+};
+
+static const char *scan_writer_sql[SW_MAX] = {
+	"INSERT OR IGNORE INTO directory (path, scan_gen) VALUES (?1, ?2)",
+	"SELECT id FROM directory WHERE path = ?1",
+	"UPDATE directory SET mtime = ?1, scan_gen = ?2 WHERE id = ?3",
+	"UPDATE track SET scan_gen = ?1 WHERE dir_id = ?2",
+	"UPDATE track SET scan_gen = ?1, dir_id = ?2 WHERE id = ?3",
+	"UPDATE track SET artist = ?2, title = ?3, album = ?4, comment = ?5, file_missing = 0, " \
+	"file_size = ?6, file_mtime = ?7, dir_id = ?8, scan_gen = ?9 WHERE id = ?1"
+};
+
+/*
+ * New tracks are collected by the writer and added in batches with
+ * medialib_add_tracks(). A directory counts a file as done only after
+ * its batch has been written.
+ */
+typedef struct ScanBatch {
+	ScanOp           *op[MEDIALIB_TRANSACTION_CHUNK];
+	GmuMedialibTrack  track[MEDIALIB_TRANSACTION_CHUNK];
+	int               count;
+} ScanBatch;
+
+/* Executes a prepared statement and resets it; Returns 1 on success */
+static int scan_step(sqlite3_stmt *pp_stmt)
+{
+	int sqres = sqlite3_step(pp_stmt);
+
+	if (sqres != SQLITE_DONE && sqres != SQLITE_ROW)
+		wdprintf(V_ERROR, "medialib", "ERROR while updating database: ERROR %d\n", sqres);
+	sqlite3_reset(pp_stmt);
+	sqlite3_clear_bindings(pp_stmt);
+	return (sqres == SQLITE_DONE || sqres == SQLITE_ROW);
+}
+
+static void scan_bind_id(sqlite3_stmt *pp_stmt, int idx, ScanDir *sd)
+{
+	if (sd && sd->id)
+		sqlite3_bind_int64(pp_stmt, idx, sd->id);
+	else
+		sqlite3_bind_null(pp_stmt, idx);
+}
+
+static void scan_write_dir_enter(ScanContext *sc, sqlite3_stmt **st, ScanDir *sd)
+{
+	if (!sd->id) {
+		sqlite3_bind_text(st[SW_DIR_INSERT], 1, sd->path, -1, SQLITE_STATIC);
+		sqlite3_bind_int(st[SW_DIR_INSERT], 2, sc->gen);
+		scan_step(st[SW_DIR_INSERT]);
+		sqlite3_bind_text(st[SW_DIR_ID], 1, sd->path, -1, SQLITE_STATIC);
+		if (sqlite3_step(st[SW_DIR_ID]) == SQLITE_ROW)
+			sd->id = sqlite3_column_int64(st[SW_DIR_ID], 0);
+		sqlite3_reset(st[SW_DIR_ID]);
+		sqlite3_clear_bindings(st[SW_DIR_ID]);
+	} else if (sd->unchanged) {
+		/* No entries have been removed, so all of the directory's tracks are still there */
+		sqlite3_bind_int(st[SW_DIR_TRACKS_SEEN], 1, sc->gen);
+		sqlite3_bind_int64(st[SW_DIR_TRACKS_SEEN], 2, sd->id);
+		scan_step(st[SW_DIR_TRACKS_SEEN]);
+	}
+}
+
+/* Stores the directory's mtime once all of its files have been written */
+static void scan_write_dir_finish(ScanContext *sc, sqlite3_stmt **st, ScanDir *sd)
+{
+	if (sd->left && sd->done == sd->issued) {
+		if (sd->id) {
+			sqlite3_bind_int64(st[SW_DIR_FINISH], 1, (sqlite3_int64)sd->mtime);
+			sqlite3_bind_int(st[SW_DIR_FINISH], 2, sc->gen);
+			sqlite3_bind_int64(st[SW_DIR_FINISH], 3, sd->id);
+			scan_step(st[SW_DIR_FINISH]);
+		}
+		free(sd->path);
+		free(sd);
+	}
+}
+
+static void scan_file_done(ScanContext *sc, sqlite3_stmt **st, ScanOp *op)
+{
+	if (op->dir) {
+		op->dir->done++;
+		scan_write_dir_finish(sc, st, op->dir);
+	}
+}
+
+/*
+ * Adds the batched tracks. The writer's transaction is committed first,
+ * as medialib_add_tracks() runs its own transactions.
+ */
+static void scan_batch_flush(ScanContext *sc, sqlite3_stmt **st, ScanBatch *b)
+{
+	int i;
+
+	if (b->count == 0) return;
+	medialib_transaction_commit(sc->gm);
+	sc->added += medialib_add_tracks(sc->gm, b->track, b->count);
+	medialib_transaction_begin(sc->gm);
+	for (i = 0; i < b->count; i++) {
+		scan_file_done(sc, st, b->op[i]);
+		free(b->op[i]->file);
+		free(b->op[i]);
+	}
+	b->count = 0;
+}
+
+/* Returns 1 if the operation has been taken over by the batch */
+static int scan_write_file(ScanContext *sc, sqlite3_stmt **st, ScanBatch *b, ScanOp *op)
+{
+	sqlite3_stmt *pp_stmt;
+
+	if (op->type == SCAN_OP_FILE_SEEN || (op->track_id && !op->have_meta_data)) {
+		/* Unchanged file, or changed file without readable meta data (keep old data) */
+		pp_stmt = st[SW_TRACK_SEEN];
+		sqlite3_bind_int(pp_stmt, 1, sc->gen);
+		scan_bind_id(pp_stmt, 2, op->dir);
+		sqlite3_bind_int64(pp_stmt, 3, op->track_id);
+		scan_step(pp_stmt);
+	} else if (op->have_meta_data && !op->track_id) {
+		GmuMedialibTrack *t = &(b->track[b->count]);
+
+		t->file     = op->file;
+		t->artist   = op->artist;
+		t->title    = op->title;
+		t->album    = op->album;
+		t->comment  = op->comment;
+		t->size     = op->size;
+		t->mtime    = op->mtime;
+		t->dir_id   = op->dir ? op->dir->id : 0;
+		t->scan_gen = sc->gen;
+		b->op[b->count++] = op;
+		if (b->count == MEDIALIB_TRANSACTION_CHUNK) scan_batch_flush(sc, st, b);
+		return 1;
+	} else if (op->have_meta_data) {
+		pp_stmt = st[SW_TRACK_UPDATE];
+		sqlite3_bind_int64(pp_stmt, 1, op->track_id);
+		sqlite3_bind_text(pp_stmt, 2, op->artist,  -1, SQLITE_STATIC);
+		sqlite3_bind_text(pp_stmt, 3, op->title,   -1, SQLITE_STATIC);
+		sqlite3_bind_text(pp_stmt, 4, op->album,   -1, SQLITE_STATIC);
+		sqlite3_bind_text(pp_stmt, 5, op->comment, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(pp_stmt, 6, (sqlite3_int64)op->size);
+		sqlite3_bind_int64(pp_stmt, 7, (sqlite3_int64)op->mtime);
+		scan_bind_id(pp_stmt, 8, op->dir);
+		sqlite3_bind_int(pp_stmt, 9, sc->gen);
+		if (scan_step(pp_stmt)) sc->updated++;
+	}
+	scan_file_done(sc, st, op);
+	return 0;
+}
+
+static void *thread_scan_writer(void *udata)
+{
+	ScanContext  *sc = (ScanContext *)udata;
+	sqlite3      *db = sc->gm->db;
+	sqlite3_stmt *st[SW_MAX];
+	ScanBatch     batch;
+	ScanOp       *op;
+	int           n = 0, ok = 1, i;
+
+	batch.count = 0;
+	for (i = 0; i < SW_MAX; i++) {
+		st[i] = NULL;
+		if (ok && sqlite3_prepare_v2(db, scan_writer_sql[i], -1, &(st[i]), NULL) != SQLITE_OK) {
+			wdprintf(V_ERROR, "medialib", "ERROR: Unable to prepare statement: %s\n", sqlite3_errmsg(db));
+			ok = 0;
+		}
+	}
+	if (ok) medialib_transaction_begin(sc->gm);
+	while ((op = scan_queue_pop(&(sc->ops)))) {
+		if (ok) {
+			switch (op->type) {
+				case SCAN_OP_DIR_ENTER:
+					scan_write_dir_enter(sc, st, op->dir);
+					break;
+				case SCAN_OP_DIR_LEAVE:
+					op->dir->left = 1;
+					scan_write_dir_finish(sc, st, op->dir);
+					break;
+				case SCAN_OP_FILE_SEEN:
+				case SCAN_OP_FILE_READ:
+					if (scan_write_file(sc, st, &batch, op)) op = NULL;
+					break;
+			}
+			medialib_transaction_chunk(sc->gm, &n);
+		} else if (op->type == SCAN_OP_DIR_LEAVE) {
+			free(op->dir->path);
+			free(op->dir);
+		}
+		if (op) {
+			free(op->file);
+			free(op);
 		}
 	}
+	if (ok) {
+		scan_batch_flush(sc, st, &batch);
+		medialib_transaction_commit(sc->gm);
+	}
+	for (i = 0; i < SW_MAX; i++) sqlite3_finalize(st[i]);
+	return NULL;
+}
+
+/*
+ * Scans all medialib paths for new and changed files and updates the
+ * medialib accordingly. Returns the generation number of this scan or
+ * 0 if the scan could not be started.
+ */
+static int medialib_scan(GmuMedialib *gm, GmuMedialibRefreshMode mode)
+{
+	ScanContext        sc;
+	DirparserCallbacks cb = { scan_enter_dir, scan_file, scan_leave_dir };
+	pthread_t          writer, reader[SCAN_MAX_THREADS];
+	int                readers = 0, i;
+	sqlite3_stmt      *pp_stmt = NULL;
+
+	memset(&sc, 0, sizeof(ScanContext));
+	sc.gm = gm;
+	sc.mode = mode;
+	if (sqlite3_prepare_v2(gm->db, "SELECT IFNULL(MAX(scan_gen), 0) + 1 FROM directory", -1, &pp_stmt, NULL) == SQLITE_OK &&
+	    sqlite3_step(pp_stmt) == SQLITE_ROW)
+		sc.gen = sqlite3_column_int(pp_stmt, 0);
 	sqlite3_finalize(pp_stmt);
-	sqlite3_exec(gm->db, "COMMIT", 0, 0, 0);
+	pp_stmt = NULL;
+	if (!sc.gen ||
+	    sqlite3_prepare_v2(gm->db, "SELECT id, file_size, file_mtime FROM track WHERE file = ?1 LIMIT 1", -1,
+	                       &(sc.pp_stmt_track), NULL) != SQLITE_OK ||
+	    sqlite3_prepare_v2(gm->db, "SELECT id, mtime FROM directory WHERE path = ?1", -1,
+	                       &(sc.pp_stmt_dir), NULL) != SQLITE_OK) {
+		wdprintf(V_ERROR, "medialib", "ERROR: Unable to prepare query: %s\n", sqlite3_errmsg(gm->db));
+		sqlite3_finalize(sc.pp_stmt_track);
+		sqlite3_finalize(sc.pp_stmt_dir);
+		return 0;
+	}
+	scan_queue_init(&(sc.files));
+	scan_queue_init(&(sc.ops));
+	if (pthread_create_with_stack_size(&writer, DEFAULT_THREAD_STACK_SIZE, thread_scan_writer, &sc) == 0) {
+		for (i = 0; i < gm->scan_threads; i++) {
+			if (pthread_create_with_stack_size(&reader[readers], DEFAULT_THREAD_STACK_SIZE,
+			                                   thread_scan_reader, &sc) == 0)
+				readers++;
+		}
+		wdprintf(V_INFO, "medialib", "%s scan #%d with %d reader thread(s).\n",
+		         mode == GMU_MLIB_REFRESH_FULL ? "Full" : "Incremental", sc.gen, readers);
+		/* Fetch all medialib filesystem paths */
+		if (readers > 0 &&
+		    sqlite3_prepare_v2(gm->db, "SELECT path FROM path", -1, &pp_stmt, NULL) == SQLITE_OK) {
+			for (; sqlite3_step(pp_stmt) == SQLITE_ROW; ) {
+				const char *path = (const char *)sqlite3_column_text(pp_stmt, 0);
+				wdprintf(V_INFO, "medialib", "Scanning '%s'...\n", path);
+				/* Scan path recursively... */
+				dirparser_scan_directory_tree(path, &cb, &sc, 0);
+			}
+		}
+		sqlite3_finalize(pp_stmt);
+		scan_queue_close(&(sc.files));
+		for (i = 0; i < readers; i++) pthread_join(reader[i], NULL);
+		scan_queue_close(&(sc.ops));
+		pthread_join(writer, NULL);
+		wdprintf(V_INFO, "medialib", "%d new file(s) added, %d file(s) updated.\n", sc.added, sc.updated);
+		if (readers == 0) sc.gen = 0;
+	} else {
+		wdprintf(V_ERROR, "medialib", "ERROR: Unable to create scanner thread.\n");
+		sc.gen = 0;
+	}
+	scan_queue_free(&(sc.ops));
+	scan_queue_free(&(sc.files));
+	sqlite3_finalize(sc.pp_stmt_track);
+	sqlite3_finalize(sc.pp_stmt_dir);
+	return sc.gen;
+}
+
+void medialib_refresh(GmuMedialib *gm, GmuMedialibRefreshMode mode)
+{
+	sqlite3_stmt *pp_stmt = NULL;
+	int           gen = medialib_scan(gm, mode);
+
 	/*
-	 * Fetch all medialib entries from DB and check if the corresponding
-	 * files exist on disk. If a file doesn't exist, flag the entry as
-	 * broken. Entries flagged as broken where the file is found again
-	 * should have the broken flag removed.
+	 * Tracks seen during the scan exist on disk. All other medialib entries
+	 * are checked against the file system. If a file doesn't exist, the
+	 * entry gets flagged as broken. Entries flagged as broken where the
+	 * file is found again should have the broken flag removed.
 	 * Broken entries can be cleaned from the DB with another command.
 	 */
-	if (sqlite3_prepare_v2(gm->db, "SELECT id,file,file_missing FROM track", -1, &pp_stmt, NULL) == SQLITE_OK) {
+	if (gen && sqlite3_prepare_v2(gm->db, "UPDATE track SET file_missing = 0 WHERE scan_gen = ?1 AND file_missing <> 0",
+	                              -1, &pp_stmt, NULL) == SQLITE_OK) {
+		if (sqlite3_bind_int(pp_stmt, 1, gen) == SQLITE_OK) scan_step(pp_stmt);
+	}
+	sqlite3_finalize(pp_stmt);
+	pp_stmt = NULL;
+	if (sqlite3_prepare_v2(gm->db, "SELECT id,file,file_missing FROM track WHERE scan_gen IS NOT ?1", -1, &pp_stmt, NULL) == SQLITE_OK &&
+	    sqlite3_bind_int(pp_stmt, 1, gen) == SQLITE_OK) {
+		int n = 0;
+
+		medialib_transaction_begin(gm);
 		for (; sqlite3_step(pp_stmt) == SQLITE_ROW; ) {
 			/* Check entry against file system... */
 			int   id           = sqlite3_column_int(pp_stmt, 0);
@@ -223,55 +993,51 @@ void medialib_refresh(GmuMedialib *gm)
 					file
 				);
 				medialib_flag_track_as_bad(gm, id, 1);
+				medialib_transaction_chunk(gm, &n);
 			} else if (file_missing) {
 				medialib_flag_track_as_bad(gm, id, 0);
+				medialib_transaction_chunk(gm, &n);
 			}
 		}
-		sqlite3_finalize(pp_stmt);
+		medialib_transaction_commit(gm);
 	}
+	sqlite3_finalize(pp_stmt);
 }
 
 void medialib_path_add(GmuMedialib *gm, const char *path)
 {
-	sqlite3_stmt *pp_stmt = NULL;
-	int           sqres;
+	sqlite3_stmt *pp_stmt = medialib_stmt_get(gm, MLIB_STMT_PATH_ADD);
 
-	const char *q =
-		"INSERT INTO path (path) " \
-		"SELECT ?1 " \
-		"WHERE NOT EXISTS (SELECT 1 FROM path WHERE path = ?1)";
-	sqres = sqlite3_prepare_v2(gm->db, q, -1, &pp_stmt, NULL);
-	if (sqres == SQLITE_OK) {
-		sqres = sqlite3_bind_text(pp_stmt, 1, path, -1, SQLITE_TRANSIENT);
-		if (sqres == SQLITE_OK) sqlite3_step(pp_stmt);
+	if (pp_stmt) {
+		if (sqlite3_bind_text(pp_stmt, 1, path, -1, SQLITE_STATIC) == SQLITE_OK) sqlite3_step(pp_stmt);
+		medialib_stmt_release(gm, pp_stmt);
 	}
-	sqlite3_finalize(pp_stmt);
 }
 
 void medialib_path_remove(GmuMedialib *gm, const char *path)
 {
-	sqlite3_stmt *pp_stmt = NULL;
-	const char   *q = "DELETE FROM path WHERE path = ?1";
-	int           sqres = sqlite3_prepare_v2(gm->db, q, -1, &pp_stmt, NULL);
-	if (sqres == SQLITE_OK) sqres = sqlite3_bind_text(pp_stmt, 1, path, -1, SQLITE_TRANSIENT);
-	if (sqres == SQLITE_OK) sqlite3_step(pp_stmt);
-	sqlite3_finalize(pp_stmt);
+	sqlite3_stmt *pp_stmt = medialib_stmt_get(gm, MLIB_STMT_PATH_REMOVE);
+
+	if (pp_stmt) {
+		if (sqlite3_bind_text(pp_stmt, 1, path, -1, SQLITE_STATIC) == SQLITE_OK) sqlite3_step(pp_stmt);
+		medialib_stmt_release(gm, pp_stmt);
+	}
 }
 
 void medialib_path_remove_with_id(GmuMedialib *gm, unsigned int id)
 {
-	sqlite3_stmt *pp_stmt = NULL;
-	const char   *q = "DELETE FROM path WHERE id = ?1";
-	int           sqres = sqlite3_prepare_v2(gm->db, q, -1, &pp_stmt, NULL);
-	if (sqres == SQLITE_OK) sqres = sqlite3_bind_int(pp_stmt, 1, id);
-	if (sqres == SQLITE_OK) sqlite3_step(pp_stmt);
-	sqlite3_finalize(pp_stmt);
+	sqlite3_stmt *pp_stmt = medialib_stmt_get(gm, MLIB_STMT_PATH_REMOVE_ID);
+
+	if (pp_stmt) {
+		if (sqlite3_bind_int(pp_stmt, 1, id) == SQLITE_OK) sqlite3_step(pp_stmt);
+		medialib_stmt_release(gm, pp_stmt);
+	}
 }
 
 int medialib_path_list(GmuMedialib *gm)
 {
 	const char *q = "SELECT path FROM path";
-	int         sqres = sqlite3_prepare_v2(gm->db, q, -1, &(gm->pp_stmt_path_list), NULL);
+	int         sqres = sqlite3_prepare_v2(gm->db_query, q, -1, &(gm->pp_stmt_path_list), NULL);
 	return (sqres == SQLITE_OK);
 }
 
@@ -289,38 +1055,112 @@ void medialib_path_list_finish(GmuMedialib *gm)
 	sqlite3_finalize(gm->pp_stmt_path_list);
 }
 
+/*
+ * Turns the words of a search string into an FTS5 query, where each word
+ * is a quoted prefix match, optionally limited to the column col.
+ * E.g. 'foo ba"r' becomes '"foo"* "ba""r"*'. Returns NULL for empty queries.
+ */
+static char *fts_query_alloc(const char *str, const char *col)
+{
+	size_t len = strlen(str), col_len = col ? strlen(col) + 1 : 0, i, j = 0;
+	char  *q = malloc(len * 2 + (len / 2 + 1) * (col_len + 4) + 1);
+	int    in_word = 0;
+
+	if (!q) return NULL;
+	for (i = 0; i <= len; i++) {
+		int space = (str[i] == '\0' || str[i] == ' ' || str[i] == '\t');
+		if (!space && !in_word) {
+			if (j > 0) q[j++] = ' ';
+			if (col) {
+				memcpy(q+j, col, col_len-1);
+				j += col_len-1;
+				q[j++] = ':';
+			}
+			q[j++] = '"';
+			in_word = 1;
+		} else if (space && in_word) {
+			q[j++] = '"';
+			q[j++] = '*';
+			in_word = 0;
+		}
+		if (!space) {
+			if (str[i] == '"') q[j++] = '"';
+			q[j++] = str[i];
+		}
+	}
+	q[j] = '\0';
+	if (j == 0) {
+		free(q);
+		q = NULL;
+	}
+	return q;
+}
+
 /* Search the medialib; Returns true on success; false (0) otherwise */
 int medialib_search_find(GmuMedialib *gm, GmuMedialibDataType type, const char *str)
 {
-	const char *q;
+	return medialib_search_find_range(gm, type, str, 0, MEDIALIB_SEARCH_PAGE_SIZE);
+}
+
+/*
+ * With the full-text search index, results are ranked by relevance (bm25,
+ * with matches in artist and title weighted higher than album matches) and
+ * every word of the search string matches as a prefix. Without the index,
+ * the search string is matched as a substring.
+ */
+int medialib_search_find_range(GmuMedialib *gm, GmuMedialibDataType type, const char *str, int offset, int count)
+{
+	const char *q, *col = NULL;
 	int         sqres = -1, len;
-	char       *str_tmp;
-
-	switch (type) {
-		case GMU_MLIB_ANY:
-		default:
-			q = "SELECT * FROM track WHERE file_missing = 0 AND (title LIKE ?1 OR artist LIKE ?1 OR album LIKE ?1) LIMIT 200";
-			break;
-		case GMU_MLIB_ARTIST:
-			q = "SELECT * FROM track WHERE file_missing = 0 AND artist LIKE ?1 LIMIT 200";
-			break;
-		case GMU_MLIB_ALBUM:
-			q = "SELECT * FROM track WHERE file_missing = 0 AND album LIKE ?1 LIMIT 200";
-			break;
-		case GMU_MLIB_TITLE:
-			q = "SELECT * FROM track WHERE file_missing = 0 AND title LIKE ?1 LIMIT 200";
-			break;
-	}
-	len = str ? strlen(str) : 0;
-	if (len > 0) {
-		str_tmp = malloc(len+3);
-		if (str_tmp) {
-			snprintf(str_tmp, len+3, "%%%s%%", str);
-			wdprintf(V_DEBUG, "medialib", "search str= %s\n", str_tmp);
-			sqres = sqlite3_prepare_v2(gm->db, q, -1, &(gm->pp_stmt_search), NULL);
-			if (sqres == SQLITE_OK) sqres = sqlite3_bind_text(gm->pp_stmt_search, 1, str_tmp, -1, SQLITE_TRANSIENT);
-			free(str_tmp);
+	char       *str_tmp = NULL;
+
+	gm->pp_stmt_search = NULL;
+	if (gm->have_fts) {
+		q = "SELECT track.* FROM track_fts JOIN track ON track.id = track_fts.rowid " \
+		    "WHERE track_fts MATCH ?1 AND track.file_missing = 0 " \
+		    "ORDER BY bm25(track_fts, 4.0, 4.0, 2.0) LIMIT ?2 OFFSET ?3";
+		switch (type) {
+			case GMU_MLIB_ANY:
+			default:
+				break;
+			case GMU_MLIB_ARTIST:
+				col = "artist";
+				break;
+			case GMU_MLIB_ALBUM:
+				col = "album";
+				break;
+			case GMU_MLIB_TITLE:
+				col = "title";
+				break;
 		}
+		if (str) str_tmp = fts_query_alloc(str, col);
+	} else {
+		switch (type) {
+			case GMU_MLIB_ANY:
+			default:
+				q = "SELECT * FROM track WHERE file_missing = 0 AND (title LIKE ?1 OR artist LIKE ?1 OR album LIKE ?1) LIMIT ?2 OFFSET ?3";
+				break;
+			case GMU_MLIB_ARTIST:
+				q = "SELECT * FROM track WHERE file_missing = 0 AND artist LIKE ?1 LIMIT ?2 OFFSET ?3";
+				break;
+			case GMU_MLIB_ALBUM:
+				q = "SELECT * FROM track WHERE file_missing = 0 AND album LIKE ?1 LIMIT ?2 OFFSET ?3";
+				break;
+			case GMU_MLIB_TITLE:
+				q = "SELECT * FROM track WHERE file_missing = 0 AND title LIKE ?1 LIMIT ?2 OFFSET ?3";
+				break;
+		}
+		len = str ? strlen(str) : 0;
+		if (len > 0 && (str_tmp = malloc(len+3)))
+			snprintf(str_tmp, len+3, "%%%s%%", str);
+	}
+	if (str_tmp) {
+		wdprintf(V_DEBUG, "medialib", "search str= %s\n", str_tmp);
+		sqres = sqlite3_prepare_v2(gm->db_query, q, -1, &(gm->pp_stmt_search), NULL);
+		if (sqres == SQLITE_OK) sqres = sqlite3_bind_text(gm->pp_stmt_search, 1, str_tmp, -1, SQLITE_TRANSIENT);
+		if (sqres == SQLITE_OK) sqres = sqlite3_bind_int(gm->pp_stmt_search, 2, count > 0 ? count : -1);
+		if (sqres == SQLITE_OK) sqres = sqlite3_bind_int(gm->pp_stmt_search, 3, offset > 0 ? offset : 0);
+		free(str_tmp);
 	}
 	return (sqres == SQLITE_OK);
 }
@@ -396,7 +1236,7 @@ int medialib_browse(GmuMedialib *gm, const char *sel_column, ...)
 	q = qtmp;
 
 	va_end(args);
-	sqres = sqlite3_prepare_v2(gm->db, q, -1, &(gm->pp_stmt_browse), NULL);
+	sqres = sqlite3_prepare_v2(gm->db_query, q, -1, &(gm->pp_stmt_browse), NULL);
 	sqlite3_free(q);
 	return (sqres == SQLITE_OK);
 }
@@ -417,54 +1257,47 @@ void medialib_browse_finish(GmuMedialib *gm)
 
 TrackInfo medialib_get_data_for_id(GmuMedialib *gm, int id)
 {
-	sqlite3_stmt *pp_stmt;
+	sqlite3_stmt *pp_stmt = medialib_stmt_get(gm, MLIB_STMT_TRACK_GET);
 	TrackInfo     ti;
-	const char   *q = "SELECT * FROM track WHERE id = ?1 LIMIT 1";
-	int           sqres;
 
 	trackinfo_init(&ti, 0);
-
-	sqres = sqlite3_prepare_v2(gm->db, q, -1, &pp_stmt, NULL);
-	if (sqres == SQLITE_OK) sqres = sqlite3_bind_int(pp_stmt, 1, id);
-	if (sqres == SQLITE_OK && sqlite3_step(pp_stmt) == SQLITE_ROW) {
-		const char *file   = (const char *)sqlite3_column_text(pp_stmt, 1);
-		const char *artist = (const char *)sqlite3_column_text(pp_stmt, 3);
-		const char *title  = (const char *)sqlite3_column_text(pp_stmt, 4);
-		const char *album  = (const char *)sqlite3_column_text(pp_stmt, 5);
-		trackinfo_set_trackid(&ti, id);
-		trackinfo_set_filename(&ti, file);
-		trackinfo_set_artist(&ti, artist);
-		trackinfo_set_title(&ti, title);
-		trackinfo_set_album(&ti, album);
-	} else {
-		trackinfo_set_trackid(&ti, -1);
+	trackinfo_set_trackid(&ti, -1);
+	if (pp_stmt) {
+		if (sqlite3_bind_int(pp_stmt, 1, id) == SQLITE_OK && sqlite3_step(pp_stmt) == SQLITE_ROW) {
+			const char *file   = (const char *)sqlite3_column_text(pp_stmt, 1);
+			const char *artist = (const char *)sqlite3_column_text(pp_stmt, 3);
+			const char *title  = (const char *)sqlite3_column_text(pp_stmt, 4);
+			const char *album  = (const char *)sqlite3_column_text(pp_stmt, 5);
+			trackinfo_set_trackid(&ti, id);
+			trackinfo_set_filename(&ti, file);
+			trackinfo_set_artist(&ti, artist);
+			trackinfo_set_title(&ti, title);
+			trackinfo_set_album(&ti, album);
+		}
+		medialib_stmt_release(gm, pp_stmt);
 	}
-	sqlite3_finalize(pp_stmt);
 	return ti;
 }
 
 static int rate_track(GmuMedialib *gm, int id, int relative, int rating)
 {
-	sqlite3_stmt *pp_stmt;
-	const char   *q;
-	int           sqres;
+	sqlite3_stmt        *pp_stmt;
+	GmuMedialibStatement s;
+	int                  sqres = SQLITE_ERROR;
 
-	if (!relative) {
-		q = "UPDATE track SET rating_explicit = ?2 WHERE id = ?1";
-	} else {
-		if (rating > 0)
-			q = "UPDATE track SET rating_explicit = rating_explicit + 1 WHERE id = ?1";
-		else
-			q = "UPDATE track SET rating_explicit = rating_explicit - 1 WHERE id = ?1";
-	}
-	sqres = sqlite3_prepare_v2(gm->db, q, -1, &pp_stmt, NULL);
-	if (sqres == SQLITE_OK) sqres = sqlite3_bind_int(pp_stmt, 1, id);
-	if (!relative && sqres == SQLITE_OK) sqres = sqlite3_bind_int(pp_stmt, 2, rating);
-	if (sqres == SQLITE_OK) sqres = sqlite3_step(pp_stmt);
+	if (!relative)
+		s = MLIB_STMT_RATE_SET;
+	else
+		s = rating > 0 ? MLIB_STMT_RATE_UP : MLIB_STMT_RATE_DOWN;
+	if ((pp_stmt = medialib_stmt_get(gm, s))) {
+		sqres = sqlite3_bind_int(pp_stmt, 1, id);
+		if (!relative && sqres == SQLITE_OK) sqres = sqlite3_bind_int(pp_stmt, 2, rating);
+		if (sqres == SQLITE_OK) sqres = sqlite3_step(pp_stmt);
+		medialib_stmt_release(gm, pp_stmt);
+	}
 	if (sqres != SQLITE_DONE) {
 		wdprintf(V_ERROR, "medialib", "ERROR while updating database: ERROR %d\n", sqres);
 	}
-	sqlite3_finalize(pp_stmt);
 	return sqres;
 }
 
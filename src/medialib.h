@@ -10,18 +10,52 @@
 #ifndef WEJ_MEDIALIB_H
 #define WEJ_MEDIALIB_H
 #ifdef GMU_MEDIALIB
+#include <pthread.h>
 #include <sqlite3.h>
 #endif
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
 #include "trackinfo.h"
 
+/* Statements kept in the prepared statement cache of GmuMedialib */
+typedef enum {
+	MLIB_STMT_TRACK_FIND, MLIB_STMT_TRACK_INSERT, MLIB_STMT_TRACK_GET,
+	MLIB_STMT_TRACK_FLAG_MISSING, MLIB_STMT_RATE_SET, MLIB_STMT_RATE_UP,
+	MLIB_STMT_RATE_DOWN, MLIB_STMT_PATH_ADD, MLIB_STMT_PATH_REMOVE,
+	MLIB_STMT_PATH_REMOVE_ID, MLIB_STMT_MAX
+} GmuMedialibStatement;
+
 typedef struct GmuMedialib {
 #ifdef GMU_MEDIALIB
-	sqlite3      *db;
-	sqlite3_stmt *pp_stmt_search, *pp_stmt_browse, *pp_stmt_path_list;
+	sqlite3        *db, *db_query;
+	sqlite3_stmt   *pp_stmt_search, *pp_stmt_browse, *pp_stmt_path_list;
+	sqlite3_stmt   *stmt_cache[MLIB_STMT_MAX];
+	pthread_mutex_t stmt_cache_mutex, transaction_mutex;
+	int             have_fts;
 #endif
 	int           refresh_in_progress;
+	int           scan_threads;
 } GmuMedialib;
 
+/*
+ * Incremental refreshes only read meta data of new files and files whose
+ * size or modification time have changed, and skip the files of directories
+ * whose modification time has not changed. Full refreshes read everything.
+ */
+typedef enum {
+	GMU_MLIB_REFRESH_INCREMENTAL, GMU_MLIB_REFRESH_FULL
+} GmuMedialibRefreshMode;
+
+/* A track with its meta data for medialib_add_tracks() */
+typedef struct GmuMedialibTrack {
+	const char *file, *artist, *title, *album, *comment;
+	off_t       size;
+	time_t      mtime;
+	int64_t     dir_id;   /* Directory entry of the file, 0 if none */
+	int         scan_gen; /* Refresh that has seen the file, 0 if none */
+} GmuMedialibTrack;
+
 typedef enum {
 	GMU_MLIB_ANY, GMU_MLIB_ARTIST, GMU_MLIB_TITLE, GMU_MLIB_ALBUM
 } GmuMedialibDataType;
@@ -29,16 +63,22 @@ typedef enum {
 int  medialib_create_db_and_open(GmuMedialib *gm);
 int  medialib_open(GmuMedialib *gm);
 void medialib_close(GmuMedialib *gm);
-int  medialib_start_refresh(GmuMedialib *gm, void (*finished_callback)(void));
+int  medialib_start_refresh(GmuMedialib *gm, GmuMedialibRefreshMode mode, void (*finished_callback)(void));
 int  medialib_is_refresh_in_progress(GmuMedialib *gm);
 void medialib_flag_track_as_bad(GmuMedialib *gm, unsigned int id, int bad);
-void medialib_refresh(GmuMedialib *gm);
+void medialib_refresh(GmuMedialib *gm, GmuMedialibRefreshMode mode);
+/* Set the number of meta data reader threads used by medialib_refresh() */
+void medialib_set_scan_threads(GmuMedialib *gm, int threads);
 int  medialib_add_file(GmuMedialib *gm, const char *file);
+/* Adds count tracks in chunked transactions; Returns the number of tracks added */
+int  medialib_add_tracks(GmuMedialib *gm, const GmuMedialibTrack *tracks, int count);
 void medialib_path_add(GmuMedialib *gm, const char *path);
 void medialib_path_remove(GmuMedialib *gm, const char *path);
 void medialib_path_remove_with_id(GmuMedialib *gm, unsigned int id);
-/* Search the medialib; Returns the number of results */
+/* Search the medialib; Returns true on success; false (0) otherwise */
 int  medialib_search_find(GmuMedialib *gm, GmuMedialibDataType type, const char *str);
+/* Like medialib_search_find(), but fetches count results starting at offset */
+int  medialib_search_find_range(GmuMedialib *gm, GmuMedialibDataType type, const char *str, int offset, int count);
 TrackInfo medialib_search_fetch_next_result(GmuMedialib *gm);
 void medialib_search_finish(GmuMedialib *gm);
 int  medialib_browse(GmuMedialib *gm, const char *sel_column, ...);
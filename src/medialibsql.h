@@ -18,9 +18,16 @@ const char *medialib_sql =
 	type integer, \
 	play_count integer, \
 	skip_count integer, \
-	file_missing integer \
+	file_missing integer, \
+	file_size integer, \
+	file_mtime integer, \
+	dir_id integer, \
+	scan_gen integer \
 ); \
 \
+CREATE INDEX track_file ON track (file); \
+CREATE INDEX track_dir_id ON track (dir_id); \
+\
 CREATE TABLE aditional_trackinfo \
 ( \
 	track_id integer, \
@@ -40,4 +47,73 @@ CREATE TABLE path \
 	id integer primary key, \
 	path varchar(255), \
 	date timestamp \
-);";
+); \
+\
+CREATE TABLE directory \
+( \
+	id integer primary key, \
+	path varchar(255) unique, \
+	mtime integer, \
+	scan_gen integer \
+); \
+\
+PRAGMA user_version = 1;";
+
+/*
+ * Upgrades a version 0 database (without file fingerprints and directory
+ * table) to version 1
+ */
+const char *medialib_sql_upgrade_1 =
+"ALTER TABLE track ADD COLUMN file_size integer; \
+ALTER TABLE track ADD COLUMN file_mtime integer; \
+ALTER TABLE track ADD COLUMN dir_id integer; \
+ALTER TABLE track ADD COLUMN scan_gen integer; \
+CREATE INDEX track_file ON track (file); \
+CREATE INDEX track_dir_id ON track (dir_id); \
+\
+CREATE TABLE directory \
+( \
+	id integer primary key, \
+	path varchar(255) unique, \
+	mtime integer, \
+	scan_gen integer \
+); \
+\
+PRAGMA user_version = 1;";
+
+/*
+ * Version 2 adds a full-text search index on artist, title and album. It
+ * is an external content table that reads the text from the track table
+ * and is kept in sync with triggers.
+ */
+const char *medialib_sql_upgrade_2 =
+"CREATE VIRTUAL TABLE track_fts USING fts5 \
+( \
+	artist, \
+	title, \
+	album, \
+	content = 'track', \
+	content_rowid = 'id', \
+	tokenize = 'unicode61 remove_diacritics 2' \
+); \
+\
+CREATE TRIGGER track_fts_insert AFTER INSERT ON track BEGIN \
+	INSERT INTO track_fts (rowid, artist, title, album) \
+	VALUES (new.id, new.artist, new.title, new.album); \
+END; \
+\
+CREATE TRIGGER track_fts_delete AFTER DELETE ON track BEGIN \
+	INSERT INTO track_fts (track_fts, rowid, artist, title, album) \
+	VALUES ('delete', old.id, old.artist, old.title, old.album); \
+END; \
+\
+CREATE TRIGGER track_fts_update AFTER UPDATE OF artist, title, album ON track BEGIN \
+	INSERT INTO track_fts (track_fts, rowid, artist, title, album) \
+	VALUES ('delete', old.id, old.artist, old.title, old.album); \
+	INSERT INTO track_fts (rowid, artist, title, album) \
+	VALUES (new.id, new.artist, new.title, new.album); \
+END; \
+\
+INSERT INTO track_fts (track_fts) VALUES ('rebuild'); \
+\
+PRAGMA user_version = 2;";
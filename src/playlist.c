@@ -16,6 +16,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <time.h>
 #include <pthread.h>
@@ -31,10 +32,497 @@
 #include "pthread_helper.h"
 #include "consts.h"
 
-#define PLAYLIST_MAX_LENGTH 9999
+#define PLAYLIST_MAX_LENGTH 99999
 
 static int recursive_directory_add_in_progress = 0;
 
+/* Interned path strings */
+
+static unsigned int string_hash(const char *str)
+{
+	unsigned int hash = 2166136261U;
+
+	for (; *str; str++) {
+		hash ^= (unsigned char)*str;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static int string_pool_grow(PlaylistStringPool *sp)
+{
+	size_t           i, buckets = sp->buckets ? sp->buckets * 2 : 256;
+	PlaylistString **bucket = calloc(buckets, sizeof(PlaylistString *));
+
+	if (!bucket) return 0;
+	for (i = 0; i < sp->buckets; i++) {
+		PlaylistString *s, *next;
+		for (s = sp->bucket[i]; s; s = next) {
+			next = s->next;
+			s->next = bucket[s->hash % buckets];
+			bucket[s->hash % buckets] = s;
+		}
+	}
+	free(sp->bucket);
+	sp->bucket  = bucket;
+	sp->buckets = buckets;
+	return 1;
+}
+
+/* Returns a reference counted copy of 'str', shared with identical strings */
+static char *string_pool_get(PlaylistStringPool *sp, const char *str)
+{
+	unsigned int    hash = string_hash(str);
+	PlaylistString *s = NULL;
+
+	if (sp->strings >= sp->buckets && !string_pool_grow(sp) && sp->buckets == 0)
+		return NULL;
+	for (s = sp->bucket[hash % sp->buckets]; s; s = s->next)
+		if (s->hash == hash && strcmp(s->str, str) == 0) break;
+	if (s) {
+		s->refs++;
+	} else {
+		size_t len = strlen(str);
+		s = malloc(sizeof(PlaylistString) + len);
+		if (s) {
+			memcpy(s->str, str, len+1);
+			s->hash = hash;
+			s->refs = 1;
+			s->next = sp->bucket[hash % sp->buckets];
+			sp->bucket[hash % sp->buckets] = s;
+			sp->strings++;
+		}
+	}
+	return s ? s->str : NULL;
+}
+
+static void string_pool_release(PlaylistStringPool *sp, char *str)
+{
+	PlaylistString *s = (PlaylistString *)(str - offsetof(PlaylistString, str));
+
+	if (--s->refs == 0) {
+		PlaylistString **iter = &(sp->bucket[s->hash % sp->buckets]);
+		while (*iter != s) iter = &((*iter)->next);
+		*iter = s->next;
+		sp->strings--;
+		free(s);
+	}
+}
+
+static void string_pool_clear(PlaylistStringPool *sp)
+{
+	size_t i;
+
+	for (i = 0; i < sp->buckets; i++) {
+		PlaylistString *s, *next;
+		for (s = sp->bucket[i]; s; s = next) {
+			next = s->next;
+			free(s);
+		}
+	}
+	free(sp->bucket);
+	sp->bucket  = NULL;
+	sp->buckets = 0;
+	sp->strings = 0;
+}
+
+/* Position index */
+
+static void index_renumber_chunks(Playlist *pl, size_t from)
+{
+	for (; from < pl->chunks_used; from++)
+		pl->chunks[from]->index = from;
+}
+
+/*
+ * The chunk sizes are kept in a Fenwick tree: chunk_tree[k] (1-based) holds
+ * the number of entries in the chunks k-(k&-k) to k-1, so the playlist
+ * position of a chunk and the chunk of a position are found in O(log n).
+ */
+static void index_tree_add(Playlist *pl, size_t index, size_t delta)
+{
+	size_t k;
+
+	for (k = index + 1; k <= pl->chunks_used; k += k & -k)
+		pl->chunk_tree[k] += delta;
+}
+
+/* Returns the playlist position of the first entry of chunk 'index' */
+static size_t index_chunk_start(Playlist *pl, size_t index)
+{
+	size_t k, start = 0;
+
+	for (k = index; k > 0; k -= k & -k)
+		start += pl->chunk_tree[k];
+	return start;
+}
+
+/* Rebuilds the tree in O(n) after chunks have been inserted or removed */
+static void index_tree_rebuild(Playlist *pl)
+{
+	size_t k;
+
+	for (k = 1; k <= pl->chunks_used; k++)
+		pl->chunk_tree[k] = pl->chunks[k-1]->count;
+	for (k = 1; k <= pl->chunks_used; k++)
+		if (k + (k & -k) <= pl->chunks_used)
+			pl->chunk_tree[k + (k & -k)] += pl->chunk_tree[k];
+}
+
+static void index_renumber_entries(PlaylistChunk *c, size_t from)
+{
+	for (; from < c->count; from++) {
+		c->entry[from]->chunk     = c;
+		c->entry[from]->chunk_pos = from;
+	}
+}
+
+/* Creates an empty chunk at position 'index' in the chunk list */
+static PlaylistChunk *index_chunk_new(Playlist *pl, size_t index)
+{
+	PlaylistChunk *c;
+
+	if (pl->chunks_used == pl->chunks_allocated) {
+		size_t          n = pl->chunks_allocated ? pl->chunks_allocated * 2 : 16;
+		PlaylistChunk **chunks = realloc(pl->chunks, n * sizeof(PlaylistChunk *));
+		size_t         *tree;
+		if (!chunks) return NULL;
+		pl->chunks = chunks;
+		if (!(tree = realloc(pl->chunk_tree, (n + 1) * sizeof(size_t)))) return NULL;
+		pl->chunk_tree = tree;
+		pl->chunks_allocated = n;
+	}
+	if (!(c = malloc(sizeof(PlaylistChunk)))) return NULL;
+	memmove(pl->chunks + index + 1, pl->chunks + index,
+	        (pl->chunks_used - index) * sizeof(PlaylistChunk *));
+	pl->chunks[index] = c;
+	pl->chunks_used++;
+	index_renumber_chunks(pl, index);
+	c->count = 0;
+	if (index + 1 == pl->chunks_used) { /* Appended: only its own node is new */
+		size_t k = pl->chunks_used;
+		pl->chunk_tree[k] = index_chunk_start(pl, k - 1) - index_chunk_start(pl, k - (k & -k));
+	} else {
+		index_tree_rebuild(pl);
+	}
+	return c;
+}
+
+static void index_chunk_remove(Playlist *pl, PlaylistChunk *c)
+{
+	size_t index = c->index;
+
+	pl->chunks_used--;
+	memmove(pl->chunks + index, pl->chunks + index + 1,
+	        (pl->chunks_used - index) * sizeof(PlaylistChunk *));
+	index_renumber_chunks(pl, index);
+	if (index < pl->chunks_used) index_tree_rebuild(pl);
+	free(c);
+}
+
+/* Moves the upper half of chunk 'c' into a new chunk following it */
+static int index_chunk_split(Playlist *pl, PlaylistChunk *c)
+{
+	PlaylistChunk *n = index_chunk_new(pl, c->index + 1);
+	size_t         half = c->count / 2;
+
+	if (!n) return 0;
+	n->count = c->count - half;
+	memcpy(n->entry, c->entry + half, n->count * sizeof(Entry *));
+	c->count = half;
+	index_tree_add(pl, c->index, -n->count);
+	index_tree_add(pl, n->index, n->count);
+	index_renumber_entries(n, 0);
+	return 1;
+}
+
+/* Appends the entries of the chunk following 'c' to 'c' */
+static void index_chunk_merge(Playlist *pl, PlaylistChunk *c)
+{
+	PlaylistChunk *n = pl->chunks[c->index + 1];
+	size_t         from = c->count;
+
+	memcpy(c->entry + c->count, n->entry, n->count * sizeof(Entry *));
+	c->count += n->count;
+	index_tree_add(pl, c->index, n->count);
+	index_renumber_entries(c, from);
+	index_chunk_remove(pl, n);
+}
+
+/*
+ * Returns the chunk containing position 'pos' (or the last chunk for
+ * pos == length) and stores the position within that chunk in 'offset'
+ */
+static PlaylistChunk *index_find_chunk(Playlist *pl, size_t pos, size_t *offset)
+{
+	size_t k = 0, step = 1;
+
+	if (pl->chunks_used == 0) return NULL;
+	while (step * 2 <= pl->chunks_used) step *= 2;
+	for (; step > 0; step /= 2) {
+		if (k + step <= pl->chunks_used && pl->chunk_tree[k + step] <= pos) {
+			k += step;
+			pos -= pl->chunk_tree[k];
+		}
+	}
+	if (k == pl->chunks_used) { /* pos == length */
+		k--;
+		pos = pl->chunks[k]->count;
+	}
+	*offset = pos;
+	return pl->chunks[k];
+}
+
+/* Change history */
+
+static void history_record_change(Playlist *pl, size_t pos)
+{
+	PlaylistChange *last = NULL;
+
+	pl->version++;
+	if (pl->changes_used > 0)
+		last = &(pl->changes[(pl->changes_next + PL_CHANGE_HISTORY - 1) % PL_CHANGE_HISTORY]);
+	if (last && pos >= last->position) {
+		last->version = pl->version;
+	} else {
+		PlaylistChange *ch = &(pl->changes[pl->changes_next]);
+
+		if (pl->changes_used == PL_CHANGE_HISTORY)
+			pl->history_start = ch->version;
+		else
+			pl->changes_used++;
+		ch->version  = pl->version;
+		ch->position = pos;
+		pl->changes_next = (pl->changes_next + 1) % PL_CHANGE_HISTORY;
+	}
+}
+
+unsigned long playlist_get_version(Playlist *pl)
+{
+	return pl->version;
+}
+
+size_t playlist_get_changed_since(Playlist *pl, unsigned long version)
+{
+	size_t i, pos = pl->length;
+
+	if (version < pl->history_start || version > pl->version) return 0;
+	for (i = 0; i < pl->changes_used; i++) {
+		PlaylistChange *ch = &(pl->changes[i]);
+
+		if (ch->version > version && ch->position < pos) pos = ch->position;
+	}
+	return pos;
+}
+
+static size_t entry_get_position(Playlist *pl, Entry *entry)
+{
+	return index_chunk_start(pl, entry->chunk->index) + entry->chunk_pos;
+}
+
+/*
+ * Inserting and removing entries costs O(log n) for the tree update plus
+ * the moves within one chunk. Only splitting, merging or removing a chunk
+ * in the middle rebuilds the tree in O(n / PL_CHUNK_SIZE), which happens
+ * at most once every PL_CHUNK_SIZE / 2 changes to a chunk.
+ */
+static int index_insert(Playlist *pl, size_t pos, Entry *entry)
+{
+	size_t         i = 0;
+	PlaylistChunk *c = index_find_chunk(pl, pos, &i);
+
+	if (!c) c = index_chunk_new(pl, 0);
+	if (!c) return 0;
+	if (c->count == PL_CHUNK_SIZE) {
+		if (pos == pl->length) { /* Appending: start a fresh chunk */
+			if (!(c = index_chunk_new(pl, pl->chunks_used))) return 0;
+			i = 0;
+		} else {
+			if (!index_chunk_split(pl, c)) return 0;
+			if (i > c->count) {
+				i -= c->count;
+				c = pl->chunks[c->index + 1];
+			}
+		}
+	}
+	memmove(c->entry + i + 1, c->entry + i, (c->count - i) * sizeof(Entry *));
+	c->entry[i] = entry;
+	c->count++;
+	index_tree_add(pl, c->index, 1);
+	index_renumber_entries(c, i);
+	history_record_change(pl, pos);
+	return 1;
+}
+
+static void index_remove(Playlist *pl, Entry *entry)
+{
+	PlaylistChunk *c = entry->chunk;
+
+	history_record_change(pl, entry_get_position(pl, entry));
+	c->count--;
+	memmove(c->entry + entry->chunk_pos, c->entry + entry->chunk_pos + 1,
+	        (c->count - entry->chunk_pos) * sizeof(Entry *));
+	index_tree_add(pl, c->index, -1);
+	index_renumber_entries(c, entry->chunk_pos);
+	if (c->count == 0) {
+		index_chunk_remove(pl, c);
+	} else {
+		/* Keep the number of chunks low by merging sparse neighbours */
+		if (c->index + 1 < pl->chunks_used &&
+		    c->count + pl->chunks[c->index + 1]->count <= PL_CHUNK_SIZE / 2)
+			index_chunk_merge(pl, c);
+		if (c->index > 0 &&
+		    c->count + pl->chunks[c->index - 1]->count <= PL_CHUNK_SIZE / 2)
+			index_chunk_merge(pl, pl->chunks[c->index - 1]);
+	}
+}
+
+static void index_clear(Playlist *pl)
+{
+	size_t i;
+
+	for (i = 0; i < pl->chunks_used; i++)
+		free(pl->chunks[i]);
+	free(pl->chunks);
+	free(pl->chunk_tree);
+	pl->chunks = NULL;
+	pl->chunk_tree = NULL;
+	pl->chunks_used = 0;
+	pl->chunks_allocated = 0;
+}
+
+/* Shuffle order */
+
+static int is_random_mode(PlayMode mode)
+{
+	return mode == PM_RANDOM || mode == PM_RANDOM_REPEAT;
+}
+
+/* xorshift32, so shuffle orders are reproducible across platforms */
+static unsigned long shuffle_rand(Playlist *pl)
+{
+	unsigned long x = pl->shuffle_state;
+
+	x ^= (x << 13) & 0xFFFFFFFFUL;
+	x ^= x >> 17;
+	x ^= (x << 5) & 0xFFFFFFFFUL;
+	pl->shuffle_state = x;
+	return x;
+}
+
+/* Returns a uniformly distributed random number in the range [0, n) */
+static size_t shuffle_rand_range(Playlist *pl, size_t n)
+{
+	unsigned long limit = 0xFFFFFFFFUL - 0xFFFFFFFFUL % n, r;
+
+	do {
+		r = shuffle_rand(pl);
+	} while (r >= limit);
+	return r % n;
+}
+
+static void shuffle_set(Playlist *pl, size_t pos, Entry *entry)
+{
+	pl->shuffle[pos] = entry;
+	entry->shuffle_pos = pos;
+}
+
+static void shuffle_swap(Playlist *pl, size_t a, size_t b)
+{
+	Entry *tmp = pl->shuffle[a];
+
+	shuffle_set(pl, a, pl->shuffle[b]);
+	shuffle_set(pl, b, tmp);
+}
+
+/* Fisher-Yates shuffle of all entries, forgetting which ones have been played */
+static void shuffle_generate(Playlist *pl)
+{
+	size_t i;
+
+	for (i = 0; i < pl->played_items; i++)
+		pl->shuffle[i]->played = 0;
+	pl->played_items = 0;
+	for (i = pl->length; i > 1; i--)
+		shuffle_swap(pl, i - 1, shuffle_rand_range(pl, i));
+}
+
+/*
+ * Adds a new entry to the shuffle order at a random position among the
+ * entries not yet played. Must be called before pl->length is increased.
+ */
+static int shuffle_insert(Playlist *pl, Entry *entry)
+{
+	if (pl->length == pl->shuffle_allocated) {
+		size_t  n = pl->shuffle_allocated ? pl->shuffle_allocated * 2 : 256;
+		Entry **shuffle = realloc(pl->shuffle, n * sizeof(Entry *));
+		if (!shuffle) return 0;
+		pl->shuffle = shuffle;
+		pl->shuffle_allocated = n;
+	}
+	shuffle_set(pl, pl->length, entry);
+	shuffle_swap(pl, pl->length,
+	             pl->played_items + shuffle_rand_range(pl, pl->length - pl->played_items + 1));
+	return 1;
+}
+
+/*
+ * Removes an entry from the shuffle order, keeping the order of the
+ * already played entries intact. Must be called before pl->length is
+ * decreased.
+ */
+static void shuffle_remove(Playlist *pl, Entry *entry)
+{
+	size_t i, last = pl->length - 1;
+
+	if (entry->shuffle_pos < pl->played_items) {
+		for (i = entry->shuffle_pos; i + 1 < pl->played_items; i++)
+			shuffle_set(pl, i, pl->shuffle[i + 1]);
+		pl->played_items--;
+		if (pl->played_items != last)
+			shuffle_set(pl, pl->played_items, pl->shuffle[last]);
+	} else if (entry->shuffle_pos != last) {
+		shuffle_set(pl, entry->shuffle_pos, pl->shuffle[last]);
+	}
+}
+
+/* Moves an unplayed entry to the end of the played part of the shuffle order */
+static void shuffle_mark_played(Playlist *pl, Entry *entry)
+{
+	if (!entry->played) {
+		shuffle_swap(pl, entry->shuffle_pos, pl->played_items);
+		pl->played_items++;
+		entry->played = 1;
+	}
+}
+
+/*
+ * Allocates a new entry and inserts it into the position index at 'pos'
+ * and into the shuffle order.
+ */
+static Entry *entry_new(Playlist *pl, size_t pos, const char *file, const char *name)
+{
+	Entry *entry = malloc(sizeof(Entry));
+	int    indexed = 0;
+
+	if (entry) {
+		entry->filename = string_pool_get(&(pl->paths), file);
+		entry->played = 0;
+		if (entry->filename) indexed = index_insert(pl, pos, entry);
+		if (indexed && shuffle_insert(pl, entry)) {
+			playlist_entry_set_name(entry, name);
+			entry->queue_pos = 0;
+			entry->next_in_queue = NULL;
+		} else {
+			if (indexed) index_remove(pl, entry);
+			if (entry->filename) string_pool_release(&(pl->paths), entry->filename);
+			free(entry);
+			entry = NULL;
+		}
+	}
+	return entry;
+}
+
 void playlist_init(Playlist *pl)
 {
 	pl->length       = 0;
@@ -44,7 +532,20 @@ void playlist_init(Playlist *pl)
 	pl->play_mode    = PM_CONTINUE;
 	pl->played_items = 0;
 	pl->queue_start  = NULL;
-	srand(time(NULL));
+	pl->chunks       = NULL;
+	pl->chunk_tree   = NULL;
+	pl->chunks_used  = 0;
+	pl->chunks_allocated = 0;
+	memset(&(pl->paths), 0, sizeof(PlaylistStringPool));
+	pl->shuffle      = NULL;
+	pl->shuffle_allocated = 0;
+	pl->shuffle_state = 0;
+	/* Start at a different version each run, so clients can't mistake old state for current */
+	pl->version      = (unsigned long)time(NULL);
+	pl->history_start = pl->version;
+	pl->changes_used = 0;
+	pl->changes_next = 0;
+	playlist_set_shuffle_seed(pl, (unsigned long)time(NULL));
 	pthread_mutex_init(&(pl->mutex), NULL);
 }
 
@@ -76,6 +577,12 @@ void playlist_clear(Playlist *pl)
 		free(entry);
 		entry = next;
 	}
+	index_clear(pl);
+	history_record_change(pl, 0);
+	string_pool_clear(&(pl->paths));
+	free(pl->shuffle);
+	pl->shuffle = NULL;
+	pl->shuffle_allocated = 0;
 	pl->length  = 0;
 	pl->current = NULL;
 	pl->first   = NULL;
@@ -86,51 +593,32 @@ void playlist_clear(Playlist *pl)
 
 int playlist_add_item(Playlist *pl, const char *file, const char *name)
 {
-	int    result = 1;
+	int    result = 0;
 	Entry *entry = NULL;
 
 	if (pl->length < PLAYLIST_MAX_LENGTH) {
-		if (pl->first == NULL) { /* playlist empty */
-			pl->first = malloc(sizeof(Entry));
-			if (pl->first) {
-				entry = pl->first;
-				entry->prev = NULL;
-				pl->last = pl->first;
+		char path[PATH_LEN_MAX];
+
+		if (file[0] != '/' && strncmp(file, "http://", 7) != 0) {
+			char cwd[PATH_LEN_DIR_MAX];
+			if (getcwd(cwd, PATH_LEN_DIR_MAX)) { /* do we still need this? */
+				snprintf(path, PATH_LEN_MAX, "%s/%s", cwd, file);
+				entry = entry_new(pl, pl->length, path, name);
 			}
 		} else {
-			pl->last->next = malloc(sizeof(Entry));
-			if (pl->last->next) {
-				entry = pl->last->next;
-				entry->prev = pl->last;
-				pl->last = entry;
-			}
+			entry = entry_new(pl, pl->length, file, name);
 		}
 		if (entry) {
-			entry->played = 0;
 			entry->next = NULL;
-			if (file[0] != '/' && strncmp(file, "http://", 7) != 0) {
-				char path[PATH_LEN_DIR_MAX];
-				if (getcwd(path, PATH_LEN_DIR_MAX)) { /* do we still need this? */
-					snprintf(entry->filename, PATH_LEN_MAX, "%s/%s", path, file);
-				} else {
-					entry->filename[0] = '\0';
-					result = 0;
-				}
-			} else {
-				strncpy(entry->filename, file, PATH_LEN_MAX);
-			}
-			if (result) {
-				entry->filename[PATH_LEN_MAX-1] = '\0';
-				playlist_entry_set_name(entry, name);
-				entry->queue_pos = 0;
-				entry->next_in_queue = NULL;
-				pl->length++;
-			}
-		} else {
-			result = 0;
+			entry->prev = pl->last;
+			if (pl->last)
+				pl->last->next = entry;
+			else
+				pl->first = entry;
+			pl->last = entry;
+			pl->length++;
+			result = 1;
 		}
-	} else {
-		result = 0;
 	}
 	return result;
 }
@@ -250,23 +738,16 @@ int playlist_insert_item_after(Playlist *pl, Entry *entry, const char *file, con
 	Entry *new_entry;
 	int    result = 0;
 
-	if (entry != NULL) {
-		new_entry = malloc(sizeof(Entry));
+	if (entry != NULL && pl->length < PLAYLIST_MAX_LENGTH) {
+		new_entry = entry_new(pl, entry_get_position(pl, entry) + 1, file, name);
 		if (new_entry) {
-			strncpy(new_entry->filename, file, 255);
-			new_entry->filename[255] = '\0';
-			playlist_entry_set_name(new_entry, name);
-			new_entry->played = 0;
-			new_entry->queue_pos = 0;
-			new_entry->next_in_queue = NULL;
 			new_entry->prev = entry;
-			if (entry->next != NULL)
-				new_entry->next = entry->next;
-			else
-				new_entry->next = NULL;
+			new_entry->next = entry->next;
 			entry->next = new_entry;
 			if (new_entry->next != NULL)
 				new_entry->next->prev = new_entry;
+			else
+				pl->last = new_entry;
 			pl->length++;
 			result = 1;
 		}
@@ -320,14 +801,13 @@ PlayMode playlist_cycle_play_mode(Playlist *pl)
 
 void playlist_reset_random(Playlist *pl)
 {
-	Entry *entry;
+	shuffle_generate(pl);
+}
 
-	entry = pl->first;
-	while (entry) {
-		entry->played = 0;
-		entry = entry->next;
-	}
-	pl->played_items = 0;
+void playlist_set_shuffle_seed(Playlist *pl, unsigned long seed)
+{
+	pl->shuffle_state = (seed & 0xFFFFFFFFUL) ? (seed & 0xFFFFFFFFUL) : 0x9E3779B9UL;
+	shuffle_generate(pl);
 }
 
 int playlist_entry_delete(Playlist *pl, Entry *entry)
@@ -335,8 +815,14 @@ int playlist_entry_delete(Playlist *pl, Entry *entry)
 	int result = 1;
 	if (entry != NULL && pl->length > 0) {
 		if (pl->current == entry) { /* We try to remove the currently playing entry */
-			pl->current = entry->prev;
+			if (!is_random_mode(pl->play_mode))
+				pl->current = entry->prev;
+			else if (entry->played && entry->shuffle_pos > 0)
+				pl->current = pl->shuffle[entry->shuffle_pos - 1];
+			else
+				pl->current = NULL;
 		}
+		shuffle_remove(pl, entry);
 		if (entry->prev == NULL && entry->next == NULL) { /* remove last remaining entry */
 			pl->first = NULL;
 			pl->last = NULL;
@@ -355,6 +841,8 @@ int playlist_entry_delete(Playlist *pl, Entry *entry)
 			pl->first = NULL;
 			pl->last = NULL;
 		}
+		index_remove(pl, entry);
+		string_pool_release(&(pl->paths), entry->filename);
 		free(entry);
 		entry = NULL;
 	} else {
@@ -365,12 +853,8 @@ int playlist_entry_delete(Playlist *pl, Entry *entry)
 
 Entry *playlist_item_delete(Playlist *pl, size_t item)
 {
-	size_t i;
-	Entry *entry = pl->first, *next = NULL;
+	Entry *entry = playlist_get_entry(pl, item), *next = NULL;
 
-	for (i = 0; entry != NULL && i != item; i++) {
-		entry = playlist_get_next(entry);
-	}
 	if (entry) {
 		next = entry->next;
 		playlist_entry_delete(pl, entry);
@@ -396,30 +880,12 @@ char *playlist_get_entry_filename(Playlist *pl, Entry *entry)
 
 char *playlist_get_name(Playlist *pl, size_t item)
 {
-	char  *result = NULL;
-	Entry *entry = pl->first;
-
-	if (item < pl->length) {
-		size_t i;
-		for (i = 0; i < item && entry->next != NULL; i++)
-			entry = entry->next;
-		result = entry->name;
-	}
-	return result;
+	return playlist_get_entry_name(pl, playlist_get_entry(pl, item));
 }
 
 char *playlist_get_filename(Playlist *pl, size_t item)
 {
-	char  *result = NULL;
-	Entry *entry = pl->first;
-
-	if (item < pl->length) {
-		size_t i;
-		for (i = 0; i < item && entry->next != NULL; i++)
-			entry = entry->next;
-		result = entry->filename;
-	}
-	return result;
+	return playlist_get_entry_filename(pl, playlist_get_entry(pl, item));
 }
 
 size_t playlist_get_length(Playlist *pl)
@@ -430,7 +896,7 @@ size_t playlist_get_length(Playlist *pl)
 int playlist_next(Playlist *pl)
 {
 	int    result = 0;
-	size_t i, next_item;
+	size_t i;
 	Entry *entry;
 
 	if (pl->queue_start != NULL) { /* Queue not empty? */
@@ -439,6 +905,8 @@ int playlist_next(Playlist *pl)
 		pl->queue_start = pl->current->next_in_queue;
 		for (i = 0; iter != NULL; iter = iter->next_in_queue, i++)
 			iter->queue_pos = i;
+		if (is_random_mode(pl->play_mode))
+			shuffle_mark_played(pl, pl->current);
 		result = 1;
 	} else {
 		switch (pl->play_mode) {
@@ -472,23 +940,22 @@ int playlist_next(Playlist *pl)
 				break;
 			case PM_RANDOM:
 			case PM_RANDOM_REPEAT:
-				entry = pl->first;
-				if (pl->length > 0) {
-					next_item = rand() / (RAND_MAX / pl->length);
-
-					for (i = 0; i < next_item; i++)
-						entry = entry->next;
-
-					if (entry->played && pl->played_items < pl->length) {
-						result = playlist_next(pl);
-					} else if (pl->played_items < pl->length) {
-						playlist_set_current(pl, entry);
-						result = 1;
+				entry = pl->current;
+				if (entry != NULL && entry->played && entry->shuffle_pos + 1 < pl->played_items) {
+					/* We went back before, so step forward through the played entries */
+					pl->current = pl->shuffle[entry->shuffle_pos + 1];
+					result = 1;
+				} else {
+					if (pl->play_mode == PM_RANDOM_REPEAT && pl->played_items >= pl->length) {
+						shuffle_generate(pl); /* all tracks played */
+						/* Avoid playing the same track twice in a row */
+						if (pl->length > 1 && pl->shuffle[0] == entry)
+							shuffle_swap(pl, 0, 1 + shuffle_rand_range(pl, pl->length - 1));
 					}
-					if (pl->play_mode == PM_RANDOM_REPEAT) {
-						if (pl->played_items >= pl->length) { /* all tracks played? */
-							playlist_reset_random(pl);
-						}
+					if (pl->played_items < pl->length) {
+						pl->current = pl->shuffle[pl->played_items];
+						shuffle_mark_played(pl, pl->current);
+						result = 1;
 					}
 				}
 				break;
@@ -497,6 +964,40 @@ int playlist_next(Playlist *pl)
 	return result;
 }
 
+/*
+ * Returns the entry playlist_next() would switch to without changing
+ * anything, or NULL if there is none or it cannot be predicted (e.g.
+ * when the shuffle order is about to be regenerated).
+ */
+Entry *playlist_peek_next(Playlist *pl)
+{
+	Entry *entry = NULL;
+
+	if (pl->queue_start != NULL) {
+		entry = pl->queue_start;
+	} else {
+		switch (pl->play_mode) {
+			case PM_CONTINUE:
+				entry = pl->current != NULL ? pl->current->next : pl->first;
+				break;
+			case PM_REPEAT_ALL:
+				entry = pl->current != NULL && pl->current->next != NULL ? pl->current->next : pl->first;
+				break;
+			case PM_REPEAT_1:
+				entry = pl->current != NULL ? pl->current : pl->first;
+				break;
+			case PM_RANDOM:
+			case PM_RANDOM_REPEAT:
+				if (pl->current != NULL && pl->current->played && pl->current->shuffle_pos + 1 < pl->played_items)
+					entry = pl->shuffle[pl->current->shuffle_pos + 1];
+				else if (pl->played_items < pl->length)
+					entry = pl->shuffle[pl->played_items];
+				break;
+		}
+	}
+	return entry;
+}
+
 int playlist_prev(Playlist *pl)
 {
 	int result = 0;
@@ -523,6 +1024,15 @@ int playlist_prev(Playlist *pl)
 			break;
 		case PM_RANDOM:
 		case PM_RANDOM_REPEAT:
+			if (pl->current != NULL && pl->current->played) {
+				if (pl->current->shuffle_pos > 0) {
+					pl->current = pl->shuffle[pl->current->shuffle_pos - 1];
+					result = 1;
+				}
+			} else if (pl->played_items > 0) {
+				pl->current = pl->shuffle[pl->played_items - 1];
+				result = 1;
+			}
 			break;
 	}
 	return result;
@@ -531,11 +1041,8 @@ int playlist_prev(Playlist *pl)
 int playlist_set_current(Playlist *pl, Entry *entry)
 {
 	pl->current = entry;
-	if (pl->current != NULL) {
-		if (pl->play_mode == PM_RANDOM || pl->play_mode == PM_RANDOM_REPEAT)
-			pl->current->played = 1;
-		pl->played_items++;
-	}
+	if (entry != NULL && is_random_mode(pl->play_mode))
+		shuffle_mark_played(pl, entry);
 	return 1;
 }
 
@@ -546,13 +1053,12 @@ Entry *playlist_get_current(Playlist *pl)
 
 int playlist_get_current_position(Playlist *pl)
 {
-	int    res = -1;
-	Entry *entry = pl->first;
+	int res = -1;
 
-	if (entry != NULL) {
-		for (res = 0; entry != playlist_get_current(pl) && res < playlist_get_length(pl); res++)
-			entry = playlist_get_next(entry);
-	}
+	if (pl->current != NULL)
+		res = (int)entry_get_position(pl, pl->current);
+	else if (pl->length > 0)
+		res = (int)pl->length;
 	return res;
 }
 
@@ -612,16 +1118,12 @@ int playlist_entry_enqueue(Playlist *pl, Entry *entry)
 
 Entry *playlist_get_entry(Playlist *pl, size_t item)
 {
-	Entry *entry;
-	size_t i = 0;
+	Entry         *entry = NULL;
+	PlaylistChunk *c;
+	size_t         i;
 
-	entry = pl->first;
-	if (entry != NULL) {
-		while (i < item && entry) {
-			entry = playlist_get_next(entry);
-			i++;
-		}
-	}
+	if (item < pl->length && (c = index_find_chunk(pl, item, &i)))
+		entry = c->entry[i];
 	return entry;
 }
 
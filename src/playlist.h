@@ -25,26 +25,93 @@ typedef enum PlayMode {
 typedef struct _Entry Entry;
 
 #define PL_ENTRY_NAME_MAX_LENGTH 64
+/* Maximum number of entries per index chunk */
+#define PL_CHUNK_SIZE 256
+/* Number of change records kept for delta syncs */
+#define PL_CHANGE_HISTORY 16
+
+typedef struct _PlaylistChunk PlaylistChunk;
 
 struct _Entry
 {
-	Entry *next, *prev;
-	char   filename[PATH_LEN_MAX];
-	char   name[PL_ENTRY_NAME_MAX_LENGTH];
-	short  played;
-	size_t queue_pos;
-	Entry *next_in_queue;
+	Entry         *next, *prev;
+	char          *filename; /* Interned, shared by identical paths */
+	char           name[PL_ENTRY_NAME_MAX_LENGTH];
+	short          played;
+	size_t         queue_pos;
+	Entry         *next_in_queue;
+	PlaylistChunk *chunk;     /* Index chunk holding this entry */
+	size_t         chunk_pos; /* Position within that chunk */
+	size_t         shuffle_pos; /* Position in the shuffle order */
+};
+
+/*
+ * The playlist index is a list of fixed-size chunks of entry pointers.
+ * A Fenwick tree over the chunk sizes yields the playlist position of a
+ * chunk's first entry, so both position -> entry and entry -> position
+ * take O(log n).
+ */
+struct _PlaylistChunk
+{
+	size_t  index; /* Position of this chunk in the chunk list */
+	size_t  count;
+	Entry  *entry[PL_CHUNK_SIZE];
+};
+
+typedef struct _PlaylistString PlaylistString;
+
+struct _PlaylistString
+{
+	PlaylistString *next;
+	unsigned int    hash;
+	size_t          refs;
+	char            str[1];
 };
 
+typedef struct _PlaylistStringPool
+{
+	PlaylistString **bucket;
+	size_t           buckets, strings;
+} PlaylistStringPool;
+
+/*
+ * Every change of the entries increments the playlist version. A change
+ * record covers the versions up to 'version' and holds the lowest
+ * position changed by them; changes at or behind the position of the
+ * newest record (like appending) extend that record.
+ */
+typedef struct _PlaylistChange
+{
+	unsigned long version;
+	size_t        position;
+} PlaylistChange;
+
+/*
+ * In the random play modes entries are played in the order given by
+ * the 'shuffle' permutation. The first 'played_items' entries of the
+ * permutation have already been played (in that order), the rest is
+ * the randomly ordered remainder.
+ */
 struct _Playlist
 {
-	size_t          length;
-	size_t          played_items;
-	PlayMode        play_mode;
-	Entry          *current;
-	Entry          *first, *last;
-	Entry          *queue_start;
-	pthread_mutex_t mutex;
+	size_t              length;
+	size_t              played_items;
+	PlayMode            play_mode;
+	Entry              *current;
+	Entry              *first, *last;
+	Entry              *queue_start;
+	PlaylistChunk     **chunks;
+	size_t             *chunk_tree; /* Fenwick tree over the chunk sizes */
+	size_t              chunks_used, chunks_allocated;
+	PlaylistStringPool  paths;
+	Entry             **shuffle;
+	size_t              shuffle_allocated;
+	unsigned long       shuffle_state;
+	unsigned long       version;
+	unsigned long       history_start; /* Oldest version changes are known since */
+	PlaylistChange      changes[PL_CHANGE_HISTORY];
+	size_t              changes_used, changes_next;
+	pthread_mutex_t     mutex;
 };
 
 typedef struct _Playlist Playlist;
@@ -62,6 +129,8 @@ int      playlist_entry_set_name(Entry *entry, const char *name);
 char    *playlist_get_filename(Playlist *pl, size_t item);
 size_t   playlist_get_length(Playlist *pl);
 int      playlist_next(Playlist *pl);
+/* Returns the entry playlist_next() is going to select, without selecting it */
+Entry   *playlist_peek_next(Playlist *pl);
 int      playlist_prev(Playlist *pl);
 int      playlist_set_current(Playlist *pl, Entry *entry);
 Entry   *playlist_get_current(Playlist *pl);
@@ -80,10 +149,18 @@ int      playlist_set_play_mode(Playlist *pl, PlayMode mode);
 PlayMode playlist_cycle_play_mode(Playlist *pl);
 int      playlist_toggle_random_mode(Playlist *pl);
 void     playlist_reset_random(Playlist *pl);
+/* Reseeds the shuffle order; the same seed yields the same order for the same playlist */
+void     playlist_set_shuffle_seed(Playlist *pl, unsigned long seed);
 int      playlist_get_played(Entry *entry);
 int      playlist_add_dir(Playlist *pl, const char *directory, void (*finished_callback)(size_t pl_len));
 int      playlist_get_current_position(Playlist *pl);
 size_t   playlist_entry_get_queue_pos(Entry *entry);
 int      playlist_entry_enqueue(Playlist *pl, Entry *entry);
 int      playlist_is_recursive_directory_add_in_progress(void);
+unsigned long playlist_get_version(Playlist *pl);
+/*
+ * Returns the lowest position changed since 'version', the playlist
+ * length if nothing changed, or 0 if the version is unknown.
+ */
+size_t   playlist_get_changed_since(Playlist *pl, unsigned long version);
 #endif
@@ -17,24 +17,42 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <netdb.h>
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
-#include <arpa/inet.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <signal.h>
+#include <time.h>
 #include "util.h" /* for assign_signal_handler() */
+#include "charset.h"
 #include "reader.h"
 #include "ringbuffer.h"
 #include "debug.h"
 #include "core.h" /* for VERSION_NUMBER and DEFAULT_THREAD_STACK_SIZE */
 #include "pthread_helper.h"
+#include "httpconn.h"
+
+/* Maximum size of a HTTP response header */
+#define HTTP_HEADER_SIZE_MAX 32768
+#define HTTP_RECV_CHUNK_SIZE 4096
+
+/* States of the chunked transfer encoding decoder */
+enum { CHUNK_SIZE, CHUNK_EXTENSION, CHUNK_DATA, CHUNK_DATA_END, CHUNK_TRAILER };
+
+/* Number of bytes following the read position the kernel is asked to read ahead */
+#define LOCAL_FILE_READAHEAD (256 * 1024)
+/* Amount of data the read-ahead thread loads at once */
+#define LOCAL_FILE_READ_AHEAD_CHUNK (64 * 1024)
 
 static size_t http_cache_size           = 512 * 1024;
 static size_t http_cache_prebuffer_size = 256 * 1024;
+static size_t local_read_ahead_size     = 512 * 1024;
+
+static pthread_mutex_t prefetch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int             prefetch_running;
 
 int reader_set_cache_size_kb(size_t size, size_t prebuffer_size)
 {
@@ -49,17 +67,24 @@ int reader_set_cache_size_kb(size_t size, size_t prebuffer_size)
 	return size;
 }
 
-int reader_get_cache_fill(Reader *r)
+void reader_set_read_ahead_kb(size_t size)
 {
-	return ringbuffer_get_fill(&(r->rb_http));
+	if (size > 0 && size * 1024 < 2 * LOCAL_FILE_READ_AHEAD_CHUNK)
+		size = 2 * LOCAL_FILE_READ_AHEAD_CHUNK / 1024;
+	local_read_ahead_size = size * 1024;
+	wdprintf(V_INFO, "reader", "Read-ahead for local files: %d kB\n", size);
 }
 
-/* get sockaddr, IPv4 or IPv6 */
-static void *get_in_addr(struct sockaddr *sa)
+static int reader_is_cached_stream(Reader *r)
 {
-	if (sa->sa_family == AF_INET)
-		return &(((struct sockaddr_in*)sa)->sin_addr);
-	return &(((struct sockaddr_in6*)sa)->sin6_addr);
+	return r->cache.fd >= 0;
+}
+
+/* Number of bytes received from the network that have not been read yet */
+int reader_get_cache_fill(Reader *r)
+{
+	return reader_is_cached_stream(r) ? (int)(r->cache_fill - (long)r->stream_pos) :
+	                                    (int)ringbuffer_get_fill(&(r->rb_http));
 }
 
 static int http_url_split_alloc(const char *url, char **hostname, int *port, char **path)
@@ -97,42 +122,355 @@ static int http_url_split_alloc(const char *url, char **hostname, int *port, cha
 	return 0;
 }
 
+static void reader_deadline(struct timespec *ts, int timeout_ms)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec  += timeout_ms / 1000;
+	ts->tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+/*
+ * Appends data received from the network to the stream buffer. Blocks
+ * while the buffer is full. The consumer is only woken up once the
+ * amount of data it waits for has arrived.
+ */
+static int http_buffer_write(Reader *r, const char *data, size_t size)
+{
+	int    res = 0;
+	size_t fill;
+
+	pthread_mutex_lock(&(r->mutex));
+	while (!r->eof && ringbuffer_get_free(&(r->rb_http)) < size) {
+		r->space_wanted = size;
+		pthread_cond_wait(&(r->space_cond), &(r->mutex));
+	}
+	r->space_wanted = 0;
+	if (!r->eof) {
+		res = ringbuffer_write(&(r->rb_http), data, size);
+		fill = ringbuffer_get_fill(&(r->rb_http));
+		if (!r->is_ready && fill >= http_cache_prebuffer_size) {
+			r->is_ready = 1;
+			pthread_cond_broadcast(&(r->data_cond));
+		} else if (r->data_wanted > 0 && fill >= r->data_wanted) {
+			pthread_cond_signal(&(r->data_cond));
+		}
+	}
+	pthread_mutex_unlock(&(r->mutex));
+	return res;
+}
+
+/*
+ * Appends data received from the network to the disk cache entry. Since
+ * the data is read back from the file, the download is not held back by
+ * the size of the stream buffer.
+ */
+static int http_cache_write(Reader *r, const char *data, size_t size)
+{
+	size_t written = 0;
+
+	while (written < size) {
+		ssize_t n = write(r->cache.fd, data + written, size - written);
+		if (n > 0)
+			written += n;
+		else if (errno != EINTR)
+			break;
+	}
+	if (written < size)
+		wdprintf(V_ERROR, "reader", "Unable to write to cache file: %s\n", strerror(errno));
+	pthread_mutex_lock(&(r->mutex));
+	r->cache_fill += written;
+	if (!r->is_ready && (r->cache_fill - (long)r->stream_pos >= (long)http_cache_prebuffer_size ||
+	                     r->cache_fill >= r->file_size)) {
+		r->is_ready = 1;
+		pthread_cond_broadcast(&(r->data_cond));
+	} else if (r->data_wanted > 0 && r->cache_fill >= (long)r->data_wanted) {
+		pthread_cond_signal(&(r->data_cond));
+	}
+	pthread_mutex_unlock(&(r->mutex));
+	return written == size;
+}
+
+/* Like http_buffer_read(), but reads from the disk cache entry */
+static size_t http_cache_read(Reader *r, char *target, size_t size)
+{
+	long   end = r->stream_pos + size;
+	size_t avail = 0, total = 0;
+
+	if (end > r->file_size) end = r->file_size;
+	pthread_mutex_lock(&(r->mutex));
+	while (r->cache_fill < end && !r->eof) {
+		r->data_wanted = end;
+		pthread_cond_wait(&(r->data_cond), &(r->mutex));
+	}
+	r->data_wanted = 0;
+	if (r->cache_fill > (long)r->stream_pos) avail = r->cache_fill - r->stream_pos;
+	pthread_mutex_unlock(&(r->mutex));
+	if (size > avail) size = avail;
+	if (!target) { /* Skip data */
+		total = size;
+	} else {
+		while (total < size) {
+			ssize_t n = pread(r->cache.fd, target + total, size - total, r->stream_pos + total);
+			if (n > 0)
+				total += n;
+			else if (n == 0 || errno != EINTR)
+				break;
+		}
+	}
+	r->stream_pos += total;
+	return total;
+}
+
+/*
+ * Reads 'size' bytes from the stream buffer, waiting for the data to
+ * arrive. Returns fewer bytes only at the end of the stream. With
+ * 'target' set to NULL the data is skipped.
+ */
+static size_t http_buffer_read(Reader *r, char *target, size_t size)
+{
+	/* Larger requests are served in pieces the network thread can always fill */
+	size_t total = 0, chunk_max = ringbuffer_get_size(&(r->rb_http)) / 2;
+
+	if (reader_is_cached_stream(r))
+		return http_cache_read(r, target, size);
+	pthread_mutex_lock(&(r->mutex));
+	while (total < size) {
+		size_t chunk = size - total, fill;
+
+		if (chunk > chunk_max) chunk = chunk_max;
+		while ((fill = ringbuffer_get_fill(&(r->rb_http))) < chunk && !r->eof) {
+			r->data_wanted = chunk;
+			pthread_cond_wait(&(r->data_cond), &(r->mutex));
+		}
+		r->data_wanted = 0;
+		if (chunk > fill) chunk = fill;
+		if (chunk == 0)
+			break;
+		if (!target) /* Skip data */
+			ringbuffer_consume(&(r->rb_http), chunk);
+		else if (!ringbuffer_read(&(r->rb_http), target + total, chunk))
+			break;
+		total += chunk;
+		if (r->space_wanted > 0 && ringbuffer_get_free(&(r->rb_http)) >= r->space_wanted)
+			pthread_cond_signal(&(r->space_cond));
+	}
+	pthread_mutex_unlock(&(r->mutex));
+	r->stream_pos += total;
+	return total;
+}
+
+static void http_set_eof(Reader *r)
+{
+	pthread_mutex_lock(&(r->mutex));
+	r->eof = 1;
+	pthread_cond_broadcast(&(r->data_cond));
+	pthread_cond_broadcast(&(r->space_cond));
+	pthread_mutex_unlock(&(r->mutex));
+}
+
+/* Passes response body data on to the disk cache or the stream buffer */
+static int http_body_deliver(Reader *r, const char *data, size_t size)
+{
+	if (r->http_discard) return 1;
+	if (reader_is_cached_stream(r)) return http_cache_write(r, data, size);
+	return http_buffer_write(r, data, size);
+}
+
+static int hex_digit_value(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+/*
+ * Processes response body data received from the network, decoding the
+ * chunked transfer encoding if necessary. Returns 0 once the body is
+ * complete or if the data could not be processed.
+ */
+static int http_body_write(Reader *r, const char *data, size_t size)
+{
+	int ok = 1;
+
+	while (size > 0 && ok && !r->http_body_done) {
+		size_t n = 1;
+		char   c = *data;
+
+		if (!r->http_chunked) {
+			n = size;
+			if (r->http_body_remaining >= 0 && (long)n > r->http_body_remaining)
+				n = r->http_body_remaining;
+			ok = http_body_deliver(r, data, n);
+			if (r->http_body_remaining >= 0) {
+				r->http_body_remaining -= n;
+				if (r->http_body_remaining == 0) r->http_body_done = 1;
+			}
+		} else {
+			switch (r->http_chunk_state) {
+				case CHUNK_SIZE:
+				case CHUNK_EXTENSION:
+					if (c == '\n') {
+						r->http_chunk_state = r->http_chunk_remaining > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+						r->http_chunk_line_len = 0;
+					} else if (c == ';') {
+						r->http_chunk_state = CHUNK_EXTENSION;
+					} else if (r->http_chunk_state == CHUNK_SIZE && hex_digit_value(c) >= 0) {
+						if (r->http_chunk_remaining > 0x7FFFFFFL) { /* Chunk size too large */
+							ok = 0;
+							break;
+						}
+						r->http_chunk_remaining = r->http_chunk_remaining * 16 + hex_digit_value(c);
+					}
+					break;
+				case CHUNK_DATA:
+					n = size;
+					if ((long)n > r->http_chunk_remaining) n = r->http_chunk_remaining;
+					ok = http_body_deliver(r, data, n);
+					r->http_chunk_remaining -= n;
+					if (r->http_chunk_remaining == 0) r->http_chunk_state = CHUNK_DATA_END;
+					break;
+				case CHUNK_DATA_END: /* CRLF following the chunk data */
+					if (c == '\n') r->http_chunk_state = CHUNK_SIZE;
+					break;
+				case CHUNK_TRAILER: /* Trailer fields; The body ends with an empty line */
+					if (c == '\n') {
+						if (r->http_chunk_line_len == 0) r->http_body_done = 1;
+						r->http_chunk_line_len = 0;
+					} else if (c != '\r') {
+						r->http_chunk_line_len++;
+					}
+					break;
+			}
+		}
+		data += n;
+		size -= n;
+	}
+	if (!ok) wdprintf(V_DEBUG, "reader", "Unable to process response body.\n");
+	return ok && !r->http_body_done;
+}
+
+/*
+ * Receives the response body until it is complete, the connection has
+ * been closed or the reader is being closed.
+ */
+static void http_receive_body(Reader *r)
+{
+	char buf[HTTP_RECV_CHUNK_SIZE];
+	int  done = 0;
+
+	while (!done && !r->eof && !r->http_body_done) {
+		ssize_t numbytes = recv(r->sockfd, buf, HTTP_RECV_CHUNK_SIZE, 0);
+
+		if (numbytes > 0) {
+			if (!http_body_write(r, buf, numbytes))
+				done = 1;
+		} else if (numbytes == 0) {
+			done = 1;
+		} else if (errno != EINTR) {
+			int err = errno;
+
+			wdprintf(V_DEBUG, "reader", "Network problem: %s (%d)\n", strerror(err), err);
+			/* Keep trying as long as there is buffered data left to play */
+			if (reader_get_cache_fill(r) > 4000) {
+				struct timespec ts;
+
+				wdprintf(V_DEBUG, "reader", "Retrying...\n");
+				reader_deadline(&ts, 300);
+				pthread_mutex_lock(&(r->mutex));
+				if (!r->eof) pthread_cond_timedwait(&(r->space_cond), &(r->mutex), &ts);
+				pthread_mutex_unlock(&(r->mutex));
+			} else {
+				done = 1;
+			}
+		}
+	}
+}
+
 static void *http_reader_thread(void *arg)
 {
 	Reader *r = (Reader *)arg;
-	int     numbytes = 1, err = 0;
-	char    buf[4096];
-
-	while (numbytes != -1 && numbytes > 0 && !r->eof) {
-		do {
-			numbytes = recv(r->sockfd, buf, 4096, 0);
-			err = errno;
-			if (numbytes > 0) { /* write to ringbuffer */
-				int write_okay = 0;
-				while (!write_okay && !r->eof) {
-					pthread_mutex_lock(&(r->mutex));
-					write_okay = ringbuffer_write(&(r->rb_http), buf, numbytes);
-					pthread_mutex_unlock(&(r->mutex));
-					usleep(1500);
-				}
+
+	http_receive_body(r);
+	wdprintf(V_DEBUG, "reader", "thread done.\n");
+	if (reader_is_cached_stream(r) && r->cache_fill == r->file_size)
+		httpcache_entry_commit(&(r->cache));
+	http_set_eof(r);
+	return NULL;
+}
+
+/*
+ * Receives the HTTP response header in bulk and stores its fields in
+ * r->streaminfo. Body data received along with the header is returned
+ * in *body (to be free'd by the caller) and *body_len.
+ * Returns 1 if the complete header has been read.
+ */
+static int http_read_header(Reader *r, char **body, size_t *body_len)
+{
+	char   *buf = malloc(HTTP_HEADER_SIZE_MAX+1), *line, *end = NULL;
+	size_t  len = 0, header_len = 0;
+
+	if (!buf) return 0;
+	while (!end && len < HTTP_HEADER_SIZE_MAX) {
+		ssize_t n = recv(r->sockfd, buf+len, HTTP_HEADER_SIZE_MAX-len, 0);
+		if (n > 0) {
+			char *crlf, *lf;
+
+			len += n;
+			buf[len] = '\0';
+			crlf = strstr(buf, "\r\n\r\n");
+			lf   = strstr(buf, "\n\n");
+			if (crlf && (!lf || crlf < lf)) {
+				end = crlf;
+				header_len = end - buf + 4;
+			} else if (lf) {
+				end = lf;
+				header_len = end - buf + 2;
+			}
+		} else if (n == 0 || errno != EINTR) {
+			break;
+		}
+	}
+	if (end) {
+		*end = '\0';
+		for (line = buf; line; ) {
+			char *next = strchr(line, '\n'), *value, *key_end, *tmp;
+
+			if (next) *next++ = '\0';
+			if ((tmp = strchr(line, '\r'))) *tmp = '\0';
+			value = strchr(line, ':');
+			if (value) {
+				/* '=' is not allowed in config keys */
+				for (key_end = line, tmp = line; key_end < value; key_end++)
+					if (*key_end != '=') *tmp++ = *key_end;
+				*tmp = '\0';
+				for (value++; *value == ' '; value++);
+				wdprintf(V_DEBUG, "reader", "%s: %s\n", line, value);
+				if (line[0] && value[0])
+					cfg_add_key(r->streaminfo, line, value);
 			} else {
-				usleep(300000);
-				if (err == 0) {
-					if (numbytes == 0) r->eof = 1;
-				} else {
-					wdprintf(V_DEBUG, "reader", "Network problem: %s (%d)\n", strerror(err), err);
-					wdprintf(V_DEBUG, "reader", "Retrying...\n");
+				wdprintf(V_DEBUG, "reader", "%s\n", line);
+				if (line == buf) { /* Status line */
+					sscanf(line, "%*s %d", &(r->http_status));
+					r->http_keep_alive = strncmp(line, "HTTP/1.1", 8) == 0;
 				}
 			}
-		} while (numbytes <= 0 && !r->eof && ringbuffer_get_fill(&(r->rb_http)) > 4000);
-		wdprintf(V_DEBUG, "reader", "buf fill: %d bytes\r", ringbuffer_get_fill(&(r->rb_http)));
-		if (!r->is_ready && ringbuffer_get_fill(&(r->rb_http)) >= http_cache_prebuffer_size)
-			r->is_ready = 1;
-		fflush(stdout);
+			line = next;
+		}
+		if (len > header_len) {
+			memmove(buf, buf + header_len, len - header_len);
+			*body = buf;
+			*body_len = len - header_len;
+			buf = NULL;
+		}
 	}
-	wdprintf(V_DEBUG, "reader", "thread done.\n");
-	r->eof = 1;
-	return NULL;
+	wdprintf(V_DEBUG, "reader", "HTTP header received: %s (%d bytes)\n", end ? "yes" : "no", header_len);
+	if (buf) free(buf);
+	return end != NULL;
 }
 
 int reader_is_ready(Reader *r)
@@ -140,207 +478,565 @@ int reader_is_ready(Reader *r)
 	return r->is_ready;
 }
 
-/* Opens a local file or HTTP URL for reading */
-static Reader *_reader_open(const char *url, int max_redirects)
+int reader_wait_until_ready(Reader *r, int timeout_ms)
+{
+	int res;
+
+	pthread_mutex_lock(&(r->mutex));
+	if (!r->is_ready && !r->eof) {
+		struct timespec ts;
+
+		reader_deadline(&ts, timeout_ms);
+		pthread_cond_timedwait(&(r->data_cond), &(r->mutex), &ts);
+	}
+	res = r->is_ready;
+	pthread_mutex_unlock(&(r->mutex));
+	return res;
+}
+
+static int reader_is_local_file(Reader *r)
+{
+	return r->fd >= 0;
+}
+
+/* Asks the kernel to read ahead the part of the mapping following the read position */
+static void local_file_prefetch(Reader *r)
+{
+	if (r->map && !r->read_ahead_running && r->file_pos < r->file_size &&
+	    r->file_pos + LOCAL_FILE_READAHEAD / 2 >= r->map_advised) {
+		long page  = sysconf(_SC_PAGESIZE);
+		long start = r->file_pos - r->file_pos % (page > 0 ? page : 4096);
+		long len   = LOCAL_FILE_READAHEAD;
+
+		if (start + len > r->file_size) len = r->file_size - start;
+		madvise(r->map + start, len, MADV_WILLNEED);
+		r->map_advised = start + len;
+	}
+}
+
+static void local_file_map(Reader *r)
+{
+	void *map = mmap(NULL, r->file_size, PROT_READ, MAP_PRIVATE, r->fd, 0);
+
+	if (map != MAP_FAILED) {
+		r->map = map;
+		madvise(r->map, r->file_size, MADV_SEQUENTIAL);
+		local_file_prefetch(r);
+	} else {
+		wdprintf(V_INFO, "reader", "Unable to map file: %s. Using read() instead.\n", strerror(errno));
+	}
+}
+
+/* Brings the given range of the file into the page cache */
+static void local_file_load(Reader *r, long start, long len, char *scratch)
+{
+	if (r->map) { /* Touching each page faults it in */
+		const volatile char *map = r->map;
+		long  page = sysconf(_SC_PAGESIZE), pos;
+		char  c;
+
+		if (page <= 0) page = 4096;
+		for (pos = start - start % page; pos < start + len; pos += page)
+			c = map[pos];
+		(void)c;
+	} else {
+		while (pread(r->fd, scratch, len, start) < 0 && errno == EINTR);
+	}
+}
+
+/*
+ * Keeps the data following the read position in memory, so slow media
+ * does not stall the decoder. The thread loads the file in chunks until
+ * it is local_read_ahead_size bytes ahead of the reader.
+ */
+static void *local_file_read_ahead_thread(void *arg)
+{
+	Reader *r = (Reader *)arg;
+	char   *scratch = r->map ? NULL : malloc(LOCAL_FILE_READ_AHEAD_CHUNK);
+
+	pthread_mutex_lock(&(r->mutex));
+	while (!r->read_ahead_stop) {
+		long end = r->read_ahead_from + (long)local_read_ahead_size, start, len;
+
+		if (end > r->file_size) end = r->file_size;
+		if (r->read_ahead_pos < r->read_ahead_from) r->read_ahead_pos = r->read_ahead_from;
+		start = r->read_ahead_pos;
+		len = end - start;
+		if (len > LOCAL_FILE_READ_AHEAD_CHUNK) len = LOCAL_FILE_READ_AHEAD_CHUNK;
+		/* Wait until there is room for a complete chunk */
+		if (len <= 0 || (len < LOCAL_FILE_READ_AHEAD_CHUNK && end < r->file_size) || (!r->map && !scratch)) {
+			pthread_cond_wait(&(r->space_cond), &(r->mutex));
+			continue;
+		}
+		pthread_mutex_unlock(&(r->mutex));
+		local_file_load(r, start, len, scratch);
+		pthread_mutex_lock(&(r->mutex));
+		if (r->read_ahead_pos == start) r->read_ahead_pos = start + len; /* Unless there has been a seek */
+	}
+	pthread_mutex_unlock(&(r->mutex));
+	if (scratch) free(scratch);
+	return NULL;
+}
+
+/* Tells the read-ahead thread about the new read position */
+static void local_file_read_ahead_update(Reader *r, int seeked)
+{
+	if (r->read_ahead_running) {
+		pthread_mutex_lock(&(r->mutex));
+		r->read_ahead_from = r->file_pos;
+		if (seeked) r->read_ahead_pos = r->file_pos;
+		pthread_cond_signal(&(r->space_cond));
+		pthread_mutex_unlock(&(r->mutex));
+	}
+}
+
+static void local_file_read_ahead_start(Reader *r)
+{
+	r->read_ahead_stop = 0;
+	if (pthread_create_with_stack_size(&(r->thread), DEFAULT_THREAD_STACK_SIZE,
+	                                   local_file_read_ahead_thread, r) == 0)
+		r->read_ahead_running = 1;
+}
+
+static void local_file_read_ahead_stop(Reader *r)
+{
+	if (r->read_ahead_running) {
+		pthread_mutex_lock(&(r->mutex));
+		r->read_ahead_stop = 1;
+		pthread_cond_signal(&(r->space_cond));
+		pthread_mutex_unlock(&(r->mutex));
+		pthread_join(r->thread, NULL);
+		r->read_ahead_running = 0;
+	}
+}
+
+/*
+ * Reads up to 'size' bytes from a local file. For mapped files no data
+ * is copied, r->data simply points into the mapping.
+ */
+static int local_file_read(Reader *r, size_t size)
+{
+	int res = 0;
+
+	if (r->map) {
+		size_t avail = r->file_pos < r->file_size ? r->file_size - r->file_pos : 0;
+		if (size > avail) size = avail;
+		r->data = r->map + r->file_pos;
+	} else {
+		size_t total = 0;
+
+		if (size > r->buf_size) {
+			char *buf = realloc(r->buf, size);
+			if (buf) {
+				r->buf = buf;
+				r->buf_size = size;
+			}
+		}
+		if (size > r->buf_size) size = r->buf_size;
+		while (total < size) {
+			ssize_t n = read(r->fd, r->buf + total, size - total);
+			if (n > 0)
+				total += n;
+			else if (n == 0 || errno != EINTR)
+				break;
+		}
+		size = total;
+		r->data = r->buf;
+	}
+	if (size > 0) {
+		r->file_pos  += size;
+		r->stream_pos = r->file_pos;
+		r->buf_data_size = size;
+		local_file_prefetch(r);
+		local_file_read_ahead_update(r, 0);
+		res = 1;
+	} else {
+		r->buf_data_size = 0;
+		r->eof = 1;
+	}
+	return res;
+}
+
+static int local_file_seek(Reader *r, long byte_offset, int whence)
+{
+	int  res = 0;
+	long pos = byte_offset;
+
+	if (whence == SEEK_CUR)
+		pos += r->file_pos;
+	else if (whence == SEEK_END)
+		pos += r->file_size;
+	if (pos >= 0 && (r->map || lseek(r->fd, pos, SEEK_SET) == pos)) {
+		r->file_pos = pos;
+		r->stream_pos = pos;
+		r->buf_data_size = 0;
+		r->eof = 0;
+		r->map_advised = 0;
+		local_file_prefetch(r);
+		local_file_read_ahead_update(r, 1);
+		res = 1;
+	}
+	return res;
+}
+
+/*
+ * Connects to the reader's HTTP host, preferably reusing an idle
+ * connection if 'allow_reuse' is set. Returns 1 on success, 0 otherwise.
+ */
+static int http_connect(Reader *r, int allow_reuse)
+{
+	wdprintf(V_INFO, "reader", "Reading from %s:%d%s\n", r->http_host, r->http_port, r->http_path);
+	r->sockfd = httpconn_open(r->http_host, r->http_port, allow_reuse, &(r->http_reused));
+	return r->sockfd >= 0;
+}
+
+/*
+ * Reads a Shoutcast meta data block from the stream and passes a new
+ * StreamTitle on to the meta data callback.
+ * Returns 0 if the end of the stream has been reached.
+ */
+static int icy_read_meta_data(Reader *r)
+{
+	char           buf[255 * 16 + 1];
+	unsigned char  len;
+	size_t         size;
+
+	if (http_buffer_read(r, (char *)&len, 1) != 1) return 0;
+	size = len * 16;
+	if (size > 0) {
+		char *title, *end;
+
+		if (http_buffer_read(r, buf, size) != size) return 0;
+		buf[size] = '\0';
+		wdprintf(V_DEBUG, "reader", "Stream meta data: [%s]\n", buf);
+		if ((title = strstr(buf, "StreamTitle='"))) {
+			char title_utf8[ICY_STREAM_TITLE_SIZE];
+
+			title += 13;
+			if ((end = strstr(title, "';"))) *end = '\0';
+			if (charset_is_valid_utf8_string(title)) {
+				strncpy(title_utf8, title, ICY_STREAM_TITLE_SIZE-1);
+				title_utf8[ICY_STREAM_TITLE_SIZE-1] = '\0';
+			} else {
+				charset_iso8859_1_to_utf8(title_utf8, title, ICY_STREAM_TITLE_SIZE-1);
+			}
+			if (strcmp(title_utf8, r->icy_stream_title) != 0) {
+				wdprintf(V_DEBUG, "reader", "Stream title: %s\n", title_utf8);
+				memcpy(r->icy_stream_title, title_utf8, ICY_STREAM_TITLE_SIZE);
+				if (r->meta_data_callback)
+					(*r->meta_data_callback)(r->icy_stream_title, r->meta_data_callback_arg);
+			}
+		}
+	}
+	r->icy_remaining = r->icy_metaint;
+	return 1;
+}
+
+/*
+ * Reads audio data from the stream. For Shoutcast streams the meta data
+ * blocks inserted every icy_metaint bytes are removed from the data.
+ */
+static size_t http_stream_read(Reader *r, char *target, size_t size)
+{
+	size_t total = 0;
+
+	if (r->icy_metaint <= 0) return http_buffer_read(r, target, size);
+	while (total < size) {
+		size_t chunk = size - total, n;
+
+		if (r->icy_remaining == 0 && !icy_read_meta_data(r)) break;
+		if (chunk > (size_t)r->icy_remaining) chunk = r->icy_remaining;
+		n = http_buffer_read(r, target ? target + total : NULL, chunk);
+		total += n;
+		r->icy_remaining -= n;
+		if (n < chunk) break;
+	}
+	return total;
+}
+
+/* Tries to figure out stream length and whether we can seek */
+static void http_parse_stream_info(Reader *r)
+{
+	char *val = cfg_get_key_value_ignore_case(r->streaminfo, "Content-Length");
+
+	if (val) {
+		r->file_size = atol(val);
+		wdprintf(V_DEBUG, "reader", "Stream size = %d bytes.\n", r->file_size);
+	}
+	val = cfg_get_key_value_ignore_case(r->streaminfo, "Accept-Ranges");
+	if (r->http_status == 200 && r->file_size > 0 && val && strstr(val, "bytes") &&
+	    !cfg_get_key_value_ignore_case(r->streaminfo, "icy-metaint")) {
+		wdprintf(V_DEBUG, "reader", "Server supports range requests. Stream is seekable.\n");
+		r->seekable = 1;
+	}
+	val = cfg_get_key_value_ignore_case(r->streaminfo, "icy-metaint");
+	if (val && (r->icy_metaint = atoi(val)) > 0) {
+		wdprintf(V_DEBUG, "reader", "Stream meta data every %d bytes.\n", r->icy_metaint);
+		r->icy_remaining = r->icy_metaint;
+	}
+}
+
+/*
+ * Downloads the file to the disk cache if it fits. The network thread
+ * then writes to the cache entry and reads are served from there.
+ */
+static void http_cache_start(Reader *r)
+{
+	char *etag = cfg_get_key_value_ignore_case(r->streaminfo, "ETag");
+	char *type = cfg_get_key_value_ignore_case(r->streaminfo, "Content-Type");
+
+	if (r->cache_url && r->http_status == 200 && httpcache_is_cacheable(r->file_size) &&
+	    !cfg_get_key_value_ignore_case(r->streaminfo, "icy-metaint") &&
+	    httpcache_entry_create(&(r->cache), r->cache_url, etag, type, r->file_size)) {
+		wdprintf(V_INFO, "reader", "Downloading stream to the disk cache.\n");
+		r->seekable = 1;
+	}
+}
+
+/*
+ * Determines how the end of the response body is recognized and whether
+ * the connection can be reused afterwards.
+ */
+static void http_parse_framing(Reader *r)
+{
+	char *val = cfg_get_key_value_ignore_case(r->streaminfo, "Transfer-Encoding");
+
+	r->http_chunked = val && strstr(val, "chunked");
+	r->http_chunk_state = CHUNK_SIZE;
+	r->http_chunk_remaining = 0;
+	r->http_body_remaining = -1;
+	if (!r->http_chunked && (val = cfg_get_key_value_ignore_case(r->streaminfo, "Content-Length")))
+		r->http_body_remaining = atol(val);
+	if (r->http_head || r->http_status == 204 || r->http_status == 304)
+		r->http_body_remaining = 0;
+	r->http_body_done = r->http_body_remaining == 0;
+	val = cfg_get_key_value_ignore_case(r->streaminfo, "Connection");
+	/* Without a known body length the end of the body is signalled by closing the connection */
+	if ((val && strstr(val, "close")) || (!r->http_chunked && r->http_body_remaining < 0))
+		r->http_keep_alive = 0;
+	if (r->http_chunked) wdprintf(V_DEBUG, "reader", "Chunked transfer encoding.\n");
+}
+
+static int http_send_request(Reader *r, long offset)
+{
+	char   http_request[1024], range[48];
+	size_t len;
+
+	range[0] = '\0';
+	if (offset > 0) snprintf(range, sizeof(range), "Range: bytes=%ld-\r\n", offset);
+	snprintf(http_request, sizeof(http_request),
+	         "%s %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: Gmu/%s\r\n%sIcy-MetaData: 1\r\n\r\n",
+	         r->http_head ? "HEAD" : "GET", r->http_path, r->http_host, VERSION_NUMBER, range);
+	wdprintf(V_DEBUG, "reader", "Sending request: %s\n", http_request);
+	len = strlen(http_request);
+	return send(r->sockfd, http_request, len, 0) == (ssize_t)len;
+}
+
+/* Stops the network thread and closes the connection or keeps it for reuse */
+static void http_disconnect(Reader *r)
+{
+	if (r->http_thread_running) {
+		int body_done;
+
+		pthread_mutex_lock(&(r->mutex));
+		body_done = r->http_body_done;
+		pthread_mutex_unlock(&(r->mutex));
+		http_set_eof(r);
+		if (!body_done) { /* Interrupt the network thread */
+			shutdown(r->sockfd, SHUT_RDWR);
+			r->http_keep_alive = 0;
+		}
+		wdprintf(V_DEBUG, "reader", "Waiting for reader thread to finish.\n");
+		pthread_join(r->thread, NULL);
+		wdprintf(V_DEBUG, "reader", "Reader thread joined.\n");
+		r->http_thread_running = 0;
+	}
+	if (r->sockfd >= 0) {
+		if (r->http_keep_alive && r->http_body_done)
+			httpconn_release(r->http_host, r->http_port, r->sockfd);
+		else
+			close(r->sockfd);
+		r->sockfd = -1;
+	}
+}
+
+/*
+ * Requests the reader's URL starting at byte 'offset', receives the
+ * response header and starts the network thread. The body of redirect
+ * responses is skipped right away instead. HEAD requests have no body.
+ * Returns 1 if a response has been received, 0 otherwise.
+ */
+static int http_request(Reader *r, long offset)
+{
+	char  *body = NULL;
+	size_t body_len = 0;
+	int    res;
+
+	r->eof = 0;
+	r->http_status = 0;
+	r->http_keep_alive = 0;
+	r->http_body_done = 0;
+	r->http_discard = 0;
+	res = http_send_request(r, offset) && http_read_header(r, &body, &body_len);
+	if (!res && r->http_reused) { /* The server might have closed the idle connection meanwhile */
+		wdprintf(V_DEBUG, "reader", "Reused connection failed. Reconnecting...\n");
+		if (body) free(body);
+		body = NULL;
+		body_len = 0;
+		http_disconnect(r);
+		res = http_connect(r, 0) && http_send_request(r, offset) && http_read_header(r, &body, &body_len);
+	}
+	if (!res) {
+		http_set_eof(r);
+	} else {
+		http_parse_framing(r);
+		if (offset == 0) {
+			http_parse_stream_info(r);
+			http_cache_start(r);
+		}
+		r->http_discard = r->http_status >= 300 && r->http_status < 400;
+		if (body_len > 0) http_body_write(r, body, body_len);
+	}
+	if (body) free(body);
+	if (!res || r->http_head) {
+		/* Nothing to receive */
+	} else if (r->http_discard) {
+		if (r->http_keep_alive) http_receive_body(r);
+	} else if (pthread_create_with_stack_size(&(r->thread), DEFAULT_THREAD_STACK_SIZE, http_reader_thread, r) == 0) {
+		r->http_thread_running = 1;
+	} else {
+		res = 0;
+	}
+	return res;
+}
+
+/*
+ * Seeks to 'pos'. A target within the buffered data is reached by
+ * skipping the data in between, otherwise the file is requested again
+ * starting at 'pos'.
+ */
+static int http_seek(Reader *r, long pos)
+{
+	int res = 0;
+
+	if (reader_is_cached_stream(r)) { /* The whole file is downloaded anyway */
+		if (pos <= r->file_size) {
+			r->stream_pos = pos;
+			r->buf_data_size = 0;
+			res = 1;
+		}
+		return res;
+	}
+	pthread_mutex_lock(&(r->mutex));
+	if (pos >= (long)r->stream_pos &&
+	    (size_t)(pos - r->stream_pos) <= ringbuffer_get_fill(&(r->rb_http))) {
+		ringbuffer_consume(&(r->rb_http), pos - r->stream_pos);
+		r->stream_pos = pos;
+		if (r->space_wanted > 0 && ringbuffer_get_free(&(r->rb_http)) >= r->space_wanted)
+			pthread_cond_signal(&(r->space_cond));
+		res = 1;
+	}
+	pthread_mutex_unlock(&(r->mutex));
+	if (!res && pos <= r->file_size) {
+		wdprintf(V_DEBUG, "reader", "Requesting data from byte %ld on.\n", pos);
+		http_disconnect(r);
+		ringbuffer_clear(&(r->rb_http));
+		if (http_connect(r, 1) && http_request(r, pos)) {
+			if (r->http_status == 206) {
+				r->stream_pos = pos;
+				res = 1;
+			} else if (r->http_status == 200) { /* Range ignored; skip to the requested position */
+				r->stream_pos = 0;
+				res = http_buffer_read(r, NULL, pos) == (size_t)pos;
+			}
+		}
+	}
+	if (res) r->buf_data_size = 0;
+	return res;
+}
+
+/*
+ * Opens a local file or HTTP URL for reading. With 'head' set, only the
+ * response header of the HTTP URL is requested.
+ */
+static Reader *_reader_open(const char *url, int max_redirects, const char *cache_url, int head)
 {
 	Reader *r = malloc(sizeof(Reader));
 	if (r) {
 		r->eof = 0;
-		r->file = NULL;
-		r->sockfd = 0;
+		r->fd = -1;
+		r->map = NULL;
+		r->file_pos = 0;
+		r->map_advised = 0;
+		r->sockfd = -1;
+		r->http_host = NULL;
+		r->http_path = NULL;
+		r->http_port = 80;
+		r->http_status = 0;
+		r->http_thread_running = 0;
+		r->http_reused = 0;
+		r->http_keep_alive = 0;
+		r->http_chunked = 0;
+		r->http_body_remaining = -1;
+		r->http_body_done = 0;
+		r->http_discard = 0;
+		r->http_head = head;
+		httpcache_entry_init(&(r->cache));
+		r->cache_fill = 0;
+		r->cache_url = NULL;
+		r->icy_metaint = 0;
+		r->icy_remaining = 0;
+		r->icy_stream_title[0] = '\0';
+		r->meta_data_callback = NULL;
+		r->meta_data_callback_arg = NULL;
+		r->read_ahead_running = 0;
+		r->read_ahead_stop = 0;
+		r->read_ahead_from = 0;
+		r->read_ahead_pos = 0;
 		r->seekable = 0;
 		r->buf = NULL;
 		r->buf_size = 0;
 		r->buf_data_size = 0;
+		r->data = NULL;
 		r->file_size = 0;
 		r->is_ready = 0;
 		r->stream_pos = 0;
+		r->data_wanted = 0;
+		r->space_wanted = 0;
 		pthread_mutex_init(&(r->mutex), NULL);
+		{
+			pthread_condattr_t attr;
+
+			pthread_condattr_init(&attr);
+			pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+			pthread_cond_init(&(r->data_cond), &attr);
+			pthread_cond_init(&(r->space_cond), &attr);
+			pthread_condattr_destroy(&attr);
+		}
 
 		r->streaminfo = cfg_init();
 
 		if (strncasecmp(url, "http://", 7) == 0) { /* Got a HTTP URL */
-			char *hostname = NULL, *path = NULL;
-			int   port = 80;
 			/* open http stream... */
 			/* 1) Split URL into host, port and path */
-			http_url_split_alloc(url, &hostname, &port, &path);
-			/* 2) open connection to host on port */
+			http_url_split_alloc(url, &(r->http_host), &(r->http_port), &(r->http_path));
+			if (cache_url && (r->cache_url = malloc(strlen(cache_url) + 1)))
+				strcpy(r->cache_url, cache_url);
 			assign_signal_handler(SIGPIPE, SIG_IGN);
-			wdprintf(V_INFO, "reader", "Opening connection to host %s on port %d. Reading from %s.\n", hostname, port, path);
-			if (hostname && path && port > 0) {
-				struct addrinfo hints, *servinfo, *p;
-				int    rv;
-				char   s[INET6_ADDRSTRLEN];
-				char   port_str[6];
-
-				snprintf(port_str, 5, "%d", port);
-				memset(&hints, 0, sizeof hints);
-				hints.ai_family = AF_UNSPEC;
-				hints.ai_socktype = SOCK_STREAM;
-
-				if ((rv = getaddrinfo(hostname, port_str, &hints, &servinfo)) != 0) {
-					wdprintf(V_ERROR, "reader",  "getaddrinfo: %s\n", gai_strerror(rv));
-					free(r);
-					r = NULL;
-				} else {
-					int err = 0;
-					int flags = 0;
-					/* loop through all the results and connect to the first we can */
-					for (p = servinfo; p != NULL; p = p->ai_next) {
-						if ((r->sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
-							wdprintf(V_INFO, "reader", "socket: %s\n", strerror(errno));
-							continue;
-						} else { /* Set socket timeout to 2 seconds */
-							struct timeval tv;
-							tv.tv_sec = 2;
-							tv.tv_usec = 0;
-							if (setsockopt(r->sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv,  sizeof tv)) {
-								wdprintf(V_INFO, "reader", "setsockopt: %s\n", strerror(errno));
-							}
-						}
-
-						flags = fcntl(r->sockfd, F_GETFL, 0);
-						fcntl(r->sockfd, F_SETFL, flags | O_NONBLOCK);
-						if (connect(r->sockfd, p->ai_addr, p->ai_addrlen) == -1) {
-							err = errno;
-							wdprintf(V_INFO, "reader", "connect: %s\n", strerror(err));
-							if (err == EINPROGRESS) {
-								wdprintf(V_DEBUG, "reader", "Connection okay; continuing...\n");
-								break;
-							} else {
-								wdprintf(V_DEBUG, "reader", "Connection unusable; closing.\n");
-								close(r->sockfd);
-							}
-							continue;
-						}
-						break;
-					}
-
-					if (err == EINPROGRESS) {
-						fd_set myset;
-						struct timeval tv; 
-
-						wdprintf(V_DEBUG, "reader", "Connection in progress. select()ing...\n");
-						do {
-							int res;
-
-							tv.tv_sec = 5; 
-							tv.tv_usec = 0; 
-							FD_ZERO(&myset); 
-							FD_SET(r->sockfd, &myset); 
-							res = select((r->sockfd)+1, NULL, &myset, NULL, &tv); 
-							if (res < 0 && errno != EINTR) {
-								wdprintf(V_DEBUG, "reader", "Error while connecting: %d - %s\n", errno, strerror(errno));
-								break;
-							} else if (res > 0) {
-								int valopt = 0;
-								socklen_t lon = sizeof(int);
-								if (getsockopt(r->sockfd, SOL_SOCKET, SO_ERROR, (void*)(&valopt), &lon) < 0) {
-									wdprintf(V_DEBUG, "reader", "Error in getsockopt(): %d - %s\n", errno, strerror(errno));
-									p = NULL;
-									break;
-								}
-								if (valopt) {
-									wdprintf(V_DEBUG, "reader", "Error in delayed connection(): %d - %s\n", valopt, strerror(valopt));
-									p = NULL;
-								}
-								break;
-							} else {
-								wdprintf(V_DEBUG, "reader", "Timeout in select() - Cancelling!\n");
-								p = NULL;
-								break;
-							}
-						} while (1);
-						flags = fcntl(r->sockfd, F_GETFL, 0);
-						fcntl(r->sockfd, F_SETFL, flags & (~O_NONBLOCK));
-					}
-
-					if (p == NULL) {
-						wdprintf(V_ERROR, "reader", "Failed to connect.\n");
-						free(r);
-						r = NULL;
-					} else {
-						inet_ntop(p->ai_family, get_in_addr((struct sockaddr *)p->ai_addr), s, sizeof s);
-						wdprintf(V_INFO, "reader", "Connected to %s:%d.\n", s, port);
-						/* Send HTTP GET request */
-						{
-							char http_request[512];
-							snprintf(http_request, 511,
-							         "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\nUser-Agent: Gmu/%s\r\nIcy-MetaData: 1\r\n\r\n",
-							         path, hostname, VERSION_NUMBER);
-							wdprintf(V_DEBUG, "reader", "Sending request: %s\n", http_request);
-							send(r->sockfd, http_request, strlen(http_request), 0);
-						}
-
-						/* Start reader thread... */
-						if (ringbuffer_init(&(r->rb_http), http_cache_size)) {
-							pthread_create_with_stack_size(&(r->thread), DEFAULT_THREAD_STACK_SIZE, http_reader_thread, r);
-						} else {
-							wdprintf(V_ERROR, "reader", "Out of memory.\n");
-						}
-
-						/* Skip http response header */
-						{
-							int    header_end_found = 0;
-							size_t cnt = 0, i = 0;
-							char   ch, key[256], value[512];
-
-							key[0] = '\0'; value[0] = '\0';
-							/* Search for http header end sequence "\r\n\r\n" (or "\n\n"); I assume http headers to be no longer than 32 kB. */
-							while (!header_end_found && !reader_is_eof(r) && cnt < 32768) {
-								/* extract key */
-								ch = 0;
-								while (ch != '\r' && ch != '\n' && ch != ':' && !reader_is_eof(r)) {
-									ch = reader_read_byte(r);
-									if (i < 255 && ch != ':' && ch != '=' && ch != '\r' && ch != '\n') key[i++] = ch;
-									cnt++;
-								}
-								key[i] = '\0';
-								wdprintf(V_DEBUG, "reader", "key=[%s]\n", key);
-
-								/* extract value */
-								i = 0;
-								while ((ch = reader_read_byte(r)) == ' ' && !reader_is_eof(r)) cnt++; /* skip spaces after ":" */
-								if (ch != '\r' && ch != '\n') value[i++] = ch;
-								while (ch != '\r' && ch != '\n' && !reader_is_eof(r)) {
-									ch = reader_read_byte(r);
-									if (i < 511 && ch != '\r' && ch != '\n') value[i++] = ch;
-									cnt++;
-								}
-								value[i] = '\0';
-								wdprintf(V_DEBUG, "reader", "value=[%s]\n", value);
-								if (key[0] && value[0])
-									cfg_add_key(r->streaminfo, key, value);
-
-								i = 0;
-								if (ch == '\n' || (ch = reader_read_byte(r)) == '\n') {
-									ch = reader_read_byte(r);
-									if ((ch == '\r' && (ch = reader_read_byte(r)) == '\n') || ch == '\n')
-										header_end_found = 1;
-									else
-										key[i++] = ch;
-									cnt+=3;
-								} else {
-									key[i++] = ch;
-								}
-							}
-							wdprintf(V_DEBUG, "reader", "HTTP header skipped: %s (%d bytes)\n", header_end_found ? "yes" : "no", cnt);
-							/* Try to figure out stream length */
-							if (header_end_found) {
-								char *val = cfg_get_key_value_ignore_case(r->streaminfo, "Content-Length");
-								if (val) {
-									r->file_size = atol(val);
-									wdprintf(V_DEBUG, "reader", "Stream size = %d bytes.\n", r->file_size);
-								}
-							}
-						}
-					}
-					freeaddrinfo(servinfo);
-				}
+			if (!r->http_host || !r->http_path || r->http_port <= 0 ||
+			    !ringbuffer_init(&(r->rb_http), http_cache_size)) {
+				wdprintf(V_ERROR, "reader", "Invalid URL or out of memory.\n");
+				if (r->http_host) free(r->http_host);
+				if (r->http_path) free(r->http_path);
+				if (r->cache_url) free(r->cache_url);
+				r->http_host = NULL; /* Nothing else to clean up for reader_close() */
+				reader_close(r);
+				r = NULL;
+			/* 2) open connection to host on port and request the file */
+			} else if (!http_connect(r, 1) || !http_request(r, 0)) {
+				reader_close(r);
+				r = NULL;
 			}
-			if (hostname) free(hostname);
-			if (path)     free(path);
 			/* Check for 302 redirect (Location) */
 			if (r) {
 				char *v = cfg_get_key_value_ignore_case(r->streaminfo, "Location");
@@ -356,7 +1052,7 @@ static Reader *_reader_open(const char *url, int max_redirects)
 					reader_close(r);
 					r = NULL;
 					if (max_redirects > 0 && vc) {
-						r = _reader_open(vc, max_redirects-1);
+						r = _reader_open(vc, max_redirects-1, cache_url, head);
 					} else {
 						wdprintf(V_WARNING, "reader", "Too many HTTP redirects.\n");
 					}
@@ -365,18 +1061,19 @@ static Reader *_reader_open(const char *url, int max_redirects)
 			}
 		} else { /* Treat everything else as a local file (for now) */
 			wdprintf(V_INFO, "reader", "Opening file %s.\n", url);
-			r->file = fopen(url, "r");
-			if (r->file) {
+			r->fd = open(url, O_RDONLY);
+			if (r->fd >= 0) {
 				struct stat st;
 				r->seekable = 1;
-				if (stat(url, &st) == 0) {
+				if (fstat(r->fd, &st) == 0) {
 					r->file_size = st.st_size;
 					wdprintf(V_DEBUG, "reader", "File size = %d bytes.\n", r->file_size);
+					if (S_ISREG(st.st_mode) && st.st_size > 0) local_file_map(r);
 				}
 				r->is_ready = 1;
 			} else {
 				wdprintf(V_ERROR, "reader", "Unable to open file '%s'.\n", url);
-				free(r);
+				reader_close(r);
 				r = NULL;
 			}
 		}
@@ -384,25 +1081,75 @@ static Reader *_reader_open(const char *url, int max_redirects)
 	return r;
 }
 
+/*
+ * Checks with a HEAD request whether the server still has the version of
+ * 'url' with the given ETag (empty if there was none) and size.
+ * Returns 1 if it does, 0 if the server reports a different version (or that
+ * the file is gone) and -1 if that could not be determined, e.g. because the
+ * server is unreachable or does not answer HEAD requests.
+ */
+static int http_cached_copy_is_current(const char *url, const char *etag, long size)
+{
+	Reader *r = _reader_open(url, 3, NULL, 1);
+	int     res = -1;
+
+	if (r) {
+		char *val = cfg_get_key_value_ignore_case(r->streaminfo, "ETag");
+
+		if (r->http_status == 200)
+			res = r->file_size == size && (etag[0] ? val && strcmp(val, etag) == 0 : !val);
+		else if (r->http_status == 404 || r->http_status == 410)
+			res = 0;
+		reader_close(r);
+	}
+	return res;
+}
+
 Reader *reader_open(const char *url)
 {
-	return _reader_open(url, 3);
+	Reader *r = NULL;
+	char   *cached;
+	char    content_type[128], etag[256];
+	long    size;
+
+	if (strncasecmp(url, "http://", 7) == 0 &&
+	    (cached = httpcache_lookup_alloc(url, content_type, sizeof(content_type), etag, sizeof(etag), &size))) {
+		int current = http_cached_copy_is_current(url, etag, size);
+
+		if (current) {
+			if (current > 0)
+				wdprintf(V_INFO, "reader", "Using cached copy of %s.\n", url);
+			else
+				wdprintf(V_INFO, "reader", "Unable to revalidate %s. Using cached copy.\n", url);
+			r = _reader_open(cached, 0, NULL, 0);
+			if (r && content_type[0]) cfg_add_key(r->streaminfo, "Content-Type", content_type);
+		} else {
+			wdprintf(V_INFO, "reader", "Cached copy of %s is outdated.\n", url);
+			httpcache_remove(url);
+		}
+		free(cached);
+	}
+	if (!r) r = _reader_open(url, 3, url, 0);
+	return r;
 }
 
 int reader_close(Reader *r)
 {
 	if (r) {
-		if (r->file) { /* local file */
-			fclose(r->file);
-		} else if (r->sockfd > 0) { /* http stream */
-			/* close http stream */
-			close(r->sockfd);
-			r->eof = 1;
-			wdprintf(V_DEBUG, "reader", "Waiting for reader thread to finish.\n");
-			pthread_join(r->thread, NULL);
-			wdprintf(V_DEBUG, "reader", "Reader thread joined.\n");
+		if (reader_is_local_file(r)) {
+			local_file_read_ahead_stop(r);
+			if (r->map) munmap(r->map, r->file_size);
+			close(r->fd);
+		} else if (r->http_host) { /* http stream */
+			http_disconnect(r);
 			ringbuffer_free(&(r->rb_http));
+			httpcache_entry_close(&(r->cache));
+			free(r->http_host);
+			free(r->http_path);
+			if (r->cache_url) free(r->cache_url);
 		}
+		pthread_cond_destroy(&(r->data_cond));
+		pthread_cond_destroy(&(r->space_cond));
 		pthread_mutex_destroy(&(r->mutex));
 		if (r->buf) free(r->buf);
 		cfg_free(r->streaminfo);
@@ -414,27 +1161,29 @@ int reader_close(Reader *r)
 
 int reader_is_eof(Reader *r)
 {
-	return r->file ? r->eof : ringbuffer_get_fill(&(r->rb_http)) > 0 ? 0 : r->eof;
+	if (reader_is_local_file(r)) return r->eof;
+	if (reader_is_cached_stream(r) && (long)r->stream_pos >= r->file_size) return 1;
+	return reader_get_cache_fill(r) > 0 ? 0 : r->eof;
 }
 
 char reader_read_byte(Reader *r)
 {
-	int ch = 0;
-	if (r->file) {
-		ch = fgetc(r->file);
-		if (ch == EOF) r->eof = 1;
-	} else {
-		int read_okay = 0;
-		while (!read_okay && !reader_is_eof(r)) {
-			char buf[1];
-			pthread_mutex_lock(&(r->mutex));
-			read_okay = ringbuffer_read(&(r->rb_http), buf, 1);
-			pthread_mutex_unlock(&(r->mutex));
-			if (!read_okay && r->eof) break;
-			if (!read_okay) usleep(150);
-			ch = buf[0];
+	int  ch = 0;
+	char c;
+	if (reader_is_local_file(r)) {
+		if (r->map && r->file_pos < r->file_size) {
+			ch = r->map[r->file_pos++];
+			r->stream_pos = r->file_pos;
+		} else if (!r->map && read(r->fd, &c, 1) == 1) {
+			ch = c;
+			r->file_pos++;
+			r->stream_pos = r->file_pos;
+		} else {
+			ch = 0;
+			r->eof = 1;
 		}
-		if (read_okay) r->stream_pos++;
+	} else {
+		if (http_stream_read(r, &c, 1) == 1) ch = c;
 	}
 	return (char)ch;
 }
@@ -449,40 +1198,21 @@ int reader_read_bytes(Reader *r, size_t size)
 	int read_okay = 0;
 
 	if (size > 0) {
-		if (size > r->buf_size) r->buf = realloc(r->buf, size+1);
-		if (r->buf) r->buf_size = size;
-		if (r->file) {
-			if (r->buf) {
-				long pos = ftell(r->file);
-				memset(r->buf, 0, r->buf_size);
-				if (fread(r->buf, size, 1, r->file) < 1) {
-					do { /* Not the most elegant solution.. ;) */
-						size--;
-						if (fseek(r->file, pos, SEEK_SET) != 0)
-							wdprintf(V_ERROR, "reader", "Unable to seek to pos %d:(\n", pos);
-					} while (fread(r->buf, size, 1, r->file) < 1 && size > 0);
-					r->eof = feof(r->file);
-					if (size > 0)
-						read_okay = 1;
-					else
-						r->eof = 1;
-					r->buf_data_size = size;
-				} else {
-					r->buf[size] = '\0';
-					read_okay = 1;
-					r->buf_data_size = size;
-					r->stream_pos += size;
+		if (reader_is_local_file(r)) {
+			read_okay = local_file_read(r, size);
+		} else {
+			if (size > r->buf_size) {
+				char *buf = realloc(r->buf, size+1);
+				if (buf) {
+					r->buf = buf;
+					r->buf_size = size;
 				}
 			}
-		} else {
-			while (!read_okay) {
-				pthread_mutex_lock(&(r->mutex));
-				read_okay = ringbuffer_read(&(r->rb_http), r->buf, size);
-				pthread_mutex_unlock(&(r->mutex));
-				if (read_okay) r->buf_data_size = size; else r->buf_data_size = 0;
-				if (!read_okay && r->eof) break;
-				r->buf[size] = '\0';
-				if (!read_okay) usleep(150);
+			r->data = r->buf;
+			if (r->buf && size <= r->buf_size) {
+				r->buf_data_size = http_stream_read(r, r->buf, size);
+				r->buf[r->buf_data_size] = '\0';
+				read_okay = r->buf_data_size > 0;
 			}
 		}
 	}
@@ -491,7 +1221,7 @@ int reader_read_bytes(Reader *r, size_t size)
 
 char *reader_get_buffer(Reader *r)
 {
-	return r->buf;
+	return r->data;
 }
 
 long reader_get_file_size(Reader *r)
@@ -508,11 +1238,8 @@ unsigned long reader_get_stream_position(Reader *r)
 int reader_reset_stream(Reader *r)
 {
 	int res = 0;
-	if (r->file) { /* Only possible for local files */
-		rewind(r->file);
-		r->stream_pos = 0;
-		res = 1;
-	}
+	if (reader_is_local_file(r)) /* Only possible for local files */
+		res = local_file_seek(r, 0, SEEK_SET);
 	return res;
 }
 
@@ -524,17 +1251,21 @@ int reader_is_seekable(Reader *r)
 int reader_seek_whence(Reader *r, long byte_offset, int whence)
 {
 	int res = 0;
-	if (r->file) {
-		if (fseek(r->file, byte_offset, whence) == 0) {
-			r->buf_data_size = 0;
-			r->stream_pos = ftell(r->file);
+	if (reader_is_local_file(r)) {
+		if (local_file_seek(r, byte_offset, whence)) {
 			res = 1;
 		} else {
 			wdprintf(V_INFO, "reader", "Seeking failed. :(\n");
 		}
-	} else {
-		/* Seeking not possible in HTTP streams */
-		res = 0;
+	} else if (r->seekable) { /* HTTP stream with range request support */
+		long pos = byte_offset;
+
+		if (whence == SEEK_CUR)
+			pos += r->stream_pos;
+		else if (whence == SEEK_END)
+			pos += r->file_size;
+		if (pos >= 0) res = http_seek(r, pos);
+		if (!res) wdprintf(V_INFO, "reader", "Seeking failed. :(\n");
 	}
 	return res;
 }
@@ -548,3 +1279,81 @@ void reader_clear_buffer(Reader *r)
 {
 	r->buf_data_size = 0;
 }
+
+void reader_set_meta_data_callback(Reader *r, ReaderMetaDataCallback callback, void *arg)
+{
+	r->meta_data_callback = callback;
+	r->meta_data_callback_arg = arg;
+	if (callback && r->icy_stream_title[0])
+		(*callback)(r->icy_stream_title, arg);
+}
+
+const char *reader_get_stream_title(Reader *r)
+{
+	return r->icy_stream_title;
+}
+
+static void *prefetch_thread(void *arg)
+{
+	char *filename = (char *)arg;
+	int   fd = open(filename, O_RDONLY);
+
+	if (fd >= 0) {
+		char  *buf = malloc(LOCAL_FILE_READ_AHEAD_CHUNK);
+		size_t total = 0;
+
+		wdprintf(V_DEBUG, "reader", "Prefetching %s.\n", filename);
+		while (buf && total < local_read_ahead_size) {
+			ssize_t n = read(fd, buf, LOCAL_FILE_READ_AHEAD_CHUNK);
+			if (n > 0)
+				total += n;
+			else if (n == 0 || errno != EINTR)
+				break;
+		}
+		if (buf) free(buf);
+		close(fd);
+	}
+	free(filename);
+	pthread_mutex_lock(&prefetch_mutex);
+	prefetch_running = 0;
+	pthread_mutex_unlock(&prefetch_mutex);
+	return NULL;
+}
+
+/*
+ * Starts reading ahead of the read position in the background. Only worth
+ * it for readers used for playback, which read the whole file over time.
+ */
+void reader_enable_read_ahead(Reader *r)
+{
+	if (reader_is_local_file(r) && r->map && local_read_ahead_size > 0 && !r->read_ahead_running) {
+		r->read_ahead_from = r->file_pos;
+		r->read_ahead_pos  = r->file_pos;
+		local_file_read_ahead_start(r);
+	}
+}
+
+void reader_prefetch_file(const char *url)
+{
+	char     *filename;
+	pthread_t thread;
+	int       start;
+
+	if (!url || local_read_ahead_size == 0 || strncasecmp(url, "http://", 7) == 0) return;
+	pthread_mutex_lock(&prefetch_mutex);
+	start = !prefetch_running;
+	prefetch_running = 1;
+	pthread_mutex_unlock(&prefetch_mutex);
+	if (!start) return;
+	if ((filename = malloc(strlen(url) + 1))) {
+		strcpy(filename, url);
+		if (pthread_create_with_stack_size(&thread, DEFAULT_THREAD_STACK_SIZE, prefetch_thread, filename) == 0) {
+			pthread_detach(thread);
+			return;
+		}
+		free(filename);
+	}
+	pthread_mutex_lock(&prefetch_mutex);
+	prefetch_running = 0;
+	pthread_mutex_unlock(&prefetch_mutex);
+}
@@ -20,27 +20,70 @@
 #include <pthread.h>
 #include "ringbuffer.h"
 #include "wejconfig.h"
+#include "httpcache.h"
 
 #define HTTP_CACHE_SIZE_MIN_KB 256
 #define HTTP_CACHE_SIZE_MAX_KB 4096
 
+#define ICY_STREAM_TITLE_SIZE 256
+
+/* Called with the new title whenever a Shoutcast stream announces a new StreamTitle */
+typedef void (*ReaderMetaDataCallback)(const char *stream_title, void *arg);
+
 typedef struct
 {
-	FILE           *file;
+	int             fd;          /* Local file; -1 for HTTP streams */
+	char           *map;         /* Local file mapped into memory (NULL if mmap() failed) */
+	long            file_pos;    /* Read position in the local file */
+	long            map_advised; /* End of the range last passed to madvise(MADV_WILLNEED) */
+	int             read_ahead_running; /* Read-ahead thread (using 'thread') is running */
+	int             read_ahead_stop;
+	long            read_ahead_from;    /* Read position as last reported to the read-ahead thread */
+	long            read_ahead_pos;     /* End of the range loaded by the read-ahead thread */
 	int             eof;
 	int             seekable;
 	long            file_size;
 
 	int             sockfd;
+	char           *http_host;
+	char           *http_path;
+	int             http_port;
+	int             http_status; /* Status code of the last HTTP response */
+	int             http_thread_running;
+	int             http_reused;          /* Connection has been taken from the keep-alive pool */
+	int             http_keep_alive;      /* Connection can be reused once the response body is complete */
+	int             http_chunked;         /* Response uses chunked transfer encoding */
+	int             http_chunk_state;
+	long            http_chunk_remaining; /* Bytes left in the current chunk */
+	int             http_chunk_line_len;
+	long            http_body_remaining;  /* Body bytes left to receive; -1 if unknown */
+	int             http_body_done;       /* The complete response body has been received */
+	int             http_discard;         /* Response body is skipped (redirects) */
+	int             http_head;            /* Only the response header is requested (HEAD) */
+
+	HttpCacheEntry  cache;      /* Disk cache entry the stream is downloaded to (cache.fd >= 0) */
+	long            cache_fill; /* Number of bytes written to the cache entry */
+	char           *cache_url;  /* URL the stream is cached under (before redirects) */
+
+	int             icy_metaint;    /* Shoutcast meta data interval; 0 if the stream has no meta data */
+	int             icy_remaining;  /* Audio bytes left until the next meta data block */
+	char            icy_stream_title[ICY_STREAM_TITLE_SIZE]; /* UTF-8 */
+	ReaderMetaDataCallback meta_data_callback;
+	void           *meta_data_callback_arg;
 
 	char           *buf; /* Dynamic read buffer */
 	size_t          buf_size;
 	size_t          buf_data_size;
+	char           *data; /* Data of the last read; points into buf or map */
 
 	ConfigFile     *streaminfo;
 
 	RingBuffer      rb_http;
 	pthread_mutex_t mutex;
+	pthread_cond_t  data_cond;    /* Signalled when data_wanted bytes are buffered or on EOF */
+	pthread_cond_t  space_cond;   /* Signalled when space_wanted bytes are free or the read position changes */
+	size_t          data_wanted;  /* Fill level (cache_fill when downloading to the disk cache) the consumer is waiting for */
+	size_t          space_wanted; /* Free space the network thread is waiting for */
 	pthread_t       thread;
 
 	unsigned long   stream_pos;
@@ -50,10 +93,18 @@ typedef struct
 
 /* Opens a local file or HTTP URL for reading */
 int     reader_set_cache_size_kb(size_t size, size_t prebuffer_size);
+/* Sets the amount of data read ahead in the background for local files; 0 disables read-ahead */
+void    reader_set_read_ahead_kb(size_t size);
+/* Reads the beginning of a local file in the background, so it is cached when it is opened */
+void    reader_prefetch_file(const char *url);
+/* Keeps reading a local file ahead of the read position in the background (for playback) */
+void    reader_enable_read_ahead(Reader *r);
 int     reader_get_cache_fill(Reader *r);
 Reader *reader_open(const char *url);
 int     reader_close(Reader *r);
 int     reader_is_ready(Reader *r);
+/* Waits up to timeout_ms milliseconds for the reader to become ready, returns reader_is_ready() */
+int     reader_wait_until_ready(Reader *r, int timeout_ms);
 int     reader_is_eof(Reader *r);
 char    reader_read_byte(Reader *r);
 int     reader_read_bytes(Reader *r, size_t size);
@@ -68,4 +119,12 @@ long    reader_get_file_size(Reader *r);
 unsigned long reader_get_stream_position(Reader *r);
 /* Sets number of bytes in buffer to 0 */
 void    reader_clear_buffer(Reader *r);
+/*
+ * Sets a function to be called when the stream title changes. The function
+ * is called from the thread reading from the reader. If a title is already
+ * known, the function is called right away.
+ */
+void    reader_set_meta_data_callback(Reader *r, ReaderMetaDataCallback callback, void *arg);
+/* Returns the current Shoutcast stream title (UTF-8) or an empty string */
+const char *reader_get_stream_title(Reader *r);
 #endif
@@ -17,22 +17,39 @@
 #include "ringbuffer.h"
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 
-int ringbuffer_init(RingBuffer *rb, size_t size)
+/* Full memory barrier; Orders buffer accesses against pointer updates */
+#define RB_BARRIER() __sync_synchronize()
+
+int ringbuffer_init_with_reserve(RingBuffer *rb, size_t size, size_t reserve_max)
 {
-	rb->buffer      = (char *)malloc(size);
-	rb->size        = size;
-	rb->read_ptr    = 0;
-	rb->write_ptr   = 0;
-	rb->buffer_fill = 0;
-	rb->unread_fill = 0;
-	rb->unread_ptr  = -1;
+	/* Reserved regions that wrap around run into the extra space after the
+	 * end of the buffer and get moved to the beginning on commit. */
+	rb->buffer         = (char *)malloc(size + reserve_max);
+	rb->size           = size;
+	rb->reserve_max    = reserve_max;
+	rb->read_ptr       = 0;
+	rb->write_ptr      = 0;
+	rb->unread_ptr     = -1;
+	rb->writer_waiting = 0;
+	if (rb->buffer && sem_init(&(rb->space_available), 0, 0) != 0) {
+		free(rb->buffer);
+		rb->buffer = NULL;
+	}
 	return rb->buffer ? 1 : 0;
 }
 
+int ringbuffer_init(RingBuffer *rb, size_t size)
+{
+	return ringbuffer_init_with_reserve(rb, size, 0);
+}
+
 void ringbuffer_free(RingBuffer *rb)
 {
 	if (rb->buffer != NULL) {
+		sem_destroy(&(rb->space_available));
 		free(rb->buffer);
 		rb->buffer = NULL;
 	}
@@ -40,65 +57,226 @@ void ringbuffer_free(RingBuffer *rb)
 
 void ringbuffer_clear(RingBuffer *rb)
 {
-	rb->read_ptr    = 0;
-	rb->write_ptr   = 0;
-	rb->buffer_fill = 0;
+	rb->read_ptr  = 0;
+	rb->write_ptr = 0;
+	RB_BARRIER();
+	ringbuffer_wake_writer(rb);
 }
 
-int ringbuffer_write(RingBuffer *rb, const char *data, size_t size)
+/* Changes the buffer size, keeping the buffered data. Fails if the data
+ * does not fit into the new size. Like ringbuffer_clear(), this must not
+ * be called while the other side is active. */
+int ringbuffer_resize(RingBuffer *rb, size_t size)
 {
-	int result = 1;
+	size_t fill = ringbuffer_get_fill(rb);
+	char  *buffer;
+	int    result = 0;
 
-	if (size > rb->size - rb->buffer_fill) {
-		result = 0;
-	} else {
-		rb->buffer_fill += size;
+	if (size > 0 && size >= fill && (buffer = (char *)malloc(size + rb->reserve_max))) {
+		ringbuffer_read(rb, buffer, fill);
+		free(rb->buffer);
+		rb->buffer     = buffer;
+		rb->size       = size;
+		rb->read_ptr   = 0;
+		rb->write_ptr  = fill;
+		rb->unread_ptr = -1;
+		RB_BARRIER();
+		result = 1;
+	}
+	return result;
+}
 
-		if (rb->size - rb->write_ptr >= size) {
-			memcpy(rb->buffer + rb->write_ptr, data, size);
-			rb->write_ptr += size;
+/* Maps a pointer (0..2*size-1) to an index into the buffer (0..size-1) */
+static size_t ptr_to_index(RingBuffer *rb, size_t ptr)
+{
+	return ptr < rb->size ? ptr : ptr - rb->size;
+}
+
+static size_t ptr_advance(RingBuffer *rb, size_t ptr, size_t offset)
+{
+	ptr += offset;
+	return ptr < 2 * rb->size ? ptr : ptr - 2 * rb->size;
+}
+
+static size_t fill_from_ptrs(RingBuffer *rb, size_t read_ptr, size_t write_ptr)
+{
+	return write_ptr >= read_ptr ? write_ptr - read_ptr : write_ptr + 2 * rb->size - read_ptr;
+}
+
+size_t ringbuffer_write_partial(RingBuffer *rb, const char *data, size_t size)
+{
+	size_t write_ptr = rb->write_ptr;
+	size_t free_space, index;
+
+	RB_BARRIER();
+	free_space = rb->size - fill_from_ptrs(rb, rb->read_ptr, write_ptr);
+	if (size > free_space) size = free_space;
+	if (size > 0) {
+		index = ptr_to_index(rb, write_ptr);
+		if (rb->size - index >= size) {
+			memcpy(rb->buffer + index, data, size);
 		} else {
-			size_t size_chunk_1 = rb->size - rb->write_ptr;
+			size_t size_chunk_1 = rb->size - index;
 			size_t size_chunk_2 = size - size_chunk_1;
-			memcpy(rb->buffer + rb->write_ptr, data, size_chunk_1);
+			memcpy(rb->buffer + index, data, size_chunk_1);
 			memcpy(rb->buffer, data + size_chunk_1, size_chunk_2);
-			rb->write_ptr = size_chunk_2;
 		}
+		/* Data must be in place before the reader gets to see the new write pointer */
+		RB_BARRIER();
+		rb->write_ptr = ptr_advance(rb, write_ptr, size);
 	}
+	return size;
+}
+
+int ringbuffer_write(RingBuffer *rb, const char *data, size_t size)
+{
+	int result = 1;
+
+	if (size > ringbuffer_get_free(rb))
+		result = 0;
+	else
+		ringbuffer_write_partial(rb, data, size);
 	return result;
 }
 
 int ringbuffer_read(RingBuffer *rb, char *target, size_t size)
 {
-	int result = 1;
+	int    result = 1;
+	size_t read_ptr = rb->read_ptr;
 
-	if (size > rb->buffer_fill) {
+	RB_BARRIER();
+	if (size > fill_from_ptrs(rb, read_ptr, rb->write_ptr)) {
 		result = 0;
 	} else {
-		rb->buffer_fill -= size;
+		size_t index = ptr_to_index(rb, read_ptr);
 
-		if (rb->size - rb->read_ptr >= size) {
-			memcpy(target, rb->buffer + rb->read_ptr, size);
-			rb->read_ptr += size;
+		RB_BARRIER();
+		if (rb->size - index >= size) {
+			memcpy(target, rb->buffer + index, size);
 		} else {
-			size_t size_chunk_1 = rb->size - rb->read_ptr;
+			size_t size_chunk_1 = rb->size - index;
 			size_t size_chunk_2 = size - size_chunk_1;
-			memcpy(target, rb->buffer + rb->read_ptr, size_chunk_1);
+			memcpy(target, rb->buffer + index, size_chunk_1);
 			memcpy(target + size_chunk_1, rb->buffer, size_chunk_2);
-			rb->read_ptr = size_chunk_2;
 		}
+		/* Data must be copied before the writer may reuse that space */
+		RB_BARRIER();
+		rb->read_ptr = ptr_advance(rb, read_ptr, size);
+		RB_BARRIER();
+		if (rb->writer_waiting) ringbuffer_wake_writer(rb);
 	}
 	return result;
 }
 
+char *ringbuffer_reserve_write(RingBuffer *rb, size_t *size)
+{
+	char  *res = NULL;
+	size_t free_space, index, contiguous;
+
+	RB_BARRIER();
+	free_space = rb->size - fill_from_ptrs(rb, rb->read_ptr, rb->write_ptr);
+	index      = ptr_to_index(rb, rb->write_ptr);
+	contiguous = rb->size - index + rb->reserve_max;
+	if (contiguous > free_space) contiguous = free_space;
+	if (*size <= contiguous && contiguous > 0) {
+		*size = contiguous;
+		res = rb->buffer + index;
+	}
+	return res;
+}
+
+void ringbuffer_commit_write(RingBuffer *rb, size_t size)
+{
+	size_t write_ptr = rb->write_ptr;
+	size_t index = ptr_to_index(rb, write_ptr);
+
+	if (size > 0) {
+		if (index + size > rb->size) /* Move wrapped part to the beginning */
+			memcpy(rb->buffer, rb->buffer + rb->size, index + size - rb->size);
+		RB_BARRIER();
+		rb->write_ptr = ptr_advance(rb, write_ptr, size);
+	}
+}
+
+char *ringbuffer_peek_read(RingBuffer *rb, size_t *size)
+{
+	char  *res = NULL;
+	size_t read_ptr = rb->read_ptr;
+	size_t fill, index;
+
+	RB_BARRIER();
+	fill  = fill_from_ptrs(rb, read_ptr, rb->write_ptr);
+	index = ptr_to_index(rb, read_ptr);
+	if (fill > rb->size - index) fill = rb->size - index;
+	if (*size > fill) *size = fill;
+	if (*size > 0) {
+		RB_BARRIER();
+		res = rb->buffer + index;
+	}
+	return res;
+}
+
+void ringbuffer_consume(RingBuffer *rb, size_t size)
+{
+	if (size > 0) {
+		RB_BARRIER();
+		rb->read_ptr = ptr_advance(rb, rb->read_ptr, size);
+		RB_BARRIER();
+		if (rb->writer_waiting) ringbuffer_wake_writer(rb);
+	}
+}
+
+/* Wakes up a writer blocked in ringbuffer_wait_for_free(). Only uses
+ * sem_post(), so it is safe to be called from the audio callback. */
+void ringbuffer_wake_writer(RingBuffer *rb)
+{
+	if (rb->writer_waiting) {
+		rb->writer_waiting = 0;
+		sem_post(&(rb->space_available));
+	}
+}
+
+int ringbuffer_wait_for_free(RingBuffer *rb, size_t size, int timeout_ms)
+{
+	int res = 0;
+
+	if (size <= rb->size) {
+		res = ringbuffer_get_free(rb) >= size;
+		if (!res) {
+			struct timespec ts;
+
+			/* Drop wake-ups left over from previous waits */
+			while (sem_trywait(&(rb->space_available)) == 0);
+			rb->writer_waiting = 1;
+			RB_BARRIER();
+			/* The reader might have freed space before it saw the waiting flag */
+			res = ringbuffer_get_free(rb) >= size;
+			if (!res) {
+				clock_gettime(CLOCK_REALTIME, &ts);
+				ts.tv_sec  += timeout_ms / 1000;
+				ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+				if (ts.tv_nsec >= 1000000000L) {
+					ts.tv_sec++;
+					ts.tv_nsec -= 1000000000L;
+				}
+				while (sem_timedwait(&(rb->space_available), &ts) == -1 && errno == EINTR);
+				res = ringbuffer_get_free(rb) >= size;
+			}
+			rb->writer_waiting = 0;
+		}
+	}
+	return res;
+}
+
 size_t ringbuffer_get_fill(RingBuffer *rb)
 {
-	return rb->buffer_fill;
+	size_t read_ptr = rb->read_ptr, write_ptr = rb->write_ptr;
+	return fill_from_ptrs(rb, read_ptr, write_ptr);
 }
 
 size_t ringbuffer_get_free(RingBuffer *rb)
 {
-	return rb->size - rb->buffer_fill;
+	return rb->size - ringbuffer_get_fill(rb);
 }
 
 size_t ringbuffer_get_size(RingBuffer *rb)
@@ -110,7 +288,6 @@ size_t ringbuffer_get_size(RingBuffer *rb)
 void ringbuffer_set_unread_pos(RingBuffer *rb)
 {
 	rb->unread_ptr = rb->read_ptr;
-	rb->unread_fill = rb->buffer_fill;
 }
 
 /* Rolls back all reads since last ringbuffer_set_unread_pos() call.
@@ -119,7 +296,6 @@ int ringbuffer_unread(RingBuffer *rb)
 {
 	int res = 0;
 	if (rb->unread_ptr > -1) {
-		rb->buffer_fill = rb->unread_fill;
 		rb->read_ptr = rb->unread_ptr;
 		rb->unread_ptr = -1;
 		res = 1;
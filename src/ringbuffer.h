@@ -16,23 +16,61 @@
 #ifndef WEJ_RINGBUFFER_H
 #define WEJ_RINGBUFFER_H
 #include <sys/types.h>
+#include <semaphore.h>
 
+/*
+ * The ring buffer is safe for use by exactly one writer thread and exactly
+ * one reader thread at the same time without any additional locking. The
+ * writer only ever modifies write_ptr, the reader only ever modifies
+ * read_ptr. Both pointers run from 0 to 2*size-1, which allows telling a
+ * full buffer from an empty one without a shared fill counter.
+ * Functions that modify both pointers (ringbuffer_clear()) must not be
+ * called while the other side is active.
+ */
 struct _RingBuffer {
-	size_t  size;
-	char   *buffer;
-	size_t  read_ptr, write_ptr, buffer_fill, unread_fill;
-	ssize_t unread_ptr;
+	size_t           size, reserve_max;
+	char            *buffer;
+	volatile size_t  read_ptr, write_ptr;
+	ssize_t          unread_ptr;
+	volatile int     writer_waiting;
+	sem_t            space_available;
 };
 
 typedef struct _RingBuffer RingBuffer;
 
 int    ringbuffer_init(RingBuffer *rb, size_t size);
+/* Same as ringbuffer_init(), but allows reserving contiguous write regions
+ * of up to reserve_max bytes with ringbuffer_reserve_write() */
+int    ringbuffer_init_with_reserve(RingBuffer *rb, size_t size, size_t reserve_max);
 void   ringbuffer_free(RingBuffer *rb);
+/* Writes all of the data or nothing. Returns 1 on success, 0 otherwise. */
 int    ringbuffer_write(RingBuffer *rb, const char *data, size_t size);
+/* Writes as much of the data as possible, returns the number of bytes written */
+size_t ringbuffer_write_partial(RingBuffer *rb, const char *data, size_t size);
 int    ringbuffer_read(RingBuffer *rb, char *target, size_t size);
+/* Blocks the writer until at least 'size' bytes are free, the timeout
+ * (in milliseconds) expires or ringbuffer_wake_writer() has been called.
+ * Returns 1 if the requested space is available, 0 otherwise. */
+int    ringbuffer_wait_for_free(RingBuffer *rb, size_t size, int timeout_ms);
+void   ringbuffer_wake_writer(RingBuffer *rb);
+/* Zero-copy access. ringbuffer_reserve_write() returns a pointer to a
+ * contiguous region of at least *size bytes the writer can write to
+ * directly, or NULL if there is not enough free space. On success *size
+ * is set to the number of bytes available in that region. The data becomes
+ * visible to the reader with ringbuffer_commit_write(). */
+char  *ringbuffer_reserve_write(RingBuffer *rb, size_t *size);
+void   ringbuffer_commit_write(RingBuffer *rb, size_t size);
+/* Returns a pointer to the contiguous readable region at the current read
+ * position and sets *size to its length (at most the requested *size).
+ * Returns NULL if the buffer is empty. The region is released to the writer
+ * with ringbuffer_consume(). */
+char  *ringbuffer_peek_read(RingBuffer *rb, size_t *size);
+void   ringbuffer_consume(RingBuffer *rb, size_t size);
 size_t ringbuffer_get_fill(RingBuffer *rb);
 size_t ringbuffer_get_free(RingBuffer *rb);
 void   ringbuffer_clear(RingBuffer *rb);
+/* Changes the size while keeping the data; Same restrictions as ringbuffer_clear() */
+int    ringbuffer_resize(RingBuffer *rb, size_t size);
 size_t ringbuffer_get_size(RingBuffer *rb);
 void   ringbuffer_set_unread_pos(RingBuffer *rb);
 int    ringbuffer_unread(RingBuffer *rb);
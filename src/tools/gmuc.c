@@ -53,11 +53,18 @@
 #define PING_TIMEOUT 30
 /* Maximum number of loop cycles until the connection times out after a PING */
 #define PONG_TIMEOUT 5
+/* Number of playlist entries requested at once */
+#define PLAYLIST_RANGE_COUNT 500
 
 typedef enum { STATE_WEBSOCKET_HANDSHAKE, STATE_CONNECTION_ESTABLISHED, STATE_WEBSOCKET_HANDSHAKE_FAILED } State;
 
 static volatile sig_atomic_t resized = 0;
 
+/* Playlist version the playlist widget is in sync with (0 = unknown) */
+static unsigned long pl_version = 0;
+/* Most recent playlist version announced by the server */
+static unsigned long pl_version_latest = 0;
+
 static void sig_handler_sigwinch(int sig)
 {
 	resized = 1;
@@ -235,11 +242,20 @@ static void cmd_trackinfo(UI *ui, JSON_Object *json)
 	ui_refresh_active_window(ui);
 }
 
+static int request_playlist_range(int sock, int offset, unsigned long since)
+{
+	char str[128];
+	snprintf(str, 127, "{\"cmd\":\"playlist_get_range\", \"offset\":%d, \"count\":%d, \"since\":%lu}",
+	         offset, PLAYLIST_RANGE_COUNT, since);
+	return websocket_send_str(sock, str, 1);
+}
+
 static void cmd_playlist_change(UI *ui, JSON_Object *json, int sock)
 {
 	char title[64];
 	int  length     = (int)json_get_number_value_for_key(json, "length");
 	int  changed_at = (int)json_get_number_value_for_key(json, "changed_at_position");
+	pl_version_latest = (unsigned long)json_get_number_value_for_key(json, "version");
 	wprintw(ui->win_cmd->win, "Playlist has been changed!\n");
 	wprintw(ui->win_cmd->win, "Length=%d Pos=%d\n", length, changed_at);
 	if (length < 0) length = 0;
@@ -250,32 +266,48 @@ static void cmd_playlist_change(UI *ui, JSON_Object *json, int sock)
 	if (listwidget_get_selection(ui->lw_pl) > changed_at)
 		listwidget_set_cursor(ui->lw_pl, changed_at);
 	if (length > 0 && changed_at >= 0) {
-		char str[64];
-		snprintf(str, 63, "{\"cmd\":\"playlist_get_item\", \"item\":%d}", changed_at);
-		if (!websocket_send_str(sock, str, 1))
+		/* The server only sends what has changed since the version we have */
+		if (!request_playlist_range(sock, 0, pl_version))
 			wprintw(ui->win_cmd->win, "FAILED sending message over socket!\n");
 		else
 			wprintw(ui->win_cmd->win, "Message sent SUCCESSFULLY.\n");
 		ui_refresh_active_window(ui);
+	} else if (length == 0) {
+		pl_version = pl_version_latest;
 	}
 }
 
-static void cmd_playlist_item(UI *ui, JSON_Object *json, int sock)
+static void cmd_playlist_range(UI *ui, JSON_Object *json, int sock)
 {
-	char  str[128];
-	char *title = json_get_string_value_for_key(json, "title");
-	int   pos = (int)json_get_number_value_for_key(json, "position");
-	if (pos >= 0 && title) {
-		snprintf(str, 127, "%5d", pos+1);
+	unsigned long version = (unsigned long)json_get_number_value_for_key(json, "version");
+	int           length  = (int)json_get_number_value_for_key(json, "length");
+	int           offset  = (int)json_get_number_value_for_key(json, "offset");
+	int           next    = (int)json_get_number_value_for_key(json, "next");
+	int           last    = (int)json_get_number_value_for_key(json, "last");
+	JSON_Key     *jk = json_get_key_object_for_key(json, "items");
+	JSON_Object  *jo = jk ? jk->key_value_object : NULL;
+	int           pos, redraw = 0;
+
+	for (pos = offset; jo && pos >= 0 && pos < next && pos < listwidget_get_rows(ui->lw_pl); pos++) {
+		char  str[16];
+		char *title;
+		snprintf(str, 15, "%d", pos);
+		title = json_get_string_value_for_key(jo, str);
+		if (!title) break;
+		snprintf(str, 15, "%5d", pos+1);
 		listwidget_set_cell_data(ui->lw_pl, pos, 0, str);
 		listwidget_set_cell_data(ui->lw_pl, pos, 1, title);
 		if (pos >= ui->lw_pl->first_visible_row &&
 		    pos < ui->lw_pl->first_visible_row + ui->lw_pl->win->height-2)
-			ui_refresh_active_window(ui);
-		if (pos+1 < listwidget_get_rows(ui->lw_pl)) {
-			snprintf(str, 127, "{\"cmd\":\"playlist_get_item\", \"item\":%d}", pos+1);
-			websocket_send_str(sock, str, 1);
-		}
+			redraw = 1;
+	}
+	if (redraw) ui_refresh_active_window(ui);
+	/* Data from an outdated playlist version is followed by another playlist_change */
+	if (last && version == pl_version_latest) {
+		if (next < length)
+			request_playlist_range(sock, next, 0);
+		else
+			pl_version = version;
 	}
 }
 
@@ -496,8 +528,8 @@ static int handle_data_in_ringbuffer(RingBuffer *rb, UI *ui, int sock, char *pas
 						} else if (strcmp(cmd, "playlist_change") == 0) {
 							cmd_playlist_change(ui, json, sock);
 							screen_update = 1;
-						} else if (strcmp(cmd, "playlist_item") == 0) {
-							cmd_playlist_item(ui, json, sock);
+						} else if (strcmp(cmd, "playlist_range") == 0) {
+							cmd_playlist_range(ui, json, sock);
 						} else if (strcmp(cmd, "dir_read") == 0) {
 							char *tmp_dir = cmd_dir_read(ui, json);
 							if (tmp_dir) {
@@ -417,6 +417,11 @@ char *get_config_dir_alloc(int create)
 	return get_xdg_dir_alloc("XDG_CONFIG_HOME", ".config", create);
 }
 
+char *get_cache_dir_alloc(int create)
+{
+	return get_xdg_dir_alloc("XDG_CACHE_HOME", ".cache", create);
+}
+
 static char *get_dir_alloc(char *dir, const char *name, int create, const char *filename)
 {
 	if (dir && name) {
@@ -453,6 +458,12 @@ char *get_data_dir_with_name_alloc(const char *name, int create, const char *fil
 	return get_dir_alloc(data_dir, name, create, filename);
 }
 
+char *get_cache_dir_with_name_alloc(const char *name, int create, const char *filename)
+{
+	char *cache_dir = get_cache_dir_alloc(create);
+	return get_dir_alloc(cache_dir, name, create, filename);
+}
+
 char *get_config_file_path_alloc(const char *program_name, const char *filename)
 {
 	char  *file_path = NULL;